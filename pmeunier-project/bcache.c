@@ -0,0 +1,529 @@
+/*
+ * file:        bcache.c
+ * description: block device caching the blocks of another block
+ *              device in memory and writing dirty blocks back in
+ *              the background
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "bcache.h"
+
+/** most blocks written back in one round */
+enum { BC_BATCH = 1024 };
+
+/** a block in the cache */
+struct bc_entry {
+	int blk; // block held, or -1
+	bool dirty; // newer than the device
+	bool busy; // being written back, not to be evicted
+	uint64_t dirtied; // time it became dirty
+	uint64_t dirty_wseq; // write sequence number when it became dirty
+	struct bc_entry *hnext; // next entry in the hash chain
+	struct bc_entry *prev, *next; // LRU list, most recently used first
+	char *data; // the block
+};
+
+/** a dirty block to write back */
+struct bc_ref {
+	int blk;
+	struct bc_entry *e;
+};
+
+/** definition of block cache device */
+struct bcache_dev {
+	struct blkdev *dev; // device being cached
+	struct bcache_params params; // behavior
+	struct bc_entry *entries; // the cache
+	char *data; // data of the entries
+	struct bc_entry **hash; // entries by block number
+	int hmask; // hash table size - 1
+	struct bc_entry lru; // head of the LRU list
+	int ndirty; // dirty entries
+	int dirty_limit; // dirty entries at which writers wait
+	int bg_limit; // dirty entries at which the thread writes back
+	uint64_t wseq; // writes so far, to spot reads that raced a write
+	int wb_err; // error of a writeback, reported by the next flush
+	bool stop; // the thread is to exit
+	struct bc_ref *refs; // dirty blocks of a writeback round
+	char *staging; // data of a writeback round
+	pthread_t thread; // writes dirty blocks back
+	pthread_mutex_t lock; // protects all of the above but refs and staging
+	pthread_mutex_t wb_lock; // one writeback round at a time, so they stay in order
+	pthread_cond_t wake; // wakes the thread
+	pthread_cond_t cleaned; // signaled after a writeback round
+	struct bcache_stats stats; // counters
+};
+
+/**
+ * Current monotonic time in nanoseconds.
+ */
+static uint64_t bc_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Find the entry of a block. Called with the lock held.
+ * @return: the entry, or NULL if the block is not cached
+*/
+static struct bc_entry *bc_lookup(struct bcache_dev *cd, int blk)
+{
+	struct bc_entry *e = cd->hash[blk & cd->hmask];
+	while (e != NULL && e->blk != blk) {
+		e = e->hnext;
+	}
+	return e;
+}
+
+/**
+ * Move an entry to the front of the LRU list. Called with the lock held.
+*/
+static void bc_touch(struct bcache_dev *cd, struct bc_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = cd->lru.next;
+	e->prev = &cd->lru;
+	cd->lru.next->prev = e;
+	cd->lru.next = e;
+}
+
+/**
+ * Take the least recently used clean entry for a block. Called with
+ * the lock held.
+ * @param cd: the cache
+ * @param blk: the block
+ * @return: the entry, or NULL if every entry is dirty or busy
+*/
+static struct bc_entry *bc_alloc(struct bcache_dev *cd, int blk)
+{
+	struct bc_entry *e = cd->lru.prev;
+	while (e != &cd->lru && (e->dirty || e->busy)) {
+		e = e->prev;
+	}
+	if (e == &cd->lru) {
+		return NULL;
+	}
+	if (e->blk >= 0) {
+		struct bc_entry **pp = &cd->hash[e->blk & cd->hmask];
+		while (*pp != e) pp = &(*pp)->hnext;
+		*pp = e->hnext;
+	}
+	e->blk = blk;
+	e->hnext = cd->hash[blk & cd->hmask];
+	cd->hash[blk & cd->hmask] = e;
+	bc_touch(cd, e);
+	return e;
+}
+
+/** order dirty blocks by block number */
+static int bc_ref_cmp(const void *a, const void *b)
+{
+	const struct bc_ref *ra = a, *rb = b;
+	return (ra->blk > rb->blk) - (ra->blk < rb->blk);
+}
+
+/**
+ * Write dirty blocks back to the device, in rounds of up to BC_BATCH
+ * blocks taken in block order, each adjacent run in one write. The
+ * blocks of a round are copied out and marked clean before they are
+ * written, so writes to them meanwhile dirty them again; if a write
+ * fails the round is marked dirty again.
+ * @param cd: the cache
+ * @param first_blk: first block to write back
+ * @param nblks: number of blocks
+ * @param expired: only write back blocks dirty for expire_ms
+ * @param to_bg: stop once no more than bg_limit blocks are dirty
+ * @param wseq: only write back blocks dirtied before this write
+ *   sequence number, so that new writes cannot keep a flush going
+ * @return: SUCCESS, or the error of the device
+*/
+static int bc_writeback(struct bcache_dev *cd, int first_blk, int nblks, bool expired, bool to_bg,
+			uint64_t wseq)
+{
+	int result = SUCCESS;
+	pthread_mutex_lock(&cd->wb_lock);
+	pthread_mutex_lock(&cd->lock);
+	for (;;) {
+		uint64_t now = bc_now(), age = (uint64_t) cd->params.expire_ms * 1000000;
+		int n = 0;
+		for (int i = 0; i < cd->params.nblks && n < cd->ndirty; i++) {
+			struct bc_entry *e = &cd->entries[i];
+			if (e->dirty && e->blk >= first_blk && e->blk < first_blk + nblks &&
+			    e->dirty_wseq < wseq && (!expired || now - e->dirtied >= age)) {
+				cd->refs[n].blk = e->blk;
+				cd->refs[n++].e = e;
+			}
+		}
+		if (n == 0) {
+			break;
+		}
+		qsort(cd->refs, n, sizeof(*cd->refs), bc_ref_cmp);
+		if (n > BC_BATCH) {
+			n = BC_BATCH;
+		}
+		for (int i = 0; i < n; i++) {
+			struct bc_entry *e = cd->refs[i].e;
+			memcpy(cd->staging + (size_t) i * BLOCK_SIZE, e->data, BLOCK_SIZE);
+			e->dirty = false;
+			e->busy = true;
+			cd->ndirty--;
+		}
+		pthread_mutex_unlock(&cd->lock);
+
+		int ios = 0;
+		for (int i = 0; i < n && result == SUCCESS; ) {
+			int j = i + 1;
+			while (j < n && cd->refs[j].blk == cd->refs[j - 1].blk + 1) j++;
+			result = cd->dev->ops->write(cd->dev, cd->refs[i].blk, j - i,
+						     cd->staging + (size_t) i * BLOCK_SIZE);
+			ios++;
+			i = j;
+		}
+
+		pthread_mutex_lock(&cd->lock);
+		now = bc_now();
+		for (int i = 0; i < n; i++) {
+			struct bc_entry *e = cd->refs[i].e;
+			e->busy = false;
+			if (result < 0 && !e->dirty) {
+				e->dirty = true;
+				e->dirtied = now;
+				cd->ndirty++;
+			}
+		}
+		cd->stats.wb_ios += ios;
+		if (result == SUCCESS) {
+			cd->stats.wb_blks += n;
+		}
+		pthread_cond_broadcast(&cd->cleaned);
+		if (result < 0) {
+			cd->wb_err = result;
+			break;
+		}
+		if (to_bg && cd->ndirty <= cd->bg_limit) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cd->lock);
+	pthread_mutex_unlock(&cd->wb_lock);
+	return result;
+}
+
+/**
+ * Thread writing dirty blocks back until the cache is closed: all
+ * of them down to bg_limit when more are dirty, and otherwise those
+ * dirty for expire_ms. After a failure it waits for the next tick.
+ * @param arg: the cache
+*/
+static void *bc_thread(void *arg)
+{
+	struct bcache_dev *cd = arg;
+	int tick_ms = cd->params.expire_ms / 4 + 1;
+	bool failed = false;
+	pthread_mutex_lock(&cd->lock);
+	while (!cd->stop) {
+		if (failed || cd->ndirty <= cd->bg_limit) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += tick_ms / 1000;
+			ts.tv_nsec += (tick_ms % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&cd->wake, &cd->lock, &ts);
+			if (cd->stop) {
+				break;
+			}
+		}
+		bool over = cd->ndirty > cd->bg_limit;
+		bool any = cd->ndirty > 0;
+		pthread_mutex_unlock(&cd->lock);
+		int result = SUCCESS;
+		if (over || any) {
+			result = bc_writeback(cd, 0, cd->dev->ops->num_blocks(cd->dev), !over, over, UINT64_MAX);
+		}
+		failed = result < 0;
+		pthread_mutex_lock(&cd->lock);
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return NULL;
+}
+
+/**
+ * To count the number of blocks on the device
+ * @param dev: the block device
+ * @return: the number of blocks in the block device
+*/
+static int bc_num_blocks(struct blkdev *dev)
+{
+	struct bcache_dev *cd = dev->private;
+	return cd->dev->ops->num_blocks(cd->dev);
+}
+
+/**
+ * Read blocks from the cache, reading the runs of blocks not cached
+ * from the device and caching them. Blocks written while a run was
+ * being read are not cached from it, and are copied from the cache.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS if successful, or the error of the device
+*/
+static int bc_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct bcache_dev *cd = dev->private;
+	char *out = buf;
+	pthread_mutex_lock(&cd->lock);
+	for (int i = 0; i < nblks; ) {
+		struct bc_entry *e = bc_lookup(cd, first_blk + i);
+		if (e != NULL) {
+			memcpy(out + (size_t) i * BLOCK_SIZE, e->data, BLOCK_SIZE);
+			bc_touch(cd, e);
+			cd->stats.read_hits++;
+			i++;
+			continue;
+		}
+		int j = i + 1;
+		while (j < nblks && bc_lookup(cd, first_blk + j) == NULL) j++;
+		uint64_t wseq = cd->wseq;
+		cd->stats.read_misses += j - i;
+		pthread_mutex_unlock(&cd->lock);
+		int result = cd->dev->ops->read(cd->dev, first_blk + i, j - i, out + (size_t) i * BLOCK_SIZE);
+		if (result < 0) {
+			return result;
+		}
+		pthread_mutex_lock(&cd->lock);
+		for (int k = i; k < j; k++) {
+			char *data = out + (size_t) k * BLOCK_SIZE;
+			if ((e = bc_lookup(cd, first_blk + k)) != NULL) {
+				memcpy(data, e->data, BLOCK_SIZE);
+			} else if (wseq == cd->wseq && (e = bc_alloc(cd, first_blk + k)) != NULL) {
+				memcpy(e->data, data, BLOCK_SIZE);
+			}
+		}
+		i = j;
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return SUCCESS;
+}
+
+/**
+ * Write blocks into the cache, waiting first if dirty_ratio of the
+ * cache is dirty, or if no clean entry is left.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return SUCCESS if successful, or the error of a failed writeback
+ *   if no entry is left to write to
+*/
+static int bc_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct bcache_dev *cd = dev->private;
+	char *in = buf;
+	pthread_mutex_lock(&cd->lock);
+	if (cd->ndirty >= cd->dirty_limit && cd->wb_err == SUCCESS) {
+		uint64_t t0 = bc_now();
+		cd->stats.throttled++;
+		while (cd->ndirty >= cd->dirty_limit && cd->wb_err == SUCCESS) {
+			pthread_cond_signal(&cd->wake);
+			pthread_cond_wait(&cd->cleaned, &cd->lock);
+		}
+		cd->stats.throttle_ns += bc_now() - t0;
+	}
+	uint64_t now = bc_now();
+	for (int i = 0; i < nblks; i++) {
+		struct bc_entry *e;
+		while ((e = bc_lookup(cd, first_blk + i)) == NULL &&
+		       (e = bc_alloc(cd, first_blk + i)) == NULL) {
+			if (cd->wb_err != SUCCESS) {
+				pthread_mutex_unlock(&cd->lock);
+				return cd->wb_err;
+			}
+			pthread_cond_signal(&cd->wake);
+			pthread_cond_wait(&cd->cleaned, &cd->lock);
+		}
+		memcpy(e->data, in + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+		if (!e->dirty) {
+			e->dirty = true;
+			e->dirtied = now;
+			e->dirty_wseq = cd->wseq;
+			cd->ndirty++;
+		}
+		bc_touch(cd, e);
+	}
+	cd->wseq++;
+	cd->stats.write_blks += nblks;
+	if (cd->ndirty > cd->bg_limit) {
+		pthread_cond_signal(&cd->wake);
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return SUCCESS;
+}
+
+/**
+ * Write back the blocks in a range dirty when the flush starts, and
+ * flush the device.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return: SUCCESS if successful, or the error of the device or of
+ *   an earlier background writeback
+*/
+static int bc_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct bcache_dev *cd = dev->private;
+	pthread_mutex_lock(&cd->lock);
+	uint64_t wseq = cd->wseq;
+	pthread_mutex_unlock(&cd->lock);
+	int result = bc_writeback(cd, first_blk, nblks, false, false, wseq);
+	pthread_mutex_lock(&cd->lock);
+	if (result == SUCCESS) {
+		result = cd->wb_err;
+	}
+	cd->wb_err = SUCCESS;
+	pthread_mutex_unlock(&cd->lock);
+	if (result < 0) {
+		return result;
+	}
+	return cd->dev->ops->flush(cd->dev, first_blk, nblks);
+}
+
+/**
+ * Free a block cache, whose thread is not running, but not the
+ * device it caches.
+ * @param dev: the block cache device
+ * @param cd: its state, with the lock and conditions initialized
+*/
+static void bc_free(struct blkdev *dev, struct bcache_dev *cd)
+{
+	pthread_cond_destroy(&cd->cleaned);
+	pthread_cond_destroy(&cd->wake);
+	pthread_mutex_destroy(&cd->wb_lock);
+	pthread_mutex_destroy(&cd->lock);
+	free(cd->staging);
+	free(cd->refs);
+	free(cd->hash);
+	free(cd->data);
+	free(cd->entries);
+	free(cd);
+	free(dev);
+}
+
+/**
+ * Stop the thread, write back all dirty blocks and close the device.
+ * @param dev: the block device
+*/
+static void bc_close(struct blkdev *dev)
+{
+	struct bcache_dev *cd = dev->private;
+	pthread_mutex_lock(&cd->lock);
+	cd->stop = true;
+	pthread_cond_signal(&cd->wake);
+	pthread_mutex_unlock(&cd->lock);
+	pthread_join(cd->thread, NULL);
+
+	if (bc_flush(dev, 0, bc_num_blocks(dev)) < 0) {
+		pthread_mutex_lock(&cd->lock);
+		int ndirty = cd->ndirty;
+		pthread_mutex_unlock(&cd->lock);
+		fprintf(stderr, "block cache: %d dirty blocks lost\n", ndirty);
+	}
+	cd->dev->ops->close(cd->dev);
+	bc_free(dev, cd);
+}
+
+/** Operations on this block device. There is no map operation:
+ *  data spliced straight from the image would miss dirty blocks. */
+static struct blkdev_ops bcache_ops = {
+	.num_blocks = bc_num_blocks,
+	.read = bc_read,
+	.write = bc_write,
+	.flush = bc_flush,
+	.close = bc_close,
+};
+
+struct blkdev *bcache_create(struct blkdev *base, const struct bcache_params *params)
+{
+	int nblks = params->nblks;
+	if (nblks < 2 || params->dirty_ratio < 1 || params->dirty_ratio > 100)
+		return NULL;
+
+	struct blkdev *dev = malloc(sizeof(*dev));
+	struct bcache_dev *cd = calloc(1, sizeof(*cd));
+	int hsize = 1;
+	while (hsize < 2 * nblks) hsize *= 2;
+
+	if (dev == NULL || cd == NULL) {
+		free(cd);
+		free(dev);
+		return NULL;
+	}
+	pthread_mutex_init(&cd->lock, NULL);
+	pthread_mutex_init(&cd->wb_lock, NULL);
+	pthread_cond_init(&cd->wake, NULL);
+	pthread_cond_init(&cd->cleaned, NULL);
+
+	cd->entries = calloc(nblks, sizeof(*cd->entries));
+	cd->data = malloc((size_t) nblks * BLOCK_SIZE);
+	cd->hash = calloc(hsize, sizeof(*cd->hash));
+	cd->refs = malloc(nblks * sizeof(*cd->refs));
+	cd->staging = malloc((size_t) BC_BATCH * BLOCK_SIZE);
+	if (cd->entries == NULL || cd->data == NULL || cd->hash == NULL ||
+	    cd->refs == NULL || cd->staging == NULL) {
+		bc_free(dev, cd);
+		return NULL;
+	}
+
+	cd->dev = base;
+	cd->params = *params;
+	cd->hmask = hsize - 1;
+	//a clean entry is always left for reads and for writes waiting on a writeback
+	cd->dirty_limit = (int) ((int64_t) nblks * params->dirty_ratio / 100);
+	if (cd->dirty_limit >= nblks) cd->dirty_limit = nblks - 1;
+	if (cd->dirty_limit < 1) cd->dirty_limit = 1;
+	cd->bg_limit = cd->dirty_limit / 2;
+	cd->lru.next = cd->lru.prev = &cd->lru;
+	for (int i = 0; i < nblks; i++) {
+		struct bc_entry *e = &cd->entries[i];
+		e->blk = -1;
+		e->data = cd->data + (size_t) i * BLOCK_SIZE;
+		e->next = cd->lru.next;
+		e->prev = &cd->lru;
+		cd->lru.next->prev = e;
+		cd->lru.next = e;
+	}
+	if (pthread_create(&cd->thread, NULL, bc_thread, cd) != 0) {
+		bc_free(dev, cd);
+		return NULL;
+	}
+
+	dev->private = cd;
+	dev->ops = &bcache_ops;
+
+	return dev;
+}
+
+void bcache_get_stats(struct blkdev *dev, struct bcache_stats *st)
+{
+	struct bcache_dev *cd = dev->private;
+	pthread_mutex_lock(&cd->lock);
+	*st = cd->stats;
+	st->dirty = cd->ndirty;
+	pthread_mutex_unlock(&cd->lock);
+}
@@ -0,0 +1,58 @@
+/*
+ * file:        bcache.h
+ * description: block device caching the blocks of another block
+ *              device in memory and writing dirty blocks back in
+ *              the background
+ */
+
+#ifndef BCACHE_H_
+#define BCACHE_H_
+
+#include <stdint.h>
+
+#include "blkdev.h"
+
+/** behavior of a block cache */
+struct bcache_params {
+	int nblks; /* blocks the cache holds */
+	int dirty_ratio; /* percent of the cache that may be dirty before writers wait */
+	int expire_ms; /* age at which dirty blocks are written back anyway */
+};
+
+/** block cache counters */
+struct bcache_stats {
+	uint64_t read_hits; /* blocks read from the cache */
+	uint64_t read_misses; /* blocks read from the device */
+	uint64_t write_blks; /* blocks written into the cache */
+	uint64_t wb_ios; /* writes to the device, each a run of blocks */
+	uint64_t wb_blks; /* blocks written back */
+	uint64_t throttled; /* writes that waited for the writeback */
+	uint64_t throttle_ns; /* time writers waited */
+	int dirty; /* blocks dirty now */
+};
+
+/*
+ * Create a block device that caches the blocks of another device.
+ * Writes are copied into the cache and return; a background thread
+ * writes the dirty blocks back, in block order and merged into runs
+ * of adjacent blocks, once they are older than expire_ms or when
+ * more than half of dirty_ratio of the cache is dirty. Writers wait
+ * when dirty_ratio of the cache is dirty. Flush writes back the dirty
+ * blocks and flushes the device; close writes them back and closes
+ * the device.
+ *
+ * @param dev: the device to cache
+ * @param params: the behavior
+ * @return: the block device, or NULL if out of memory
+ */
+extern struct blkdev *bcache_create(struct blkdev *dev, const struct bcache_params *params);
+
+/*
+ * Get the counters of a block cache.
+ *
+ * @param dev: the block cache
+ * @param st: set to the counters
+ */
+extern void bcache_get_stats(struct blkdev *dev, struct bcache_stats *st);
+
+#endif /* BCACHE_H_ */
@@ -0,0 +1,750 @@
+/*
+ * file:        bench.c
+ * description: benchmark suite for the CS492 file system. Fresh
+ *              images are created and the same scripted workloads
+ *              are run directly against fs_ops, bypassing FUSE, and
+ *              through a real mount of fsx492. Results are printed
+ *              as CSV or JSON, one row per workload.
+ *
+ *  usage: ./fsx492_bench [-json] [-dir <dir>] [-mb <MiB>] [-nomount]
+ *  		[-fsx492 <path>] [-latency <usecs>] [-bandwidth <MB/s>] [-ram]
+ *  		[-stripe <n>] [-chunk <blocks>] [-mirror <n>] [-cache <MiB>]
+ */
+
+#define FUSE_USE_VERSION 29
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fuse.h>
+
+#include "fscore.h"
+#include "image.h"
+#include "slow.h"
+#include "stripe.h"
+#include "mirror.h"
+#include "bcache.h"
+#include "stats.h"
+
+/** file system operations, see fs.c */
+extern struct fuse_operations fs_ops;
+
+/** disk block device used by fs_ops */
+struct blkdev *disk;
+
+enum {
+	MAX_PATH = 4096,
+	BENCH_BLKS = 65536, /* blocks in a benchmark image, 64 MiB */
+	BENCH_INODES = 1024, /* inodes in a benchmark image */
+	MAX_IMAGES = 16, /* most images to stripe or mirror across */
+	RAND_OPS = 2000, /* requests of each random I/O workload */
+	RAND_SIZE = 4096, /* size of a random I/O request */
+	META_DIRS = 10, /* directories of the metadata storm */
+	META_FILES = 30, /* files in each directory of the metadata storm */
+	LIST_OPS = 5000, /* listings of the large directory */
+	DEEP_DEPTH = 40, /* directories in the deep path */
+	DEEP_OPS = 5000, /* lookups of the deep path */
+};
+
+/** request sizes of the sequential workloads */
+static const int seq_sizes[] = { 4096, 65536, 1 << 20 };
+
+/** print JSON instead of CSV */
+static bool json;
+/** rows printed so far */
+static int rows;
+/** seed of the random I/O workloads, fixed so runs are comparable */
+static unsigned rand_seed = 492;
+/** delays added to the image, none by default */
+static struct slow_params slow = { .seed = 492 };
+/** keep images in memory, to measure the file system without the disk */
+static bool ram;
+/** images the file system is striped or mirrored across, and blocks in a chunk */
+static int n_images = 1, stripe_chunk = STRIPE_CHUNK;
+/** mirror the images instead of striping them */
+static bool mirror;
+/** MiB of block cache written back in the background, 0 for none */
+static int cache_mb;
+
+/**
+ * File system under test. Paths are relative to the root of the
+ * file system; the mount backend prefixes them with the mount point.
+ */
+struct bench_backend {
+	const char *name;
+	const char *root; /* mount point, or "" to call fs_ops */
+};
+
+/** open file of a backend */
+struct bench_file {
+	char path[MAX_PATH];
+	int fd; /* file descriptor through a mount */
+	struct fuse_file_info fi; /* file info of fs_ops */
+};
+
+/** latencies of the requests of a workload */
+struct bench_samples {
+	uint64_t *ns;
+	int n, cap;
+	uint64_t bytes; /* bytes read or written */
+	uint64_t start; /* start of the workload */
+};
+
+/* Backends. Each returns 0 or a count on success, or -error number.
+ */
+
+static const char *bpath(struct bench_backend *be, const char *path, char *buf)
+{
+	if (be->root[0] == '\0') return path;
+	snprintf(buf, MAX_PATH, "%s%s", be->root, path);
+	return buf;
+}
+
+static int b_mkdir(struct bench_backend *be, const char *path)
+{
+	char buf[MAX_PATH];
+	if (be->root[0] == '\0') return fs_ops.mkdir(path, 0777);
+	return mkdir(bpath(be, path, buf), 0777) < 0 ? -errno : 0;
+}
+
+static int b_rmdir(struct bench_backend *be, const char *path)
+{
+	char buf[MAX_PATH];
+	if (be->root[0] == '\0') return fs_ops.rmdir(path);
+	return rmdir(bpath(be, path, buf)) < 0 ? -errno : 0;
+}
+
+static int b_create(struct bench_backend *be, const char *path)
+{
+	char buf[MAX_PATH];
+	if (be->root[0] == '\0') return fs_ops.mknod(path, 0666, 0);
+	int fd = open(bpath(be, path, buf), O_CREAT | O_EXCL | O_WRONLY, 0666);
+	if (fd < 0) return -errno;
+	close(fd);
+	return 0;
+}
+
+static int b_unlink(struct bench_backend *be, const char *path)
+{
+	char buf[MAX_PATH];
+	if (be->root[0] == '\0') return fs_ops.unlink(path);
+	return unlink(bpath(be, path, buf)) < 0 ? -errno : 0;
+}
+
+static int b_stat(struct bench_backend *be, const char *path)
+{
+	char buf[MAX_PATH];
+	struct stat sb;
+	if (be->root[0] == '\0') return fs_ops.getattr(path, &sb);
+	return stat(bpath(be, path, buf), &sb) < 0 ? -errno : 0;
+}
+
+/** count the entries passed to a readdir filler */
+static int count_filler(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+	(*(int *) ptr)++;
+	return 0;
+}
+
+/**
+ * List a directory.
+ *
+ * @return the number of entries, or -error number
+ */
+static int b_list(struct bench_backend *be, const char *path)
+{
+	char buf[MAX_PATH];
+	int n = 0;
+	if (be->root[0] == '\0') {
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(fi));
+		int res = fs_ops.opendir(path, &fi);
+		if (res == 0) res = fs_ops.readdir(path, &n, count_filler, 0, &fi);
+		fs_ops.releasedir(path, &fi);
+		return res < 0 ? res : n;
+	}
+	DIR *dir = opendir(bpath(be, path, buf));
+	if (dir == NULL) return -errno;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+static int b_open(struct bench_backend *be, const char *path, struct bench_file *f)
+{
+	memset(f, 0, sizeof(*f));
+	snprintf(f->path, sizeof(f->path), "%s", path);
+	if (be->root[0] == '\0') {
+		f->fi.flags = O_RDWR;
+		return fs_ops.open(path, &f->fi);
+	}
+	char buf[MAX_PATH];
+	f->fd = open(bpath(be, path, buf), O_RDWR);
+	return f->fd < 0 ? -errno : 0;
+}
+
+static int b_close(struct bench_backend *be, struct bench_file *f)
+{
+	if (be->root[0] == '\0') return fs_ops.release(f->path, &f->fi);
+	return close(f->fd) < 0 ? -errno : 0;
+}
+
+/**
+ * Read a whole request.
+ *
+ * @return number of bytes read, short only at EOF, or -error number
+ */
+static int b_read(struct bench_backend *be, struct bench_file *f, char *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	while (done < len) {
+		int n = (be->root[0] == '\0')
+			? fs_ops.read(f->path, buf + done, len - done, offset + done, &f->fi)
+			: pread(f->fd, buf + done, len - done, offset + done);
+		if (n < 0) return (be->root[0] == '\0') ? n : -errno;
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Write a whole request.
+ *
+ * @return number of bytes written, or -error number
+ */
+static int b_write(struct bench_backend *be, struct bench_file *f, const char *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	while (done < len) {
+		int n = (be->root[0] == '\0')
+			? fs_ops.write(f->path, buf + done, len - done, offset + done, &f->fi)
+			: pwrite(f->fd, buf + done, len - done, offset + done);
+		if (n < 0) return (be->root[0] == '\0') ? n : -errno;
+		if (n == 0) return -EIO;
+		done += n;
+	}
+	return done;
+}
+
+/* Results
+ */
+
+static void samples_begin(struct bench_samples *s)
+{
+	s->n = 0;
+	s->bytes = 0;
+	s->start = stats_start();
+}
+
+/**
+ * Record the latency of one request.
+ *
+ * @param s: the samples
+ * @param t0: start of the request from stats_start()
+ * @param bytes: bytes read or written by it
+ */
+static void samples_add(struct bench_samples *s, uint64_t t0, uint64_t bytes)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 4096;
+		s->ns = realloc(s->ns, s->cap * sizeof(uint64_t));
+		if (s->ns == NULL) exit(1);
+	}
+	s->ns[s->n++] = stats_start() - t0;
+	s->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print the row of a finished workload.
+ *
+ * @param be: the backend
+ * @param workload: the workload name
+ * @param reqsize: request size in bytes, or 0 if it has none
+ * @param s: the samples
+ */
+static void report(struct bench_backend *be, const char *workload, int reqsize, struct bench_samples *s)
+{
+	double secs = (stats_start() - s->start) / 1e9;
+	if (s->n == 0 || secs <= 0) return;
+	qsort(s->ns, s->n, sizeof(uint64_t), cmp_u64);
+	double p50 = s->ns[(s->n - 1) * 50 / 100] / 1e3;
+	double p99 = s->ns[(s->n - 1) * 99 / 100] / 1e3;
+	double mbs = s->bytes / 1e6 / secs;
+	if (json) {
+		printf("%s  {\"backend\": \"%s\", \"workload\": \"%s\", \"reqsize\": %d, \"ops\": %d, "
+			   "\"secs\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": ",
+			   rows ? ",\n" : "[\n", be->name, workload, reqsize, s->n, secs, s->n / secs);
+		if (s->bytes > 0) printf("%.2f", mbs);
+		else printf("null");
+		printf(", \"p50_us\": %.2f, \"p99_us\": %.2f}", p50, p99);
+	} else {
+		if (rows == 0) printf("backend,workload,reqsize,ops,secs,ops_per_s,mb_per_s,p50_us,p99_us\n");
+		printf("%s,%s,%d,%d,%.6f,%.1f,", be->name, workload, reqsize, s->n, secs, s->n / secs);
+		if (s->bytes > 0) printf("%.2f", mbs);
+		printf(",%.2f,%.2f\n", p50, p99);
+	}
+	rows++;
+	fflush(stdout);
+}
+
+/* Workloads. Each returns 0 if successful, or -error number.
+ */
+
+/**
+ * Write a file sequentially, then read it back, at each request size.
+ */
+static int wl_sequential(struct bench_backend *be, const char *path, long size, struct bench_samples *s)
+{
+	char *buf = malloc(seq_sizes[sizeof(seq_sizes) / sizeof(seq_sizes[0]) - 1]);
+	for (long i = 0; i < seq_sizes[sizeof(seq_sizes) / sizeof(seq_sizes[0]) - 1]; i++) buf[i] = (char) (i * 7);
+	int res = 0;
+	for (int k = 0; res >= 0 && k < sizeof(seq_sizes) / sizeof(seq_sizes[0]); k++) {
+		int req = seq_sizes[k];
+		struct bench_file f;
+		b_unlink(be, path);
+		if ((res = b_create(be, path)) < 0 || (res = b_open(be, path, &f)) < 0) break;
+		samples_begin(s);
+		for (long off = 0; res >= 0 && off < size; off += req) {
+			uint64_t t0 = stats_start();
+			res = b_write(be, &f, buf, req, off);
+			samples_add(s, t0, req);
+		}
+		//the close writes out buffered data, so it is part of the run
+		int cres = b_close(be, &f);
+		if (res >= 0) res = cres;
+		if (res < 0) break;
+		report(be, "seq_write", req, s);
+
+		if ((res = b_open(be, path, &f)) < 0) break;
+		samples_begin(s);
+		for (long off = 0; res >= 0 && off < size; off += req) {
+			uint64_t t0 = stats_start();
+			res = b_read(be, &f, buf, req, off);
+			samples_add(s, t0, req);
+		}
+		b_close(be, &f);
+		if (res < 0) break;
+		report(be, "seq_read", req, s);
+	}
+	free(buf);
+	return res < 0 ? res : 0;
+}
+
+/**
+ * Read and then overwrite random aligned blocks of the file left by
+ * the sequential workload.
+ */
+static int wl_random(struct bench_backend *be, const char *path, long size, struct bench_samples *s)
+{
+	char buf[RAND_SIZE];
+	memset(buf, 0x5a, sizeof(buf));
+	long nreq = size / RAND_SIZE;
+	struct bench_file f;
+	int res = b_open(be, path, &f);
+	if (res < 0) return res;
+	for (int w = 0; res >= 0 && w <= 1; w++) {
+		unsigned seed = rand_seed;
+		samples_begin(s);
+		for (int i = 0; res >= 0 && i < RAND_OPS; i++) {
+			off_t off = (off_t) (rand_r(&seed) % nreq) * RAND_SIZE;
+			uint64_t t0 = stats_start();
+			res = w ? b_write(be, &f, buf, RAND_SIZE, off) : b_read(be, &f, buf, RAND_SIZE, off);
+			samples_add(s, t0, RAND_SIZE);
+		}
+		if (res >= 0) report(be, w ? "rand_write" : "rand_read", RAND_SIZE, s);
+	}
+	int cres = b_close(be, &f);
+	b_unlink(be, path);
+	return res < 0 ? res : cres;
+}
+
+/**
+ * Create, stat and unlink many small files, spread over directories
+ * since a directory holds only DIRENTS_PER_BLK entries.
+ */
+static int wl_metadata(struct bench_backend *be, struct bench_samples *s)
+{
+	static const char *phases[] = { "meta_create", "meta_stat", "meta_unlink" };
+	char path[MAX_PATH];
+	int res = 0;
+	for (int d = 0; res >= 0 && d < META_DIRS; d++) {
+		sprintf(path, "/meta%d", d);
+		res = b_mkdir(be, path);
+	}
+	for (int p = 0; res >= 0 && p < 3; p++) {
+		samples_begin(s);
+		for (int d = 0; res >= 0 && d < META_DIRS; d++) {
+			for (int i = 0; res >= 0 && i < META_FILES; i++) {
+				sprintf(path, "/meta%d/f%d", d, i);
+				uint64_t t0 = stats_start();
+				res = (p == 0) ? b_create(be, path) : (p == 1) ? b_stat(be, path) : b_unlink(be, path);
+				samples_add(s, t0, 0);
+			}
+		}
+		if (res >= 0) report(be, phases[p], 0, s);
+	}
+	for (int d = 0; d < META_DIRS; d++) {
+		sprintf(path, "/meta%d", d);
+		b_rmdir(be, path);
+	}
+	return res < 0 ? res : 0;
+}
+
+/**
+ * List a full directory repeatedly.
+ */
+static int wl_listing(struct bench_backend *be, struct bench_samples *s)
+{
+	char path[MAX_PATH];
+	int res = b_mkdir(be, "/list");
+	for (int i = 0; res >= 0 && i < DIRENTS_PER_BLK; i++) {
+		sprintf(path, "/list/entry%02d", i);
+		res = b_create(be, path);
+	}
+	samples_begin(s);
+	for (int i = 0; res >= 0 && i < LIST_OPS; i++) {
+		uint64_t t0 = stats_start();
+		res = b_list(be, "/list");
+		samples_add(s, t0, 0);
+		if (res >= 0 && res != DIRENTS_PER_BLK) res = -EIO;
+	}
+	if (res >= 0) report(be, "list_dir", 0, s);
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		sprintf(path, "/list/entry%02d", i);
+		b_unlink(be, path);
+	}
+	b_rmdir(be, "/list");
+	return res < 0 ? res : 0;
+}
+
+/**
+ * Look up the file at the bottom of a deep directory path repeatedly.
+ */
+static int wl_deep(struct bench_backend *be, struct bench_samples *s)
+{
+	char path[MAX_PATH] = "";
+	int res = 0;
+	for (int i = 0; res >= 0 && i < DEEP_DEPTH; i++) {
+		sprintf(path + strlen(path), "/d%d", i);
+		res = b_mkdir(be, path);
+	}
+	int len = strlen(path);
+	strcat(path, "/leaf");
+	if (res >= 0) res = b_create(be, path);
+	samples_begin(s);
+	for (int i = 0; res >= 0 && i < DEEP_OPS; i++) {
+		uint64_t t0 = stats_start();
+		res = b_stat(be, path);
+		samples_add(s, t0, 0);
+	}
+	if (res >= 0) report(be, "deep_stat", 0, s);
+	b_unlink(be, path);
+	for (path[len] = '\0'; len > 0; path[len] = '\0') {
+		b_rmdir(be, path);
+		while (len > 0 && path[--len] != '/');
+	}
+	return res < 0 ? res : 0;
+}
+
+/**
+ * Run every workload on a backend.
+ */
+static int run_workloads(struct bench_backend *be, long size)
+{
+	struct bench_samples s = { .ns = NULL };
+	int res = wl_sequential(be, "/seq", size, &s);
+	if (res >= 0) res = wl_random(be, "/seq", size, &s);
+	if (res >= 0) res = wl_metadata(be, &s);
+	if (res >= 0) res = wl_listing(be, &s);
+	if (res >= 0) res = wl_deep(be, &s);
+	if (res < 0) fprintf(stderr, "%s: workload failed: %s\n", be->name, strerror(-res));
+	free(s.ns);
+	return res;
+}
+
+/* Images and mounts
+ */
+
+/**
+ * Name the images of a benchmark backend: one image, or the images
+ * of the stripe or mirror.
+ *
+ * @param dir: directory of the images
+ * @param name: name of the backend
+ * @param imgs: set to the image paths
+ */
+static void image_names(const char *dir, const char *name, char imgs[][MAX_PATH])
+{
+	snprintf(imgs[0], MAX_PATH, "%s/bench-%s.img", dir, name);
+	for (int i = 1; i < n_images; i++) {
+		snprintf(imgs[i], MAX_PATH, "%s/bench-%s-%d.img", dir, name, i);
+	}
+}
+
+/**
+ * Create the empty images of a stripe, each a share of BENCH_BLKS
+ * in whole chunks, or of a mirror, each BENCH_BLKS.
+ *
+ * @return 0 if successful, or -errno
+ */
+static int raid_images(char imgs[][MAX_PATH])
+{
+	int chunks = (BENCH_BLKS / n_images + stripe_chunk - 1) / stripe_chunk;
+	off_t size = (off_t) (mirror ? BENCH_BLKS : chunks * stripe_chunk) * BLOCK_SIZE;
+	for (int i = 0; i < n_images; i++) {
+		int fd = open(imgs[i], O_CREAT | O_TRUNC | O_WRONLY, 0666);
+		if (fd < 0 || ftruncate(fd, size) < 0) {
+			int err = errno;
+			if (fd >= 0) close(fd);
+			return -err;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+/**
+ * Open an image, in memory with -ram and slowed down with -latency
+ * or -bandwidth.
+ *
+ * @return the block device, or NULL if it cannot be opened
+ */
+static struct blkdev *bench_open(char *img)
+{
+	struct blkdev *dev = ram ? image_create_ram(img, 0, false) : image_create(img);
+	if (dev != NULL && (slow.latency_us > 0 || slow.bandwidth > 0)) {
+		dev = slow_create(dev, &slow);
+	}
+	return dev;
+}
+
+/**
+ * Run the workloads directly against fs_ops on a fresh image, or on
+ * a fresh stripe or mirror of images with -stripe or -mirror.
+ */
+static int bench_direct(const char *dir, long size)
+{
+	char imgs[MAX_IMAGES][MAX_PATH];
+	image_names(dir, "direct", imgs);
+	int res;
+	if (n_images > 1) {
+		struct blkdev *devs[MAX_IMAGES];
+		res = raid_images(imgs);
+		for (int i = 0; i < n_images && res == 0; i++) {
+			if ((devs[i] = bench_open(imgs[i])) == NULL) res = -EIO;
+		}
+		if (res == 0) {
+			disk = mirror ? mirror_create(devs, n_images, -1) : stripe_create(devs, n_images, stripe_chunk);
+			if (disk == NULL) res = -EIO;
+		}
+		if (res == 0) res = fs_mkfs_dev(disk, BENCH_INODES);
+	} else {
+		res = fs_mkfs(imgs[0], BENCH_BLKS, BENCH_INODES);
+		if (res == 0 && (disk = bench_open(imgs[0])) == NULL) res = -EIO;
+	}
+	if (res == 0 && cache_mb > 0) {
+		struct bcache_params bp = {
+			.nblks = cache_mb * (1024 * 1024 / BLOCK_SIZE), .dirty_ratio = 20, .expire_ms = 1000,
+		};
+		if ((disk = bcache_create(disk, &bp)) == NULL) res = -ENOMEM;
+	}
+	if (res < 0) {
+		fprintf(stderr, "cannot create image %s\n", imgs[0]);
+		return -EIO;
+	}
+	fs_ops.init(NULL);
+	struct bench_backend be = { "fs_ops", "" };
+	res = run_workloads(&be, size);
+	fs_ops.destroy(NULL);
+	disk->ops->close(disk);
+	for (int i = 0; i < n_images; i++) {
+		unlink(imgs[i]);
+	}
+	return res;
+}
+
+/**
+ * Run a program and wait for it.
+ *
+ * @return its exit status, or -1 if it could not be run
+ */
+static int run(char *const argv[])
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0) return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Mount a fresh image with fsx492 and run the workloads through the
+ * mount. Skipped with a message if the mount does not come up, as
+ * where FUSE is unavailable.
+ */
+static int bench_mount(const char *dir, const char *fsx492, long size)
+{
+	char imgs[MAX_IMAGES][MAX_PATH], mnt[MAX_PATH], probe[MAX_PATH + 32];
+	char *img = imgs[0];
+	image_names(dir, "mount", imgs);
+	snprintf(mnt, sizeof(mnt), "%s/bench-mnt", dir);
+	snprintf(probe, sizeof(probe), "%s/.fsx492-stats", mnt);
+	if ((n_images > 1) ? raid_images(imgs) < 0 : fs_mkfs(img, BENCH_BLKS, BENCH_INODES) < 0) {
+		fprintf(stderr, "cannot create image %s\n", img);
+		return -EIO;
+	}
+	mkdir(mnt, 0777);
+
+	//run in the foreground so the mount is ours to stop
+	pid_t pid = fork();
+	if (pid == 0) {
+		char latency[32], bandwidth[32], chunk[32], inodes[32], cache[32];
+		char members[MAX_IMAGES * MAX_PATH] = "";
+		snprintf(latency, sizeof(latency), "%d", slow.latency_us);
+		snprintf(bandwidth, sizeof(bandwidth), "%g", slow.bandwidth);
+		snprintf(chunk, sizeof(chunk), "%d", stripe_chunk);
+		snprintf(inodes, sizeof(inodes), "%d", BENCH_INODES);
+		char *args[24] = { (char *) fsx492, "-f", "-image", img, "-latency", latency,
+				   "-bandwidth", bandwidth };
+		int n = 8;
+		if (ram) {
+			args[n++] = "-ram-scratch";
+		}
+		if (n_images > 1) {
+			for (int i = 1; i < n_images; i++) {
+				if (i > 1) strcat(members, ",");
+				strcat(members, imgs[i]);
+			}
+			args[n++] = mirror ? "-mirror" : "-stripe";
+			args[n++] = members;
+			if (!mirror) {
+				args[n++] = "-chunk";
+				args[n++] = chunk;
+			}
+			args[n++] = "-mkfs";
+			args[n++] = inodes;
+		}
+		if (cache_mb > 0) {
+			snprintf(cache, sizeof(cache), "%d", cache_mb);
+			args[n++] = "-cache";
+			args[n++] = cache;
+		}
+		args[n++] = mnt;
+		args[n] = NULL;
+		execv(fsx492, args);
+		_exit(127);
+	}
+	//the stats file exists only once the mount is up
+	struct stat sb;
+	bool up = false;
+	for (int i = 0; pid > 0 && i < 100 && !up; i++) {
+		if (waitpid(pid, NULL, WNOHANG) != 0) break;
+		up = stat(probe, &sb) == 0;
+		if (!up) usleep(50000);
+	}
+	int res = 0;
+	if (up) {
+		struct bench_backend be = { "mount", mnt };
+		res = run_workloads(&be, size);
+		char *umount[] = { "fusermount", "-u", mnt, NULL };
+		if (run(umount) != 0) kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	} else {
+		fprintf(stderr, "mount of %s on %s failed, skipping mount workloads\n", img, mnt);
+		if (pid > 0 && waitpid(pid, NULL, WNOHANG) == 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+	}
+	rmdir(mnt);
+	for (int i = 0; i < n_images; i++) {
+		unlink(imgs[i]);
+	}
+	return res;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: fsx492_bench [-json] [-dir <dir>] [-mb <MiB>] [-nomount] [-fsx492 <path>]\n"
+		"\t[-latency <usecs>] [-bandwidth <MB/s>] [-ram] [-stripe <n>] [-chunk <blocks>]\n"
+		"\t[-mirror <n>] [-cache <MiB>]\n");
+	fprintf(stderr, " -json : print JSON instead of CSV\n");
+	fprintf(stderr, " -dir <dir> : directory for images and the mount point (default /tmp)\n");
+	fprintf(stderr, " -mb <MiB> : size of the sequential file (default 16)\n");
+	fprintf(stderr, " -nomount : only run directly against fs_ops\n");
+	fprintf(stderr, " -fsx492 <path> : file system program to mount with (default ./fsx492)\n");
+	fprintf(stderr, " -latency <usecs> : delay every image request, to model a slow disk\n");
+	fprintf(stderr, " -bandwidth <MB/s> : limit image transfers to this rate\n");
+	fprintf(stderr, " -ram : keep the images in memory, to measure without the disk\n");
+	fprintf(stderr, " -stripe <n> : stripe the file system across n images, each slowed separately\n");
+	fprintf(stderr, " -chunk <blocks> : blocks in each stripe chunk (default 64)\n");
+	fprintf(stderr, " -mirror <n> : mirror the file system on n images, each slowed separately\n");
+	fprintf(stderr, " -cache <MiB> : cache blocks in memory and write them back in the background\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "/tmp", *fsx492 = "./fsx492";
+	long mb = 16;
+	bool mount = true;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-json") == 0) json = true;
+		else if (strcmp(argv[i], "-nomount") == 0) mount = false;
+		else if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc) dir = argv[++i];
+		else if (strcmp(argv[i], "-mb") == 0 && i + 1 < argc) mb = atol(argv[++i]);
+		else if (strcmp(argv[i], "-fsx492") == 0 && i + 1 < argc) fsx492 = argv[++i];
+		else if (strcmp(argv[i], "-latency") == 0 && i + 1 < argc) slow.latency_us = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-bandwidth") == 0 && i + 1 < argc) slow.bandwidth = atof(argv[++i]);
+		else if (strcmp(argv[i], "-ram") == 0) ram = true;
+		else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) cache_mb = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-stripe") == 0 && i + 1 < argc) n_images = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-mirror") == 0 && i + 1 < argc) {
+			n_images = atoi(argv[++i]);
+			mirror = true;
+		}
+		else if (strcmp(argv[i], "-chunk") == 0 && i + 1 < argc) stripe_chunk = atoi(argv[++i]);
+		else {
+			usage();
+			exit(1);
+		}
+	}
+	//the file and its blocks must fit in a benchmark image
+	if (mb <= 0 || mb > BENCH_BLKS / 1024 / 2) {
+		fprintf(stderr, "-mb must be 1 to %d\n", BENCH_BLKS / 1024 / 2);
+		exit(1);
+	}
+	if (n_images < 1 || n_images > MAX_IMAGES || stripe_chunk < 1) {
+		fprintf(stderr, "-stripe and -mirror must be 1 to %d and -chunk at least 1\n", MAX_IMAGES);
+		exit(1);
+	}
+
+	int res = bench_direct(dir, mb << 20);
+	if (res >= 0 && mount) res = bench_mount(dir, fsx492, mb << 20);
+	if (json) printf(rows ? "\n]\n" : "[]\n");
+	return res < 0 ? 1 : 0;
+}
@@ -9,11 +9,13 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
+#include <sys/types.h>
+
 /**  block device block size */
 enum { BLOCK_SIZE = 1024};
 
 /** block device operation status */
-enum { SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3};
+enum { SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3, E_CSUM = -4};
 
 /** Definition of a block device */
 struct blkdev {
@@ -28,6 +30,9 @@ struct blkdev_ops {
 	int  (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
 	int  (*flush)(struct blkdev *dev, int first_blk, int num_blks);
 	void (*close)(struct blkdev *dev);
+	/* optional: file descriptor and byte offset holding a block, so
+	 * its data can be spliced; returns E_UNAVAIL if not file backed */
+	int  (*map)(struct blkdev *dev, int blk, off_t *pos);
 };
 
 #endif
@@ -0,0 +1,445 @@
+/*
+ * file:        bulk.c
+ * description: bulk copies of whole directory trees between the host
+ *              and the file system, used by the REPL
+ *
+ * The tree is walked by a single thread, which creates every entry,
+ * and on import allocates the blocks of each file up front. Only file
+ * data is copied by the worker threads: calls into the file system
+ * core are serialized by bulk_lock, but the blocks of an extent are
+ * read or written straight on the device without it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "fscore.h"
+#include "bulk.h"
+
+/** size of the buffer of each worker thread */
+enum { BULK_BUF_SIZE = 4 << 20 };
+
+/** a file to copy */
+struct bulk_file {
+	char *path; /* host path */
+	int inum; /* the file inode */
+	off_t size; /* size when the tree was walked */
+	bool prealloc; /* blocks allocated by inode_prealloc */
+};
+
+struct bulk_job;
+
+/**
+ * Copy the data of one file.
+ *
+ * @param job: the copy
+ * @param f: the file
+ * @param buf: buffer of BULK_BUF_SIZE bytes
+ * @param ext: array of BULK_BUF_SIZE / BLOCK_SIZE + 2 extents
+ */
+typedef void (*bulk_copy_t)(struct bulk_job *job, struct bulk_file *f, char *buf, struct fs_extent *ext);
+
+/** state shared by the threads of a bulk copy */
+struct bulk_job {
+	struct bulk_file *files; /* files to copy */
+	int nfiles, cap;
+	int next; /* next file to copy */
+	int err; /* first error */
+	struct bulk_stats *st; /* the totals */
+	bulk_copy_t copy; /* copies the data of a file */
+};
+
+/** protects bulk_job and serializes calls into the file system core */
+static pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Current monotonic time in seconds.
+ */
+static double bulk_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Report a failed file or directory, keeping the first error.
+ * Call with bulk_lock held once the workers have started.
+ */
+static void bulk_fail(struct bulk_job *job, const char *path, int err)
+{
+	fprintf(stderr, "%s: %s\n", path, strerror(-err));
+	if (job->err == 0) job->err = err;
+	job->st->errors++;
+}
+
+/**
+ * Add a file to the copy, taking over its path.
+ */
+static void bulk_add(struct bulk_job *job, char *path, int inum, off_t size, bool prealloc)
+{
+	if (job->nfiles == job->cap) {
+		job->cap = job->cap ? 2 * job->cap : 64;
+		job->files = realloc(job->files, job->cap * sizeof(struct bulk_file));
+	}
+	struct bulk_file *f = &job->files[job->nfiles++];
+	f->path = path;
+	f->inum = inum;
+	f->size = size;
+	f->prealloc = prealloc;
+}
+
+/**
+ * Create the entries of a host directory, and of its subdirectories,
+ * in a directory of the file system, and allocate the blocks of
+ * each file.
+ *
+ * @param job: the copy, to which files are added
+ * @param outside: the host directory
+ * @param dir: the directory inode
+ */
+static void put_walk(struct bulk_job *job, const char *outside, int dir)
+{
+	DIR *d = opendir(outside);
+	if (d == NULL) {
+		bulk_fail(job, outside, -errno);
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		char *path = malloc(strlen(outside) + strlen(de->d_name) + 2);
+		sprintf(path, "%s/%s", outside, de->d_name);
+		struct stat sb;
+		if (lstat(path, &sb) < 0) {
+			bulk_fail(job, path, -errno);
+			free(path);
+			continue;
+		}
+		if (strlen(de->d_name) > FS_FILENAME_SIZE - 1) {
+			bulk_fail(job, path, -ENAMETOOLONG);
+			free(path);
+			continue;
+		}
+
+		if (S_ISDIR(sb.st_mode)) {
+			int inum = dir_create(dir, de->d_name, S_IFDIR | (sb.st_mode & 0777));
+			if (inum == -EEXIST) {
+				//merge into a directory that is already there
+				inum = lookup(dir, de->d_name);
+				if (!inode_is_dir(inum)) inum = -ENOTDIR;
+			} else if (inum >= 0) {
+				job->st->dirs++;
+			}
+			if (inum < 0) bulk_fail(job, path, inum);
+			else put_walk(job, path, inum);
+			free(path);
+		} else if (S_ISREG(sb.st_mode)) {
+			int inum = dir_create(dir, de->d_name, S_IFREG | (sb.st_mode & 0777));
+			int res = (inum < 0) ? inum : inode_prealloc(inum, sb.st_size);
+			if (res < 0) {
+				bulk_fail(job, path, res);
+				free(path);
+				continue;
+			}
+			bulk_add(job, path, inum, sb.st_size, res == 1);
+		} else {
+			//special files and links are not copied
+			free(path);
+		}
+	}
+	closedir(d);
+}
+
+/**
+ * Copy the data of a file into the file system, at most
+ * BULK_BUF_SIZE bytes at a time. A file that fails is left empty.
+ */
+static void put_file(struct bulk_job *job, struct bulk_file *f, char *buf, struct fs_extent *ext)
+{
+	int fd = open(f->path, O_RDONLY);
+	int err = (fd < 0) ? -errno : 0;
+	off_t offset = 0;
+	while (err == 0 && offset < f->size) {
+		size_t len = (f->size - offset < BULK_BUF_SIZE) ? f->size - offset : BULK_BUF_SIZE;
+		size_t got = 0;
+		while (got < len) {
+			ssize_t n = read(fd, buf + got, len - got);
+			if (n <= 0) break;
+			got += n;
+		}
+		if (got < len) {
+			//the file shrank or could not be read
+			err = -EIO;
+			break;
+		}
+
+		if (f->prealloc) {
+			pthread_mutex_lock(&bulk_lock);
+			int n = inode_prealloc_extents(f->inum, offset, len, ext, BULK_BUF_SIZE / BLOCK_SIZE + 2);
+			pthread_mutex_unlock(&bulk_lock);
+			size_t pos = 0;
+			for (int i = 0; i < n; i++) {
+				extent_write(&ext[i], buf + pos);
+				pos += ext[i].len;
+			}
+			if (n < 0 || pos < len) {
+				err = (n < 0) ? n : -EIO;
+				break;
+			}
+		} else {
+			pthread_mutex_lock(&bulk_lock);
+			int n = inode_write(f->inum, buf, len, offset);
+			pthread_mutex_unlock(&bulk_lock);
+			if (n < 0 || (size_t) n < len) {
+				err = (n < 0) ? n : -ENOSPC;
+				break;
+			}
+		}
+		offset += len;
+	}
+	if (fd >= 0) close(fd);
+
+	pthread_mutex_lock(&bulk_lock);
+	if (err == 0 && f->prealloc) {
+		inode_prealloc_done(f->inum, f->size);
+	}
+	if (err == 0) {
+		job->st->files++;
+		job->st->bytes += f->size;
+	} else {
+		inode_truncate(f->inum);
+		bulk_fail(job, f->path, err);
+	}
+	pthread_mutex_unlock(&bulk_lock);
+}
+
+/**
+ * Copy an extent to a host file at its current offset, straight
+ * from the image file if the device allows it.
+ *
+ * @param ext: the extent
+ * @param out: the host file
+ * @param buf: buffer of at least ext->len bytes
+ * @return 0 if successful, or -errno
+ */
+static int get_extent(struct fs_extent *ext, int out, char *buf)
+{
+	off_t pos;
+	int in = extent_fd(ext, &pos);
+	size_t len = ext->len;
+	if (in >= 0) {
+		//the kernel copies the data, sharing it between files
+		//where the host file system can
+		while (len > 0) {
+			ssize_t n = copy_file_range(in, &pos, out, NULL, len, 0);
+			if (n <= 0) n = sendfile(out, in, &pos, len);
+			if (n <= 0) break;
+			len -= n;
+		}
+		if (len == 0) return 0;
+	}
+
+	//data not in the image file as it is stored, or not copied above
+	int err = extent_read(ext, buf);
+	if (err < 0) return err;
+	const char *p = buf + (ext->len - len);
+	while (len > 0) {
+		ssize_t n = write(out, p, len);
+		if (n < 0) return -errno;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Copy the data of a file out to the host, at most BULK_BUF_SIZE
+ * bytes at a time.
+ */
+static void get_file(struct bulk_job *job, struct bulk_file *f, char *buf, struct fs_extent *ext)
+{
+	int out = open(f->path, O_WRONLY | O_CREAT | O_TRUNC, inode_attr(f->inum)->mode & 0777);
+	int err = (out < 0) ? -errno : 0;
+	off_t offset = 0;
+	while (err == 0 && offset < f->size) {
+		size_t len = (f->size - offset < BULK_BUF_SIZE) ? f->size - offset : BULK_BUF_SIZE;
+		pthread_mutex_lock(&bulk_lock);
+		int n = inode_extents(f->inum, offset, len, ext, BULK_BUF_SIZE / BLOCK_SIZE + 2);
+		pthread_mutex_unlock(&bulk_lock);
+		for (int i = 0; i < n && err == 0; i++) {
+			err = get_extent(&ext[i], out, buf);
+		}
+		offset += len;
+	}
+	if (out >= 0 && close(out) < 0 && err == 0) err = -errno;
+
+	pthread_mutex_lock(&bulk_lock);
+	if (err == 0) {
+		job->st->files++;
+		job->st->bytes += f->size;
+	} else {
+		bulk_fail(job, f->path, err);
+	}
+	pthread_mutex_unlock(&bulk_lock);
+}
+
+/**
+ * Create the host directories of a file system directory, and of
+ * its subdirectories, and add its files to the copy.
+ *
+ * @param job: the copy, to which files are added
+ * @param dir: the directory inode
+ * @param outside: the host directory, which exists
+ */
+static void get_walk(struct bulk_job *job, int dir, const char *outside)
+{
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dir_read(dir, entries);
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		if (!entries[i].valid) continue;
+		char *path = malloc(strlen(outside) + strlen(entries[i].name) + 2);
+		sprintf(path, "%s/%s", outside, entries[i].name);
+		int inum = entries[i].inode;
+		if (inode_is_dir(inum)) {
+			if (mkdir(path, inode_attr(inum)->mode & 0777) == 0) {
+				job->st->dirs++;
+				get_walk(job, inum, path);
+			} else if (errno == EEXIST) {
+				get_walk(job, inum, path);
+			} else {
+				bulk_fail(job, path, -errno);
+			}
+			free(path);
+		} else {
+			//buffered writes are part of the size
+			wbuf_sync_inode(inum);
+			bulk_add(job, path, inum, inode_attr(inum)->size, false);
+		}
+	}
+}
+
+/**
+ * Worker thread: copy files until there are none left.
+ */
+static void *bulk_main(void *arg)
+{
+	struct bulk_job *job = arg;
+	char *buf = malloc(BULK_BUF_SIZE);
+	struct fs_extent *ext = malloc((BULK_BUF_SIZE / BLOCK_SIZE + 2) * sizeof(struct fs_extent));
+	for (;;) {
+		pthread_mutex_lock(&bulk_lock);
+		int i = job->next++;
+		pthread_mutex_unlock(&bulk_lock);
+		if (i >= job->nfiles) break;
+		job->copy(job, &job->files[i], buf, ext);
+	}
+	free(ext);
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Copy the files of a job on up to nthreads threads, and free them.
+ */
+static void bulk_run(struct bulk_job *job, int nthreads)
+{
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > job->nfiles) nthreads = job->nfiles;
+	pthread_t threads[nthreads + 1];
+	int started = 0;
+	while (started < nthreads && pthread_create(&threads[started], NULL, bulk_main, job) == 0) {
+		started++;
+	}
+	//copy on this thread if no worker could be started
+	if (started == 0) bulk_main(job);
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (int i = 0; i < job->nfiles; i++) {
+		free(job->files[i].path);
+	}
+	free(job->files);
+}
+
+int bulk_put(const char *outside, int dir, int nthreads, struct bulk_stats *st)
+{
+	struct bulk_job job = { .st = st, .copy = put_file };
+	memset(st, 0, sizeof(*st));
+	double t0 = bulk_now();
+
+	//create the tree, with one metadata flush at the end
+	defer_metadata();
+	put_walk(&job, outside, dir);
+	bulk_run(&job, nthreads);
+	flush_metadata();
+
+	st->secs = bulk_now() - t0;
+	return job.err;
+}
+
+int bulk_get(int dir, const char *outside, int nthreads, struct bulk_stats *st)
+{
+	struct bulk_job job = { .st = st, .copy = get_file };
+	memset(st, 0, sizeof(*st));
+	double t0 = bulk_now();
+
+	if (mkdir(outside, 0777) < 0 && errno != EEXIST) {
+		return -errno;
+	}
+	get_walk(&job, dir, outside);
+	bulk_run(&job, nthreads);
+
+	st->secs = bulk_now() - t0;
+	return job.err;
+}
+
+/**
+ * Change the attributes of an inode, and of the entries below it
+ * if it is a directory.
+ */
+static void setattr_walk(int inum, int mode, time_t mtime, struct bulk_stats *st)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (mode != -1) inode->mode = (inode->mode & S_IFMT) | (mode & 07777);
+	if (mtime != -1) inode->mtime = mtime;
+	update_inode(inum);
+	if (!S_ISDIR(inode->mode)) {
+		st->files++;
+		return;
+	}
+	st->dirs++;
+
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dir_read(inum, entries);
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		if (entries[i].valid) setattr_walk(entries[i].inode, mode, mtime, st);
+	}
+}
+
+int bulk_setattr(int inum, int mode, time_t mtime, struct bulk_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	if (fs_readonly) return -EROFS;
+	double t0 = bulk_now();
+
+	defer_metadata();
+	setattr_walk(inum, mode, mtime, st);
+	flush_metadata();
+
+	st->secs = bulk_now() - t0;
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * file:        bulk.h
+ * description: bulk copies of whole directory trees between the host
+ *              and the file system, used by the REPL
+ */
+
+#ifndef BULK_H_
+#define BULK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/** totals of a bulk operation */
+struct bulk_stats {
+	uint64_t files; /* files copied or changed */
+	uint64_t dirs; /* directories created or changed */
+	uint64_t bytes; /* bytes of file data copied */
+	uint64_t errors; /* files or directories that failed */
+	double secs; /* elapsed time in seconds */
+};
+
+/**
+ * Copy a host directory tree into a directory of the file system.
+ * Directories and files are created and every file's blocks
+ * allocated first, with metadata writes deferred to a single flush
+ * at the end; file data is then streamed in large buffers by
+ * several threads.
+ *
+ * @param outside: the host directory
+ * @param dir: the directory inode to copy into
+ * @param nthreads: number of threads copying file data
+ * @param st: set to the totals
+ * @return 0 if successful, or -error number of the first failure
+ */
+extern int bulk_put(const char *outside, int dir, int nthreads, struct bulk_stats *st);
+
+/**
+ * Copy a directory tree of the file system out to a host directory,
+ * which is created if needed. Files are copied by several threads;
+ * runs of contiguous blocks are copied from the image file by the
+ * kernel where the device allows it, and through a large buffer
+ * otherwise.
+ *
+ * @param dir: the directory inode to copy
+ * @param outside: the host directory
+ * @param nthreads: number of threads copying file data
+ * @param st: set to the totals
+ * @return 0 if successful, or -error number of the first failure
+ */
+extern int bulk_get(int dir, const char *outside, int nthreads, struct bulk_stats *st);
+
+/**
+ * Change the permissions or modification time of a file or
+ * directory and of everything below it. The tree is walked once,
+ * changing the inode table in memory, and each changed block of it
+ * is written once at the end.
+ *
+ * @param inum: the file or directory inode
+ * @param mode: permission bits to set, or -1 to leave them
+ * @param mtime: modification time to set, or -1 to leave it
+ * @param st: set to the totals
+ * @return 0 if successful, or -EROFS
+ */
+extern int bulk_setattr(int inum, int mode, time_t mtime, struct bulk_stats *st);
+
+#endif /* BULK_H_ */
@@ -0,0 +1,194 @@
+/*
+ * file:        crc32c.c
+ * description: CRC-32C (Castagnoli) checksum, using the SSE4.2 or
+ *              ARMv8 CRC instructions when available and a lookup
+ *              table otherwise
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.h"
+
+/** reflected CRC-32C polynomial */
+enum { CRC32C_POLY = 0x82f63b78 };
+
+/** table for byte-at-a-time computation */
+static uint32_t crc32c_table[256];
+
+/** bytes per lane of the three-lane SSE4.2 loop; three lanes fit
+ *  in one file system block */
+enum { CRC32C_LANE = 336 };
+/** tables advancing a crc over one and two lanes of zero bytes */
+static uint32_t crc32c_shift1[4][256];
+static uint32_t crc32c_shift2[4][256];
+
+/** implementation chosen by crc32c_init */
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Table-driven CRC-32C of a buffer, on a pre-inverted crc.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len-- > 0) {
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/**
+ * Product of two polynomials modulo the CRC-32C polynomial, in
+ * reflected bit order.
+ */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t p = 0;
+	for (uint32_t m = 1U << 31; m != 0; m >>= 1) {
+		if (a & m) p ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/**
+ * Build a table advancing a crc over len zero bytes, which is
+ * multiplication by x^(8*len). The product is linear in the crc, so
+ * it splits into one lookup per crc byte.
+ */
+static void crc32c_shift_init(uint32_t table[4][256], size_t len)
+{
+	uint32_t xn = 1U << 31;	//x^0
+	for (size_t i = 0; i < 8 * len; i++) {
+		xn = (xn & 1) ? (xn >> 1) ^ CRC32C_POLY : xn >> 1;
+	}
+	for (int k = 0; k < 4; k++) {
+		for (uint32_t v = 0; v < 256; v++) {
+			table[k][v] = crc32c_multmodp(v << (8 * k), xn);
+		}
+	}
+}
+
+/**
+ * Advance a crc over the zero bytes of a shift table.
+ */
+static uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc)
+{
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+		table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/**
+ * CRC-32C of a buffer using the SSE4.2 crc32 instruction. The
+ * instruction has a latency of three cycles but can start every
+ * cycle, so large buffers are summed as three independent lanes
+ * whose crcs are then combined.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len >= 3 * CRC32C_LANE) {
+		uint64_t a = crc, b = 0, c = 0;
+		for (int i = 0; i < CRC32C_LANE; i += sizeof(uint64_t)) {
+			uint64_t wa, wb, wc;
+			memcpy(&wa, p + i, sizeof(wa));
+			memcpy(&wb, p + CRC32C_LANE + i, sizeof(wb));
+			memcpy(&wc, p + 2 * CRC32C_LANE + i, sizeof(wc));
+			a = _mm_crc32_u64(a, wa);
+			b = _mm_crc32_u64(b, wb);
+			c = _mm_crc32_u64(c, wc);
+		}
+		crc = crc32c_shift(crc32c_shift2, a) ^ crc32c_shift(crc32c_shift1, b) ^ (uint32_t) c;
+		p += 3 * CRC32C_LANE;
+		len -= 3 * CRC32C_LANE;
+	}
+
+	uint64_t crc64 = crc;
+	while (len >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += sizeof(word);
+		len -= sizeof(word);
+	}
+	crc = (uint32_t) crc64;
+	while (len-- > 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+/**
+ * CRC-32C of a buffer using the ARMv8 crc32c instructions.
+ */
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32cd(crc, word);
+		p += sizeof(word);
+		len -= sizeof(word);
+	}
+	while (len-- > 0) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+/**
+ * Build the lookup table and choose the fastest implementation
+ * this machine supports.
+ */
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+	crc32c_impl = crc32c_sw;
+	crc32c_name = "table";
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_shift_init(crc32c_shift1, CRC32C_LANE);
+		crc32c_shift_init(crc32c_shift2, 2 * CRC32C_LANE);
+		crc32c_impl = crc32c_sse42;
+		crc32c_name = "sse4.2";
+	}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_impl = crc32c_armv8;
+	crc32c_name = "armv8";
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_impl(~crc, buf, len);
+}
+
+const char *crc32c_impl_name(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_name;
+}
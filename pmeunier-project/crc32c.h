@@ -0,0 +1,30 @@
+/*
+ * file:        crc32c.h
+ * description: CRC-32C (Castagnoli) checksum, using the SSE4.2 or
+ *              ARMv8 CRC instructions when available
+ */
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute or continue a CRC-32C checksum.
+ *
+ * @param crc: 0, or the checksum of the preceding data
+ * @param buf: the data
+ * @param len: the number of bytes
+ * @return the checksum of the data
+ */
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Name of the implementation crc32c uses on this machine.
+ *
+ * @return "sse4.2", "armv8" or "table"
+ */
+extern const char *crc32c_impl_name(void);
+
+#endif /* CRC32C_H_ */
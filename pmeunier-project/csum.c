@@ -0,0 +1,389 @@
+/*
+ * file:        csum.c
+ * description: block device adding CRC-32C checksums to the blocks
+ *              of another block device, kept in a checksum file
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "blkdev.h"
+#include "crc32c.h"
+#include "csum.h"
+
+// should be defined in "string.h" but is not on macos
+extern char* strdup(const char *);
+
+/** number of blocks read at a time when building the checksum file */
+enum { CSUM_BUILD_BLKS = 64 };
+
+/** checksums of a block, as kept in the checksum file */
+struct csum_entry {
+	uint32_t sum; // checksum of the block
+	uint32_t prev; // checksum before the last write, until flushed
+};
+
+/** definition of checksum block device */
+struct csum_dev {
+	struct blkdev *dev; // device being checksummed
+	char *path; // path to checksum file
+	int   fd; // file descriptor of checksum file
+	int   nblks; // number of blocks in device
+	struct csum_entry *sums; // checksums of each block
+	uint64_t *unflushed; // blocks written since the last flush, one bit each
+	pthread_mutex_t lock; // protects sums, unflushed, checksum file and stats
+	struct csum_stats stats; // verification counters
+};
+
+/**
+ * Current monotonic time in nanoseconds.
+ */
+static uint64_t csum_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * To count the number of blocks on the device
+ * @param dev: the block device
+ * @return: the number of blocks in the block device
+*/
+static int csum_num_blocks(struct blkdev *dev)
+{
+	struct csum_dev *cs = dev->private;
+	return cs->nblks;
+}
+
+/**
+ * Mark a block written since the last flush. Called with the lock held.
+ * @param cs: the checksum device state
+ * @param blk: the block
+*/
+static void csum_mark_unflushed(struct csum_dev *cs, int blk)
+{
+	cs->unflushed[blk / 64] |= (uint64_t) 1 << (blk % 64);
+}
+
+/**
+ * Clear the mark of a block written since the last flush. Called
+ * with the lock held.
+ * @param cs: the checksum device state
+ * @param blk: the block
+ * @return true if the block was marked
+*/
+static bool csum_claim_unflushed(struct csum_dev *cs, int blk)
+{
+	uint64_t bit = (uint64_t) 1 << (blk % 64);
+	bool marked = (cs->unflushed[blk / 64] & bit) != 0;
+	cs->unflushed[blk / 64] &= ~bit;
+	return marked;
+}
+
+/**
+ * Write the checksums of a range of blocks to the checksum file.
+ * Called with the lock held.
+ * @param cs: the checksum device state
+ * @param first_blk: the first block
+ * @param nblks: the number of blocks
+ * @return SUCCESS, or E_UNAVAIL if the file cannot be written
+*/
+static int csum_store(struct csum_dev *cs, int first_blk, int nblks)
+{
+	size_t size = nblks * sizeof(struct csum_entry);
+	if (pwrite(cs->fd, &cs->sums[first_blk], size,
+			(off_t) first_blk * sizeof(struct csum_entry)) != (ssize_t) size) {
+		fprintf(stderr, "write error on %s: %s\n", cs->path, strerror(errno));
+		return E_UNAVAIL;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Read blocks from the underlying device and verify their checksums.
+ * A block written since the last flush may match its checksum from
+ * before the write too, as its data may not have been written.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS if successful, E_CSUM if a block is corrupt, or
+ *   the error of the underlying device
+*/
+static int csum_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct csum_dev *cs = dev->private;
+	uint64_t t0 = csum_now();
+	int result = cs->dev->ops->read(cs->dev, first_blk, nblks, buf);
+	if (result < 0) {
+		return result;
+	}
+
+	uint64_t t1 = csum_now();
+	uint32_t sums[nblks];
+	for (int i = 0; i < nblks; i++) {
+		sums[i] = crc32c(0, (char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	uint64_t t2 = csum_now();
+
+	pthread_mutex_lock(&cs->lock);
+	for (int i = 0; i < nblks; i++) {
+		struct csum_entry *e = &cs->sums[first_blk + i];
+		if (sums[i] != e->sum && sums[i] != e->prev) {
+			fprintf(stderr, "checksum mismatch on block %d (%s)\n",
+					first_blk + i, cs->path);
+			cs->stats.mismatches++;
+			result = E_CSUM;
+		}
+	}
+	cs->stats.blks_verified += nblks;
+	cs->stats.verify_ns += t2 - t1;
+	cs->stats.read_ns += t2 - t0;
+	pthread_mutex_unlock(&cs->lock);
+	return result;
+}
+
+/**
+ * Record the checksums of blocks, then write them to the underlying
+ * device. The checksums from before the write are kept until the
+ * next flush, so a block reads back whether or not its data was
+ * written when the write failed or the program stopped.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return SUCCESS if successful, E_UNAVAIL if the checksum file
+ *   cannot be written, or the error of the underlying device
+*/
+static int csum_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct csum_dev *cs = dev->private;
+	uint64_t t0 = csum_now();
+	uint32_t sums[nblks];
+	for (int i = 0; i < nblks; i++) {
+		sums[i] = crc32c(0, (char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	uint64_t t1 = csum_now();
+
+	pthread_mutex_lock(&cs->lock);
+	for (int i = 0; i < nblks; i++) {
+		struct csum_entry *e = &cs->sums[first_blk + i];
+		e->prev = e->sum;
+		e->sum = sums[i];
+		csum_mark_unflushed(cs, first_blk + i);
+	}
+	int result = csum_store(cs, first_blk, nblks);
+	cs->stats.blks_summed += nblks;
+	cs->stats.sum_ns += t1 - t0;
+	pthread_mutex_unlock(&cs->lock);
+	if (result < 0) {
+		return result;
+	}
+
+	result = cs->dev->ops->write(cs->dev, first_blk, nblks, buf);
+	pthread_mutex_lock(&cs->lock);
+	cs->stats.write_ns += csum_now() - t0;
+	pthread_mutex_unlock(&cs->lock);
+	return result;
+}
+
+/**
+ * Flush the underlying device and the checksum file. Once the data
+ * is flushed, the checksums from before the writes are dropped.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if the checksum file
+ *   cannot be written, or the error of the underlying device
+*/
+static int csum_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct csum_dev *cs = dev->private;
+	if (fsync(cs->fd) < 0) {
+		return E_UNAVAIL;
+	}
+	int result = cs->dev->ops->flush(cs->dev, first_blk, nblks);
+	if (result < 0) {
+		return result;
+	}
+
+	pthread_mutex_lock(&cs->lock);
+	int end = (first_blk + nblks < cs->nblks) ? first_blk + nblks : cs->nblks;
+	for (int blk = first_blk; blk < end && result == SUCCESS; blk++) {
+		//store each run of written blocks at once
+		int n = 0;
+		while (blk + n < end && csum_claim_unflushed(cs, blk + n)) {
+			struct csum_entry *e = &cs->sums[blk + n];
+			e->prev = e->sum;
+			n++;
+		}
+		if (n > 0) {
+			result = csum_store(cs, blk, n);
+			blk += n;
+		}
+	}
+	pthread_mutex_unlock(&cs->lock);
+	if (result == SUCCESS && fsync(cs->fd) < 0) {
+		result = E_UNAVAIL;
+	}
+	return result;
+}
+
+/**
+ * Close the checksum file, if open, and free a checksum device.
+ * @param dev: the block device
+ * @param cs: the checksum device state, with the lock initialized
+*/
+static void csum_free(struct blkdev *dev, struct csum_dev *cs)
+{
+	if (cs->fd >= 0 && close(cs->fd) < 0) {
+		perror("close");
+	}
+	pthread_mutex_destroy(&cs->lock);
+	free(cs->unflushed);
+	free(cs->sums);
+	free(cs->path);
+	free(cs);
+	free(dev);
+}
+
+/**
+ * Close the checksum file and the underlying device.
+ * @param dev: the block device
+*/
+static void csum_close(struct blkdev *dev)
+{
+	struct csum_dev *cs = dev->private;
+	cs->dev->ops->close(cs->dev);
+	csum_free(dev, cs);
+}
+
+/** Operations on this block device. There is no map operation:
+ *  data spliced straight from the image would skip verification. */
+static struct blkdev_ops csum_ops = {
+	.num_blocks = csum_num_blocks,
+	.read = csum_read,
+	.write = csum_write,
+	.flush = csum_flush,
+	.close = csum_close,
+};
+
+/**
+ * Compute the checksum of every block of the device and write
+ * them to the checksum file.
+ * @param cs: the checksum device state
+ * @return SUCCESS, or the error reading the device or E_UNAVAIL
+*/
+static int csum_build(struct csum_dev *cs)
+{
+	char *buf = malloc(CSUM_BUILD_BLKS * BLOCK_SIZE);
+	if (buf == NULL) {
+		return E_UNAVAIL;
+	}
+	int result = SUCCESS;
+	for (int blk = 0; blk < cs->nblks && result == SUCCESS; blk += CSUM_BUILD_BLKS) {
+		int n = (cs->nblks - blk < CSUM_BUILD_BLKS) ? cs->nblks - blk : CSUM_BUILD_BLKS;
+		result = cs->dev->ops->read(cs->dev, blk, n, buf);
+		for (int i = 0; i < n && result == SUCCESS; i++) {
+			cs->sums[blk + i].sum = cs->sums[blk + i].prev =
+				crc32c(0, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+		}
+	}
+	free(buf);
+
+	size_t size = cs->nblks * sizeof(struct csum_entry);
+	if (result == SUCCESS && (ftruncate(cs->fd, size) < 0 ||
+			pwrite(cs->fd, cs->sums, size, 0) != (ssize_t) size)) {
+		fprintf(stderr, "can't write checksums %s: %s\n", cs->path, strerror(errno));
+		result = E_UNAVAIL;
+	}
+	return result;
+}
+
+struct blkdev *csum_create(struct blkdev *base, char *path, bool rebuild)
+{
+	struct blkdev *dev = malloc(sizeof(*dev));
+	struct csum_dev *cs = calloc(1, sizeof(*cs));
+
+	if (dev == NULL || cs == NULL) {
+		free(cs);
+		free(dev);
+		return NULL;
+	}
+
+	cs->dev = base;
+	cs->fd = -1;
+	cs->path = strdup(path); /* save a copy for error reporting */
+	cs->nblks = base->ops->num_blocks(base);
+	cs->sums = malloc(cs->nblks * sizeof(struct csum_entry));
+	cs->unflushed = calloc(cs->nblks / 64 + 1, sizeof(uint64_t));
+	pthread_mutex_init(&cs->lock, NULL);
+	if (cs->path == NULL || cs->sums == NULL || cs->unflushed == NULL) {
+		csum_free(dev, cs);
+		return NULL;
+	}
+
+	/* open checksum file */
+	cs->fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (cs->fd < 0) {
+		fprintf(stderr, "can't open checksums %s: %s\n", path, strerror(errno));
+		csum_free(dev, cs);
+		return NULL;
+	}
+
+	/* build the checksums of a new file, or if asked to */
+	struct stat sb;
+	size_t size = cs->nblks * sizeof(struct csum_entry);
+	if (fstat(cs->fd, &sb) < 0) {
+		fprintf(stderr, "can't access checksums %s: %s\n", path, strerror(errno));
+		csum_free(dev, cs);
+		return NULL;
+	}
+	if (!rebuild && sb.st_size != 0 && (sb.st_size != (off_t) size ||
+			pread(cs->fd, cs->sums, size, 0) != (ssize_t) size)) {
+		fprintf(stderr, "checksums %s are not the size of the image, use -checksum-rebuild to rebuild them\n",
+				path);
+		csum_free(dev, cs);
+		return NULL;
+	}
+	if (rebuild || sb.st_size == 0) {
+		printf("building checksums %s (%s)\n", path, crc32c_impl_name());
+		if (csum_build(cs) != SUCCESS) {
+			csum_free(dev, cs);
+			return NULL;
+		}
+	}
+
+	//blocks written since the last flush when the program stopped
+	for (int blk = 0; blk < cs->nblks; blk++) {
+		if (cs->sums[blk].prev != cs->sums[blk].sum) {
+			csum_mark_unflushed(cs, blk);
+		}
+	}
+
+	dev->private = cs;
+	dev->ops = &csum_ops;
+
+	return dev;
+}
+
+void csum_get_stats(struct blkdev *dev, struct csum_stats *st)
+{
+	struct csum_dev *cs = dev->private;
+	pthread_mutex_lock(&cs->lock);
+	*st = cs->stats;
+	pthread_mutex_unlock(&cs->lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * file:        csum.h
+ * description: block device adding CRC-32C checksums to the blocks
+ *              of another block device
+ */
+
+#ifndef CSUM_H_
+#define CSUM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "blkdev.h"
+
+/** checksum verification counters */
+struct csum_stats {
+	uint64_t blks_verified; /* blocks checked on read */
+	uint64_t blks_summed; /* blocks checksummed on write */
+	uint64_t mismatches; /* blocks that failed verification */
+	uint64_t read_ns; /* time in reads, including verification */
+	uint64_t verify_ns; /* time computing checksums on read */
+	uint64_t write_ns; /* time in writes, including checksums */
+	uint64_t sum_ns; /* time computing checksums on write */
+};
+
+/*
+ * Create a block device that keeps a CRC-32C checksum of every
+ * block of another device in a checksum file, verifying blocks
+ * as they are read and updating checksums as they are written.
+ * A read of a corrupt block fails with E_CSUM.
+ *
+ * If the checksum file does not exist or is empty, it is built from
+ * the current device contents. A checksum file of the wrong size is
+ * an error unless rebuild is set, as rebuilding accepts whatever the
+ * device holds; it must also be rebuilt if the device is written
+ * without checksums.
+ *
+ * @param dev: the device to checksum
+ * @param path: the path to the checksum file
+ * @param rebuild: build the checksum file even if it has contents
+ * @return: the block device, or NULL if the checksum file cannot
+ *   be opened or built, or is the wrong size
+ */
+extern struct blkdev *csum_create(struct blkdev *dev, char *path, bool rebuild);
+
+/*
+ * Get the checksum counters of a checksum device.
+ *
+ * @param dev: the checksum device
+ * @param st: set to the counters
+ */
+extern void csum_get_stats(struct blkdev *dev, struct csum_stats *st);
+
+#endif /* CSUM_H_ */
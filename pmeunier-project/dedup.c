@@ -0,0 +1,208 @@
+/*
+ * file:        dedup.c
+ * description: reference counts of data blocks shared between files,
+ *              and the content index used to deduplicate blocks
+ *
+ * A block has one reference plus the count in refs[], so refs[] is
+ * all zero until blocks are shared and is only allocated then. The
+ * index is an open-addressing table from the crc32c of a block to
+ * the block, grown as blocks are added. A crc match is confirmed by
+ * comparing the stored block before it is shared.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fscore.h"
+#include "dedup.h"
+
+/** initial number of index slots */
+enum { DEDUP_MIN_SLOTS = 1024 };
+
+/** index entry, blk 0 if empty */
+struct dedup_entry {
+	uint32_t crc;
+	uint32_t blk;
+};
+
+/** number of blocks on the device */
+static int dedup_nblks;
+/** references of each block beyond the first, or NULL if none */
+static uint32_t *refs;
+/** index slots, a power of two */
+static struct dedup_entry *slots;
+static uint32_t n_slots;
+/** crc of each block, valid while the block is in the index */
+static uint32_t *blk_crc;
+static struct dedup_stats stats;
+/** protects reference counts, the index and stats */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dedup_init(int nblks)
+{
+	pthread_mutex_lock(&dedup_lock);
+	free(refs);
+	free(slots);
+	free(blk_crc);
+	refs = NULL;
+	slots = NULL;
+	blk_crc = NULL;
+	n_slots = 0;
+	dedup_nblks = nblks;
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+/**
+ * Find the slot of a crc, or the empty slot ending its probe run.
+ * Caller holds dedup_lock and the index exists.
+ */
+static uint32_t dedup_slot(uint32_t crc)
+{
+	uint32_t i = crc & (n_slots - 1);
+	while (slots[i].blk != 0 && slots[i].crc != crc) {
+		i = (i + 1) & (n_slots - 1);
+	}
+	return i;
+}
+
+/**
+ * Remove a block from the index if it is there, shifting later
+ * entries of its probe run back. Caller holds dedup_lock.
+ */
+static void dedup_forget(uint32_t blk)
+{
+	if (slots == NULL) return;
+	uint32_t i = dedup_slot(blk_crc[blk]);
+	if (slots[i].blk != blk) return;
+
+	slots[i].blk = 0;
+	stats.entries--;
+	for (uint32_t j = (i + 1) & (n_slots - 1); slots[j].blk != 0; j = (j + 1) & (n_slots - 1)) {
+		//move j to the hole unless its home lies cyclically in (i, j]
+		uint32_t home = slots[j].crc & (n_slots - 1);
+		if (((j - home) & (n_slots - 1)) >= ((j - i) & (n_slots - 1))) {
+			slots[i] = slots[j];
+			slots[j].blk = 0;
+			i = j;
+		}
+	}
+}
+
+/**
+ * Double the number of index slots, or create the index.
+ * Caller holds dedup_lock.
+ */
+static void dedup_grow(void)
+{
+	struct dedup_entry *old = slots;
+	uint32_t old_n = n_slots;
+	n_slots = old_n ? 2 * old_n : DEDUP_MIN_SLOTS;
+	slots = calloc(n_slots, sizeof(*slots));
+	if (blk_crc == NULL) {
+		blk_crc = malloc(dedup_nblks * sizeof(uint32_t));
+	}
+	for (uint32_t i = 0; i < old_n; i++) {
+		if (old[i].blk != 0) slots[dedup_slot(old[i].crc)] = old[i];
+	}
+	free(old);
+}
+
+/**
+ * Add a reference to a block. Caller holds dedup_lock.
+ */
+static void blk_ref_locked(uint32_t blk)
+{
+	if (refs == NULL) {
+		refs = calloc(dedup_nblks, sizeof(uint32_t));
+	}
+	if (refs[blk]++ == 0) stats.shared_blks++;
+	stats.extra_refs++;
+}
+
+void blk_ref(uint32_t blk)
+{
+	pthread_mutex_lock(&dedup_lock);
+	blk_ref_locked(blk);
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+bool blk_unref(uint32_t blk)
+{
+	bool last = true;
+	pthread_mutex_lock(&dedup_lock);
+	if (refs != NULL && refs[blk] > 0) {
+		if (--refs[blk] == 0) stats.shared_blks--;
+		stats.extra_refs--;
+		last = false;
+	} else {
+		dedup_forget(blk);
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return last;
+}
+
+bool blk_own(uint32_t blk)
+{
+	pthread_mutex_lock(&dedup_lock);
+	bool own = (refs == NULL || refs[blk] == 0);
+	if (own) dedup_forget(blk);
+	pthread_mutex_unlock(&dedup_lock);
+	return own;
+}
+
+bool blk_shared(uint32_t blk)
+{
+	pthread_mutex_lock(&dedup_lock);
+	bool shared = (refs != NULL && refs[blk] > 0);
+	pthread_mutex_unlock(&dedup_lock);
+	return shared;
+}
+
+uint32_t dedup_find(const char *data, uint32_t crc)
+{
+	char stored[BLOCK_SIZE];
+	uint32_t blk = 0;
+	pthread_mutex_lock(&dedup_lock);
+	stats.lookups++;
+	if (slots != NULL) {
+		uint32_t i = dedup_slot(crc);
+		//read under the lock, so the block cannot be freed meanwhile
+		if (slots[i].blk != 0) {
+			if (disk->ops->read(disk, slots[i].blk, 1, stored) < 0) exit(1);
+			if (memcmp(stored, data, BLOCK_SIZE) == 0) blk = slots[i].blk;
+		}
+	}
+	if (blk != 0) {
+		blk_ref_locked(blk);
+		stats.hits++;
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return blk;
+}
+
+void dedup_add(uint32_t blk, uint32_t crc)
+{
+	pthread_mutex_lock(&dedup_lock);
+	//keep the load at most a half
+	if (2 * (stats.entries + 1) > n_slots) dedup_grow();
+	uint32_t i = dedup_slot(crc);
+	if (slots[i].blk == 0) {
+		stats.entries++;
+	}
+	slots[i].crc = crc;
+	slots[i].blk = blk;
+	blk_crc[blk] = crc;
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+void dedup_get_stats(struct dedup_stats *st)
+{
+	pthread_mutex_lock(&dedup_lock);
+	*st = stats;
+	st->index_bytes = (uint64_t) n_slots * sizeof(struct dedup_entry) +
+		(blk_crc ? dedup_nblks * sizeof(uint32_t) : 0) +
+		(refs ? dedup_nblks * sizeof(uint32_t) : 0);
+	pthread_mutex_unlock(&dedup_lock);
+}
@@ -0,0 +1,92 @@
+/*
+ * file:        dedup.h
+ * description: reference counts of data blocks shared between files,
+ *              and the content index used to deduplicate blocks
+ */
+
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** deduplication counters */
+struct dedup_stats {
+	uint64_t lookups; /* blocks looked up in the index */
+	uint64_t hits; /* blocks shared instead of written */
+	uint64_t entries; /* blocks in the index */
+	uint64_t index_bytes; /* memory used by the index and counts */
+	uint64_t shared_blks; /* blocks with more than one reference */
+	uint64_t extra_refs; /* references beyond the first */
+};
+
+/*
+ * Set up reference counts for a device. Every block starts with
+ * a single reference, or none if it is free.
+ *
+ * @param nblks: number of blocks on the device
+ */
+extern void dedup_init(int nblks);
+
+/*
+ * Add a reference to a block in use.
+ *
+ * @param blk: the block
+ */
+extern void blk_ref(uint32_t blk);
+
+/*
+ * Drop a reference to a block. The last reference also removes the
+ * block from the index, and the caller frees the block.
+ *
+ * @param blk: the block
+ * @return true if that was the last reference
+ */
+extern bool blk_unref(uint32_t blk);
+
+/*
+ * Check that a block has a single reference, so it may be written
+ * in place, and remove it from the index so it cannot be shared
+ * while it is written.
+ *
+ * @param blk: the block
+ * @return true if the block has a single reference
+ */
+extern bool blk_own(uint32_t blk);
+
+/*
+ * Check whether a block has more than one reference, without
+ * changing it.
+ *
+ * @param blk: the block
+ * @return true if other references to the block remain
+ */
+extern bool blk_shared(uint32_t blk);
+
+/*
+ * Find a stored block with the same content and add a reference
+ * to it.
+ *
+ * @param data: BLOCK_SIZE bytes of content
+ * @param crc: crc32c of the content
+ * @return the block, or 0 if there is none
+ */
+extern uint32_t dedup_find(const char *data, uint32_t crc);
+
+/*
+ * Add a block just written to the index, replacing any block with
+ * the same crc.
+ *
+ * @param blk: the block
+ * @param crc: crc32c of its content
+ */
+extern void dedup_add(uint32_t blk, uint32_t crc);
+
+/*
+ * Get the deduplication counters.
+ *
+ * @param st: set to the counters
+ */
+extern void dedup_get_stats(struct dedup_stats *st);
+
+#endif /* DEDUP_H_ */
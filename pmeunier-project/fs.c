@@ -7,7 +7,7 @@
  * 	Philip Gust, March 2019
  */
 
-#define FUSE_USE_VERSION 27
+#define FUSE_USE_VERSION 29
 
 #include <stdlib.h>
 #include <stddef.h>
@@ -18,101 +18,45 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 
-#include "fsx492.h"
-#include "blkdev.h"
+#include "fscore.h"
+#include "stats.h"
+#include "trace.h"
 
-/*
- * disk access - the global variable 'disk' points to a blkdev
- * structure which has been initialized to access the image file.
- *
- * NOTE - blkdev access is in terms of 1024-byte blocks
- */
-extern struct blkdev *disk; //see main.c
-
-/* by defining bitmaps as 'fd_set' pointers, you can use existing
- * macros to handle them.
- *   FD_ISSET(##, inode_map);
- *   FD_CLR(##, block_map);
- *   FD_SET(##, block_map);
- */
-
-/** pointer to inode bitmap to determine free inodes */ 
-static fd_set *inode_map;
-static int     inode_map_base;
+/** number of slots in the entry cache */
+#define ENTRY_CACHE_SIZE 1024
 
-/** pointer to inode blocks */
-static struct fs_inode *inodes;
-/** number of inodes from superblock */
-static int   n_inodes;
-/** number of first inode block */
-static int   inode_base;
+/** seconds an entry listed by readdir stays cached, 0 to disable;
+ *  set from the entry_timeout option in main.c */
+double entry_timeout = 1.0;
 
-/** pointer to block bitmap to determine free blocks */
-fd_set *block_map;
-/** number of first data block */
-static int     block_map_base;
-
-/** number of available blocks from superblock */
-static int   n_blocks;
-
-/** number of root inode from superblock */
-static int   root_inode;
-
-/** array of dirty metadata blocks to write  -- optional */
-static void **dirty;
+/**
+ * Entry cache slot mapping a path listed by readdir to its inode,
+ * so a following getattr on it needs no path walk. Attributes are
+ * always read from the in-memory inode table, so only the name
+ * mapping is cached.
+ */
+struct entry_cache_ent {
+	char *path; /* the path, NULL if slot unused */
+	int inum; /* inode of the path */
+	unsigned gen; /* entry_cache_gen when cached */
+	struct timespec expires; /* time the entry becomes stale */
+};
 
-/** length of dirty array -- optional */
-static int    dirty_len;
+static struct entry_cache_ent entry_cache[ENTRY_CACHE_SIZE];
+/** bumped by every unlink, rmdir and rename to drop cached entries */
+static unsigned entry_cache_gen;
+static pthread_mutex_t entry_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/** total size of direct blocks */
-static int DIR_SIZE = BLOCK_SIZE * N_DIRECT;
-static int INDIR1_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
-static int INDIR2_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
+/** lock serializing the operations, as the core is not thread safe */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Suggested functions to implement -- you are free to ignore these
  * and implement your own instead
  */
 
-/**
- * Find inode for existing directory entry.
- *
- * @param fs_dirent: pointer to first dirent in directory
- * @param name: the name of the directory entry
- * @return the entry inode, or 0 if not found.
- */
-static int find_in_dir(struct fs_dirent *de, char *name)
-{
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		//found, return its inode
-		if (de[i].valid && strcmp(de[i].name, name) == 0) {
-			return de[i].inode;
-		}
-	}
-	return 0;
-}
-
-/**
- * Look up a single directory entry in a directory.
- *
- * Errors
- *   -EIO     - error reading block
- *   -ENOENT  - a component of the path is not present.
- *   -ENOTDIR - intermediate component of path not a directory
- *
- */
-static int lookup(int inum, char *name)
-{
-	//get corresponding directory
-	struct fs_inode cur_dir = inodes[inum];
-	//init buff entries
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, cur_dir.direct[0], 1, &entries) < 0) exit(1);
-	int inode = find_in_dir(entries, name);
-	return inode == 0 ? -ENOENT : inode;
-}
-
 /**
  * Parse path name into tokens at most nnames tokens after
  * normalizing paths by removing '.' and '..' elements.
@@ -161,6 +105,119 @@ static void free_char_ptr_array(char *arr[], int len) {
 	}
 }
 
+/**
+ * Hash a path to its entry cache slot.
+ */
+static struct entry_cache_ent *entry_cache_slot(const char *path)
+{
+	unsigned h = 5381;
+	while (*path) h = h * 33 + (unsigned char) *path++;
+	return &entry_cache[h % ENTRY_CACHE_SIZE];
+}
+
+/**
+ * Cache the inode of a path.
+ *
+ * @param path: the path
+ * @param inum: its inode
+ */
+static void entry_cache_add(const char *path, int inum)
+{
+	if (entry_timeout <= 0) return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&entry_cache_lock);
+	struct entry_cache_ent *ent = entry_cache_slot(path);
+	free(ent->path);
+	ent->path = strdup(path);
+	ent->inum = inum;
+	ent->gen = entry_cache_gen;
+	ent->expires.tv_sec = now.tv_sec + (time_t) entry_timeout;
+	ent->expires.tv_nsec = now.tv_nsec + (long) ((entry_timeout - (time_t) entry_timeout) * 1e9);
+	if (ent->expires.tv_nsec >= 1000000000L) {
+		ent->expires.tv_sec++;
+		ent->expires.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_unlock(&entry_cache_lock);
+}
+
+/**
+ * Look up the cached inode of a path.
+ *
+ * @param path: the path
+ * @return the inode, or -1 if not cached or stale
+ */
+static int entry_cache_find(const char *path)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&entry_cache_lock);
+	struct entry_cache_ent *ent = entry_cache_slot(path);
+	int inum = -1;
+	if (ent->path != NULL && ent->gen == entry_cache_gen && strcmp(ent->path, path) == 0 &&
+	    (now.tv_sec < ent->expires.tv_sec ||
+	     (now.tv_sec == ent->expires.tv_sec && now.tv_nsec < ent->expires.tv_nsec))) {
+		inum = ent->inum;
+	}
+	pthread_mutex_unlock(&entry_cache_lock);
+	return inum;
+}
+
+/**
+ * Drop all cached entries after a name is removed or renamed.
+ */
+static void entry_cache_invalidate(void)
+{
+	pthread_mutex_lock(&entry_cache_lock);
+	entry_cache_gen++;
+	pthread_mutex_unlock(&entry_cache_lock);
+}
+
+/** path of the virtual file holding the performance counters */
+#define STATS_PATH "/.fsx492-stats"
+
+/**
+ * Report of the performance counters, taken when the stats file
+ * is opened so that reads of it see a consistent copy.
+ */
+struct stats_file {
+	int len; /* length of the report */
+	char text[]; /* the report */
+};
+
+/**
+ * Take a report of the performance counters for an open of the
+ * stats file.
+ *
+ * @return the report
+ */
+static struct stats_file *stats_file_open(void)
+{
+	int len = stats_format(NULL, 0);
+	struct stats_file *sf = malloc(sizeof(*sf) + len + 1);
+	//counters may grow between the two calls
+	sf->len = stats_format(sf->text, len + 1);
+	if (sf->len > len) sf->len = len;
+	return sf;
+}
+
+/**
+ * Copy part of a report of the stats file.
+ *
+ * @param sf: the report
+ * @param buf: the buffer for the data
+ * @param len: the number of bytes to read
+ * @param offset: the location to start reading at
+ * @return number of bytes read, 0 at or after the end
+ */
+static int stats_file_read(struct stats_file *sf, char *buf, size_t len, off_t offset)
+{
+	if (offset >= sf->len) return 0;
+	if (len > sf->len - offset) len = sf->len - offset;
+	memcpy(buf, sf->text + offset, len);
+	return len;
+}
+
 /**
  * Return inode number for specified file or
  * directory.
@@ -174,8 +231,15 @@ static void free_char_ptr_array(char *arr[], int len) {
  */
 static int translate(char *path)
 {
+	stats_add(ST_TRANSLATES, 1);
 	if (strcmp(path, "/") == 0 || strlen(path) == 0) return root_inode;
-	int inode_idx = root_inode;
+	int inode_idx = entry_cache_find(path);
+	if (inode_idx >= 0) {
+		stats_add(ST_ENTRY_HITS, 1);
+		return inode_idx;
+	}
+	stats_add(ST_ENTRY_MISSES, 1);
+	inode_idx = root_inode;
 	//get number of names
 	int num_names = parse(path, NULL, 0);
 	//if the number of names in the path exceed the maximum, return an error, error type to be fixed if necessary
@@ -188,7 +252,7 @@ static int translate(char *path)
 
 	for (int i = 0; i < num_names; i++) {
 		//if token is not a directory return error
-		if (!S_ISDIR(inodes[inode_idx].mode)) {
+		if (!inode_is_dir(inode_idx)) {
 			free_char_ptr_array(names, num_names);
 			return -ENOTDIR;
 		}
@@ -218,6 +282,7 @@ static int translate(char *path)
  */
 static int translate_1(char *path, char *leaf)
 {
+	stats_add(ST_TRANSLATES, 1);
 	if (strcmp(path, "/") == 0 || strlen(path) == 0) return root_inode;
 	int inode_idx = root_inode;
 	//get number of names
@@ -232,7 +297,7 @@ static int translate_1(char *path, char *leaf)
 
 	for (int i = 0; i < num_names - 1; i++) {
 		//if token is not a directory return error
-		if (!S_ISDIR(inodes[inode_idx].mode)) {
+		if (!inode_is_dir(inode_idx)) {
 			free_char_ptr_array(names, num_names);
 			return -ENOTDIR;
 		}
@@ -248,155 +313,6 @@ static int translate_1(char *path, char *leaf)
 	return inode_idx;
 }
 
-/**
- * Flush dirty metadata blocks to disk.
- */
-void flush_metadata(void)
-{
-	int i;
-	for (i = 0; i < dirty_len; i++) {
-		if (dirty[i]) {
-			disk->ops->write(disk, i, 1, dirty[i]);
-			dirty[i] = NULL;
-		}
-	}
-}
-
-/**
- * Count number of free blocks
- * @return number of free blocks
- */
-int num_free_blk() {
-	int count = 0;
-	for (int i = 0; i < n_blocks; i++) {
-		if (!FD_ISSET(i, block_map)) {
-			count++;
-		}
-	}
-	return count;
-}
-
-/**
- * Returns a free block number or -ENOSPC if none available.
- *
- * @return free block number or -ENOSPC if none available
- */
-static int get_free_blk(void)
-{
-	for (int i = 0; i < n_blocks; i++) {
-		if (!FD_ISSET(i, block_map)) {
-			char buff[BLOCK_SIZE];
-			memset(buff, 0, BLOCK_SIZE);
-			if (disk->ops->write(disk, i, 1, buff) < 0) exit(1);
-			FD_SET(i, block_map);
-			return i;
-		}
-	}
-	return -ENOSPC;
-}
-
-/**
- * Return a block to the free list
- *
- * @param  blkno the block number
- */
-static void return_blk(int blkno)
-{
-	FD_CLR(blkno, block_map);
-}
-
-static void update_blk(void)
-{
-	if (disk->ops->write(disk, block_map_base, inode_base - block_map_base, block_map) < 0)
-		exit(1);
-}
-
-/**
- * Returns a free inode number
- *
- * @return a free inode number or -ENOSPC if none available
- */
-static int get_free_inode(void)
-{
-	for (int i = 2; i < n_inodes; i++) {
-		if (!FD_ISSET(i, inode_map)) {
-			FD_SET(i, inode_map);
-			return i;
-		}
-	}
-	return -ENOSPC;
-}
-
-/**
- * Return an inode to the free list.
- *
- * @param  inum the inode number
- */
-static void return_inode(int inum)
-{
-	FD_CLR(inum, inode_map);
-}
-
-static void update_inode(int inum)
-{
-	if (disk->ops->write(disk, inode_base + inum / INODES_PER_BLK, 1, &inodes[inum - (inum % INODES_PER_BLK)]) < 0)
-		exit(1);
-	if (disk->ops->write(disk, inode_map_base, block_map_base - inode_map_base, inode_map) < 0)
-		exit(1);
-}
-
-/**
- * Find free directory entry.
- *
- * @return index of directory free entry or -ENOSPC
- *   if no space for new entry in directory
- */
-static int find_free_dir(struct fs_dirent *de)
-{
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (!de[i].valid) {
-			return i;
-		}
-	}
-	return -ENOSPC;
-}
-
-/**
- * Determines whether directory is empty.
- *
- * @param de ptr to first entry in directory
- * @return 1 if empty 0 if has entries
- */
-static int is_empty_dir(struct fs_dirent *de)
-{
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (de[i].valid) {
-			return 0;
-		}
-	}
-	return 1;
-}
-
-/**
- * Copy stat from inode to sb
- * @param inode inode to be copied from
- * @param sb holder to hold copied stat
- * @param inode_idx inode_idx
- */
-static void cpy_stat(struct fs_inode *inode, struct stat *sb) {
-	memset(sb, 0, sizeof(*sb));
-	sb->st_uid = inode->uid;
-	sb->st_gid = inode->gid;
-	sb->st_mode = (mode_t) inode->mode;
-	sb->st_atime = inode->mtime;
-	sb->st_ctime = inode->ctime;
-	sb->st_mtime = inode->mtime;
-	sb->st_size = inode->size;
-	sb->st_blksize = FS_BLOCK_SIZE;
-	sb->st_nlink = 1;
-	sb->st_blocks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-}
-
 /*
  * CS492: FUSE functions to implement are below.
 */
@@ -408,71 +324,35 @@ static void cpy_stat(struct fs_inode *inode, struct stat *sb) {
  * global variables you need. You don't need to worry about the
  * argument or the return value.
  *
- * @param conn: fuse connection information - unused
+ * @param conn: fuse connection information, NULL in cmdline mode
  * @return: unused - returns NULL
  *
  * Note: if any block read operation fails, just exit(1) immediately.
 */
 void* fs_init(struct fuse_conn_info *conn)
 {
-	//CS492: todo
-	// read the superblock
-	struct fs_super sb;
-
-
-	//read superblock into SB struct
-
-	int ret = disk->ops->read(disk, 0, 1, &sb);
-	
-	//check for faliure of the read operation
-	if(ret != SUCCESS){
-		exit(1);
-	}
-
-	root_inode = sb.root_inode;
-
-	/* The inode map and block map are directly after the superblock */
-	// read inode map
-	inode_map_base = 1; // This is correct.
-	inode_map = (fd_set *)malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-
-	ret = disk->ops->read(disk, 1, 1, inode_map);
-	
-	if(ret != SUCCESS){
-		exit(1);
-	}
-	
-	// read block map 
-	block_map_base = 2;
-	block_map = (fd_set *)malloc(sb.block_map_sz * FS_BLOCK_SIZE);
-	
-	ret = disk->ops->read(disk, 2, 1, block_map);
-
-	if(ret != SUCCESS){
-		exit(1);
-	}
-
-	/* The inode data is in the next set of blocks */
-	inode_base = 3;
-	n_inodes = sb.inode_region_sz;
-	inodes = (struct fs_inode *)malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
+	fs_mount();
 
-	ret = disk->ops->read(disk, inode_base, n_inodes, inodes);
-
-	if(ret != SUCCESS){
-		exit(1);
+	//let read_buf replies be spliced from the image
+	if (conn != NULL && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
 	}
-
-	// number of blocks on device
-	n_blocks = sb.num_blocks;
-
-	// dirty metadata blocks
-	dirty_len = inode_base + sb.inode_region_sz;
-	dirty = calloc(dirty_len*sizeof(void*), 1);
-
 	return NULL;
 }
 
+/**
+ * destroy - called once by the FUSE framework at unmount.
+ *
+ * Waits for the reclaimer to free all detached block trees so
+ * no blocks are leaked in the block map.
+ *
+ * @param private_data: unused
+ */
+void fs_destroy(void *private_data)
+{
+	fs_unmount();
+}
+
 /* Note on path translation errors:
  * In addition to the method-specific errors listed below, almost
  * every method can return one of the following errors if it fails to
@@ -503,6 +383,9 @@ void* fs_init(struct fuse_conn_info *conn)
  * st_nlink: always set to 1
  * st_atime, st_ctime: set to same value as st_mtime
  *
+ * STATS_PATH is a read-only file whose size is that of the current
+ * report of the performance counters.
+ *
  * @param path: the file path
  * @param sb: pointer to stat struct
  *
@@ -512,13 +395,23 @@ void* fs_init(struct fuse_conn_info *conn)
 */
 static int fs_getattr(const char *path, struct stat *sb)
 {
-	fs_init(NULL);
-
+	if (strcmp(path, STATS_PATH) == 0) {
+		memset(sb, 0, sizeof(*sb));
+		sb->st_mode = S_IFREG | 0444;
+		sb->st_nlink = 1;
+		sb->st_uid = getuid();
+		sb->st_gid = getgid();
+		sb->st_size = stats_format(NULL, 0);
+		sb->st_mtime = sb->st_atime = sb->st_ctime = time(NULL);
+		return SUCCESS;
+	}
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
+	free(_path);
 	if (inode_idx < 0) return inode_idx;
-	struct fs_inode* inode = &inodes[inode_idx];
-	cpy_stat(inode, sb);
+	//size must include buffered writes
+	wbuf_sync_inode(inode_idx);
+	cpy_stat(inode_idx, sb);
 	return SUCCESS;
 }
 
@@ -540,7 +433,7 @@ static int fs_opendir(const char *path, struct fuse_file_info *fi)
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
 	if (inode_idx < 0) return inode_idx;
-	if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
+	if (!inode_is_dir(inode_idx)) return -ENOTDIR;
 	fi->fh = (uint64_t) inode_idx;
 	return SUCCESS;
 }
@@ -553,6 +446,9 @@ static int fs_opendir(const char *path, struct fuse_file_info *fi)
  * filler(buf, <name>, <statbuf>, 0)
  * where <statbuf> is a struct stat, just like in getattr.
  *
+ * Each entry's path is added to the entry cache, so the getattr
+ * calls that typically follow a listing need no path walk.
+ *
  * @param path: the directory path
  * @param ptr: filler buf pointer
  * @param filler filler function to call for each entry
@@ -568,16 +464,22 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 {
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
+	free(_path);
 	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
+	struct fs_inode *inode = inode_get(inode_idx);
 	if (!S_ISDIR(inode->mode)) return -ENOTDIR;
 	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
 	struct stat sb;
-	if (disk->ops->read(disk, inode->direct[0], 1, entries) < 0) exit(1);
+	char entry_path[strlen(path) + FS_FILENAME_SIZE + 1];
+	//entry paths are <path>/<name>, or /<name> in the root
+	int plen = sprintf(entry_path, "%s", strcmp(path, "/") == 0 ? "" : path);
+	dir_read(inode_idx, entries);
 	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
 		if (entries[i].valid) {
-			cpy_stat(&inodes[entries[i].inode], &sb);
+			sprintf(entry_path + plen, "/%s", entries[i].name);
+			entry_cache_add(entry_path, entries[i].inode);
+			wbuf_sync_inode(entries[i].inode);
+			cpy_stat(entries[i].inode, &sb);
 			filler(ptr, entries[i].name, &sb, 0);
 		}
 	}
@@ -600,35 +502,11 @@ static int fs_releasedir(const char *path, struct fuse_file_info *fi)
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
 	if (inode_idx < 0) return inode_idx;
-	if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
+	if (!inode_is_dir(inode_idx)) return -ENOTDIR;
 	fi->fh = (uint64_t) -1;
 	return SUCCESS;
 }
 
-static int set_attributes_and_update(struct fs_dirent *de, char *name, mode_t mode, bool isDir)
-{
-	//get free directory and inode
-	int freed = find_free_dir(de);
-	int freei = get_free_inode();
-	int freeb = isDir ? get_free_blk() : 0;
-	if (freed < 0 || freei < 0 || freeb < 0) return -ENOSPC;
-	struct fs_dirent *dir = &de[freed];
-	struct fs_inode *inode = &inodes[freei];
-	strcpy(dir->name, name);
-	dir->inode = freei;
-	dir->valid = true;
-	inode->uid = getuid();
-	inode->gid = getgid();
-	inode->mode = mode;
-	inode->ctime = inode->mtime = time(NULL);
-	inode->size = 0;
-	inode->direct[0] = freeb;
-	//update map and inode
-	update_inode(freei);
-	update_blk();
-	return SUCCESS;
-}
-
 /**
  * mknod - create a new regular file with permissions (mode & 01777).
  * Behavior undefined when mode bits other than the low 9 bits are used.
@@ -645,31 +523,19 @@ static int set_attributes_and_update(struct fs_dirent *de, char *name, mode_t mo
 */
 static int fs_mknod(const char *path, mode_t mode, dev_t dev)
 {
-	//get current and parent inodes
+	//get parent inode
 	mode |= S_IFREG;
 	if (!S_ISREG(mode) || strcmp(path, "/") == 0) return -EINVAL;
+	if (strcmp(path, STATS_PATH) == 0) return -EEXIST;
 	char *_path = strdup(path);
 	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
 	int parent_inode_idx = translate_1(_path, name);
-	if (inode_idx >= 0) return -EEXIST;
+	free(_path);
 	if (parent_inode_idx < 0) return parent_inode_idx;
-	//read parent info
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
 
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	//assign inode and directory and update
-	int res = set_attributes_and_update(entries, name, mode, false);
-	if (res < 0) return res;
-
-	//write entries buffer into disk
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	return SUCCESS;
+	//assign inode and directory entry
+	int res = dir_create(parent_inode_idx, name, mode);
+	return (res < 0) ? res : SUCCESS;
 }
 
 /**
@@ -691,62 +557,18 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
 */
 static int fs_mkdir(const char *path, mode_t mode)
 {
-    //CS496
-    mode |= S_IFDIR;
-    if (!S_ISDIR(mode) || strcmp(path, "/") == 0) return -EINVAL;
-    char *_path = strdup(path);
-    char name[FS_FILENAME_SIZE];
-    int inode_idx = translate(_path);
-    int parent_inode_idx = translate_1(_path, name);
-    if (inode_idx >= 0) return -EEXIST;
-    if (parent_inode_idx < 0) return parent_inode_idx;
-    //read parent info
-    struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-    if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
-
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
-    //assign inode and directory and update
-    int res = set_attributes_and_update(entries, name, mode, false);
-    if (res < 0) return res;
-
-    //write entries buffer into disk
-    if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
-    return SUCCESS;
-}
-
-static void fs_truncate_dir(uint32_t *de) {
-	for (int i = 0; i < N_DIRECT; i++) {
-		if (de[i]) return_blk(de[i]);
-		de[i] = 0;
-	}
-}
-
-static void fs_truncate_indir1(int blk_num) {
-	uint32_t entries[PTRS_PER_BLK];
-	memset(entries, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0)
-		exit(1);
-	//clear each blk and wipe from blk_map
-	for (int i = 0; i < PTRS_PER_BLK; i++) {
-		if (entries[i]) return_blk(entries[i]);
-		entries[i] = 0;
-	}
-}
+	mode |= S_IFDIR;
+	if (!S_ISDIR(mode) || strcmp(path, "/") == 0) return -EINVAL;
+	if (strcmp(path, STATS_PATH) == 0) return -EEXIST;
+	char *_path = strdup(path);
+	char name[FS_FILENAME_SIZE];
+	int parent_inode_idx = translate_1(_path, name);
+	free(_path);
+	if (parent_inode_idx < 0) return parent_inode_idx;
 
-static void fs_truncate_indir2(int blk_num) {
-	uint32_t entries[PTRS_PER_BLK];
-	memset(entries, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0)
-		exit(1);
-	//clear each double link
-	for (int i = 0; i < PTRS_PER_BLK; i++) {
-		if (entries[i]) fs_truncate_indir1(entries[i]);
-		entries[i] = 0;
-	}
+	//assign inode, directory block and directory entry
+	int res = dir_create(parent_inode_idx, name, mode);
+	return (res < 0) ? res : SUCCESS;
 }
 
 /**
@@ -769,34 +591,10 @@ static int fs_truncate(const char *path, off_t len)
 	//get inode
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
+	free(_path);
 	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	if (S_ISDIR(inode->mode)) return -EISDIR;
 
-	//clear direct
-	fs_truncate_dir(inode->direct);
-
-	//clear indirect1
-	if (inode->indir_1) {
-		fs_truncate_indir1(inode->indir_1);
-		return_blk(inode->indir_1);
-	}
-	inode->indir_1 = 0;
-
-	//clear indirect2
-	if (inode->indir_2) {
-		fs_truncate_indir2(inode->indir_2);
-		return_blk(inode->indir_2);
-	}
-	inode->indir_2 = 0;
-
-	inode->size = 0;
-
-	//update at the end for efficiency
-	update_inode(inode_idx);
-	update_blk();
-
-	return SUCCESS;
+	return inode_truncate(inode_idx);
 }
 
 /**
@@ -811,41 +609,20 @@ static int fs_truncate(const char *path, off_t len)
 */
 static int fs_unlink(const char *path)
 {
-	//truncate first
-	int res = fs_truncate(path, 0);
-	if (res < 0) return res;
+	if (strcmp(path, "/") == 0) return -EISDIR;
 
-	//get inodes and check
+	//get parent inode
 	char *_path = strdup(path);
 	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
 	int parent_inode_idx = translate_1(_path, name);
-	struct fs_inode *inode = &inodes[inode_idx];
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (inode_idx < 0 || parent_inode_idx < 0) return -ENOENT;
-	if (S_ISDIR(inode->mode)) return -EISDIR;
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
-
-	//remove entire entry from parent dir
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
-			memset(&entries[i], 0, sizeof(struct fs_dirent));
-		}
-	}
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1); 
-
-	//clear inode
-	memset(inode, 0, sizeof(struct fs_inode));
-	return_inode(inode_idx);
+	free(_path);
+	if (parent_inode_idx < 0) return parent_inode_idx;
 
-	//update
-	update_inode(inode_idx);
-	update_blk();
+	//remove entry from parent dir, then free inode and blocks
+	int inode_idx = dir_remove(parent_inode_idx, name, false);
+	if (inode_idx < 0) return inode_idx;
+	entry_cache_invalidate();
+	inode_release(inode_idx);
 
 	return SUCCESS;
 }
@@ -869,47 +646,18 @@ static int fs_rmdir(const char *path)
 	//can not remove root
 	if (strcmp(path, "/") == 0) return -EINVAL;
 
-	//get inodes and check
-	//CS492: your code below
+	//get parent inode
 	char *_path = strdup(path);
 	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
 	int parent_inode_idx = translate_1(_path, name);
-	struct fs_inode *inode = &inodes[inode_idx];
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-
-	//files don't exist
-	if (inode_idx < 0 || parent_inode_idx < 0) return -ENOENT;
-
-	//either is not a directory
-	if (!S_ISDIR(parent_inode->mode) || !S_ISDIR(inode->mode)) return -ENOTDIR;
-
-	//check if dir if empty
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, inode->direct[0], 1, entries) < 0)
-		exit(1);
-	int res = is_empty_dir(entries);
-	if (res == 0) return -ENOTEMPTY;
-
-	//remove entry from parent dir
-	//CS492: your code below
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (entries[i].valid) {
-			memset(&entries[i], 0, sizeof(struct fs_dirent));
-		}
-	}
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0) exit(1);
-
-	//return blk and clear inode
-	fs_releasedir(path, NULL);
-	return_blk(inode->direct[0]);
-	memset(inode, 0, sizeof(struct fs_inode));
-	return_inode(inode_idx);
+	free(_path);
+	if (parent_inode_idx < 0) return parent_inode_idx;
 
-	//update
-	update_inode(inode_idx);
-	update_blk();
+	//remove entry from parent dir, then free inode and block
+	int inode_idx = dir_remove(parent_inode_idx, name, true);
+	if (inode_idx < 0) return inode_idx;
+	entry_cache_invalidate();
+	inode_release(inode_idx);
 
 	return SUCCESS;
 }
@@ -939,43 +687,22 @@ static int fs_rename(const char *src_path, const char *dst_path)
 	//deep copy both path
 	char *_src_path = strdup(src_path);
 	char *_dst_path = strdup(dst_path);
-	//get inodes
-	int src_inode_idx = translate(_src_path);
-	int dst_inode_idx = translate(_dst_path);
-	//if src inode does not exist return error
-	if (src_inode_idx < 0) return src_inode_idx;
-	//if dst already exist return error
-	if (dst_inode_idx >= 0) return -EEXIST;
 
 	//get parent directory inode
 	char src_name[FS_FILENAME_SIZE];
 	char dst_name[FS_FILENAME_SIZE];
 	int src_parent_inode_idx = translate_1(_src_path, src_name);
 	int dst_parent_inode_idx = translate_1(_dst_path, dst_name);
+	free(_src_path);
+	free(_dst_path);
+	if (src_parent_inode_idx < 0) return src_parent_inode_idx;
+	if (dst_parent_inode_idx < 0) return dst_parent_inode_idx;
 	//src and dst should be in the same directory (same parent)
 	if (src_parent_inode_idx != dst_parent_inode_idx) return -EINVAL;
-	int parent_inode_idx = src_parent_inode_idx;
-	if (parent_inode_idx < 0) return parent_inode_idx;
-
-	//read parent dir inode
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
 
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0) exit(1);
-
-	//make change to buff
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (entries[i].valid && strcmp(entries[i].name, src_name) == 0) {
-			memset(entries[i].name, 0, sizeof(entries[i].name));
-			strcpy(entries[i].name, dst_name);
-		}
-	}
-
-	//write buff to inode
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries)) exit(1);
-	return SUCCESS;
+	int res = dir_rename(src_parent_inode_idx, src_name, dst_name);
+	if (res == SUCCESS) entry_cache_invalidate();
+	return res;
 }
 
 /**
@@ -991,10 +718,11 @@ static int fs_rename(const char *src_path, const char *dst_path)
 */
 static int fs_chmod(const char *path, mode_t mode)
 {
+	if (fs_readonly) return -EROFS;
 	char* _path = strdup(path);
 	int inode_idx = translate(_path);
 	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
+	struct fs_inode *inode = inode_get(inode_idx);
 	//protect system from other modes
 	mode |= S_ISDIR(inode->mode) ? S_IFDIR : S_IFREG;
 	//change through reference
@@ -1015,12 +743,13 @@ static int fs_chmod(const char *path, mode_t mode)
 int fs_utime(const char *path, struct utimbuf *ut)
 {
 	//CS492: your code here
+	if (fs_readonly) return -EROFS;
 	char* _path = strdup(path);
 	int inode_idx = translate(_path);
 
 	if (inode_idx < 0) return inode_idx;
 
-	struct fs_inode *inode = &inodes[inode_idx];
+	struct fs_inode *inode = inode_get(inode_idx);
 	inode->mtime = ut->modtime;
 
 	update_inode(inode_idx);
@@ -1028,7 +757,64 @@ int fs_utime(const char *path, struct utimbuf *ut)
 }
 
 /**
- * Open a filesystem file or directory path.
+ * clone - create a file sharing the data blocks of another file,
+ * so only blocks later written by either file take new space.
+ *
+ * @param src_path: the file to clone
+ * @param dst_path: path of the new file
+ * @return 0 if successful, or -error number
+ *   -ENOENT   - source does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EISDIR   - source is a directory
+ *   -EEXIST   - destination already exists
+ *   -ENOSPC   - no free inode, directory entry or indirect blocks
+ */
+int fs_clone(const char *src_path, const char *dst_path)
+{
+	char *_path = strdup(src_path);
+	int src = translate(_path);
+	free(_path);
+	if (src < 0) return src;
+	if (inode_is_dir(src)) return -EISDIR;
+
+	_path = strdup(dst_path);
+	char name[FS_FILENAME_SIZE];
+	int parent = translate_1(_path, name);
+	free(_path);
+	if (parent < 0) return parent;
+
+	int dst = dir_create(parent, name, inode_attr(src)->mode);
+	if (dst < 0) return dst;
+	int res = inode_clone(src, dst);
+	if (res < 0) {
+		//remove the new entry again
+		dir_remove(parent, name, false);
+		inode_release(dst);
+	}
+	return res;
+}
+
+/**
+ * Get the inode of a path, for REPL commands that work on the
+ * file system core directly.
+ *
+ * @param path: the path
+ * @return the inode, or -error number
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ */
+int fs_inum(const char *path)
+{
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	return inode_idx;
+}
+
+/**
+ * Open a filesystem file or directory path. The file's write-back
+ * buffer is kept in fi->fh. Opening STATS_PATH, which is not in any
+ * directory, takes a report of the performance counters instead.
  *
  * @param path: the path
  * @param fuse: file info data
@@ -1036,106 +822,25 @@ int fs_utime(const char *path, struct utimbuf *ut)
  * @return: 0 if successful, or -error number
  *	-ENOENT   - file does not exist
  *	-ENOTDIR  - component of path not a directory
+ *	-EACCES   - STATS_PATH opened for writing
 */
 static int fs_open(const char *path, struct fuse_file_info *fi)
 {
+	if (strcmp(path, STATS_PATH) == 0) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+		//the report is longer than the size getattr saw if counters grew
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) (uintptr_t) stats_file_open();
+		return SUCCESS;
+	}
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
+	free(_path);
 	if (inode_idx < 0) return inode_idx;
-	if (S_ISDIR(inodes[inode_idx].mode)) return -EISDIR;
-	fi->fh = (uint64_t) inode_idx;
+	if (inode_is_dir(inode_idx)) return -EISDIR;
+	fi->fh = (uint64_t) (uintptr_t) wbuf_open(inode_idx);
 	return SUCCESS;
 }
-/*
-static void fs_write_blk(int blk_num, const char *buf, size_t len, size_t offset) {
-	char entries[BLOCK_SIZE];
-	memset(entries, 0, BLOCK_SIZE);
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
-	memcpy(entries + offset, buf, len);
-	if (disk->ops->write(disk, blk_num, 1, entries) < 0) exit(1);
-}*/
-static void fs_read_blk(int blk_num, char *buf, size_t len, size_t offset) {
-	//CS492: your code here
-	char entries[BLOCK_SIZE];
-	memset(entries, 0, BLOCK_SIZE);
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
-	memcpy(buf, entries + offset, len);
-}
-
-static size_t fs_read_dir(size_t inode_idx, char *buf, size_t len, size_t offset) {
-	struct fs_inode *inode = &inodes[inode_idx];
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_read = len;
-	while (blk_num < N_DIRECT && len_to_read > 0) {
-		size_t cur_len_to_read = len_to_read > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_read;
-		size_t temp = blk_offset + cur_len_to_read;
-
-		if (!inode->direct[blk_num]) {
-			return len - len_to_read;
-		}
-
-		fs_read_blk(inode->direct[blk_num], buf, temp, blk_offset);
-
-		buf += temp;
-		len_to_read -= temp;
-		blk_num++;
-		blk_offset = 0;
-	}
-	return len - len_to_read;
-}
-
-static size_t fs_read_indir1(size_t blk, char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) exit(1);
-
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_read = len;
-	while (blk_num < PTRS_PER_BLK && len_to_read > 0) {
-		size_t cur_len_to_read = len_to_read > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_read;
-		size_t temp = blk_offset + cur_len_to_read;
-
-		if (!blk_indices[blk_num]) {
-			return len - len_to_read;
-		}
-
-		fs_read_blk(blk_indices[blk_num], buf, temp, blk_offset);
-
-		buf += temp;
-		len_to_read -= temp;
-		blk_num++;
-		blk_offset = 0;
-	}
-	return len - len_to_read;
-}
-
-static size_t fs_read_indir2(size_t blk, char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) return 0;
-
-	size_t blk_num = offset / INDIR1_SIZE;
-	size_t blk_offset = offset % INDIR1_SIZE;
-	size_t len_to_read = len;
-	while (blk_num < PTRS_PER_BLK && len_to_read > 0) {
-		size_t cur_len_to_read = len_to_read > INDIR1_SIZE ? (size_t) INDIR1_SIZE - blk_offset : len_to_read;
-		size_t temp = blk_offset + cur_len_to_read;
-
-		if (!blk_indices[blk_num]) {
-			return len - len_to_read;
-		}
-
-		temp = fs_read_indir1(blk_indices[blk_num], buf, temp, blk_offset);
-
-		buf += temp;
-		len_to_read -= temp;
-		blk_num++;
-		blk_offset = 0;
-	}
-	return len - len_to_read;
-}
 
 /**
  * read - read data from an open file.
@@ -1164,143 +869,70 @@ static size_t fs_read_indir2(size_t blk, char *buf, size_t len, size_t offset) {
 static int fs_read(const char *path, char *buf, size_t len, off_t offset,
 		    struct fuse_file_info *fi)
 {
-	//CS492: your code here
+	if (strcmp(path, STATS_PATH) == 0) {
+		return stats_file_read((struct stats_file *) (uintptr_t) fi->fh, buf, len, offset);
+	}
 	char *_path = strdup(path);
 	int inode_idx = translate(_path);
+	free(_path);
 	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	if (S_ISDIR(inode->mode)) return -EISDIR;
-	if (offset > inode->size) return 0;
-	if (offset + len > inode->size) return (int) inode->size - offset;
-	//enough bytes to read in the file
-	size_t size_to_read = len;
-
-	//read direct blocks
-	if(size_to_read > 0 && offset < DIR_SIZE){
-		//reading is withen bounds
-		size_t temp = fs_read_dir(inode_idx, buf, size_to_read, (size_t) offset);
-		size_to_read -= temp; //subtract read bytes from size_to_read
-		offset += temp;
-		buf += temp;
-	}
-
-	//read indirect 1 blocks
-	if (size_to_read > 0 && offset < DIR_SIZE + INDIR1_SIZE) {
-		size_t temp = fs_read_indir1(inode->indir_1, buf, size_to_read, (size_t) offset - DIR_SIZE);
-		size_to_read -= temp;
-		offset += temp;
-		buf += temp;
-	}
-
-	//read indirect 2 blocks
-	if (size_to_read > 0 && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE) {
-		//len finshed write
-		size_t temp = fs_read_indir2(inode->indir_2, buf, size_to_read, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
-		size_to_read -= temp;
-		offset += size_to_read;
-	}
-
-	return (int) len - size_to_read;
+	return inode_read(inode_idx, buf, len, offset);
 }
 
-static void fs_write_blk(int blk_num, const char *buf, size_t len, size_t offset) {
-	char entries[BLOCK_SIZE];
-	memset(entries, 0, BLOCK_SIZE);
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
-	memcpy(entries + offset, buf, len);
-	if (disk->ops->write(disk, blk_num, 1, entries) < 0) exit(1);
-}
-
-static size_t fs_write_dir(size_t inode_idx, const char *buf, size_t len, size_t offset) {
-	struct fs_inode *inode = &inodes[inode_idx];
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_write = len;
-	while (blk_num < N_DIRECT && len_to_write > 0) {
-		size_t cur_len_to_write = len_to_write > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_write;
-		//size_t temp = blk_offset + cur_len_to_write;
-		size_t temp = cur_len_to_write;
-
-		if (!inode->direct[blk_num]) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			inode->direct[blk_num] = freeb;
-			update_inode(inode_idx);
-		}
-
-		fs_write_blk(inode->direct[blk_num], buf, temp, blk_offset);
-
-		buf += temp;
-		len_to_write -= temp;
-		blk_num++;
-		blk_offset = 0;
+/**
+ * read_buf - read data from an open file into a buffer vector.
+ *
+ * The data is copied into a memory buffer rather than returned as
+ * image file ranges: FUSE would splice those after fs_lock is
+ * released, when a truncate or unlink could free the blocks for
+ * another file, and there is no call after the reply to pin them
+ * until then. FUSE frees the vector and its buffer after replying.
+ *
+ * @param path: the path to the file
+ * @param bufp: set to the allocated buffer vector
+ * @param len: the number of bytes to read
+ * @param offset: the location to start reading at
+ * @param fi: fuse file info
+ *
+ * @return: 0 if successful, or -error number as for read
+*/
+static int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t len,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	if (strcmp(path, STATS_PATH) == 0) {
+		struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+		*bufv = FUSE_BUFVEC_INIT(0);
+		bufv->buf[0].mem = malloc(len > 0 ? len : 1);
+		bufv->buf[0].size = stats_file_read((struct stats_file *) (uintptr_t) fi->fh,
+						    bufv->buf[0].mem, len, offset);
+		*bufp = bufv;
+		return SUCCESS;
 	}
-	return len - len_to_write;
-}
-
-static size_t fs_write_indir1(size_t blk, const char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) exit(1);
-
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_write = len;
-	while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
-		size_t cur_len_to_write = len_to_write > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_write;
-		size_t temp = blk_offset + cur_len_to_write;
-
-		if (!blk_indices[blk_num]) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			blk_indices[blk_num] = freeb;
-			//write back
-			if (disk->ops->write(disk, blk, 1, blk_indices) < 0)
-				exit(1);
-		}
-
-		fs_write_blk(blk_indices[blk_num], buf, temp, blk_offset);
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
 
-		buf += temp;
-		len_to_write -= temp;
-		blk_num++;
-		blk_offset = 0;
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->buf[0].mem = malloc(len > 0 ? len : 1);
+	int n = inode_read(inode_idx, bufv->buf[0].mem, len, offset);
+	if (n < 0) {
+		free(bufv->buf[0].mem);
+		free(bufv);
+		return n;
 	}
-	return len - len_to_write;
-}
-
-static size_t fs_write_indir2(size_t blk, const char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) return 0;
-
-	size_t blk_num = offset / INDIR1_SIZE;
-	size_t blk_offset = offset % INDIR1_SIZE;
-	size_t len_to_write = len;
-	while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
-		size_t cur_len_to_write = len_to_write > INDIR1_SIZE ? (size_t) INDIR1_SIZE - blk_offset : len_to_write;
-		size_t temp = blk_offset + cur_len_to_write;
-		len_to_write -= temp;
-		if (!blk_indices[blk_num]) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			blk_indices[blk_num] = freeb;
-			//write back
-			if (disk->ops->write(disk, blk, 1, blk_indices) < 0)
-				exit(1);
-		}
+	bufv->buf[0].size = n;
 
-		temp = fs_write_indir1(blk_indices[blk_num], buf, temp, blk_offset);
-		if (temp == 0) return len - len_to_write;
-		buf += temp;
-		blk_num++;
-		blk_offset = 0;
-	}
-	return len - len_to_write;
+	*bufp = bufv;
+	return SUCCESS;
 }
 
 /**
- * write - write data to a file
+ * write - write data to a file through its write-back buffer.
+ * Small sequential writes are collected and written out a block
+ * at a time; an error writing them out is returned by the next
+ * write, fsync or release.
  *
  * @param path: the file path
  * @param buf: the buffer to write
@@ -1320,82 +952,77 @@ static size_t fs_write_indir2(size_t blk, const char *buf, size_t len, size_t of
 static int fs_write(const char *path, const char *buf, size_t len,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	if (S_ISDIR(inode->mode)) return -EISDIR;
-	if (offset > inode->size) return 0;
-
-	//len need to write
-	size_t len_to_write = len;
-
-	//write direct blocks
-	if (len_to_write > 0 && offset < DIR_SIZE) {
-		//len finished write
-		size_t temp = fs_write_dir(inode_idx, buf, len_to_write, (size_t) offset);
-		len_to_write -= temp;
-		offset += temp;
-		buf += temp;
-	}
-
-	//write indirect 1 blocks
-	if (len_to_write > 0 && offset < DIR_SIZE + INDIR1_SIZE) {
-		//need to allocate indir_1
-		if (!inode->indir_1) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			inode->indir_1 = freeb;
-			update_inode(inode_idx);
-		}
-		size_t temp = fs_write_indir1(inode->indir_1, buf, len_to_write, (size_t) offset - DIR_SIZE);
-		len_to_write -= temp;
-		offset += temp;
-		buf += temp;
-	}
+	struct fs_wbuf *wb = (struct fs_wbuf *) (uintptr_t) fi->fh;
+	return wbuf_write(wb, buf, len, offset);
+}
 
-	//write indirect 2 blocks
-	if (len_to_write > 0 && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE) {
-		//need to allocate indir_2
-		if (!inode->indir_2) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			inode->indir_2 = freeb;
-			update_inode(inode_idx);
-		}
-		//len finshed write
-		size_t temp = fs_write_indir2(inode->indir_2, buf, len_to_write, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
-		len_to_write -= temp;
-		offset += len_to_write;
+/**
+ * write_buf - write data to a file from a buffer vector. Data already
+ * in a single memory buffer is written from it in place; data in a
+ * pipe spliced from the FUSE device is copied once into memory.
+ *
+ * @param path: the file path
+ * @param in_buf: the data to write
+ * @param offset: the offset to starting writing at
+ * @param fi: the Fuse file info for writing
+ *
+ * @return: number of bytes written, or -error number as for write
+*/
+static int fs_write_buf(const char *path, struct fuse_bufvec *in_buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct fs_wbuf *wb = (struct fs_wbuf *) (uintptr_t) fi->fh;
+	size_t len = fuse_buf_size(in_buf);
+	struct fuse_buf *buf = &in_buf->buf[0];
+	if (in_buf->count == 1 && in_buf->idx == 0 && in_buf->off == 0 &&
+	    !(buf->flags & FUSE_BUF_IS_FD)) {
+		return wbuf_write(wb, buf->mem, len, offset);
 	}
 
-	if (offset > inode->size) inode->size = offset;
-
-	//update inode and blk
-	update_inode(inode_idx);
-	update_blk();
+	struct fuse_bufvec mem_buf = FUSE_BUFVEC_INIT(len);
+	mem_buf.buf[0].mem = malloc(len);
+	ssize_t res = fuse_buf_copy(&mem_buf, in_buf, 0);
+	if (res >= 0) res = wbuf_write(wb, mem_buf.buf[0].mem, res, offset);
+	free(mem_buf.buf[0].mem);
+	return (int) res;
+}
 
-	return (int) (len - len_to_write);
+/**
+ * fsync - write out buffered data of an open file.
+ *
+ * @param path: the file path
+ * @param datasync: only flush user data (ignored)
+ * @param fi: the Fuse file info
+ *
+ * @return: 0 if successful, or -error number of an earlier write
+*/
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int res = wbuf_flush((struct fs_wbuf *) (uintptr_t) fi->fh);
+	//write out blocks a caching device holds
+	if (res == 0 && disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) res = -EIO;
+	return res;
 }
 
 /**
- * Release resources created by pending open call.
+ * Release resources created by pending open call, writing out
+ * the file's buffered data.
  *
  * @param path: path to the file
  * @param fi: the fuse file info
  *
- * @return: 0 if successful, or -error number
- *	-ENOENT   - file does not exist
- *	-ENOTDIR  - component of path not a directory
+ * @return: 0 if successful, or -error number of an earlier write
 */
 static int fs_release(const char *path, struct fuse_file_info *fi)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	if (S_ISDIR(inodes[inode_idx].mode)) return -EISDIR;
+	if (strcmp(path, STATS_PATH) == 0) {
+		free((struct stats_file *) (uintptr_t) fi->fh);
+		fi->fh = (uint64_t) -1;
+		return SUCCESS;
+	}
+	int res = wbuf_close((struct fs_wbuf *) (uintptr_t) fi->fh);
 	fi->fh = (uint64_t) -1;
-	return SUCCESS;
+	return res;
 }
 
 /**
@@ -1418,42 +1045,137 @@ static int fs_statfs(const char *path, struct statvfs *st)
 	 *   f_bfree = f_blocks - blocks used
 	 *   f_bavail = f_bfree
 	 *   f_namelen = <whatever your max namelength is>
+	 *
+	 * Blocks detached by truncate/unlink but not yet freed by the
+	 * reclaimer are counted in f_bfree but not in f_bavail, so
+	 * f_bfree - f_bavail is the pending-free space.
 	 */
 
 	//clear original stats
 	memset(st, 0, sizeof(*st));
 	st->f_bsize = FS_BLOCK_SIZE;
-	st->f_blocks = (fsblkcnt_t) (n_blocks - root_inode - inode_base);
-	st->f_bfree = (fsblkcnt_t) num_free_blk();
-	st->f_bavail = st->f_bfree;
+	st->f_blocks = (fsblkcnt_t) num_fs_blk();
+	st->f_bavail = (fsblkcnt_t) num_free_blk();
+	st->f_bfree = st->f_bavail + num_pending_blk();
 	st->f_namemax = FS_FILENAME_SIZE - 1;
 
 	return 0;
 }
 
+/**
+ * Define timed_<name>, which calls fs_<name> under fs_lock, records
+ * its latency as operation op in the performance counters and, while
+ * tracing, adds it to the trace with the trace_rec fields given last.
+ */
+#define TIMED_OP(name, op, params, args, path, path2, ...) \
+static int timed_##name params \
+{ \
+	uint64_t start = stats_start(); \
+	pthread_mutex_lock(&fs_lock); \
+	int res = fs_##name args; \
+	pthread_mutex_unlock(&fs_lock); \
+	stats_op(op, start); \
+	if (trace_enabled) { \
+		struct trace_rec rec = { __VA_ARGS__ }; \
+		trace_op(&rec, op, start, res, path, path2); \
+	} \
+	return res; \
+}
+
+TIMED_OP(getattr, OP_GETATTR, (const char *path, struct stat *sb), (path, sb),
+	 path, NULL, 0)
+TIMED_OP(opendir, OP_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi),
+	 path, NULL, .fh = fi->fh)
+TIMED_OP(readdir, OP_READDIR, (const char *path, void *ptr, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi),
+		(path, ptr, filler, offset, fi),
+	 path, NULL, .offset = offset)
+TIMED_OP(releasedir, OP_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi),
+	 path, NULL, 0)
+TIMED_OP(mknod, OP_MKNOD, (const char *path, mode_t mode, dev_t dev), (path, mode, dev),
+	 path, NULL, .mode = mode)
+TIMED_OP(mkdir, OP_MKDIR, (const char *path, mode_t mode), (path, mode),
+	 path, NULL, .mode = mode)
+TIMED_OP(unlink, OP_UNLINK, (const char *path), (path),
+	 path, NULL, 0)
+TIMED_OP(rmdir, OP_RMDIR, (const char *path), (path),
+	 path, NULL, 0)
+TIMED_OP(rename, OP_RENAME, (const char *src_path, const char *dst_path), (src_path, dst_path),
+	 src_path, dst_path, 0)
+TIMED_OP(chmod, OP_CHMOD, (const char *path, mode_t mode), (path, mode),
+	 path, NULL, .mode = mode)
+TIMED_OP(utime, OP_UTIME, (const char *path, struct utimbuf *ut), (path, ut),
+	 path, NULL, .offset = (ut != NULL) ? ut->modtime : -1)
+TIMED_OP(truncate, OP_TRUNCATE, (const char *path, off_t len), (path, len),
+	 path, NULL, .len = len)
+TIMED_OP(open, OP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi),
+	 path, NULL, .fh = fi->fh, .mode = fi->flags)
+TIMED_OP(read, OP_READ, (const char *path, char *buf, size_t len, off_t offset,
+		struct fuse_file_info *fi),
+		(path, buf, len, offset, fi),
+	 path, NULL, .fh = fi->fh, .offset = offset, .len = len)
+TIMED_OP(read_buf, OP_READ_BUF, (const char *path, struct fuse_bufvec **bufp, size_t len,
+		off_t offset, struct fuse_file_info *fi),
+		(path, bufp, len, offset, fi),
+	 path, NULL, .fh = fi->fh, .offset = offset, .len = len)
+TIMED_OP(write, OP_WRITE, (const char *path, const char *buf, size_t len,
+		off_t offset, struct fuse_file_info *fi),
+		(path, buf, len, offset, fi),
+	 path, NULL, .fh = fi->fh, .offset = offset, .len = len)
+TIMED_OP(write_buf, OP_WRITE_BUF, (const char *path, struct fuse_bufvec *in_buf,
+		off_t offset, struct fuse_file_info *fi),
+		(path, in_buf, offset, fi),
+	 path, NULL, .fh = fi->fh, .offset = offset, .len = fuse_buf_size(in_buf))
+TIMED_OP(fsync, OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi),
+	 path, NULL, .fh = fi->fh, .mode = datasync)
+TIMED_OP(statfs, OP_STATFS, (const char *path, struct statvfs *st), (path, st),
+	 path, NULL, 0)
+
+/**
+ * Timed release, tracing the handle that fs_release clears.
+ */
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_start();
+	uint64_t fh = fi->fh;
+	pthread_mutex_lock(&fs_lock);
+	int res = fs_release(path, fi);
+	pthread_mutex_unlock(&fs_lock);
+	stats_op(OP_RELEASE, start);
+	if (trace_enabled) {
+		struct trace_rec rec = { .fh = fh };
+		trace_op(&rec, OP_RELEASE, start, res, path, NULL);
+	}
+	return res;
+}
+
 /**
  * Operations vector. Please don't rename it, as the
  * skeleton code in main.c assumes it is named 'fs_ops'.
  */
 struct fuse_operations fs_ops = {
 	.init = fs_init,
-	.getattr = fs_getattr,
-	.opendir = fs_opendir,
-	.readdir = fs_readdir,
-	.releasedir = fs_releasedir,
-	.mknod = fs_mknod,
-	.mkdir = fs_mkdir,
-	.unlink = fs_unlink,
-	.rmdir = fs_rmdir,
-	.rename = fs_rename,
-	.chmod = fs_chmod,
-	.utime = fs_utime,
-	.truncate = fs_truncate,
-	.open = fs_open,
-	.read = fs_read,
-	.write = fs_write,
-	.release = fs_release,
-	.statfs = fs_statfs,
+	.destroy = fs_destroy,
+	.getattr = timed_getattr,
+	.opendir = timed_opendir,
+	.readdir = timed_readdir,
+	.releasedir = timed_releasedir,
+	.mknod = timed_mknod,
+	.mkdir = timed_mkdir,
+	.unlink = timed_unlink,
+	.rmdir = timed_rmdir,
+	.rename = timed_rename,
+	.chmod = timed_chmod,
+	.utime = timed_utime,
+	.truncate = timed_truncate,
+	.open = timed_open,
+	.read = timed_read,
+	.read_buf = timed_read_buf,
+	.write = timed_write,
+	.write_buf = timed_write_buf,
+	.fsync = timed_fsync,
+	.release = timed_release,
+	.statfs = timed_statfs,
 };
 
 /*#pragma clang diagnostic pop*/
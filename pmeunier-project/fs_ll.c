@@ -0,0 +1,738 @@
+/*
+ * file:        fs_ll.c
+ * description: FUSE low-level (inode number) interface for the FSX492
+ *              file system. Shares the on-disk format, allocator and
+ *              block-mapping code in fscore.c with the path-based fs.c,
+ *              but never has to parse or translate a path.
+ *
+ *  usage: ./fsx492_ll -image test/fsx492.img [FUSE options] <directory>
+ *
+ * Credit:
+ * 	Peter Desnoyers, November 2016
+ * 	Philip Gust, March 2019
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+
+#include "image.h"
+#include "fscore.h"
+#include "csum.h"
+
+/**  disk block device */
+struct blkdev *disk;
+
+/** attribute and entry cache timeouts in seconds, set by the
+ *  attr_timeout and entry_timeout options */
+static double attr_timeout = 1.0;
+static double entry_timeout = 1.0;
+
+/** lock serializing access to the shared file system state */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** kernel lookup count of each inode */
+static uint64_t *nlookup;
+/** inodes removed from their directory but still looked up */
+static bool *unlinked;
+
+/**
+ * Map a FUSE inode number to a file system inode.
+ *
+ * @param ino: the FUSE inode number
+ * @return the inode, or -ENOENT if not in use
+ */
+static int to_inum(fuse_ino_t ino)
+{
+	int inum = (ino == FUSE_ROOT_ID) ? root_inode : (int) ino;
+	if (inum <= 0 || inum >= n_inodes || inode_attr(inum)->mode == 0) return -ENOENT;
+	return inum;
+}
+
+/**
+ * Map a file system inode to a FUSE inode number.
+ */
+static fuse_ino_t to_ino(int inum)
+{
+	return (inum == root_inode) ? FUSE_ROOT_ID : (fuse_ino_t) inum;
+}
+
+/**
+ * Fill in entry parameters for an inode.
+ *
+ * @param inum: the inode
+ * @param e: the entry parameters to fill in
+ */
+static void fill_entry(int inum, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = to_ino(inum);
+	wbuf_sync_inode(inum);
+	cpy_stat(inum, &e->attr);
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = attr_timeout;
+	e->entry_timeout = entry_timeout;
+}
+
+/**
+ * Get the write-back buffer of an open file.
+ */
+static struct fs_wbuf *fh_wbuf(struct fuse_file_info *fi)
+{
+	return (struct fs_wbuf *) (uintptr_t) fi->fh;
+}
+
+/**
+ * Drop kernel references to an inode, and free it if it was
+ * unlinked and this was the last reference. Call with fs_lock held.
+ *
+ * @param inum: the inode
+ * @param n: number of references to drop
+ */
+static void forget_inode(int inum, uint64_t n)
+{
+	nlookup[inum] = (n < nlookup[inum]) ? nlookup[inum] - n : 0;
+	if (nlookup[inum] == 0 && unlinked[inum]) {
+		unlinked[inum] = false;
+		inode_release(inum);
+	}
+}
+
+/**
+ * init - read in the file system and negotiate capabilities.
+ *
+ * @param userdata: unused
+ * @param conn: fuse connection information
+ */
+static void fs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	fs_mount();
+	nlookup = calloc(n_inodes, sizeof(uint64_t));
+	unlinked = calloc(n_inodes, sizeof(bool));
+
+	//let the kernel splice write data in and read data out
+	if (conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+/**
+ * destroy - free inodes still held by the kernel at unmount and
+ * wait for the reclaimer.
+ *
+ * @param userdata: unused
+ */
+static void fs_ll_destroy(void *userdata)
+{
+	for (int i = 0; i < n_inodes; i++) {
+		if (unlinked[i]) inode_release(i);
+	}
+	fs_unmount();
+	free(nlookup);
+	free(unlinked);
+}
+
+/**
+ * lookup - look up a directory entry by name and get its attributes.
+ */
+static void fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	pthread_mutex_lock(&fs_lock);
+	int pinum = to_inum(parent);
+	int inum = pinum;
+	if (pinum >= 0 && !inode_is_dir(pinum)) inum = -ENOTDIR;
+	else if (strlen(name) > FS_FILENAME_SIZE - 1) inum = -ENAMETOOLONG;
+	else if (pinum >= 0) inum = lookup(pinum, (char *) name);
+
+	struct fuse_entry_param e;
+	if (inum >= 0) {
+		fill_entry(inum, &e);
+		nlookup[inum]++;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (inum < 0) fuse_reply_err(req, -inum);
+	else fuse_reply_entry(req, &e);
+}
+
+/**
+ * forget - drop lookup references to an inode.
+ */
+static void fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t n)
+{
+	pthread_mutex_lock(&fs_lock);
+	int inum = (ino == FUSE_ROOT_ID) ? root_inode : (int) ino;
+	if (inum > 0 && inum < n_inodes) forget_inode(inum, n);
+	pthread_mutex_unlock(&fs_lock);
+	fuse_reply_none(req);
+}
+
+/**
+ * forget_multi - drop lookup references to several inodes.
+ */
+static void fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	pthread_mutex_lock(&fs_lock);
+	for (size_t i = 0; i < count; i++) {
+		int inum = (forgets[i].ino == FUSE_ROOT_ID) ? root_inode : (int) forgets[i].ino;
+		if (inum > 0 && inum < n_inodes) forget_inode(inum, forgets[i].nlookup);
+	}
+	pthread_mutex_unlock(&fs_lock);
+	fuse_reply_none(req);
+}
+
+/**
+ * getattr - get file or directory attributes.
+ */
+static void fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat sb;
+	pthread_mutex_lock(&fs_lock);
+	int inum = to_inum(ino);
+	if (inum >= 0) {
+		//size must include buffered writes
+		wbuf_sync_inode(inum);
+		cpy_stat(inum, &sb);
+		sb.st_ino = ino;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (inum < 0) fuse_reply_err(req, -inum);
+	else fuse_reply_attr(req, &sb, attr_timeout);
+}
+
+/**
+ * setattr - change mode, owner, size (only to 0) or modification time.
+ */
+static void fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			  int to_set, struct fuse_file_info *fi)
+{
+	struct stat sb;
+	pthread_mutex_lock(&fs_lock);
+	int inum = to_inum(ino);
+	int res = (inum < 0) ? inum : fs_readonly ? -EROFS : SUCCESS;
+	struct fs_inode *inode = (inum < 0) ? NULL : inode_get(inum);
+
+	if (res == SUCCESS && (to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != inode->size) {
+		res = (attr->st_size == 0) ? inode_truncate(inum) : -EINVAL;
+	}
+	if (res == SUCCESS) {
+		if (to_set & FUSE_SET_ATTR_MODE) {
+			//protect system from other modes
+			inode->mode = (attr->st_mode & 07777) | (S_ISDIR(inode->mode) ? S_IFDIR : S_IFREG);
+		}
+		if (to_set & FUSE_SET_ATTR_UID) inode->uid = attr->st_uid;
+		if (to_set & FUSE_SET_ATTR_GID) inode->gid = attr->st_gid;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) inode->mtime = time(NULL);
+		else if (to_set & FUSE_SET_ATTR_MTIME) inode->mtime = attr->st_mtime;
+		update_inode(inum);
+		wbuf_sync_inode(inum);
+		cpy_stat(inum, &sb);
+		sb.st_ino = ino;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_attr(req, &sb, attr_timeout);
+}
+
+/**
+ * Create a file or directory and reply with its entry.
+ *
+ * @param fi: file info to reply with fuse_reply_create, or NULL
+ */
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	pthread_mutex_lock(&fs_lock);
+	int inum = to_inum(parent);
+	if (inum >= 0) inum = dir_create(inum, (char *) name, mode);
+	if (inum >= 0) {
+		fill_entry(inum, &e);
+		nlookup[inum]++;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (inum < 0) {
+		fuse_reply_err(req, -inum);
+	} else if (fi != NULL) {
+		fi->fh = (uint64_t) (uintptr_t) wbuf_open(inum);
+		fuse_reply_create(req, &e, fi);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+/**
+ * mknod - create a new regular file.
+ */
+static void fs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode, dev_t rdev)
+{
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	do_create(req, parent, name, mode, NULL);
+}
+
+/**
+ * mkdir - create a directory.
+ */
+static void fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	do_create(req, parent, name, (mode & 07777) | S_IFDIR, NULL);
+}
+
+/**
+ * create - create and open a new regular file.
+ */
+static void fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, struct fuse_file_info *fi)
+{
+	do_create(req, parent, name, (mode & 07777) | S_IFREG, fi);
+}
+
+/**
+ * Remove a file or empty directory. The inode is freed once the
+ * kernel forgets it.
+ */
+static void do_remove(fuse_req_t req, fuse_ino_t parent, const char *name, bool is_dir)
+{
+	pthread_mutex_lock(&fs_lock);
+	int inum = to_inum(parent);
+	if (inum >= 0) inum = dir_remove(inum, (char *) name, is_dir);
+	if (inum >= 0) {
+		if (nlookup[inum] > 0) unlinked[inum] = true;
+		else inode_release(inum);
+	}
+	pthread_mutex_unlock(&fs_lock);
+	fuse_reply_err(req, (inum < 0) ? -inum : 0);
+}
+
+/**
+ * unlink - delete a file.
+ */
+static void fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	do_remove(req, parent, name, false);
+}
+
+/**
+ * rmdir - remove an empty directory.
+ */
+static void fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	do_remove(req, parent, name, true);
+}
+
+/**
+ * rename - rename a file or directory within its directory.
+ */
+static void fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	//src and dst should be in the same directory (same parent)
+	if (flags != 0 || parent != newparent) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	pthread_mutex_lock(&fs_lock);
+	int res = to_inum(parent);
+	if (res >= 0) res = dir_rename(res, (char *) name, (char *) newname);
+	pthread_mutex_unlock(&fs_lock);
+	fuse_reply_err(req, (res < 0) ? -res : 0);
+}
+
+/**
+ * open - open a file, truncating it for O_TRUNC. The file's
+ * write-back buffer is kept in fi->fh.
+ */
+static void fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	pthread_mutex_lock(&fs_lock);
+	int inum = to_inum(ino);
+	if (inum >= 0 && inode_is_dir(inum)) inum = -EISDIR;
+	if (inum >= 0 && (fi->flags & O_TRUNC)) inode_truncate(inum);
+	pthread_mutex_unlock(&fs_lock);
+
+	if (inum < 0) {
+		fuse_reply_err(req, -inum);
+	} else {
+		fi->fh = (uint64_t) (uintptr_t) wbuf_open(inum);
+		fuse_reply_open(req, fi);
+	}
+}
+
+/**
+ * read - read data from an open file. Runs of contiguous blocks on
+ * a file-backed device are replied as image file ranges, so the
+ * kernel can splice them without copying through this process. The
+ * blocks are pinned until the reply is sent, so a truncate or unlink
+ * in the meantime cannot free them for another file.
+ */
+static void fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		       struct fuse_file_info *fi)
+{
+	int max_ext = size / BLOCK_SIZE + 2;
+	struct fs_extent *ext = malloc(max_ext * sizeof(struct fs_extent));
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + max_ext * sizeof(struct fuse_buf));
+	*bufv = FUSE_BUFVEC_INIT(0);
+
+	pthread_mutex_lock(&fs_lock);
+	int pin = reclaim_pin();
+	int n = inode_extents(fh_wbuf(fi)->inum, off, size, ext, max_ext);
+	int err = (n < 0) ? n : 0;
+	for (int i = 0; i < n; i++) {
+		struct fuse_buf *buf = &bufv->buf[i];
+		memset(buf, 0, sizeof(*buf));
+		buf->size = ext[i].len;
+		buf->fd = extent_fd(&ext[i], &buf->pos);
+		if (buf->fd >= 0) {
+			buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		} else {
+			buf->mem = malloc(ext[i].len);
+			if (err == 0) err = extent_read(&ext[i], buf->mem);
+		}
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (err < 0) {
+		fuse_reply_err(req, -err);
+	} else {
+		bufv->count = (n > 0) ? n : 1;
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	}
+	for (int i = 0; i < n; i++) {
+		free(bufv->buf[i].mem);
+	}
+	reclaim_unpin(pin);
+	free(bufv);
+	free(ext);
+}
+
+/**
+ * write_buf - write data to an open file through its write-back
+ * buffer. Data already in a single memory buffer is written from it
+ * in place; data in a pipe spliced from the FUSE device is copied
+ * once into memory.
+ */
+static void fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+			    off_t off, struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(in_buf);
+	struct fuse_buf *buf = &in_buf->buf[0];
+	ssize_t res;
+	if (in_buf->count == 1 && in_buf->idx == 0 && in_buf->off == 0 &&
+	    !(buf->flags & FUSE_BUF_IS_FD)) {
+		pthread_mutex_lock(&fs_lock);
+		res = wbuf_write(fh_wbuf(fi), buf->mem, size, off);
+		pthread_mutex_unlock(&fs_lock);
+	} else {
+		struct fuse_bufvec mem_buf = FUSE_BUFVEC_INIT(size);
+		mem_buf.buf[0].mem = malloc(size);
+		res = fuse_buf_copy(&mem_buf, in_buf, 0);
+		if (res >= 0) {
+			pthread_mutex_lock(&fs_lock);
+			res = wbuf_write(fh_wbuf(fi), mem_buf.buf[0].mem, res, off);
+			pthread_mutex_unlock(&fs_lock);
+		}
+		free(mem_buf.buf[0].mem);
+	}
+
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+
+/**
+ * copy_file_range - copy a whole file over a file no longer than it
+ * by sharing its data blocks. Any other range is refused with
+ * EOPNOTSUPP, so the kernel falls back to copying the data.
+ */
+static void fs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+				  struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+				  off_t off_out, struct fuse_file_info *fi_out,
+				  size_t len, int flags)
+{
+	int src = fh_wbuf(fi_in)->inum, dst = fh_wbuf(fi_out)->inum;
+	ssize_t res = -EOPNOTSUPP;
+	pthread_mutex_lock(&fs_lock);
+	wbuf_sync_inode(src);
+	wbuf_sync_inode(dst);
+	size_t size = inode_attr(src)->size;
+	if (src != dst && off_in == 0 && off_out == 0 && len >= size &&
+	    (size_t) inode_attr(dst)->size <= size) {
+		res = inode_clone(src, dst);
+		if (res == 0) res = size;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+
+/**
+ * fsync - write out buffered data of an open file.
+ */
+static void fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			struct fuse_file_info *fi)
+{
+	pthread_mutex_lock(&fs_lock);
+	int res = wbuf_flush(fh_wbuf(fi));
+	pthread_mutex_unlock(&fs_lock);
+	//write out blocks a caching device holds
+	if (res == 0 && disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) res = -EIO;
+	fuse_reply_err(req, -res);
+}
+
+/**
+ * release - close an open file, writing out its buffered data.
+ */
+static void fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	pthread_mutex_lock(&fs_lock);
+	int res = wbuf_close(fh_wbuf(fi));
+	pthread_mutex_unlock(&fs_lock);
+	fuse_reply_err(req, -res);
+}
+
+/**
+ * opendir - open a directory.
+ */
+static void fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	pthread_mutex_lock(&fs_lock);
+	int inum = to_inum(ino);
+	if (inum >= 0 && !inode_is_dir(inum)) inum = -ENOTDIR;
+	pthread_mutex_unlock(&fs_lock);
+
+	if (inum < 0) {
+		fuse_reply_err(req, -inum);
+	} else {
+		fi->fh = (uint64_t) inum;
+		fuse_reply_open(req, fi);
+	}
+}
+
+/**
+ * Fill a reply buffer with directory entries starting at entry
+ * index off. With plus, each entry carries its attributes and
+ * counts as a lookup, so the kernel needs no separate lookup or
+ * getattr for it.
+ */
+static void do_readdir(fuse_req_t req, size_t size, off_t off,
+		       struct fuse_file_info *fi, bool plus)
+{
+	char *buf = malloc(size);
+	size_t pos = 0;
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+
+	pthread_mutex_lock(&fs_lock);
+	dir_read((int) fi->fh, entries);
+	for (int i = off; i < DIRENTS_PER_BLK; i++) {
+		if (!entries[i].valid) continue;
+		size_t entsize;
+		if (plus) {
+			struct fuse_entry_param e;
+			fill_entry(entries[i].inode, &e);
+			entsize = fuse_add_direntry_plus(req, buf + pos, size - pos, entries[i].name, &e, i + 1);
+		} else {
+			struct stat sb;
+			memset(&sb, 0, sizeof(sb));
+			sb.st_ino = to_ino(entries[i].inode);
+			sb.st_mode = inode_attr(entries[i].inode)->mode;
+			entsize = fuse_add_direntry(req, buf + pos, size - pos, entries[i].name, &sb, i + 1);
+		}
+		//stop when the reply buffer is full
+		if (entsize > size - pos) break;
+		if (plus) nlookup[entries[i].inode]++;
+		pos += entsize;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+/**
+ * readdir - get directory entries.
+ */
+static void fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			  struct fuse_file_info *fi)
+{
+	do_readdir(req, size, off, fi, false);
+}
+
+/**
+ * readdirplus - get directory entries with their attributes.
+ */
+static void fs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			      struct fuse_file_info *fi)
+{
+	do_readdir(req, size, off, fi, true);
+}
+
+/**
+ * releasedir - close a directory.
+ */
+static void fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * statfs - get file system statistics, as in fs.c.
+ */
+static void fs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = FS_BLOCK_SIZE;
+	st.f_blocks = (fsblkcnt_t) num_fs_blk();
+	st.f_bavail = (fsblkcnt_t) num_free_blk();
+	st.f_bfree = st.f_bavail + num_pending_blk();
+	st.f_namemax = FS_FILENAME_SIZE - 1;
+	fuse_reply_statfs(req, &st);
+}
+
+/** Low-level operations vector */
+static struct fuse_lowlevel_ops fs_ll_ops = {
+	.init = fs_ll_init,
+	.destroy = fs_ll_destroy,
+	.lookup = fs_ll_lookup,
+	.forget = fs_ll_forget,
+	.forget_multi = fs_ll_forget_multi,
+	.getattr = fs_ll_getattr,
+	.setattr = fs_ll_setattr,
+	.mknod = fs_ll_mknod,
+	.mkdir = fs_ll_mkdir,
+	.create = fs_ll_create,
+	.unlink = fs_ll_unlink,
+	.rmdir = fs_ll_rmdir,
+	.rename = fs_ll_rename,
+	.open = fs_ll_open,
+	.read = fs_ll_read,
+	.write_buf = fs_ll_write_buf,
+	.copy_file_range = fs_ll_copy_file_range,
+	.fsync = fs_ll_fsync,
+	.release = fs_ll_release,
+	.opendir = fs_ll_opendir,
+	.readdir = fs_ll_readdir,
+	.readdirplus = fs_ll_readdirplus,
+	.releasedir = fs_ll_releasedir,
+	.statfs = fs_ll_statfs,
+};
+
+/** how -checksum and -checksum-rebuild open the checksum file */
+enum { CSUM_NONE, CSUM_VERIFY, CSUM_REBUILD };
+
+struct data {
+	char *image_name;
+	int   checksum;
+	int   compress;
+	int   dedup;
+	int   prewarm;
+	char *snapshot;
+	double attr_timeout;
+	double entry_timeout;
+} _data = { .attr_timeout = 1.0, .entry_timeout = 1.0 };
+
+static struct fuse_opt opts[] = {
+	{"-image %s", offsetof(struct data, image_name), 0},
+	{"-checksum", offsetof(struct data, checksum), CSUM_VERIFY},
+	{"-checksum-rebuild", offsetof(struct data, checksum), CSUM_REBUILD},
+	{"-compress", offsetof(struct data, compress), 1},
+	{"-dedup", offsetof(struct data, dedup), 1},
+	{"-prewarm", offsetof(struct data, prewarm), 1},
+	{"-snapshot %s", offsetof(struct data, snapshot), 0},
+	{"attr_timeout=%lf", offsetof(struct data, attr_timeout), 0},
+	{"entry_timeout=%lf", offsetof(struct data, entry_timeout), 0},
+	FUSE_OPT_END
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, &_data, opts, NULL) == -1) {
+		return 1;
+	}
+	attr_timeout = _data.attr_timeout;
+	entry_timeout = _data.entry_timeout;
+	fs_compress = _data.compress;
+	fs_dedup = _data.dedup;
+	fs_prewarm = _data.prewarm;
+	fs_snapshot = _data.snapshot;
+
+	struct fuse_cmdline_opts cmd;
+	if (fuse_parse_cmdline(&args, &cmd) != 0) {
+		return 1;
+	}
+	if (cmd.show_help) {
+		printf("usage: %s -image <name.img> [options] <mountpoint>\n", argv[0]);
+		printf("    -checksum                verify block checksums kept in <name.img>.crc\n");
+		printf("    -checksum-rebuild        ditto, building <name.img>.crc from the image first\n");
+		printf("    -compress                store new files in compressed clusters\n");
+		printf("    -dedup                   share data blocks with identical content\n");
+		printf("    -prewarm                 load the inode table in the background\n");
+		printf("    -snapshot <name>         mount the named snapshot read-only\n");
+		printf("    -o attr_timeout=<secs>   attribute cache timeout (default 1.0)\n");
+		printf("    -o entry_timeout=<secs>  name cache timeout (default 1.0)\n");
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		return 0;
+	}
+	if (_data.image_name == NULL || cmd.mountpoint == NULL) {
+		fprintf(stderr, "usage: %s -image <name.img> [options] <mountpoint>\n", argv[0]);
+		return 1;
+	}
+
+	if ((disk = image_create(_data.image_name)) == NULL) {
+		fprintf(stderr, "cannot open image file '%s': %s\n", _data.image_name, strerror(errno));
+		return 1;
+	}
+	if (_data.checksum) {
+		char crc_path[strlen(_data.image_name) + 5];
+		sprintf(crc_path, "%s.crc", _data.image_name);
+		if ((disk = csum_create(disk, crc_path, _data.checksum == CSUM_REBUILD)) == NULL) {
+			return 1;
+		}
+	}
+
+	//the kernel rejects changes to a snapshot too
+	if (fs_snapshot != NULL) {
+		fuse_opt_add_arg(&args, "-oro");
+	}
+
+	int ret = 1;
+	struct fuse_session *se = fuse_session_new(&args, &fs_ll_ops, sizeof(fs_ll_ops), NULL);
+	if (se != NULL) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			if (fuse_session_mount(se, cmd.mountpoint) == 0) {
+				fuse_daemonize(cmd.foreground);
+				if (cmd.singlethread) {
+					ret = fuse_session_loop(se);
+				} else {
+					ret = fuse_session_loop_mt(se, cmd.clone_fd);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+
+	free(cmd.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,2763 @@
+/*
+ * file:        fscore.c
+ * description: inode, allocator and block-mapping code shared by
+ *              the path-based (fs.c) and low-level (fs_ll.c) builds
+ *
+ * Credit:
+ * 	Peter Desnoyers, November 2016
+ * 	Philip Gust, March 2019
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/select.h>
+
+#include "fscore.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "dedup.h"
+#include "stats.h"
+
+/* by defining bitmaps as 'fd_set' pointers, you can use existing
+ * macros to handle them.
+ *   FD_ISSET(##, inode_map);
+ *   FD_CLR(##, block_map);
+ *   FD_SET(##, block_map);
+ */
+
+static void wbuf_drop_inode(int inum);
+static void share_scan(void);
+static int snap_find(const char *name, struct fs_snap *snap);
+static uint32_t *snap_blocks(struct fs_snap *snap, int *nheld);
+static void snap_read(const uint32_t *blks, int first, int nblks, void *buf);
+static void snap_load(void);
+
+/** pointer to inode bitmap to determine free inodes */ 
+static fd_set *inode_map;
+static int     inode_map_base;
+/** set when inode_map changes, until update_inode writes it */
+static bool    inode_map_changed;
+
+/** pointer to inode blocks */
+struct fs_inode *inodes;
+/** hot attributes and directory flags of the inodes */
+struct fs_inode_hot *inode_hot;
+uint64_t *inode_dirs;
+/** set for each inode block once it is loaded */
+uint8_t *inode_blk_loaded;
+/** serializes loading inode blocks */
+static pthread_mutex_t inode_load_lock = PTHREAD_MUTEX_INITIALIZER;
+/** inode blocks the prewarm thread reads at a time */
+enum { PREWARM_RUN = 64 };
+/** thread loading the inode table in the background */
+static pthread_t prewarm_thread;
+/** set to stop the prewarm thread */
+static bool prewarm_stop;
+/** number of inodes from superblock */
+int   n_inodes;
+/** number of first inode block */
+static int   inode_base;
+
+/** pointer to block bitmap to determine free blocks */
+fd_set *block_map;
+/** number of first data block */
+static int     block_map_base;
+/** lock for block_map, shared with the reclaimer thread */
+static pthread_mutex_t block_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** number of available blocks from superblock */
+static int   n_blocks;
+
+/** number of root inode from superblock */
+int   root_inode;
+/** flags from superblock */
+static uint32_t super_flags;
+/** snapshot header blocks from superblock */
+static uint32_t super_snaps[FS_MAX_SNAPS];
+/** blocks held by snapshots, or NULL if there are none */
+static fd_set *snap_map;
+
+/** array of dirty metadata blocks to write  -- optional */
+static void **dirty;
+
+/** length of dirty array -- optional */
+static int    dirty_len;
+
+/** set while metadata writes are deferred to flush_metadata */
+static bool defer_meta;
+
+/** total size of direct blocks */
+static int DIR_SIZE = BLOCK_SIZE * N_DIRECT;
+static int INDIR1_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
+static int INDIR2_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
+
+/** bytes of file data in a compression cluster */
+enum { CLUSTER_SIZE = FS_CLUSTER_BLKS * BLOCK_SIZE };
+
+bool fs_compress;
+bool fs_dedup;
+bool fs_prewarm;
+bool fs_readonly;
+const char *fs_snapshot;
+
+/**
+ * Find inode for existing directory entry.
+ *
+ * @param fs_dirent: pointer to first dirent in directory
+ * @param name: the name of the directory entry
+ * @return the entry inode, or 0 if not found.
+ */
+static int find_in_dir(struct fs_dirent *de, char *name)
+{
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		//found, return its inode
+		if (de[i].valid && strcmp(de[i].name, name) == 0) {
+			return de[i].inode;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Look up a single directory entry in a directory.
+ *
+ * Errors
+ *   -EIO     - error reading block
+ *   -ENOENT  - a component of the path is not present.
+ *   -ENOTDIR - intermediate component of path not a directory
+ *
+ */
+int lookup(int inum, char *name)
+{
+	//init buff entries
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dir_read(inum, entries);
+	int inode = find_in_dir(entries, name);
+	return inode == 0 ? -ENOENT : inode;
+}
+
+/**
+ * Record metadata blocks changed while writes are deferred.
+ * Call with block_map_lock held.
+ *
+ * @param first: the first block
+ * @param nblks: number of blocks
+ * @param buf: their contents in memory
+ */
+static void mark_dirty(int first, int nblks, void *buf)
+{
+	for (int i = 0; i < nblks; i++) {
+		dirty[first + i] = (char *) buf + i * BLOCK_SIZE;
+	}
+}
+
+void defer_metadata(void)
+{
+	pthread_mutex_lock(&block_map_lock);
+	defer_meta = true;
+	pthread_mutex_unlock(&block_map_lock);
+}
+
+/**
+ * Flush dirty metadata blocks to disk.
+ */
+void flush_metadata(void)
+{
+	int i;
+	pthread_mutex_lock(&block_map_lock);
+	for (i = 0; i < dirty_len; i++) {
+		if (dirty[i]) {
+			if (disk->ops->write(disk, i, 1, dirty[i]) < 0) exit(1);
+			dirty[i] = NULL;
+		}
+	}
+	defer_meta = false;
+	pthread_mutex_unlock(&block_map_lock);
+}
+
+/**
+ * Number of blocks available to the file system
+ * @return number of blocks
+ */
+int num_fs_blk(void) {
+	return n_blocks - root_inode - inode_base;
+}
+
+/**
+ * Count number of free blocks
+ * @return number of free blocks
+ */
+int num_free_blk(void) {
+	int count = 0;
+	pthread_mutex_lock(&block_map_lock);
+	for (int i = 0; i < n_blocks; i++) {
+		if (!FD_ISSET(i, block_map) && !(snap_map && FD_ISSET(i, snap_map))) {
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&block_map_lock);
+	return count;
+}
+
+/**
+ * Returns a free block number or -ENOSPC if none available.
+ *
+ * @return free block number or -ENOSPC if none available
+ */
+static int get_free_blk(void)
+{
+	int blkno = -ENOSPC;
+	pthread_mutex_lock(&block_map_lock);
+	int i;
+	for (i = 0; i < n_blocks; i++) {
+		//blocks freed but held by a snapshot are not reused
+		if (!FD_ISSET(i, block_map) && !(snap_map && FD_ISSET(i, snap_map))) {
+			FD_SET(i, block_map);
+			blkno = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&block_map_lock);
+	stats_add(ST_ALLOCS, 1);
+	stats_add(ST_ALLOC_SCAN, (i < n_blocks) ? i + 1 : n_blocks);
+
+	if (blkno >= 0) {
+		char buff[BLOCK_SIZE];
+		memset(buff, 0, BLOCK_SIZE);
+		if (disk->ops->write(disk, blkno, 1, buff) < 0) exit(1);
+	}
+	return blkno;
+}
+
+/** block after the last run taken by get_free_run, where the next search starts */
+static int run_hint;
+
+/**
+ * Allocate blocks for a new file, taking the first run of nblks
+ * contiguous free blocks from where the last run ended, or the
+ * first free blocks if there is no such run. Unlike get_free_blk,
+ * the blocks are not cleared.
+ *
+ * @param blks array for the block numbers
+ * @param nblks number of blocks
+ * @return 0 if successful, or -ENOSPC
+ */
+static int get_free_run(uint32_t *blks, int nblks)
+{
+	int start = -1, run = 0, n = 0, k;
+	pthread_mutex_lock(&block_map_lock);
+	for (k = 0; k < n_blocks && run < nblks; k++) {
+		int i = (run_hint + k) % n_blocks;
+		//a run cannot wrap around the end of the device
+		if (i == 0) run = 0;
+		if (!FD_ISSET(i, block_map) && !(snap_map && FD_ISSET(i, snap_map))) {
+			if (run++ == 0) start = i;
+		} else {
+			run = 0;
+		}
+	}
+	if (run == nblks) {
+		for (n = 0; n < nblks; n++) blks[n] = start + n;
+		run_hint = start + nblks;
+	} else {
+		int i;
+		for (i = 0; i < n_blocks && n < nblks; i++) {
+			if (!FD_ISSET(i, block_map) && !(snap_map && FD_ISSET(i, snap_map))) blks[n++] = i;
+		}
+		k += i;
+	}
+	if (n == nblks) {
+		for (int i = 0; i < nblks; i++) FD_SET(blks[i], block_map);
+	}
+	pthread_mutex_unlock(&block_map_lock);
+	stats_add(ST_ALLOCS, 1);
+	stats_add(ST_ALLOC_SCAN, k);
+	return (n == nblks) ? SUCCESS : -ENOSPC;
+}
+
+/**
+ * Return a block to the free list
+ *
+ * @param  blkno the block number
+ */
+static void return_blk(int blkno)
+{
+	pthread_mutex_lock(&block_map_lock);
+	FD_CLR(blkno, block_map);
+	pthread_mutex_unlock(&block_map_lock);
+}
+
+/**
+ * Whether a block is held by a snapshot, so must not be changed.
+ *
+ * @param blkno the block number
+ */
+static bool snap_held(uint32_t blkno)
+{
+	pthread_mutex_lock(&block_map_lock);
+	bool held = snap_map && FD_ISSET(blkno, snap_map);
+	pthread_mutex_unlock(&block_map_lock);
+	return held;
+}
+
+/**
+ * Whether a data block may be written in place: it is not held by
+ * a snapshot and no other file shares it.
+ *
+ * @param blkno the block number
+ */
+static bool blk_writable(uint32_t blkno)
+{
+	return !snap_held(blkno) && blk_own(blkno);
+}
+
+/**
+ * Copy a metadata block held by a snapshot to a new block, so it
+ * can be changed. The caller writes the new block number to the
+ * block's parent.
+ *
+ * @param blkno pointer to the block number, changed if copied
+ * @return 1 if copied, 0 if the block may be changed in place,
+ *   or -ENOSPC
+ */
+static int cow_blk(uint32_t *blkno)
+{
+	if (*blkno == 0 || !snap_held(*blkno)) return 0;
+	char buf[BLOCK_SIZE];
+	if (disk->ops->read(disk, *blkno, 1, buf) < 0) exit(1);
+	int freeb = get_free_blk();
+	if (freeb < 0) return -ENOSPC;
+	if (disk->ops->write(disk, freeb, 1, buf) < 0) exit(1);
+	return_blk(*blkno);
+	*blkno = freeb;
+	return 1;
+}
+
+static void update_blk(void)
+{
+	int ret = SUCCESS;
+	pthread_mutex_lock(&block_map_lock);
+	if (defer_meta) mark_dirty(block_map_base, inode_base - block_map_base, block_map);
+	else ret = disk->ops->write(disk, block_map_base, inode_base - block_map_base, block_map);
+	pthread_mutex_unlock(&block_map_lock);
+	if (ret < 0)
+		exit(1);
+}
+
+/**
+ * Returns a free inode number
+ *
+ * @return a free inode number or -ENOSPC if none available
+ */
+static int get_free_inode(void)
+{
+	for (int i = 2; i < n_inodes; i++) {
+		if (!FD_ISSET(i, inode_map)) {
+			FD_SET(i, inode_map);
+			inode_map_changed = true;
+			return i;
+		}
+	}
+	return -ENOSPC;
+}
+
+/**
+ * Return an inode to the free list.
+ *
+ * @param  inum the inode number
+ */
+static void return_inode(int inum)
+{
+	FD_CLR(inum, inode_map);
+	inode_map_changed = true;
+}
+
+/**
+ * Refresh the hot attributes of an inode from the inode table.
+ *
+ * @param inum the inode number
+ */
+static void inode_hot_update(int inum)
+{
+	struct fs_inode *inode = &inodes[inum];
+	struct fs_inode_hot *hot = &inode_hot[inum];
+	hot->mode = inode->mode;
+	hot->size = inode->size;
+	hot->mtime = inode->mtime;
+	hot->ctime = inode->ctime;
+	hot->uid = inode->uid;
+	hot->gid = inode->gid;
+	if (inode->flags & FS_INODE_INLINE) hot->blocks = 0;
+	else if (inode->flags & FS_INODE_COMPRESSED) hot->blocks = inode->zblocks;
+	else hot->blocks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+/**
+ * Set the directory flag of an inode from its hot attributes. The
+ * word is changed atomically, since the flags of other inodes in it
+ * may be set at the same time by the prewarm thread.
+ *
+ * @param inum the inode number
+ */
+static void inode_dir_update(int inum)
+{
+	uint64_t bit = (uint64_t) 1 << (inum % 64);
+	if (S_ISDIR(inode_hot[inum].mode)) __atomic_fetch_or(&inode_dirs[inum / 64], bit, __ATOMIC_RELAXED);
+	else __atomic_fetch_and(&inode_dirs[inum / 64], ~bit, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copy blocks of the inode table that are not yet loaded into it and
+ * mark them loaded. The caller holds inode_load_lock.
+ *
+ * @param blk first block of the inode table
+ * @param nblks number of blocks
+ * @param buf the blocks as read from disk
+ */
+static void inode_fill(int blk, int nblks, const struct fs_inode *buf)
+{
+	for (int b = blk; b < blk + nblks; b++, buf += INODES_PER_BLK) {
+		//a loaded block may have changed since buf was read
+		if (inode_blk_loaded[b]) continue;
+		memcpy(&inodes[b * INODES_PER_BLK], buf, FS_BLOCK_SIZE);
+		stats_add(ST_INODE_BLKS, 1);
+		for (int i = b * INODES_PER_BLK; i < (b + 1) * INODES_PER_BLK; i++) {
+			inode_hot_update(i);
+			inode_dir_update(i);
+		}
+		__atomic_store_n(&inode_blk_loaded[b], 1, __ATOMIC_RELEASE);
+	}
+}
+
+void inode_load(int inum)
+{
+	int blk = inum / INODES_PER_BLK;
+	struct fs_inode buf[INODES_PER_BLK];
+	pthread_mutex_lock(&inode_load_lock);
+	if (!inode_blk_loaded[blk]) {
+		if (disk->ops->read(disk, inode_base + blk, 1, buf) < 0) exit(1);
+		inode_fill(blk, 1, buf);
+	}
+	pthread_mutex_unlock(&inode_load_lock);
+}
+
+/**
+ * Prewarm thread: loads the inode table in runs of blocks, skipping
+ * runs already loaded, until done or stopped. Runs are read without
+ * inode_load_lock, so faults in the foreground do not wait for them.
+ */
+static void *prewarm_main(void *arg)
+{
+	int nblks = n_inodes / INODES_PER_BLK;
+	struct fs_inode *buf = malloc(PREWARM_RUN * FS_BLOCK_SIZE);
+	if (buf == NULL) return NULL;
+	for (int blk = 0; blk < nblks && !__atomic_load_n(&prewarm_stop, __ATOMIC_RELAXED);
+	     blk += PREWARM_RUN) {
+		int n = (nblks - blk < PREWARM_RUN) ? nblks - blk : PREWARM_RUN;
+		//blocks not loaded are not written, so reading them unlocked is safe
+		bool need = false;
+		for (int b = blk; b < blk + n && !need; b++) {
+			need = !__atomic_load_n(&inode_blk_loaded[b], __ATOMIC_ACQUIRE);
+		}
+		if (!need) continue;
+		if (disk->ops->read(disk, inode_base + blk, n, buf) < 0) exit(1);
+		pthread_mutex_lock(&inode_load_lock);
+		inode_fill(blk, n, buf);
+		pthread_mutex_unlock(&inode_load_lock);
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Load all blocks of the inode table, for code that works on the
+ * whole table.
+ */
+static void inode_load_all(void)
+{
+	for (int i = 0; i < n_inodes; i += INODES_PER_BLK) {
+		inode_get(i);
+	}
+}
+
+void update_inode(int inum)
+{
+	inode_hot_update(inum);
+	inode_dir_update(inum);
+	//the inode map is only written when an inode was taken or freed
+	bool map = inode_map_changed;
+	inode_map_changed = false;
+	pthread_mutex_lock(&block_map_lock);
+	bool defer = defer_meta;
+	if (defer) {
+		mark_dirty(inode_base + inum / INODES_PER_BLK, 1, &inodes[inum - (inum % INODES_PER_BLK)]);
+		if (map) mark_dirty(inode_map_base, block_map_base - inode_map_base, inode_map);
+	}
+	pthread_mutex_unlock(&block_map_lock);
+	if (defer) return;
+
+	if (disk->ops->write(disk, inode_base + inum / INODES_PER_BLK, 1, &inodes[inum - (inum % INODES_PER_BLK)]) < 0)
+		exit(1);
+	if (map && disk->ops->write(disk, inode_map_base, block_map_base - inode_map_base, inode_map) < 0)
+		exit(1);
+}
+
+/**
+ * Block tree detached from an inode by truncate or unlink. The
+ * blocks stay marked in block_map until the reclaimer frees them,
+ * so they cannot be reallocated while the tree is being walked.
+ */
+struct reclaim_req {
+	uint32_t direct[N_DIRECT]; /* direct block pointers */
+	uint32_t indir_1; /* single indirect block pointer */
+	uint32_t indir_2; /* double indirect block pointer */
+	int nblks; /* blocks held by the tree, including indirect blocks */
+	int nfree; /* blocks freeing the tree returns, counted in reclaim_pending */
+	struct reclaim_req *next;
+};
+
+/** list of detached block trees waiting to be freed */
+static struct reclaim_req *reclaim_list;
+/** number of blocks that freeing the detached trees will return */
+static int reclaim_pending;
+/** set to stop the reclaimer once the list is drained */
+static bool reclaim_stop;
+static pthread_t reclaim_thread;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+/** signalled when a batch of trees has been freed */
+static pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER;
+/** reads still using their blocks, counted in the epoch they started in */
+static int reclaim_pins[2];
+/** epoch new pins are counted in */
+static int reclaim_epoch;
+/** signalled when the pins of an epoch drop to 0 */
+static pthread_cond_t reclaim_unpinned = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Number of blocks held by the tree of an inode. Files have no
+ * holes, so this follows from the size alone, except for compressed
+ * files, whose blocks are counted in the inode.
+ *
+ * @param inode the inode
+ * @return number of data and indirect blocks
+ */
+static int tree_blocks(struct fs_inode *inode)
+{
+	//compressed clusters leave some block pointers unused
+	if (inode->flags & FS_INODE_COMPRESSED) return inode->zblocks;
+	int data = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int nblks = data;
+	data -= N_DIRECT;
+	if (data > 0) {
+		nblks++;	//indir_1
+		data -= PTRS_PER_BLK;
+	}
+	if (data > 0) {
+		nblks += 1 + (data + PTRS_PER_BLK - 1) / PTRS_PER_BLK;	//indir_2 and its children
+	}
+	return nblks;
+}
+
+/**
+ * Whether an inode holds any block pointers.
+ *
+ * @param inode the inode, not inline
+ */
+static bool has_blocks(struct fs_inode *inode)
+{
+	bool has_blocks = inode->indir_1 || inode->indir_2;
+	for (int i = 0; i < N_DIRECT; i++) {
+		has_blocks |= inode->direct[i] != 0;
+	}
+	return has_blocks;
+}
+
+static int reclaim_count(struct reclaim_req *req);
+
+/**
+ * Detach the block tree from an inode and hand it to the reclaimer.
+ * The inode is left with no blocks; the caller still has to write it.
+ *
+ * @param inode the inode to detach the block tree from
+ */
+static void detach_blocks(struct fs_inode *inode)
+{
+	//inline data holds no blocks
+	if (inode->flags & FS_INODE_INLINE) {
+		memset(inode->direct, 0, FS_INLINE_SIZE);
+		inode->flags &= ~FS_INODE_INLINE;
+		return;
+	}
+	if (!has_blocks(inode)) return;
+
+	struct reclaim_req *req = malloc(sizeof(*req));
+	memcpy(req->direct, inode->direct, sizeof(req->direct));
+	req->indir_1 = inode->indir_1;
+	req->indir_2 = inode->indir_2;
+	req->nblks = tree_blocks(inode);
+	req->nfree = reclaim_count(req);
+
+	memset(inode->direct, 0, sizeof(inode->direct));
+	inode->indir_1 = inode->indir_2 = 0;
+	inode->zblocks = 0;
+
+	pthread_mutex_lock(&reclaim_lock);
+	req->next = reclaim_list;
+	reclaim_list = req;
+	reclaim_pending += req->nfree;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Append block number to a growable array of blocks.
+ *
+ * @param blks pointer to the array
+ * @param n pointer to number of entries
+ * @param cap pointer to capacity of the array
+ * @param blkno the block number
+ */
+static void add_blk(uint32_t **blks, int *n, int *cap, uint32_t blkno)
+{
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : PTRS_PER_BLK;
+		*blks = realloc(*blks, *cap * sizeof(uint32_t));
+	}
+	(*blks)[(*n)++] = blkno;
+}
+
+/**
+ * Collect the blocks of a single indirect block, and the block itself.
+ */
+static void reclaim_indir1(uint32_t blk_num, uint32_t **blks, int *n, int *cap)
+{
+	uint32_t entries[PTRS_PER_BLK];
+	if (disk->ops->read(disk, blk_num, 1, entries) < 0)
+		exit(1);
+	for (int i = 0; i < PTRS_PER_BLK; i++) {
+		if (entries[i]) add_blk(blks, n, cap, entries[i]);
+	}
+	add_blk(blks, n, cap, blk_num);
+}
+
+/**
+ * Collect the blocks of a double indirect block, and the block itself.
+ */
+static void reclaim_indir2(uint32_t blk_num, uint32_t **blks, int *n, int *cap)
+{
+	uint32_t entries[PTRS_PER_BLK];
+	if (disk->ops->read(disk, blk_num, 1, entries) < 0)
+		exit(1);
+	for (int i = 0; i < PTRS_PER_BLK; i++) {
+		if (entries[i]) reclaim_indir1(entries[i], blks, n, cap);
+	}
+	add_blk(blks, n, cap, blk_num);
+}
+
+/**
+ * Collect the blocks of a detached tree.
+ */
+static void reclaim_tree(struct reclaim_req *req, uint32_t **blks, int *n, int *cap)
+{
+	for (int i = 0; i < N_DIRECT; i++) {
+		if (req->direct[i]) add_blk(blks, n, cap, req->direct[i]);
+	}
+	if (req->indir_1) reclaim_indir1(req->indir_1, blks, n, cap);
+	if (req->indir_2) reclaim_indir2(req->indir_2, blks, n, cap);
+}
+
+/**
+ * Count the blocks that freeing a detached tree will return: those
+ * no other file shares and no snapshot holds. The tree is only
+ * walked when some block may be shared or held.
+ *
+ * @param req the detached tree
+ * @return the number of blocks
+ */
+static int reclaim_count(struct reclaim_req *req)
+{
+	struct dedup_stats st;
+	dedup_get_stats(&st);
+	pthread_mutex_lock(&block_map_lock);
+	bool held = (snap_map != NULL);
+	pthread_mutex_unlock(&block_map_lock);
+	if (st.extra_refs == 0 && !held) return req->nblks;
+
+	uint32_t *blks = NULL;
+	int n = 0, cap = 0, count = 0;
+	reclaim_tree(req, &blks, &n, &cap);
+	for (int i = 0; i < n; i++) {
+		if (!blk_shared(blks[i]) && !snap_held(blks[i])) count++;
+	}
+	free(blks);
+	return count;
+}
+
+/**
+ * Wait for the reads pinned before the trees of a batch were taken
+ * to finish with their blocks. Reads pinned later mapped their blocks
+ * after the trees were detached, so they are counted in a new epoch
+ * and not waited for.
+ */
+static void reclaim_drain(void)
+{
+	pthread_mutex_lock(&reclaim_lock);
+	int old = reclaim_epoch;
+	reclaim_epoch = !old;
+	while (reclaim_pins[old] > 0) {
+		pthread_cond_wait(&reclaim_unpinned, &reclaim_lock);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+int reclaim_pin(void)
+{
+	pthread_mutex_lock(&reclaim_lock);
+	int pin = reclaim_epoch;
+	reclaim_pins[pin]++;
+	pthread_mutex_unlock(&reclaim_lock);
+	return pin;
+}
+
+void reclaim_unpin(int pin)
+{
+	pthread_mutex_lock(&reclaim_lock);
+	if (--reclaim_pins[pin] == 0) {
+		pthread_cond_broadcast(&reclaim_unpinned);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Free all blocks of a list of detached trees with a single
+ * block map update, once no read still uses them.
+ *
+ * @param list the detached trees
+ */
+static void reclaim_batch(struct reclaim_req *list)
+{
+	uint32_t *blks = NULL;
+	int n = 0, cap = 0, nblks = 0;
+
+	//walk trees without holding any lock
+	for (struct reclaim_req *req = list; req != NULL; req = req->next) {
+		reclaim_tree(req, &blks, &n, &cap);
+		nblks += req->nfree;
+	}
+
+	reclaim_drain();
+
+	//blocks still referenced by other files are kept
+	pthread_mutex_lock(&block_map_lock);
+	for (int i = 0; i < n; i++) {
+		if (blk_unref(blks[i])) FD_CLR(blks[i], block_map);
+	}
+	pthread_mutex_unlock(&block_map_lock);
+	update_blk();
+
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_pending -= nblks;
+	pthread_cond_broadcast(&reclaim_done);
+	pthread_mutex_unlock(&reclaim_lock);
+
+	while (list != NULL) {
+		struct reclaim_req *next = list->next;
+		free(list);
+		list = next;
+	}
+	free(blks);
+}
+
+/**
+ * Reclaimer thread: frees detached trees in batches until stopped.
+ */
+static void *reclaim_main(void *arg)
+{
+	while (true) {
+		pthread_mutex_lock(&reclaim_lock);
+		while (reclaim_list == NULL && !reclaim_stop) {
+			pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+		}
+		struct reclaim_req *list = reclaim_list;
+		reclaim_list = NULL;
+		pthread_mutex_unlock(&reclaim_lock);
+
+		if (list == NULL) break;	//stopped and drained
+		reclaim_batch(list);
+	}
+	return NULL;
+}
+
+/**
+ * Wait until the reclaimer has freed all detached trees.
+ */
+static void reclaim_wait(void)
+{
+	pthread_mutex_lock(&reclaim_lock);
+	while (reclaim_list != NULL || reclaim_pending > 0) {
+		pthread_cond_wait(&reclaim_done, &reclaim_lock);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Number of blocks detached but not yet returned to the free list.
+ */
+int num_pending_blk(void)
+{
+	pthread_mutex_lock(&reclaim_lock);
+	int count = reclaim_pending;
+	pthread_mutex_unlock(&reclaim_lock);
+	return count;
+}
+
+/**
+ * Sum the sizes and blocks of compressed files.
+ */
+void compressed_usage(uint64_t *size, uint64_t *blocks)
+{
+	*size = *blocks = 0;
+	for (int i = 0; i < n_inodes; i++) {
+		//unused inodes are skipped without loading their block
+		if (!FD_ISSET(i, inode_map) || inode_is_dir(i)) continue;
+		struct fs_inode *inode = inode_get(i);
+		if ((inode->flags & (FS_INODE_COMPRESSED | FS_INODE_INLINE)) != FS_INODE_COMPRESSED) continue;
+		*size += inode->size;
+		*blocks += inode->zblocks;
+	}
+}
+
+/**
+ * Find free directory entry.
+ *
+ * @return index of directory free entry or -ENOSPC
+ *   if no space for new entry in directory
+ */
+static int find_free_dir(struct fs_dirent *de)
+{
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		if (!de[i].valid) {
+			return i;
+		}
+	}
+	return -ENOSPC;
+}
+
+/**
+ * Determines whether directory is empty.
+ *
+ * @param de ptr to first entry in directory
+ * @return 1 if empty 0 if has entries
+ */
+static int is_empty_dir(struct fs_dirent *de)
+{
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		if (de[i].valid) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Copy stat from inode to sb
+ * @param inode inode to be copied from
+ * @param sb holder to hold copied stat
+ */
+void cpy_stat(int inum, struct stat *sb) {
+	struct fs_inode_hot *hot = inode_attr(inum);
+	memset(sb, 0, sizeof(*sb));
+	sb->st_uid = hot->uid;
+	sb->st_gid = hot->gid;
+	sb->st_mode = (mode_t) hot->mode;
+	sb->st_atime = hot->mtime;
+	sb->st_ctime = hot->ctime;
+	sb->st_mtime = hot->mtime;
+	sb->st_size = hot->size;
+	sb->st_blksize = FS_BLOCK_SIZE;
+	sb->st_nlink = 1;
+	sb->st_blocks = hot->blocks;
+}
+
+/**
+ * Record in the superblock that data blocks may be shared, so
+ * their reference counts are rebuilt at the next mount.
+ */
+static void mark_shared(void)
+{
+	if (super_flags & FS_SUPER_SHARED) return;
+	struct fs_super sb;
+	if (disk->ops->read(disk, 0, 1, &sb) < 0) exit(1);
+	sb.flags |= FS_SUPER_SHARED;
+	if (disk->ops->write(disk, 0, 1, &sb) < 0) exit(1);
+	super_flags = sb.flags;
+}
+
+/**
+ * Read in the superblock, bitmaps and inode table, and set up
+ * the global variables describing the file system.
+ *
+ * Note: if any block read operation fails, just exit(1) immediately.
+ */
+void fs_mount(void)
+{
+	// read the superblock
+	struct fs_super sb;
+
+
+	//read superblock into SB struct
+
+	int ret = disk->ops->read(disk, 0, 1, &sb);
+	
+	//check for faliure of the read operation
+	if(ret != SUCCESS){
+		exit(1);
+	}
+
+	root_inode = sb.root_inode;
+	super_flags = sb.flags;
+	memcpy(super_snaps, sb.snaps, sizeof(super_snaps));
+
+	/* The inode map and block map are directly after the superblock */
+	// read inode map
+	inode_map_base = 1; // This is correct.
+	inode_map = (fd_set *)malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
+
+	ret = disk->ops->read(disk, inode_map_base, sb.inode_map_sz, inode_map);
+	
+	if(ret != SUCCESS){
+		exit(1);
+	}
+	
+	// read block map 
+	block_map_base = inode_map_base + sb.inode_map_sz;
+	block_map = (fd_set *)malloc(sb.block_map_sz * FS_BLOCK_SIZE);
+	
+	ret = disk->ops->read(disk, block_map_base, sb.block_map_sz, block_map);
+
+	if(ret != SUCCESS){
+		exit(1);
+	}
+
+	/* The inode data is in the next set of blocks, read as they are
+	 * first used; large zeroed allocations are not touched until then */
+	inode_base = block_map_base + sb.block_map_sz;
+	n_inodes = sb.inode_region_sz * INODES_PER_BLK;
+	inodes = calloc(sb.inode_region_sz, FS_BLOCK_SIZE);
+	inode_hot = calloc(n_inodes, sizeof(struct fs_inode_hot));
+	inode_dirs = calloc(n_inodes / 64 + 1, sizeof(uint64_t));
+	inode_blk_loaded = calloc(sb.inode_region_sz, 1);
+	if (inodes == NULL || inode_hot == NULL || inode_dirs == NULL || inode_blk_loaded == NULL) {
+		exit(1);
+	}
+
+	// number of blocks on device
+	n_blocks = sb.num_blocks;
+
+	// dirty metadata blocks
+	dirty_len = inode_base + sb.inode_region_sz;
+	dirty = calloc(dirty_len*sizeof(void*), 1);
+
+	// a snapshot is mounted read-only in place of the live tables
+	if (fs_snapshot != NULL) {
+		struct fs_snap snap;
+		if (snap_find(fs_snapshot, &snap) < 0) {
+			fprintf(stderr, "no snapshot named %s\n", fs_snapshot);
+			exit(1);
+		}
+		int nheld;
+		uint32_t *blks = snap_blocks(&snap, &nheld);
+		snap_read(blks, 0, sb.inode_map_sz, inode_map);
+		snap_read(blks, sb.inode_map_sz, sb.block_map_sz, block_map);
+		snap_read(blks, inode_base - 1, sb.inode_region_sz, inodes);
+		free(blks);
+		for (int i = 0; i < n_inodes; i++) {
+			inode_hot_update(i);
+			inode_dir_update(i);
+		}
+		memset(inode_blk_loaded, 1, sb.inode_region_sz);
+		fs_readonly = true;
+	} else {
+		snap_load();
+	}
+
+	// count shared blocks, and index blocks for deduplication
+	dedup_init(n_blocks);
+	if (!fs_readonly && ((super_flags & FS_SUPER_SHARED) || fs_dedup)) {
+		share_scan();
+	}
+
+	// start freeing detached block trees in the background
+	reclaim_stop = false;
+	if (pthread_create(&reclaim_thread, NULL, reclaim_main, NULL) != 0) {
+		exit(1);
+	}
+
+	// load the rest of the inode table while requests are served
+	prewarm_stop = false;
+	if (fs_prewarm && pthread_create(&prewarm_thread, NULL, prewarm_main, NULL) != 0) {
+		exit(1);
+	}
+}
+
+/**
+ * Stop the reclaimer once it has freed all detached block trees,
+ * so no blocks are leaked in the block map, and write out any
+ * deferred metadata.
+ */
+void fs_unmount(void)
+{
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_stop = true;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+	pthread_join(reclaim_thread, NULL);
+	if (fs_prewarm) {
+		__atomic_store_n(&prewarm_stop, true, __ATOMIC_RELAXED);
+		pthread_join(prewarm_thread, NULL);
+	}
+	flush_metadata();
+}
+
+/**
+ * Read the entries of a directory.
+ *
+ * @param inum: the directory inode
+ * @param entries: buffer for DIRENTS_PER_BLK entries
+ */
+void dir_read(int inum, struct fs_dirent *entries)
+{
+	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
+	//directory without a block has no entries
+	if (inode_get(inum)->direct[0] == 0) return;
+	stats_add(ST_DIR_BLKS, 1);
+	if (disk->ops->read(disk, inode_get(inum)->direct[0], 1, entries) < 0)
+		exit(1);
+}
+
+/**
+ * Write back the entries of a directory.
+ *
+ * @param inum: the directory inode
+ * @param entries: the DIRENTS_PER_BLK entries
+ */
+static void dir_write(int inum, struct fs_dirent *entries)
+{
+	if (disk->ops->write(disk, inode_get(inum)->direct[0], 1, entries) < 0)
+		exit(1);
+}
+
+/**
+ * Copy the block of a directory if a snapshot holds it, before the
+ * directory is changed.
+ *
+ * @param inum: the directory inode
+ * @return 0 if successful, or -ENOSPC
+ */
+static int dir_cow(int inum)
+{
+	int res = cow_blk(&inode_get(inum)->direct[0]);
+	if (res > 0) {
+		update_inode(inum);
+		update_blk();
+	}
+	return (res < 0) ? res : SUCCESS;
+}
+
+/**
+ * Assign an inode (and a block for directories) to a free
+ * directory entry and write out the inode and block map.
+ *
+ * @param de: pointer to first entry in directory
+ * @param name: name of the new entry
+ * @param mode: mode of the new entry
+ * @param isDir: true if a directory block is needed
+ * @return the new inode, or -ENOSPC
+ */
+static int set_attributes_and_update(struct fs_dirent *de, char *name, mode_t mode, bool isDir)
+{
+	//get free directory and inode
+	int freed = find_free_dir(de);
+	if (freed < 0) return -ENOSPC;
+	int freei = get_free_inode();
+	if (freei < 0) return -ENOSPC;
+	int freeb = isDir ? get_free_blk() : 0;
+	if (freeb < 0) {
+		return_inode(freei);
+		return -ENOSPC;
+	}
+	struct fs_dirent *dir = &de[freed];
+	struct fs_inode *inode = inode_get(freei);
+	strcpy(dir->name, name);
+	dir->inode = freei;
+	dir->valid = true;
+	memset(inode, 0, sizeof(struct fs_inode));
+	inode->uid = getuid();
+	inode->gid = getgid();
+	inode->mode = mode;
+	inode->ctime = inode->mtime = time(NULL);
+	inode->size = 0;
+	inode->direct[0] = freeb;
+	if (!isDir && fs_compress) inode->flags = FS_INODE_COMPRESSED;
+	//update map and inode
+	update_inode(freei);
+	update_blk();
+	return freei;
+}
+
+int dir_create(int parent, char *name, mode_t mode)
+{
+	if (fs_readonly) return -EROFS;
+	if (!inode_is_dir(parent)) return -ENOTDIR;
+	if (strlen(name) > FS_FILENAME_SIZE - 1) return -ENAMETOOLONG;
+
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dir_read(parent, entries);
+	if (find_in_dir(entries, name) != 0) return -EEXIST;
+	if (dir_cow(parent) < 0) return -ENOSPC;
+
+	//assign inode and directory and update
+	int inum = set_attributes_and_update(entries, name, mode, S_ISDIR(mode));
+	if (inum < 0) return inum;
+
+	//write entries buffer into disk
+	dir_write(parent, entries);
+	return inum;
+}
+
+int dir_remove(int parent, char *name, bool is_dir)
+{
+	if (fs_readonly) return -EROFS;
+	if (!inode_is_dir(parent)) return -ENOTDIR;
+
+	//find entry in parent dir
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dir_read(parent, entries);
+	int i;
+	for (i = 0; i < DIRENTS_PER_BLK; i++) {
+		if (entries[i].valid && strcmp(entries[i].name, name) == 0) break;
+	}
+	if (i == DIRENTS_PER_BLK) return -ENOENT;
+	int inum = entries[i].inode;
+	struct fs_inode *inode = inode_get(inum);
+
+	if (is_dir) {
+		if (!S_ISDIR(inode->mode)) return -ENOTDIR;
+		//check if dir is empty
+		struct fs_dirent children[DIRENTS_PER_BLK];
+		dir_read(inum, children);
+		if (!is_empty_dir(children)) return -ENOTEMPTY;
+	} else if (S_ISDIR(inode->mode)) {
+		return -EISDIR;
+	}
+
+	//remove entry from parent dir
+	if (dir_cow(parent) < 0) return -ENOSPC;
+	memset(&entries[i], 0, sizeof(struct fs_dirent));
+	dir_write(parent, entries);
+	return inum;
+}
+
+int dir_rename(int parent, char *src_name, char *dst_name)
+{
+	if (fs_readonly) return -EROFS;
+	if (!inode_is_dir(parent)) return -ENOTDIR;
+	if (strlen(dst_name) > FS_FILENAME_SIZE - 1) return -ENAMETOOLONG;
+
+	struct fs_dirent entries[DIRENTS_PER_BLK];
+	dir_read(parent, entries);
+	if (find_in_dir(entries, dst_name) != 0) return -EEXIST;
+
+	//make change to buff
+	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+		if (entries[i].valid && strcmp(entries[i].name, src_name) == 0) {
+			if (dir_cow(parent) < 0) return -ENOSPC;
+			memset(entries[i].name, 0, sizeof(entries[i].name));
+			strcpy(entries[i].name, dst_name);
+			dir_write(parent, entries);
+			return SUCCESS;
+		}
+	}
+	return -ENOENT;
+}
+
+void inode_release(int inum)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (S_ISDIR(inode->mode)) {
+		//directories only hold a single block
+		if (inode->direct[0]) {
+			return_blk(inode->direct[0]);
+			update_blk();
+		}
+	} else {
+		wbuf_drop_inode(inum);
+		detach_blocks(inode);
+	}
+	memset(inode, 0, sizeof(struct fs_inode));
+	return_inode(inum);
+	update_inode(inum);
+}
+
+int inode_truncate(int inum)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (fs_readonly) return -EROFS;
+	if (S_ISDIR(inode->mode)) return -EISDIR;
+
+	//buffered writes happened before the truncate
+	wbuf_sync_inode(inum);
+	//blocks are freed in the background by the reclaimer
+	detach_blocks(inode);
+	inode->size = 0;
+	update_inode(inum);
+	return SUCCESS;
+}
+
+/**
+ * Copy a single indirect block to a new block, adding a reference
+ * to each data block it points to.
+ *
+ * @param blk: the indirect block
+ * @param copy: the new block
+ */
+static void clone_indir1(uint32_t blk, uint32_t copy)
+{
+	uint32_t ptrs[PTRS_PER_BLK];
+	if (disk->ops->read(disk, blk, 1, ptrs) < 0) exit(1);
+	for (int i = 0; i < PTRS_PER_BLK; i++) {
+		if (ptrs[i]) blk_ref(ptrs[i]);
+	}
+	if (disk->ops->write(disk, copy, 1, ptrs) < 0) exit(1);
+}
+
+int inode_clone(int src, int dst)
+{
+	struct fs_inode *from = inode_get(src), *to = inode_get(dst);
+	if (fs_readonly) return -EROFS;
+	if (S_ISDIR(from->mode) || S_ISDIR(to->mode)) return -EISDIR;
+	if (src == dst) return SUCCESS;
+
+	wbuf_sync_inode(src);
+	wbuf_sync_inode(dst);
+
+	//allocate every indirect block first, so the copy cannot fail
+	uint32_t top[PTRS_PER_BLK] = { 0 };
+	int need = 0;
+	if (!(from->flags & FS_INODE_INLINE)) {
+		need = (from->indir_1 != 0) + (from->indir_2 != 0);
+		if (from->indir_2 && disk->ops->read(disk, from->indir_2, 1, top) < 0) exit(1);
+		for (int i = 0; i < PTRS_PER_BLK; i++) {
+			need += (top[i] != 0);
+		}
+	}
+	int copies[need + 1];
+	for (int i = 0; i < need; i++) {
+		copies[i] = get_free_blk();
+		if (copies[i] < 0) {
+			while (i-- > 0) return_blk(copies[i]);
+			return -ENOSPC;
+		}
+	}
+
+	//the blocks of dst are freed in the background by the reclaimer
+	wbuf_drop_inode(dst);
+	detach_blocks(to);
+	to->size = from->size;
+	to->flags = from->flags;
+	to->mtime = time(NULL);
+	if (from->flags & FS_INODE_INLINE) {
+		memcpy(to->direct, from->direct, FS_INLINE_SIZE);
+		update_inode(dst);
+		return SUCCESS;
+	}
+
+	to->zblocks = from->zblocks;
+	for (int i = 0; i < N_DIRECT; i++) {
+		to->direct[i] = from->direct[i];
+		if (to->direct[i]) blk_ref(to->direct[i]);
+	}
+	int n = 0;
+	if (from->indir_1) {
+		to->indir_1 = copies[n++];
+		clone_indir1(from->indir_1, to->indir_1);
+	}
+	if (from->indir_2) {
+		to->indir_2 = copies[n++];
+		for (int i = 0; i < PTRS_PER_BLK; i++) {
+			if (!top[i]) continue;
+			clone_indir1(top[i], copies[n]);
+			top[i] = copies[n++];
+		}
+		if (disk->ops->write(disk, to->indir_2, 1, top) < 0) exit(1);
+	}
+
+	//reference counts of shared blocks are rebuilt at mount
+	mark_shared();
+	update_inode(dst);
+	update_blk();
+	return SUCCESS;
+}
+
+/**
+ * Write a single indirect block.
+ *
+ * @param blk: the indirect block
+ * @param ptrs: its first block pointers
+ * @param n: number of pointers, the rest are cleared
+ */
+static void indir_fill(uint32_t blk, const uint32_t *ptrs, int n)
+{
+	uint32_t entries[PTRS_PER_BLK] = { 0 };
+	memcpy(entries, ptrs, n * sizeof(uint32_t));
+	if (disk->ops->write(disk, blk, 1, entries) < 0) exit(1);
+}
+
+int inode_prealloc(int inum, off_t size)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (fs_readonly) return -EROFS;
+	if (S_ISDIR(inode->mode)) return -EISDIR;
+	//compressed and deduplicated data is placed as it is written
+	if (fs_dedup || (inode->flags & (FS_INODE_COMPRESSED | FS_INODE_INLINE)) ||
+	    inode->size != 0 || has_blocks(inode) || size <= FS_INLINE_SIZE) {
+		return 0;
+	}
+	int ndata = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (ndata > N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK) return -EFBIG;
+
+	//data blocks first, so they form a single extent, then indirect blocks
+	inode->size = size;
+	int nblks = tree_blocks(inode);
+	uint32_t *blks = malloc(nblks * sizeof(uint32_t));
+	if (get_free_run(blks, nblks) < 0) {
+		inode->size = 0;
+		free(blks);
+		return -ENOSPC;
+	}
+	//clear the end of the last block, past what the caller writes
+	if (size % BLOCK_SIZE != 0) {
+		char zero[BLOCK_SIZE] = { 0 };
+		if (disk->ops->write(disk, blks[ndata - 1], 1, zero) < 0) exit(1);
+	}
+	uint32_t *ind = blks + ndata;
+	int n = (ndata < N_DIRECT) ? ndata : N_DIRECT;
+	memcpy(inode->direct, blks, n * sizeof(uint32_t));
+	if (n < ndata) {
+		int k = (ndata - n < PTRS_PER_BLK) ? ndata - n : PTRS_PER_BLK;
+		inode->indir_1 = *ind++;
+		indir_fill(inode->indir_1, blks + n, k);
+		n += k;
+	}
+	if (n < ndata) {
+		uint32_t top[PTRS_PER_BLK];
+		int nmid = 0;
+		inode->indir_2 = *ind++;
+		while (n < ndata) {
+			int k = (ndata - n < PTRS_PER_BLK) ? ndata - n : PTRS_PER_BLK;
+			top[nmid] = *ind++;
+			indir_fill(top[nmid++], blks + n, k);
+			n += k;
+		}
+		indir_fill(inode->indir_2, top, nmid);
+	}
+	free(blks);
+
+	//the size is set once the data is written, so the blocks are
+	//never read before then, even after a crash
+	inode->size = 0;
+	inode->mtime = time(NULL);
+	update_inode(inum);
+	update_blk();
+	return 1;
+}
+
+/**
+ * Single indirect block most recently read by inode_bmap, so mapping
+ * consecutive blocks reads each indirect block only once.
+ */
+struct bmap_cache {
+	uint32_t blk; /* block number of cached indirect block, 0 if none */
+	uint32_t ptrs[PTRS_PER_BLK]; /* its block pointers */
+};
+
+static uint32_t bmap_ptr(struct bmap_cache *cache, uint32_t blk, int idx)
+{
+	if (cache->blk != blk) {
+		stats_add(ST_BMAP_MISSES, 1);
+		if (disk->ops->read(disk, blk, 1, cache->ptrs) < 0) exit(1);
+		cache->blk = blk;
+	} else {
+		stats_add(ST_BMAP_HITS, 1);
+	}
+	return cache->ptrs[idx];
+}
+
+/**
+ * Map a file block index to a block number.
+ *
+ * @param inode: the file inode
+ * @param n: index of the block in the file
+ * @param cache: indirect block cache, zero-initialized by caller
+ * @return the block number, or 0 if not allocated
+ */
+static uint32_t inode_bmap(struct fs_inode *inode, int n, struct bmap_cache *cache)
+{
+	if (n < N_DIRECT) return inode->direct[n];
+	n -= N_DIRECT;
+	if (n < PTRS_PER_BLK) return inode->indir_1 ? bmap_ptr(cache, inode->indir_1, n) : 0;
+	n -= PTRS_PER_BLK;
+	if (!inode->indir_2 || n >= PTRS_PER_BLK * PTRS_PER_BLK) return 0;
+	uint32_t blk = bmap_ptr(cache, inode->indir_2, n / PTRS_PER_BLK);
+	return blk ? bmap_ptr(cache, blk, n % PTRS_PER_BLK) : 0;
+}
+
+/**
+ * Rebuild the reference counts of data blocks by walking the block
+ * trees of all files. With deduplication on, also add the data
+ * blocks of uncompressed files to the index, which reads every
+ * data block once.
+ */
+static void share_scan(void)
+{
+	fd_set *seen = calloc(n_blocks / 8 + sizeof(fd_set), 1);
+	char data[BLOCK_SIZE];
+	for (int i = 0; i < n_inodes; i++) {
+		//unused inodes are skipped without loading their block
+		if (!FD_ISSET(i, inode_map) || inode_is_dir(i)) continue;
+		struct fs_inode *inode = inode_get(i);
+		if (inode->flags & FS_INODE_INLINE) continue;
+
+		bool index = fs_dedup && !(inode->flags & FS_INODE_COMPRESSED);
+		struct bmap_cache cache = { .blk = 0 };
+		int nblks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for (int n = 0; n < nblks; n++) {
+			uint32_t blk = inode_bmap(inode, n, &cache);
+			if (blk == 0) continue;
+			if (FD_ISSET(blk, seen)) {
+				blk_ref(blk);
+				continue;
+			}
+			FD_SET(blk, seen);
+			if (index) {
+				if (disk->ops->read(disk, blk, 1, data) < 0) exit(1);
+				dedup_add(blk, crc32c(0, data, BLOCK_SIZE));
+			}
+		}
+	}
+	free(seen);
+}
+
+/**
+ * Set a block pointer in an indirect block, allocating the
+ * indirect block if there is none yet.
+ *
+ * @param indir: pointer to the indirect block number, 0 if none
+ * @param idx: index of the pointer in the indirect block
+ * @param blk: the block number to set
+ * @return 1 if the indirect block was allocated, 0 if not, or -ENOSPC
+ */
+static int indir_set(uint32_t *indir, int idx, uint32_t blk)
+{
+	uint32_t ptrs[PTRS_PER_BLK];
+	if (!*indir) {
+		if (blk == 0) return SUCCESS;
+		int freeb = get_free_blk();
+		if (freeb < 0) return -ENOSPC;
+		*indir = freeb;
+		memset(ptrs, 0, sizeof(ptrs));
+		ptrs[idx] = blk;
+		if (disk->ops->write(disk, *indir, 1, ptrs) < 0) exit(1);
+		return 1;
+	}
+	if (disk->ops->read(disk, *indir, 1, ptrs) < 0) exit(1);
+	ptrs[idx] = blk;
+	if (disk->ops->write(disk, *indir, 1, ptrs) < 0) exit(1);
+	return 0;
+}
+
+/**
+ * Copy the indirect blocks above a file block index that are held
+ * by a snapshot, so its pointer can be changed in place.
+ *
+ * @param inode: the file inode
+ * @param n: index of the block in the file
+ * @return 0 if successful, or -ENOSPC
+ */
+static int bmap_cow(struct fs_inode *inode, int n)
+{
+	if (snap_map == NULL || n < N_DIRECT) return SUCCESS;
+	n -= N_DIRECT;
+	if (n < PTRS_PER_BLK) return (cow_blk(&inode->indir_1) < 0) ? -ENOSPC : SUCCESS;
+	n -= PTRS_PER_BLK;
+	if (cow_blk(&inode->indir_2) < 0) return -ENOSPC;
+	if (inode->indir_2 == 0) return SUCCESS;
+
+	struct bmap_cache cache = { .blk = 0 };
+	uint32_t mid = bmap_ptr(&cache, inode->indir_2, n / PTRS_PER_BLK);
+	int res = cow_blk(&mid);
+	if (res < 0) return -ENOSPC;
+	//indir_2 is writable now, so this cannot fail
+	if (res > 0) indir_set(&inode->indir_2, n / PTRS_PER_BLK, mid);
+	return SUCCESS;
+}
+
+/**
+ * Set the block number of a file block index, allocating indirect
+ * blocks as needed and counting them in zblocks. The caller writes
+ * the inode.
+ *
+ * @param inode: the file inode
+ * @param n: index of the block in the file
+ * @param blk: the block number, or 0 to clear it
+ * @return 0 if successful, or -ENOSPC
+ */
+static int inode_bmap_set(struct fs_inode *inode, int n, uint32_t blk)
+{
+	if (bmap_cow(inode, n) < 0) return -ENOSPC;
+	if (n < N_DIRECT) {
+		inode->direct[n] = blk;
+		return SUCCESS;
+	}
+	n -= N_DIRECT;
+	if (n < PTRS_PER_BLK) {
+		int res = indir_set(&inode->indir_1, n, blk);
+		if (res < 0) return res;
+		inode->zblocks += res;
+		return SUCCESS;
+	}
+	n -= PTRS_PER_BLK;
+	if (n >= PTRS_PER_BLK * PTRS_PER_BLK) return -ENOSPC;
+
+	//find the single indirect block below indir_2, adding it if needed
+	struct bmap_cache cache = { .blk = 0 };
+	uint32_t mid = inode->indir_2 ? bmap_ptr(&cache, inode->indir_2, n / PTRS_PER_BLK) : 0;
+	if (!mid) {
+		if (blk == 0) return SUCCESS;
+		int freeb = get_free_blk();
+		if (freeb < 0) return -ENOSPC;
+		uint32_t ptrs[PTRS_PER_BLK] = { 0 };
+		if (disk->ops->write(disk, freeb, 1, ptrs) < 0) exit(1);
+		int res = indir_set(&inode->indir_2, n / PTRS_PER_BLK, freeb);
+		if (res < 0) {
+			return_blk(freeb);
+			return -ENOSPC;
+		}
+		inode->zblocks += res + 1;
+		mid = freeb;
+	}
+	//mid exists, so this cannot fail
+	return indir_set(&mid, n % PTRS_PER_BLK, blk);
+}
+
+/**
+ * Bytes of data in a cluster of a compressed file.
+ *
+ * @param size: the file size
+ * @param c: the cluster index
+ */
+static int cluster_len(int32_t size, int c)
+{
+	int64_t len = (int64_t) size - (int64_t) c * CLUSTER_SIZE;
+	return (len <= 0) ? 0 : (len < CLUSTER_SIZE) ? (int) len : CLUSTER_SIZE;
+}
+
+/**
+ * Get the block numbers of a cluster of a compressed file.
+ *
+ * @param inode: the file inode
+ * @param c: the cluster index
+ * @param blks: set to the block numbers, 0 where unused
+ * @param cache: indirect block cache
+ * @return true if the cluster is stored compressed
+ */
+static bool cluster_map(struct fs_inode *inode, int c, uint32_t blks[FS_CLUSTER_BLKS],
+			struct bmap_cache *cache)
+{
+	int k = 0;
+	for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+		blks[i] = inode_bmap(inode, c * FS_CLUSTER_BLKS + i, cache);
+		if (blks[i]) k++;
+	}
+	return k > 0 && k < (cluster_len(inode->size, c) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * Read blocks of file data. A block failing its checksum only fails
+ * the read of the file; other read errors exit, as for metadata.
+ *
+ * @param first_blk: the first block
+ * @param nblks: the number of blocks
+ * @param buf: buffer for the blocks
+ * @return 0 if successful, or -EIO if a block is corrupt
+ */
+static int data_read(int first_blk, int nblks, void *buf)
+{
+	int result = disk->ops->read(disk, first_blk, nblks, buf);
+	if (result == E_CSUM) return -EIO;
+	if (result < 0) exit(1);
+	return SUCCESS;
+}
+
+/**
+ * Read and decompress a compressed cluster.
+ *
+ * @param blks: the cluster's block numbers
+ * @param data: buffer for CLUSTER_SIZE bytes
+ * @return 0 if successful, or -EIO if the cluster is corrupt
+ */
+static int cluster_unpack(const uint32_t blks[FS_CLUSTER_BLKS], char *data)
+{
+	char z[CLUSTER_SIZE];
+	int k = 0;
+	while (k < FS_CLUSTER_BLKS && blks[k]) {
+		if (data_read(blks[k], 1, z + k * BLOCK_SIZE) < 0) return -EIO;
+		k++;
+	}
+	uint32_t zlen;
+	memcpy(&zlen, z, sizeof(zlen));
+	if (zlen > k * BLOCK_SIZE - sizeof(zlen) ||
+	    lz_decompress(z + sizeof(zlen), zlen, data, CLUSTER_SIZE) != CLUSTER_SIZE) {
+		fprintf(stderr, "corrupt compressed cluster at block %u\n", blks[0]);
+		return -EIO;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Store the data of a cluster of a compressed file, compressed if
+ * the cluster is full and that saves a block. Blocks are allocated
+ * before anything is written, so the cluster is unchanged if there
+ * is no space, and blocks that are shared or held by a snapshot are
+ * replaced rather than written. The caller writes the inode and
+ * block map.
+ *
+ * @param inode: the file inode
+ * @param c: the cluster index
+ * @param data: the cluster data
+ * @param len: the number of bytes in the cluster
+ * @return 0 if successful, or -ENOSPC
+ */
+static int cluster_store(struct fs_inode *inode, int c, const char *data, int len)
+{
+	struct bmap_cache cache = { .blk = 0 };
+	uint32_t blks[FS_CLUSTER_BLKS];
+	cluster_map(inode, c, blks, &cache);
+
+	const char *src = data;
+	int nblks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	char z[CLUSTER_SIZE];
+	if (len == CLUSTER_SIZE) {
+		uint32_t zlen = lz_compress(data, len, z + sizeof(zlen), (nblks - 1) * BLOCK_SIZE - sizeof(zlen));
+		if (zlen > 0) {
+			memcpy(z, &zlen, sizeof(zlen));
+			nblks = (zlen + sizeof(zlen) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			src = z;
+		}
+	}
+
+	//make the pointers writable, so clearing them below cannot fail
+	for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+		if (bmap_cow(inode, c * FS_CLUSTER_BLKS + i) < 0) return -ENOSPC;
+	}
+
+	//allocate missing and replaced blocks first
+	uint32_t fresh[FS_CLUSTER_BLKS] = { 0 }, old[FS_CLUSTER_BLKS];
+	memcpy(old, blks, sizeof(old));
+	for (int i = 0; i < nblks; i++) {
+		if (blks[i] && blk_writable(blks[i])) continue;
+		int freeb = get_free_blk();
+		if (freeb < 0 || inode_bmap_set(inode, c * FS_CLUSTER_BLKS + i, freeb) < 0) {
+			if (freeb >= 0) return_blk(freeb);
+			for (int j = 0; j < i; j++) {
+				if (fresh[j]) {
+					inode_bmap_set(inode, c * FS_CLUSTER_BLKS + j, old[j]);
+					return_blk(fresh[j]);
+				}
+			}
+			return -ENOSPC;
+		}
+		blks[i] = fresh[i] = freeb;
+	}
+
+	if (src == data) {
+		//pad the last block
+		memcpy(z, data, len);
+		memset(z + len, 0, nblks * BLOCK_SIZE - len);
+		src = z;
+	}
+	if (disk->ops->write(disk, blks[0], 1, z) < 0) exit(1);
+	for (int i = 1; i < nblks; i++) {
+		if (disk->ops->write(disk, blks[i], 1, z + i * BLOCK_SIZE) < 0) exit(1);
+	}
+	for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+		//drop replaced and surplus blocks
+		uint32_t drop = (i >= nblks) ? blks[i] : fresh[i] ? old[i] : 0;
+		if (fresh[i]) inode->zblocks++;
+		if (i >= nblks && blks[i]) inode_bmap_set(inode, c * FS_CLUSTER_BLKS + i, 0);
+		if (drop) {
+			if (blk_unref(drop)) return_blk(drop);
+			inode->zblocks--;
+		}
+	}
+	return SUCCESS;
+}
+
+/**
+ * Map a byte range of a file to extents, up to the first block that
+ * is not allocated.
+ *
+ * @param inode: the file inode
+ * @param offset: the location to start at
+ * @param len: the number of bytes, within EOF for an inline file
+ * @param ext: array for the extents
+ * @param max_ext: size of ext
+ * @return number of extents
+ */
+static int extents_map(struct fs_inode *inode, off_t offset, size_t len, struct fs_extent *ext, int max_ext)
+{
+	if (inode->flags & FS_INODE_INLINE) {
+		if (max_ext < 1) return 0;
+		ext[0].blk = 0;
+		ext[0].offset = offset;
+		ext[0].len = len;
+		ext[0].mem = (char *) inode->direct + offset;
+		ext[0].zblk[0] = 0;
+		return 1;
+	}
+
+	struct bmap_cache cache = { .blk = 0 };
+	bool compressed = inode->flags & FS_INODE_COMPRESSED;
+	int n = 0, raw_cluster = -1;
+	while (len > 0) {
+		//a compressed cluster is a single extent
+		int c = offset / CLUSTER_SIZE;
+		uint32_t blks[FS_CLUSTER_BLKS];
+		if (compressed && c != raw_cluster) {
+			if (!cluster_map(inode, c, blks, &cache)) {
+				raw_cluster = c;
+			} else if (n < max_ext) {
+				size_t temp = len < CLUSTER_SIZE - offset % CLUSTER_SIZE ? len : CLUSTER_SIZE - offset % CLUSTER_SIZE;
+				ext[n].blk = blks[0];
+				ext[n].offset = offset % CLUSTER_SIZE;
+				ext[n].len = temp;
+				ext[n].mem = NULL;
+				memcpy(ext[n].zblk, blks, sizeof(blks));
+				n++;
+				offset += temp;
+				len -= temp;
+				continue;
+			} else {
+				break;
+			}
+		}
+
+		uint32_t blk = inode_bmap(inode, offset / BLOCK_SIZE, &cache);
+		if (blk == 0) break;
+		uint32_t blk_offset = offset % BLOCK_SIZE;
+		size_t temp = len < BLOCK_SIZE - blk_offset ? len : BLOCK_SIZE - blk_offset;
+
+		//extend previous extent if this block directly follows it
+		struct fs_extent *prev = (n > 0) ? &ext[n - 1] : NULL;
+		uint32_t prev_end = prev ? prev->offset + prev->len : 0;
+		if (prev && prev->zblk[0] == 0 && prev_end % BLOCK_SIZE == 0 &&
+		    blk == prev->blk + prev_end / BLOCK_SIZE) {
+			prev->len += temp;
+		} else if (n < max_ext) {
+			ext[n].blk = blk;
+			ext[n].offset = blk_offset;
+			ext[n].len = temp;
+			ext[n].mem = NULL;
+			ext[n].zblk[0] = 0;
+			n++;
+		} else {
+			break;
+		}
+		offset += temp;
+		len -= temp;
+	}
+	return n;
+}
+
+int inode_extents(int inum, off_t offset, size_t len, struct fs_extent *ext, int max_ext)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (S_ISDIR(inode->mode)) return -EISDIR;
+	wbuf_sync_inode(inum);
+	if (offset >= inode->size) return 0;
+	//limit read to EOF
+	if (offset + len > inode->size) len = inode->size - offset;
+	return extents_map(inode, offset, len, ext, max_ext);
+}
+
+int inode_prealloc_extents(int inum, off_t offset, size_t len, struct fs_extent *ext, int max_ext)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (S_ISDIR(inode->mode)) return -EISDIR;
+	//inline and compressed files are never preallocated
+	if (inode->flags & (FS_INODE_INLINE | FS_INODE_COMPRESSED)) return -EINVAL;
+	return extents_map(inode, offset, len, ext, max_ext);
+}
+
+void inode_prealloc_done(int inum, off_t size)
+{
+	struct fs_inode *inode = inode_get(inum);
+	inode->size = size;
+	inode->mtime = time(NULL);
+	update_inode(inum);
+}
+
+int extent_fd(struct fs_extent *ext, off_t *pos)
+{
+	if (ext->mem != NULL || ext->zblk[0] != 0 || disk->ops->map == NULL) return E_UNAVAIL;
+	int fd = disk->ops->map(disk, ext->blk, pos);
+	if (fd >= 0) *pos += ext->offset;
+	return fd;
+}
+
+int extent_read(struct fs_extent *ext, char *buf)
+{
+	uint32_t blk = ext->blk;
+	size_t len = ext->len;
+	char tmp[BLOCK_SIZE];
+
+	if (ext->mem != NULL) {
+		memcpy(buf, ext->mem, len);
+		return SUCCESS;
+	}
+	if (ext->zblk[0] != 0) {
+		char data[CLUSTER_SIZE];
+		if (cluster_unpack(ext->zblk, data) < 0) return -EIO;
+		memcpy(buf, data + ext->offset, len);
+		return SUCCESS;
+	}
+
+	//partial first block
+	if (ext->offset != 0) {
+		size_t temp = len < BLOCK_SIZE - ext->offset ? len : BLOCK_SIZE - ext->offset;
+		if (data_read(blk, 1, tmp) < 0) return -EIO;
+		memcpy(buf, tmp + ext->offset, temp);
+		buf += temp;
+		len -= temp;
+		blk++;
+	}
+
+	//whole blocks go straight into the caller's buffer
+	int nblks = len / BLOCK_SIZE;
+	if (nblks > 0) {
+		if (data_read(blk, nblks, buf) < 0) return -EIO;
+		buf += nblks * BLOCK_SIZE;
+		len -= nblks * BLOCK_SIZE;
+		blk += nblks;
+	}
+
+	//partial last block
+	if (len > 0) {
+		if (data_read(blk, 1, tmp) < 0) return -EIO;
+		memcpy(buf, tmp, len);
+	}
+	return SUCCESS;
+}
+
+void extent_write(struct fs_extent *ext, const char *buf)
+{
+	uint32_t blk = ext->blk;
+	size_t len = ext->len;
+	char tmp[BLOCK_SIZE];
+
+	//partial first block
+	if (ext->offset != 0) {
+		size_t temp = len < BLOCK_SIZE - ext->offset ? len : BLOCK_SIZE - ext->offset;
+		if (disk->ops->read(disk, blk, 1, tmp) < 0) exit(1);
+		memcpy(tmp + ext->offset, buf, temp);
+		if (disk->ops->write(disk, blk, 1, tmp) < 0) exit(1);
+		buf += temp;
+		len -= temp;
+		blk++;
+	}
+
+	//whole blocks go straight from the caller's buffer
+	int nblks = len / BLOCK_SIZE;
+	if (nblks > 0) {
+		if (disk->ops->write(disk, blk, nblks, (void *) buf) < 0) exit(1);
+		buf += nblks * BLOCK_SIZE;
+		len -= nblks * BLOCK_SIZE;
+		blk += nblks;
+	}
+
+	//partial last block
+	if (len > 0) {
+		if (disk->ops->read(disk, blk, 1, tmp) < 0) exit(1);
+		memcpy(tmp, buf, len);
+		if (disk->ops->write(disk, blk, 1, tmp) < 0) exit(1);
+	}
+}
+
+int inode_read(int inum, char *buf, size_t len, off_t offset)
+{
+	int max_ext = len / BLOCK_SIZE + 2;
+	struct fs_extent *ext = malloc(max_ext * sizeof(struct fs_extent));
+	int n = inode_extents(inum, offset, len, ext, max_ext);
+
+	int total = 0;
+	for (int i = 0; i < n && total >= 0; i++) {
+		if (extent_read(&ext[i], buf + total) < 0) {
+			total = -EIO;
+		} else {
+			total += ext[i].len;
+		}
+	}
+	free(ext);
+	return (n < 0) ? n : total;
+}
+
+static void fs_write_blk(int blk_num, const char *buf, size_t len, size_t offset) {
+	char entries[BLOCK_SIZE];
+	//whole blocks are written without reading them first
+	if (len == BLOCK_SIZE) {
+		if (disk->ops->write(disk, blk_num, 1, (void *) buf) < 0) exit(1);
+		return;
+	}
+	if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
+	memcpy(entries + offset, buf, len);
+	if (disk->ops->write(disk, blk_num, 1, entries) < 0) exit(1);
+}
+
+/**
+ * Write data to a block of a file, allocating the block if there is
+ * none. A block shared with other files or held by a snapshot is
+ * copied rather than written in place. With deduplication on, a block whose new content
+ * is already stored is shared instead of written.
+ *
+ * @param slot: the block pointer, changed if the data moves
+ * @param buf: the data
+ * @param len: the number of bytes, within the block
+ * @param offset: the offset in the block
+ * @return 0 if successful, or -ENOSPC
+ */
+static int fs_write_data(uint32_t *slot, const char *buf, size_t len, size_t offset)
+{
+	uint32_t old = *slot;
+	bool own = old != 0 && blk_writable(old);
+	if (!fs_dedup && own) {
+		fs_write_blk(old, buf, len, offset);
+		return SUCCESS;
+	}
+
+	//the whole new content of the block
+	const char *data = buf;
+	char tmp[BLOCK_SIZE];
+	if (len < BLOCK_SIZE) {
+		if (old == 0) memset(tmp, 0, BLOCK_SIZE);
+		else if (disk->ops->read(disk, old, 1, tmp) < 0) exit(1);
+		memcpy(tmp + offset, buf, len);
+		data = tmp;
+	}
+
+	uint32_t crc = 0;
+	if (fs_dedup) {
+		crc = crc32c(0, data, BLOCK_SIZE);
+		uint32_t match = dedup_find(data, crc);
+		if (match != 0) {
+			mark_shared();
+			if (old != 0 && blk_unref(old)) return_blk(old);
+			*slot = match;
+			return SUCCESS;
+		}
+	}
+
+	uint32_t blk = old;
+	if (!own) {
+		int freeb = get_free_blk();
+		if (freeb < 0) return -ENOSPC;
+		blk = freeb;
+	}
+	if (disk->ops->write(disk, blk, 1, (void *) data) < 0) exit(1);
+	if (fs_dedup) dedup_add(blk, crc);
+	if (blk != old) {
+		if (old != 0 && blk_unref(old)) return_blk(old);
+		*slot = blk;
+	}
+	return SUCCESS;
+}
+
+static size_t fs_write_dir(size_t inode_idx, const char *buf, size_t len, size_t offset) {
+	struct fs_inode *inode = inode_get(inode_idx);
+	size_t blk_num = offset / BLOCK_SIZE;
+	size_t blk_offset = offset % BLOCK_SIZE;
+	size_t len_to_write = len;
+	while (blk_num < N_DIRECT && len_to_write > 0) {
+		size_t temp = len_to_write < BLOCK_SIZE - blk_offset ? len_to_write : BLOCK_SIZE - blk_offset;
+
+		if (fs_write_data(&inode->direct[blk_num], buf, temp, blk_offset) < 0) {
+			return len - len_to_write;
+		}
+
+		buf += temp;
+		len_to_write -= temp;
+		blk_num++;
+		blk_offset = 0;
+	}
+	return len - len_to_write;
+}
+
+static size_t fs_write_indir1(uint32_t *blk, const char *buf, size_t len, size_t offset) {
+	//an indirect block held by a snapshot is copied first
+	int dirty = cow_blk(blk);
+	if (dirty < 0) return 0;
+	uint32_t blk_indices[PTRS_PER_BLK];
+	if (disk->ops->read(disk, (int) *blk, 1, blk_indices) < 0) exit(1);
+
+	size_t blk_num = offset / BLOCK_SIZE;
+	size_t blk_offset = offset % BLOCK_SIZE;
+	size_t len_to_write = len;
+	while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
+		size_t temp = len_to_write < BLOCK_SIZE - blk_offset ? len_to_write : BLOCK_SIZE - blk_offset;
+
+		uint32_t old = blk_indices[blk_num];
+		if (fs_write_data(&blk_indices[blk_num], buf, temp, blk_offset) < 0) break;
+		dirty |= blk_indices[blk_num] != old;
+
+		buf += temp;
+		len_to_write -= temp;
+		blk_num++;
+		blk_offset = 0;
+	}
+	//write back
+	if (dirty && disk->ops->write(disk, *blk, 1, blk_indices) < 0)
+		exit(1);
+	return len - len_to_write;
+}
+
+static size_t fs_write_indir2(uint32_t *blk, const char *buf, size_t len, size_t offset) {
+	int dirty = cow_blk(blk);
+	if (dirty < 0) return 0;
+	uint32_t blk_indices[PTRS_PER_BLK];
+	if (disk->ops->read(disk, (int) *blk, 1, blk_indices) < 0) exit(1);
+
+	size_t blk_num = offset / INDIR1_SIZE;
+	size_t blk_offset = offset % INDIR1_SIZE;
+	size_t len_to_write = len;
+	while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
+		size_t cur_len_to_write = len_to_write < INDIR1_SIZE - blk_offset ? len_to_write : INDIR1_SIZE - blk_offset;
+		if (!blk_indices[blk_num]) {
+			int freeb = get_free_blk();
+			if (freeb < 0) break;
+			blk_indices[blk_num] = freeb;
+			dirty = 1;
+		}
+
+		uint32_t old = blk_indices[blk_num];
+		size_t temp = fs_write_indir1(&blk_indices[blk_num], buf, cur_len_to_write, blk_offset);
+		dirty |= blk_indices[blk_num] != old;
+		buf += temp;
+		len_to_write -= temp;
+		if (temp < cur_len_to_write) break;
+		blk_num++;
+		blk_offset = 0;
+	}
+	//write back
+	if (dirty && disk->ops->write(disk, *blk, 1, blk_indices) < 0)
+		exit(1);
+	return len - len_to_write;
+}
+
+/**
+ * Write data to a compressed file, one cluster at a time. A cluster
+ * that stays partial is stored uncompressed, so appends to it only
+ * write the blocks they touch; other clusters are read, merged and
+ * stored again.
+ *
+ * @param inum: the file inode
+ * @param buf: the buffer to write
+ * @param len: the number of bytes to write
+ * @param offset: the offset to start writing at, at most the size
+ * @return the number of bytes written, or -ENOSPC
+ */
+static int inode_write_z(int inum, const char *buf, size_t len, off_t offset)
+{
+	struct fs_inode *inode = inode_get(inum);
+	char data[CLUSTER_SIZE];
+	size_t done = 0;
+
+	while (done < len) {
+		int c = offset / CLUSTER_SIZE;
+		int c_off = offset % CLUSTER_SIZE;
+		int temp = (len - done < (size_t) (CLUSTER_SIZE - c_off)) ? len - done : CLUSTER_SIZE - c_off;
+		int old_len = cluster_len(inode->size, c);
+		int new_len = (c_off + temp > old_len) ? c_off + temp : old_len;
+
+		struct bmap_cache cache = { .blk = 0 };
+		uint32_t blks[FS_CLUSTER_BLKS];
+		bool packed = cluster_map(inode, c, blks, &cache);
+
+		if (!packed && new_len < CLUSTER_SIZE) {
+			//partial cluster: write the touched blocks in place
+			int written = 0;
+			while (written < temp) {
+				int i = (c_off + written) / BLOCK_SIZE;
+				int blk_off = (c_off + written) % BLOCK_SIZE;
+				int n = (temp - written < BLOCK_SIZE - blk_off) ? temp - written : BLOCK_SIZE - blk_off;
+				if (!blks[i] || !blk_writable(blks[i])) {
+					//new block, or a copy of a shared one
+					int freeb = get_free_blk();
+					if (freeb < 0) break;
+					if (inode_bmap_set(inode, c * FS_CLUSTER_BLKS + i, freeb) < 0) {
+						return_blk(freeb);
+						break;
+					}
+					if (blks[i]) {
+						char tmp[BLOCK_SIZE];
+						if (disk->ops->read(disk, blks[i], 1, tmp) < 0) exit(1);
+						if (disk->ops->write(disk, freeb, 1, tmp) < 0) exit(1);
+						if (blk_unref(blks[i])) return_blk(blks[i]);
+					} else {
+						inode->zblocks++;
+					}
+					blks[i] = freeb;
+				}
+				fs_write_blk(blks[i], buf + done + written, n, blk_off);
+				written += n;
+			}
+			done += written;
+			offset += written;
+			if (offset > inode->size) inode->size = offset;
+			if (written < temp) break;
+			continue;
+		}
+
+		//load the old data unless it is all overwritten
+		if (packed) {
+			if (cluster_unpack(blks, data) < 0) exit(1);
+		} else if (c_off > 0 || c_off + temp < old_len) {
+			for (int i = 0; i * BLOCK_SIZE < old_len; i++) {
+				if (disk->ops->read(disk, blks[i], 1, data + i * BLOCK_SIZE) < 0) exit(1);
+			}
+		}
+		memcpy(data + c_off, buf + done, temp);
+		if (cluster_store(inode, c, data, new_len) < 0) break;
+		done += temp;
+		offset += temp;
+		if (offset > inode->size) inode->size = offset;
+	}
+
+	update_inode(inum);
+	update_blk();
+	if (done == 0 && len > 0) return -ENOSPC;
+	return (int) done;
+}
+
+/**
+ * Move the data of an inline file to a data block.
+ *
+ * @param inum: the file inode
+ * @return 0 if successful, or -ENOSPC
+ */
+static int inline_promote(int inum)
+{
+	struct fs_inode *inode = inode_get(inum);
+	char data[FS_INLINE_SIZE];
+	memcpy(data, inode->direct, FS_INLINE_SIZE);
+	memset(inode->direct, 0, FS_INLINE_SIZE);
+	inode->flags &= ~FS_INODE_INLINE;
+	if (inode->flags & FS_INODE_COMPRESSED) {
+		//rewritten from the start, so the clusters are counted
+		int32_t size = inode->size;
+		inode->size = 0;
+		if (size == 0 || inode_write_z(inum, data, size, 0) == size) return SUCCESS;
+		inode->size = size;
+		memcpy(inode->direct, data, FS_INLINE_SIZE);
+		inode->flags |= FS_INODE_INLINE;
+		return -ENOSPC;
+	}
+	if (inode->size > 0 && fs_write_dir(inum, data, inode->size, 0) < inode->size) {
+		//keep the data inline if no block is free
+		memcpy(inode->direct, data, FS_INLINE_SIZE);
+		inode->flags |= FS_INODE_INLINE;
+		return -ENOSPC;
+	}
+	return SUCCESS;
+}
+
+int inode_write(int inum, const char *buf, size_t len, off_t offset)
+{
+	struct fs_inode *inode = inode_get(inum);
+	if (fs_readonly) return -EROFS;
+	if (S_ISDIR(inode->mode)) return -EISDIR;
+	if (offset > inode->size) return -EINVAL;
+
+	//tiny files are kept in the inode until they outgrow it
+	bool is_inline = inode->flags & FS_INODE_INLINE;
+	if (len > 0 && offset + len <= FS_INLINE_SIZE &&
+	    (is_inline || (inode->size == 0 && !has_blocks(inode)))) {
+		memcpy((char *) inode->direct + offset, buf, len);
+		inode->flags |= FS_INODE_INLINE;
+		if (offset + len > inode->size) inode->size = offset + len;
+		update_inode(inum);
+		return (int) len;
+	}
+	if (is_inline && len > 0) {
+		int res = inline_promote(inum);
+		if (res < 0) return res;
+	}
+	if (inode->flags & FS_INODE_COMPRESSED) return inode_write_z(inum, buf, len, offset);
+
+	//len need to write
+	size_t len_to_write = len;
+
+	//write direct blocks
+	if (len_to_write > 0 && offset < DIR_SIZE) {
+		size_t temp = fs_write_dir(inum, buf, len_to_write, (size_t) offset);
+		len_to_write -= temp;
+		offset += temp;
+		buf += temp;
+	}
+
+	//write indirect 1 blocks
+	if (len_to_write > 0 && offset >= DIR_SIZE && offset < DIR_SIZE + INDIR1_SIZE) {
+		//need to allocate indir_1
+		if (!inode->indir_1) {
+			int freeb = get_free_blk();
+			if (freeb >= 0) inode->indir_1 = freeb;
+		}
+		if (inode->indir_1) {
+			size_t temp = fs_write_indir1(&inode->indir_1, buf, len_to_write, (size_t) offset - DIR_SIZE);
+			len_to_write -= temp;
+			offset += temp;
+			buf += temp;
+		}
+	}
+
+	//write indirect 2 blocks
+	if (len_to_write > 0 && offset >= DIR_SIZE + INDIR1_SIZE && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE) {
+		//need to allocate indir_2
+		if (!inode->indir_2) {
+			int freeb = get_free_blk();
+			if (freeb >= 0) inode->indir_2 = freeb;
+		}
+		if (inode->indir_2) {
+			size_t temp = fs_write_indir2(&inode->indir_2, buf, len_to_write, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
+			len_to_write -= temp;
+			offset += temp;
+		}
+	}
+
+	if (offset > inode->size) inode->size = offset;
+
+	//update inode and blk
+	update_inode(inum);
+	update_blk();
+
+	if (len_to_write == len && len > 0) return -ENOSPC;
+	return (int) (len - len_to_write);
+}
+
+/** list of write-back buffers of open files */
+static struct fs_wbuf *wbuf_list;
+/** protects wbuf_list and the buffers on it */
+static pthread_mutex_t wbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fs_wbuf *wbuf_open(int inum)
+{
+	struct fs_wbuf *wb = calloc(1, sizeof(struct fs_wbuf));
+	wb->inum = inum;
+	pthread_mutex_lock(&wbuf_lock);
+	wb->next = wbuf_list;
+	wbuf_list = wb;
+	pthread_mutex_unlock(&wbuf_lock);
+	return wb;
+}
+
+/**
+ * Write out the buffered data of a write-back buffer. Call with
+ * wbuf_lock held.
+ *
+ * @param wb: the buffer
+ * @return 0 if successful, or -error number
+ */
+static int wbuf_flush_locked(struct fs_wbuf *wb)
+{
+	if (wb->len == 0) return SUCCESS;
+	int res = inode_write(wb->inum, wb->data, wb->len, wb->offset);
+	if (res >= 0 && (size_t) res < wb->len) res = -ENOSPC;
+	wb->len = 0;
+	if (res < 0 && wb->err == 0) wb->err = res;
+	return (res < 0) ? res : SUCCESS;
+}
+
+/**
+ * Flush all write-back buffers of an inode. Call with wbuf_lock held.
+ *
+ * @param inum: the file inode
+ */
+static void wbuf_sync_inode_locked(int inum)
+{
+	for (struct fs_wbuf *wb = wbuf_list; wb != NULL; wb = wb->next) {
+		if (wb->inum == inum) wbuf_flush_locked(wb);
+	}
+}
+
+void wbuf_sync_inode(int inum)
+{
+	pthread_mutex_lock(&wbuf_lock);
+	wbuf_sync_inode_locked(inum);
+	pthread_mutex_unlock(&wbuf_lock);
+}
+
+/**
+ * Discard buffered data of an inode being freed.
+ *
+ * @param inum: the file inode
+ */
+static void wbuf_drop_inode(int inum)
+{
+	pthread_mutex_lock(&wbuf_lock);
+	for (struct fs_wbuf *wb = wbuf_list; wb != NULL; wb = wb->next) {
+		if (wb->inum == inum) wb->len = 0;
+	}
+	pthread_mutex_unlock(&wbuf_lock);
+}
+
+int wbuf_write(struct fs_wbuf *wb, const char *buf, size_t len, off_t offset)
+{
+	pthread_mutex_lock(&wbuf_lock);
+	//report an earlier failed flush first
+	int res = wb->err;
+	if (res == 0 && wb->len > 0 && offset != wb->offset + (off_t) wb->len) {
+		res = wbuf_flush_locked(wb);
+	}
+	if (res == 0 && wb->len == 0) {
+		//other open files may have buffered data up to offset
+		wbuf_sync_inode_locked(wb->inum);
+		if (fs_readonly) res = -EROFS;
+		else if (inode_is_dir(wb->inum)) res = -EISDIR;
+		else if (offset > inode_get(wb->inum)->size) res = -EINVAL;
+	}
+
+	size_t done = 0;
+	while (res == 0 && done < len) {
+		off_t pos = offset + done;
+		size_t room = BLOCK_SIZE - pos % BLOCK_SIZE;
+		if (wb->len == 0 && room == BLOCK_SIZE && len - done >= BLOCK_SIZE) {
+			//write a run of whole blocks directly
+			size_t run = (len - done) / BLOCK_SIZE * BLOCK_SIZE;
+			res = inode_write(wb->inum, buf + done, run, pos);
+			if (res < 0) break;
+			done += res;
+			res = ((size_t) res < run) ? -ENOSPC : 0;
+			continue;
+		}
+		size_t n = (len - done < room) ? len - done : room;
+		if (wb->len == 0) wb->offset = pos;
+		memcpy(wb->data + wb->len, buf + done, n);
+		wb->len += n;
+		done += n;
+		//flush when the buffer reaches a block boundary
+		if (n == room) res = wbuf_flush_locked(wb);
+	}
+
+	//a failed flush after accepting data is reported by the next call
+	if (done == 0) wb->err = 0;
+	pthread_mutex_unlock(&wbuf_lock);
+	return (done > 0) ? (int) done : res;
+}
+
+int wbuf_flush(struct fs_wbuf *wb)
+{
+	pthread_mutex_lock(&wbuf_lock);
+	wbuf_flush_locked(wb);
+	int res = wb->err;
+	wb->err = 0;
+	pthread_mutex_unlock(&wbuf_lock);
+	return res;
+}
+
+int wbuf_close(struct fs_wbuf *wb)
+{
+	int res = wbuf_flush(wb);
+	pthread_mutex_lock(&wbuf_lock);
+	struct fs_wbuf **pp = &wbuf_list;
+	while (*pp != wb) pp = &(*pp)->next;
+	*pp = wb->next;
+	pthread_mutex_unlock(&wbuf_lock);
+	free(wb);
+	return res;
+}
+
+/**
+ * Flush the write-back buffers of all open files.
+ */
+static void wbuf_sync_all(void)
+{
+	pthread_mutex_lock(&wbuf_lock);
+	for (struct fs_wbuf *wb = wbuf_list; wb != NULL; wb = wb->next) {
+		wbuf_flush_locked(wb);
+	}
+	pthread_mutex_unlock(&wbuf_lock);
+}
+
+/**
+ * Find a snapshot by name.
+ *
+ * @param name: the snapshot name
+ * @param snap: set to the snapshot header
+ * @return index of the snapshot in the superblock, or -ENOENT
+ */
+static int snap_find(const char *name, struct fs_snap *snap)
+{
+	for (int i = 0; i < FS_MAX_SNAPS; i++) {
+		if (super_snaps[i] == 0) continue;
+		if (disk->ops->read(disk, super_snaps[i], 1, snap) < 0) exit(1);
+		if (snap->magic == FS_SNAP_MAGIC && strcmp(snap->name, name) == 0) return i;
+	}
+	return -ENOENT;
+}
+
+/**
+ * Number of index blocks a snapshot needs for its copy.
+ *
+ * @param nblks: blocks holding the copy
+ * @return the number of index blocks
+ */
+static int snap_index_blks(int nblks)
+{
+	if (nblks <= FS_SNAP_MAX_BLKS) return 0;
+	return (nblks - FS_SNAP_MAX_BLKS + FS_SNAP_INDEX_BLKS - 1) / FS_SNAP_INDEX_BLKS;
+}
+
+/**
+ * Get the blocks a snapshot holds besides its header: the blocks of
+ * the metadata copy in order, then its index blocks.
+ *
+ * @param snap: the snapshot header
+ * @param nheld: set to the number of blocks
+ * @return the blocks, to be freed by the caller
+ */
+static uint32_t *snap_blocks(struct fs_snap *snap, int *nheld)
+{
+	int nblks = snap->nblks, nidx = snap_index_blks(nblks);
+	uint32_t *blks = malloc((nblks + nidx) * sizeof(uint32_t));
+	int n = (nblks < FS_SNAP_MAX_BLKS) ? nblks : FS_SNAP_MAX_BLKS;
+	memcpy(blks, snap->blks, n * sizeof(uint32_t));
+	uint32_t next = snap->next;
+	for (int i = 0; i < nidx; i++) {
+		struct fs_snap_index idx;
+		if (disk->ops->read(disk, next, 1, &idx) < 0) exit(1);
+		int k = (nblks - n < FS_SNAP_INDEX_BLKS) ? nblks - n : FS_SNAP_INDEX_BLKS;
+		memcpy(blks + n, idx.blks, k * sizeof(uint32_t));
+		n += k;
+		blks[nblks + i] = next;
+		next = idx.next;
+	}
+	*nheld = nblks + nidx;
+	return blks;
+}
+
+/**
+ * Read blocks of the metadata copy of a snapshot.
+ *
+ * @param blks: the blocks of the snapshot, from snap_blocks()
+ * @param first: index of the first block, counting from the inode map
+ * @param nblks: number of blocks
+ * @param buf: buffer for the blocks
+ */
+static void snap_read(const uint32_t *blks, int first, int nblks, void *buf)
+{
+	for (int i = 0; i < nblks; i++) {
+		if (disk->ops->read(disk, blks[first + i], 1, (char *) buf + i * BLOCK_SIZE) < 0)
+			exit(1);
+	}
+}
+
+/**
+ * Rebuild the map of blocks held by snapshots from their frozen
+ * block maps. Blocks marked free in the live map but held by a
+ * snapshot are never allocated.
+ */
+static void snap_load(void)
+{
+	int map_sz = inode_base - block_map_base;
+	fd_set *map = NULL, *frozen = malloc(map_sz * BLOCK_SIZE);
+	struct fs_snap snap;
+	for (int i = 0; i < FS_MAX_SNAPS; i++) {
+		if (super_snaps[i] == 0) continue;
+		if (disk->ops->read(disk, super_snaps[i], 1, &snap) < 0) exit(1);
+		if (map == NULL) map = calloc(map_sz, BLOCK_SIZE);
+		int nheld;
+		uint32_t *blks = snap_blocks(&snap, &nheld);
+		snap_read(blks, block_map_base - inode_map_base, map_sz, frozen);
+		free(blks);
+		for (size_t w = 0; w < map_sz * BLOCK_SIZE / sizeof(uint32_t); w++) {
+			((uint32_t *) map)[w] |= ((uint32_t *) frozen)[w];
+		}
+	}
+	free(frozen);
+
+	pthread_mutex_lock(&block_map_lock);
+	free(snap_map);
+	snap_map = map;
+	pthread_mutex_unlock(&block_map_lock);
+}
+
+/**
+ * Write the snapshot list to the superblock.
+ */
+static void snap_update_super(void)
+{
+	struct fs_super sb;
+	if (disk->ops->read(disk, 0, 1, &sb) < 0) exit(1);
+	memcpy(sb.snaps, super_snaps, sizeof(sb.snaps));
+	if (disk->ops->write(disk, 0, 1, &sb) < 0) exit(1);
+}
+
+int snap_create(const char *name)
+{
+	if (fs_readonly) return -EROFS;
+	if (strlen(name) > FS_FILENAME_SIZE - 1) return -ENAMETOOLONG;
+	struct fs_snap snap;
+	if (snap_find(name, &snap) >= 0) return -EEXIST;
+	int slot = 0;
+	while (slot < FS_MAX_SNAPS && super_snaps[slot] != 0) slot++;
+	if (slot == FS_MAX_SNAPS) return -ENOSPC;
+	int meta_blks = inode_base - inode_map_base + n_inodes / INODES_PER_BLK;
+	int nidx = snap_index_blks(meta_blks);
+
+	//settle buffered writes and detached trees, so the frozen
+	//tables describe exactly the blocks in use
+	wbuf_sync_all();
+	reclaim_wait();
+	inode_load_all();
+	char *meta = malloc(meta_blks * BLOCK_SIZE);
+	int map_off = (block_map_base - inode_map_base) * BLOCK_SIZE;
+	memcpy(meta, inode_map, map_off);
+	pthread_mutex_lock(&block_map_lock);
+	memcpy(meta + map_off, block_map, (inode_base - block_map_base) * BLOCK_SIZE);
+	pthread_mutex_unlock(&block_map_lock);
+	//the blocks of other snapshots are not part of this one
+	fd_set *frozen = (fd_set *) (meta + map_off);
+	for (int i = 0; i < FS_MAX_SNAPS; i++) {
+		if (super_snaps[i] == 0) continue;
+		if (disk->ops->read(disk, super_snaps[i], 1, &snap) < 0) exit(1);
+		FD_CLR(super_snaps[i], frozen);
+		int nheld;
+		uint32_t *blks = snap_blocks(&snap, &nheld);
+		for (int j = 0; j < nheld; j++) {
+			FD_CLR(blks[j], frozen);
+		}
+		free(blks);
+	}
+	memcpy(meta + (inode_base - inode_map_base) * BLOCK_SIZE, inodes,
+	       n_inodes / INODES_PER_BLK * BLOCK_SIZE);
+
+	//header and copy live in blocks that are not part of the snapshot
+	memset(&snap, 0, sizeof(snap));
+	snap.magic = FS_SNAP_MAGIC;
+	snap.ctime = time(NULL);
+	strcpy(snap.name, name);
+	snap.nblks = meta_blks;
+	uint32_t *blks = malloc((meta_blks + nidx) * sizeof(uint32_t));
+	int hdr = get_free_blk(), n = 0;
+	while (hdr >= 0 && n < meta_blks + nidx) {
+		int freeb = get_free_blk();
+		if (freeb < 0) break;
+		blks[n++] = freeb;
+	}
+	if (hdr < 0 || n < meta_blks + nidx) {
+		for (int i = 0; i < n; i++) return_blk(blks[i]);
+		if (hdr >= 0) return_blk(hdr);
+		free(blks);
+		free(meta);
+		return -ENOSPC;
+	}
+	for (int i = 0; i < meta_blks; i++) {
+		if (disk->ops->write(disk, blks[i], 1, meta + i * BLOCK_SIZE) < 0) exit(1);
+	}
+	free(meta);
+
+	//the header lists the first blocks, then each index block the next
+	n = (meta_blks < FS_SNAP_MAX_BLKS) ? meta_blks : FS_SNAP_MAX_BLKS;
+	memcpy(snap.blks, blks, n * sizeof(uint32_t));
+	snap.next = nidx ? blks[meta_blks] : 0;
+	for (int i = 0; i < nidx; i++) {
+		struct fs_snap_index idx = { .next = (i + 1 < nidx) ? blks[meta_blks + i + 1] : 0 };
+		int k = (meta_blks - n < FS_SNAP_INDEX_BLKS) ? meta_blks - n : FS_SNAP_INDEX_BLKS;
+		memcpy(idx.blks, blks + n, k * sizeof(uint32_t));
+		n += k;
+		if (disk->ops->write(disk, blks[meta_blks + i], 1, &idx) < 0) exit(1);
+	}
+	free(blks);
+	if (disk->ops->write(disk, hdr, 1, &snap) < 0) exit(1);
+	update_blk();
+
+	super_snaps[slot] = hdr;
+	snap_update_super();
+	snap_load();
+	return SUCCESS;
+}
+
+int snap_delete(const char *name)
+{
+	if (fs_readonly) return -EROFS;
+	struct fs_snap snap;
+	int slot = snap_find(name, &snap);
+	if (slot < 0) return slot;
+
+	uint32_t hdr = super_snaps[slot];
+	super_snaps[slot] = 0;
+	snap_update_super();
+	int nheld;
+	uint32_t *blks = snap_blocks(&snap, &nheld);
+	for (int i = 0; i < nheld; i++) {
+		return_blk(blks[i]);
+	}
+	free(blks);
+	return_blk(hdr);
+	update_blk();
+	//blocks only this snapshot held become free
+	snap_load();
+	return SUCCESS;
+}
+
+int snap_list(struct fs_snap *snaps, int max)
+{
+	int n = 0;
+	for (int i = 0; i < FS_MAX_SNAPS && n < max; i++) {
+		if (super_snaps[i] == 0) continue;
+		if (disk->ops->read(disk, super_snaps[i], 1, &snaps[n]) < 0) exit(1);
+		n++;
+	}
+	return n;
+}
+
+int num_snap_blk(void)
+{
+	int count = 0;
+	pthread_mutex_lock(&block_map_lock);
+	for (int i = 0; snap_map != NULL && i < n_blocks; i++) {
+		if (FD_ISSET(i, snap_map) && !FD_ISSET(i, block_map)) count++;
+	}
+	pthread_mutex_unlock(&block_map_lock);
+	return count;
+}
+
+int snap_export(const char *name, const char *path)
+{
+	struct fs_snap snap;
+	if (snap_find(name, &snap) < 0) return -ENOENT;
+
+	//the exported image has the snapshot's tables and no snapshots
+	struct fs_super sb;
+	if (disk->ops->read(disk, 0, 1, &sb) < 0) exit(1);
+	sb.flags &= FS_SUPER_SHARED;
+	memset(sb.snaps, 0, sizeof(sb.snaps));
+	char *meta = malloc(snap.nblks * BLOCK_SIZE);
+	int nheld;
+	uint32_t *blks = snap_blocks(&snap, &nheld);
+	snap_read(blks, 0, snap.nblks, meta);
+	free(blks);
+	fd_set *frozen = (fd_set *) (meta + (block_map_base - inode_map_base) * BLOCK_SIZE);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		free(meta);
+		return -errno;
+	}
+	int res = SUCCESS;
+	size_t meta_len = snap.nblks * BLOCK_SIZE;
+	if (ftruncate(fd, (off_t) n_blocks * BLOCK_SIZE) < 0 ||
+	    pwrite(fd, &sb, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+	    pwrite(fd, meta, meta_len, BLOCK_SIZE) != (ssize_t) meta_len) {
+		res = -errno;
+	}
+
+	//copy the blocks in use in the snapshot
+	char buf[BLOCK_SIZE];
+	for (int i = inode_map_base + snap.nblks; i < n_blocks && res == SUCCESS; i++) {
+		if (!FD_ISSET(i, frozen)) continue;
+		if (disk->ops->read(disk, i, 1, buf) < 0) exit(1);
+		if (pwrite(fd, buf, BLOCK_SIZE, (off_t) i * BLOCK_SIZE) != BLOCK_SIZE) res = -errno;
+	}
+	if (close(fd) < 0 && res == SUCCESS) res = -errno;
+	free(meta);
+	return res;
+}
+
+/**
+ * Build the metadata of an empty file system: the superblock, the
+ * bitmaps, the inode table and the root directory block.
+ *
+ * @param nblks: number of blocks
+ * @param ninodes: number of inodes
+ * @param meta_blks: set to the number of blocks built
+ * @return the blocks, or NULL if nblks is too small for them
+ */
+static char *mkfs_meta(int nblks, int ninodes, int *meta_blks)
+{
+	int imap_blks = (ninodes + BITS_PER_BLK - 1) / BITS_PER_BLK;
+	int inode_blks = (ninodes + INODES_PER_BLK - 1) / INODES_PER_BLK;
+	int bmap_blks = (nblks + BITS_PER_BLK - 1) / BITS_PER_BLK;
+	int root_blk = 1 + imap_blks + bmap_blks + inode_blks;
+	if (root_blk >= nblks) return NULL;
+	char *meta = calloc(root_blk + 1, FS_BLOCK_SIZE);
+	struct fs_super *sb = (struct fs_super *) meta;
+	sb->magic = FS_MAGIC;
+	sb->inode_map_sz = imap_blks;
+	sb->inode_region_sz = inode_blks;
+	sb->block_map_sz = bmap_blks;
+	sb->num_blocks = nblks;
+	sb->root_inode = 1;
+	//inode 0 is never used, inode 1 is the root
+	fd_set *imap = (fd_set *) (meta + FS_BLOCK_SIZE);
+	FD_SET(0, imap);
+	FD_SET(1, imap);
+	//the metadata blocks and the root directory block are in use
+	fd_set *bmap = (fd_set *) (meta + (1 + imap_blks) * FS_BLOCK_SIZE);
+	for (int i = 0; i <= root_blk; i++) FD_SET(i, bmap);
+	struct fs_inode *root = (struct fs_inode *) (meta + (1 + imap_blks + bmap_blks) * FS_BLOCK_SIZE) + 1;
+	root->uid = getuid();
+	root->gid = getgid();
+	root->mode = S_IFDIR | 0777;
+	root->ctime = root->mtime = time(NULL);
+	root->size = FS_BLOCK_SIZE;
+	root->direct[0] = root_blk;
+	*meta_blks = root_blk + 1;
+	return meta;
+}
+
+int fs_mkfs(const char *path, int nblks, int ninodes)
+{
+	int meta_blks;
+	char *meta = mkfs_meta(nblks, ninodes, &meta_blks);
+	if (meta == NULL) return -EINVAL;
+
+	int res = SUCCESS;
+	ssize_t len = (ssize_t) meta_blks * FS_BLOCK_SIZE;
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0 || ftruncate(fd, (off_t) nblks * FS_BLOCK_SIZE) < 0 ||
+	    pwrite(fd, meta, len, 0) != len) {
+		res = -errno;
+	}
+	if (fd >= 0) close(fd);
+	free(meta);
+	return res;
+}
+
+int fs_mkfs_dev(struct blkdev *dev, int ninodes)
+{
+	int meta_blks;
+	char *meta = mkfs_meta(dev->ops->num_blocks(dev), ninodes, &meta_blks);
+	if (meta == NULL) return -EINVAL;
+	int res = dev->ops->write(dev, 0, meta_blks, meta);
+	if (res == SUCCESS) res = dev->ops->flush(dev, 0, meta_blks);
+	free(meta);
+	return (res < 0) ? -EIO : 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * file:        fscore.h
+ * description: inode, allocator and block-mapping functions shared by
+ *              the path-based (fs.c) and low-level (fs_ll.c) builds
+ *
+ * Credit:
+ * 	Peter Desnoyers, November 2016
+ * 	Philip Gust, March 2019
+ */
+#ifndef FSCORE_H_
+#define FSCORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fsx492.h"
+#include "blkdev.h"
+
+/** disk block device, see main.c */
+extern struct blkdev *disk;
+
+/** pointer to inode blocks; use inode_get(), which loads them */
+extern struct fs_inode *inodes;
+
+/**
+ * Attributes of an inode read by lookups and getattr, kept in a
+ * table apart from the block pointers so that those of neighboring
+ * inodes share cache lines. update_inode() refreshes them.
+ */
+struct fs_inode_hot {
+	uint32_t mode; /* permissions | type */
+	int32_t size; /* size in bytes */
+	uint32_t mtime; /* last modification time */
+	uint32_t ctime; /* creation time */
+	uint16_t uid; /* user ID of file owner */
+	uint16_t gid; /* group ID of file owner */
+	uint32_t blocks; /* blocks reported by stat */
+};
+
+/** hot attributes of the inodes */
+extern struct fs_inode_hot *inode_hot;
+/** directory flag of the inodes, one bit each */
+extern uint64_t *inode_dirs;
+/** set for each block of the inode table once it is loaded */
+extern uint8_t *inode_blk_loaded;
+/** number of inodes from superblock */
+extern int n_inodes;
+/** number of root inode from superblock */
+extern int root_inode;
+/** store new files in compressed clusters */
+extern bool fs_compress;
+/** share data blocks with identical content */
+extern bool fs_dedup;
+/** load the inode table in the background after mount */
+extern bool fs_prewarm;
+/** reject changes, set when a snapshot is mounted */
+extern bool fs_readonly;
+/** name of the snapshot to mount read-only, or NULL for the live tables */
+extern const char *fs_snapshot;
+
+/**
+ * Read the superblock, bitmaps and inode table from disk and
+ * start the background reclaimer. Exits if any read fails.
+ */
+extern void fs_mount(void);
+
+/**
+ * Wait for the reclaimer to free all detached block trees.
+ */
+extern void fs_unmount(void);
+
+/**
+ * Load the block of the inode table holding an inode, and the hot
+ * attributes of its inodes, if no other thread has. Exits if the
+ * read fails.
+ *
+ * @param inum: the inode
+ */
+extern void inode_load(int inum);
+
+/**
+ * Get an inode of the inode table, loading its block on first use.
+ *
+ * @param inum: the inode
+ * @return the inode
+ */
+static inline struct fs_inode *inode_get(int inum)
+{
+	if (!__atomic_load_n(&inode_blk_loaded[inum / INODES_PER_BLK], __ATOMIC_ACQUIRE)) {
+		inode_load(inum);
+	}
+	return &inodes[inum];
+}
+
+/**
+ * Get the hot attributes of an inode, loading its block on first use.
+ *
+ * @param inum: the inode
+ * @return the attributes
+ */
+static inline struct fs_inode_hot *inode_attr(int inum)
+{
+	if (!__atomic_load_n(&inode_blk_loaded[inum / INODES_PER_BLK], __ATOMIC_ACQUIRE)) {
+		inode_load(inum);
+	}
+	return &inode_hot[inum];
+}
+
+/**
+ * Whether an inode is a directory.
+ *
+ * @param inum: the inode
+ */
+static inline bool inode_is_dir(int inum)
+{
+	if (!__atomic_load_n(&inode_blk_loaded[inum / INODES_PER_BLK], __ATOMIC_ACQUIRE)) {
+		inode_load(inum);
+	}
+	return (__atomic_load_n(&inode_dirs[inum / 64], __ATOMIC_RELAXED) >> (inum % 64)) & 1;
+}
+
+/**
+ * Create an image holding an empty file system, with only the root
+ * directory.
+ *
+ * @param path: the image file, created or truncated
+ * @param nblks: number of blocks
+ * @param ninodes: number of inodes, rounded up to a whole block of them
+ * @return 0 if successful, -EINVAL if nblks is too small for the
+ *	metadata, or -errno of the image file
+ */
+extern int fs_mkfs(const char *path, int nblks, int ninodes);
+
+/**
+ * Create an empty file system, with only the root directory, on a
+ * block device, for devices not backed by one image file. Blocks
+ * past the metadata are left as they are.
+ *
+ * @param dev: the block device
+ * @param ninodes: number of inodes, rounded up to a whole block of them
+ * @return 0 if successful, -EINVAL if the device is too small for the
+ *	metadata, or -EIO if it cannot be written
+ */
+extern int fs_mkfs_dev(struct blkdev *dev, int ninodes);
+
+/**
+ * Look up a single directory entry in a directory.
+ *
+ * @param inum: the directory inode
+ * @param name: the entry name
+ * @return the entry inode or -ENOENT
+ */
+extern int lookup(int inum, char *name);
+
+/**
+ * Read the entries of a directory.
+ *
+ * @param inum: the directory inode
+ * @param entries: buffer for DIRENTS_PER_BLK entries
+ */
+extern void dir_read(int inum, struct fs_dirent *entries);
+
+/**
+ * Create a new file or directory entry in a directory.
+ *
+ * @param parent: the directory inode
+ * @param name: the new entry name
+ * @param mode: mode including S_IFREG or S_IFDIR
+ * @return inode of the new entry, or -error number
+ * 	-ENOTDIR  - parent not a directory
+ * 	-EEXIST   - entry already exists
+ * 	-ENOSPC   - no free inode, block or directory entry
+ */
+extern int dir_create(int parent, char *name, mode_t mode);
+
+/**
+ * Remove an entry from a directory. The inode itself is not
+ * freed; call inode_release() once it is no longer referenced.
+ *
+ * @param parent: the directory inode
+ * @param name: the entry name
+ * @param is_dir: true to remove an empty directory, false for a file
+ * @return inode of the removed entry, or -error number
+ * 	-ENOENT    - entry does not exist
+ * 	-ENOTDIR   - parent not a directory, or entry not one for is_dir
+ * 	-EISDIR    - entry is a directory and is_dir is false
+ * 	-ENOTEMPTY - directory not empty
+ */
+extern int dir_remove(int parent, char *name, bool is_dir);
+
+/**
+ * Rename an entry within a directory.
+ *
+ * @param parent: the directory inode
+ * @param src_name: the existing name
+ * @param dst_name: the new name
+ * @return 0 if successful, or -error number
+ * 	-ENOENT   - source does not exist
+ * 	-EEXIST   - destination already exists
+ */
+extern int dir_rename(int parent, char *src_name, char *dst_name);
+
+/**
+ * Free an inode removed from its directory, and its blocks.
+ *
+ * @param inum: the inode
+ */
+extern void inode_release(int inum);
+
+/**
+ * Truncate a file to zero length. Its blocks are freed in the
+ * background by the reclaimer.
+ *
+ * @param inum: the file inode
+ * @return 0 if successful, or -EISDIR
+ */
+extern int inode_truncate(int inum);
+
+/**
+ * Replace the data of a file with that of another file, sharing
+ * its data blocks. Only indirect blocks are copied; a shared data
+ * block is copied when either file writes it.
+ *
+ * @param src: the file inode to clone
+ * @param dst: the file inode to replace
+ * @return 0 if successful, or -error number
+ * 	-EISDIR   - src or dst is a directory
+ * 	-ENOSPC   - no free blocks for the indirect blocks
+ */
+extern int inode_clone(int src, int dst);
+
+/**
+ * Read data from a file.
+ *
+ * @param inum: the file inode
+ * @param buf: the buffer to keep the data
+ * @param len: the number of bytes to read
+ * @param offset: the location to start reading at
+ * @return number of bytes read, 0 at or after EOF, or -error number
+ * 	-EISDIR   - inum is a directory
+ * 	-EIO      - a data block fails its checksum
+ */
+extern int inode_read(int inum, char *buf, size_t len, off_t offset);
+
+/**
+ * Run of contiguous blocks holding part of a file.
+ */
+struct fs_extent {
+	uint32_t blk; /* first block */
+	uint32_t offset; /* byte offset of data within first block or cluster */
+	uint32_t len; /* length of data in bytes */
+	const char *mem; /* data held inline in the inode, or NULL */
+	uint32_t zblk[FS_CLUSTER_BLKS]; /* blocks of a compressed cluster, or zblk[0] is 0 */
+};
+
+/**
+ * Map a byte range of a file to runs of contiguous blocks,
+ * limited to EOF. The data of an inline file is a single extent
+ * pointing at the inode, and each compressed cluster is a single
+ * extent that extent_read decompresses.
+ *
+ * @param inum: the file inode
+ * @param offset: the location to start at
+ * @param len: the number of bytes
+ * @param ext: array for the extents
+ * @param max_ext: size of ext; len / BLOCK_SIZE + 2 always suffices
+ * @return number of extents, or -EISDIR
+ */
+extern int inode_extents(int inum, off_t offset, size_t len, struct fs_extent *ext, int max_ext);
+
+/**
+ * Allocate every block of an empty file for its final size, taking
+ * a run of contiguous free blocks if there is one. The blocks are not
+ * cleared, so the size stays 0: the caller maps them with
+ * inode_prealloc_extents(), writes the whole file with extent_write()
+ * and then sets the size with inode_prealloc_done(). Files that are
+ * compressed, deduplicated or small enough to be inline are left
+ * alone, to be written with inode_write().
+ *
+ * @param inum: the file inode
+ * @param size: the file size
+ * @return 1 if allocated, 0 if the file is left alone, or -error number
+ * 	-EISDIR   - inum is a directory
+ * 	-EFBIG    - size is larger than a file can be
+ * 	-ENOSPC   - not enough free blocks
+ */
+extern int inode_prealloc(int inum, off_t size);
+
+/**
+ * Map a byte range of a file allocated by inode_prealloc(), whose
+ * size is not yet set, to runs of contiguous blocks.
+ *
+ * @param inum: the file inode
+ * @param offset: the location to start at
+ * @param len: the number of bytes
+ * @param ext: array for the extents
+ * @param max_ext: size of ext; len / BLOCK_SIZE + 2 always suffices
+ * @return number of extents, or -error number
+ * 	-EISDIR   - inum is a directory
+ * 	-EINVAL   - the file is inline or compressed
+ */
+extern int inode_prealloc_extents(int inum, off_t offset, size_t len, struct fs_extent *ext, int max_ext);
+
+/**
+ * Set the size of a file allocated by inode_prealloc() once its data
+ * is written, making the data visible.
+ *
+ * @param inum: the file inode
+ * @param size: the file size
+ */
+extern void inode_prealloc_done(int inum, off_t size);
+
+/**
+ * Get the file descriptor and byte offset holding an extent, so
+ * its data can be spliced without a copy.
+ *
+ * @param ext: the extent
+ * @param pos: set to byte offset of the extent data
+ * @return the file descriptor, or E_UNAVAIL if not file backed
+ */
+extern int extent_fd(struct fs_extent *ext, off_t *pos);
+
+/**
+ * Read the data of an extent, with whole blocks read directly
+ * into the buffer.
+ *
+ * @param ext: the extent
+ * @param buf: buffer for ext->len bytes
+ * @return 0 if successful, or -EIO if a block fails its checksum
+ */
+extern int extent_read(struct fs_extent *ext, char *buf);
+
+/**
+ * Write the data of an extent of blocks held by a single file, as
+ * after inode_prealloc(). Only the device is accessed, so several
+ * threads may write extents of different files at once.
+ *
+ * @param ext: the extent, not inline or compressed
+ * @param buf: ext->len bytes of data
+ */
+extern void extent_write(struct fs_extent *ext, const char *buf);
+
+/**
+ * Write data to a file.
+ *
+ * @param inum: the file inode
+ * @param buf: the buffer to write
+ * @param len: the number of bytes to write
+ * @param offset: the offset to start writing at
+ * @return number of bytes written, or -error number
+ * 	-EISDIR  - file is in fact a directory
+ * 	-EINVAL  - offset is greater than current file length
+ */
+extern int inode_write(int inum, const char *buf, size_t len, off_t offset);
+
+/**
+ * Write-back buffer of an open file. Small sequential writes are
+ * collected in it and written out a block at a time.
+ */
+struct fs_wbuf {
+	int inum; /* the file inode */
+	off_t offset; /* file offset of buffered data */
+	size_t len; /* number of bytes buffered, never past a block boundary */
+	int err; /* error from a flush, reported by the next call */
+	struct fs_wbuf *next; /* next buffer on the open list */
+	char data[BLOCK_SIZE]; /* buffered data */
+};
+
+/**
+ * Create the write-back buffer for an open file.
+ *
+ * @param inum: the file inode
+ * @return the buffer
+ */
+extern struct fs_wbuf *wbuf_open(int inum);
+
+/**
+ * Write data to a file through its write-back buffer. Writes that
+ * continue the buffered data are collected until they reach a block
+ * boundary; runs of whole blocks are written directly.
+ *
+ * @param wb: the buffer
+ * @param buf: the buffer to write
+ * @param len: the number of bytes to write
+ * @param offset: the offset to start writing at
+ * @return number of bytes accepted, or -error number as for inode_write
+ */
+extern int wbuf_write(struct fs_wbuf *wb, const char *buf, size_t len, off_t offset);
+
+/**
+ * Write out the buffered data of a file.
+ *
+ * @param wb: the buffer
+ * @return 0 if successful, or -error number of a failed flush
+ */
+extern int wbuf_flush(struct fs_wbuf *wb);
+
+/**
+ * Flush and free the write-back buffer of a file being closed.
+ *
+ * @param wb: the buffer
+ * @return 0 if successful, or -error number of a failed flush
+ */
+extern int wbuf_close(struct fs_wbuf *wb);
+
+/**
+ * Flush the write-back buffers of all open files of an inode, so
+ * its size and blocks are current. Reads and truncates do this.
+ *
+ * @param inum: the file inode
+ */
+extern void wbuf_sync_inode(int inum);
+
+/**
+ * Write the inode's block of the inode table, and the inode map
+ * if an inode was taken or freed since it was last written.
+ *
+ * @param inum: the inode
+ */
+extern void update_inode(int inum);
+
+/**
+ * Keep changes to the inode table, inode map and block map in
+ * memory until flush_metadata(), so a bulk operation writes each
+ * block once instead of once per file.
+ */
+extern void defer_metadata(void);
+
+/**
+ * Write the metadata blocks changed since defer_metadata() and
+ * stop deferring.
+ */
+extern void flush_metadata(void);
+
+/**
+ * Copy stat from the hot attributes of an inode to sb.
+ *
+ * @param inum: inode to be copied from
+ * @param sb: holder to hold copied stat
+ */
+extern void cpy_stat(int inum, struct stat *sb);
+
+/**
+ * Number of blocks available to the file system.
+ */
+extern int num_fs_blk(void);
+
+/**
+ * Count number of free blocks.
+ */
+extern int num_free_blk(void);
+
+/**
+ * Number of blocks detached but not yet returned to the free list.
+ */
+extern int num_pending_blk(void);
+
+/**
+ * Keep the blocks of files from being freed and reused while a read
+ * still uses them after returning, as when the kernel splices them
+ * from the image file after the reply. Taken where the blocks are
+ * mapped, under the same lock as truncate and unlink.
+ *
+ * @return the pin, to pass to reclaim_unpin()
+ */
+extern int reclaim_pin(void);
+
+/**
+ * Release a pin taken by reclaim_pin().
+ *
+ * @param pin: the pin
+ */
+extern void reclaim_unpin(int pin);
+
+/**
+ * Sum the sizes and blocks, including indirect blocks, of files
+ * held in compressed clusters.
+ *
+ * @param size: set to the total file size in bytes
+ * @param blocks: set to the total number of blocks
+ */
+extern void compressed_usage(uint64_t *size, uint64_t *blocks);
+
+/**
+ * Create a snapshot of the file system. The snapshot is a copy of
+ * the inode map, block map and inode table; the blocks in use stay
+ * unchanged while the snapshot exists, as writes to them go to new
+ * blocks instead.
+ *
+ * @param name: the snapshot name
+ * @return 0 if successful, or -error number
+ * 	-EEXIST       - snapshot already exists
+ * 	-ENOSPC       - no free snapshot slot or blocks
+ * 	-ENAMETOOLONG - name too long
+ * 	-EROFS        - a snapshot is mounted
+ */
+extern int snap_create(const char *name);
+
+/**
+ * Delete a snapshot, freeing the blocks only it holds.
+ *
+ * @param name: the snapshot name
+ * @return 0 if successful, -ENOENT, or -EROFS
+ */
+extern int snap_delete(const char *name);
+
+/**
+ * Get the headers of the snapshots.
+ *
+ * @param snaps: array for the headers
+ * @param max: size of snaps
+ * @return the number of snapshots
+ */
+extern int snap_list(struct fs_snap *snaps, int max);
+
+/**
+ * Number of blocks free in the live file system but held by
+ * snapshots.
+ */
+extern int num_snap_blk(void);
+
+/**
+ * Write a snapshot out as a standalone image file.
+ *
+ * @param name: the snapshot name
+ * @param path: the image file to create
+ * @return 0 if successful, -ENOENT, or -errno of the image file
+ */
+extern int snap_export(const char *name, const char *path);
+
+#endif /* FSCORE_H_ */
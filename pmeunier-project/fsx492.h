@@ -11,7 +11,8 @@
 
 enum {
 	FS_BLOCK_SIZE = 1024, /* block size in bytes */
-	FS_MAGIC = 0x37363030 /* magic number for superblock */
+	FS_MAGIC = 0x37363030, /* magic number for superblock */
+	FS_SNAP_MAGIC = 0x70616e73 /* magic number for snapshot header */
 };
 
 /**
@@ -28,6 +29,7 @@ struct fs_dirent {
 /**
  * Superblock - holds file system parameters.
  */
+enum { FS_MAX_SNAPS = 8 }; /* maximum number of snapshots */
 struct fs_super {
 	uint32_t magic; /* magic number */
 	uint32_t inode_map_sz; /* inode map size in blocks */
@@ -35,7 +37,42 @@ struct fs_super {
 	uint32_t block_map_sz; /* block map size in blocks */
 	uint32_t num_blocks; /* total blocks, including SB, bitmaps, inodes */
 	uint32_t root_inode; /* always inode 1 */
-	char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; /* pad out to an entire block */
+	uint32_t flags; /* FS_SUPER_* flags */
+	uint32_t snaps[FS_MAX_SNAPS]; /* snapshot header blocks, 0 if unused */
+	char pad[FS_BLOCK_SIZE - (7 + FS_MAX_SNAPS) * sizeof(uint32_t)]; /* pad out to an entire block */
+}; /* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Superblock flags
+ *   FS_SUPER_SHARED - data blocks may be shared between files; their
+ *                     reference counts are rebuilt at mount
+ */
+enum { FS_SUPER_SHARED = 0x1 };
+
+/**
+ * Snapshot header - a snapshot is a frozen copy of the inode map,
+ * block map and inode table, in that order, in the blocks listed in
+ * the header and then in a chain of index blocks. Blocks set in the
+ * frozen block map are not changed or freed while the snapshot exists.
+ */
+enum { FS_SNAP_MAX_BLKS = (FS_BLOCK_SIZE - 40) / sizeof(uint32_t) - 1 };
+struct fs_snap {
+	uint32_t magic; /* FS_SNAP_MAGIC */
+	uint32_t ctime; /* creation time */
+	char name[FS_FILENAME_SIZE]; /* with trailing '\0' */
+	uint32_t nblks; /* blocks holding the copy */
+	uint32_t blks[FS_SNAP_MAX_BLKS]; /* the first blocks holding the copy */
+	uint32_t next; /* first index block, 0 if the header lists them all */
+}; /* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Snapshot index block - lists the blocks of the copy that follow
+ * those in the header or in the previous index block.
+ */
+enum { FS_SNAP_INDEX_BLKS = FS_BLOCK_SIZE / sizeof(uint32_t) - 1 };
+struct fs_snap_index {
+	uint32_t blks[FS_SNAP_INDEX_BLKS]; /* the next blocks holding the copy */
+	uint32_t next; /* next index block, or 0 */
 }; /* total FS_BLOCK_SIZE bytes */
 
 /**
@@ -52,9 +89,31 @@ struct fs_inode {
 	uint32_t direct[N_DIRECT]; /* direct block pointers */
 	uint32_t indir_1; /* single indirect block pointer */
 	uint32_t indir_2; /* double indirect block pointer */
-	uint32_t pad[3]; /* padding to make 64 bytes per inode */
+	uint32_t zblocks; /* blocks held by a compressed file */
+	uint32_t pad; /* padding to make 64 bytes per inode */
+	uint32_t flags; /* FS_INODE_* flags */
 }; /* total 64 bytes */
 
+/**
+ * Inode flags
+ *   FS_INODE_INLINE     - file data is held in the inode itself, in the
+ *                         FS_INLINE_SIZE bytes from direct[] through pad
+ *   FS_INODE_COMPRESSED - file data is stored in compressed clusters
+ */
+enum { FS_INODE_INLINE = 0x1, FS_INODE_COMPRESSED = 0x2 };
+enum { FS_INLINE_SIZE = (N_DIRECT + 4) * sizeof(uint32_t) };
+
+/**
+ * Compressed files are divided into clusters of FS_CLUSTER_BLKS
+ * blocks. A full cluster whose data compresses into fewer blocks is
+ * stored as a 32-bit compressed length followed by the compressed
+ * data, in the blocks of its first block pointers; its remaining
+ * block pointers are 0. Other clusters are stored uncompressed, so
+ * a cluster is compressed exactly when it has fewer blocks than its
+ * data needs.
+ */
+enum { FS_CLUSTER_BLKS = 4 };
+
 /**
  * Constants for blocks
  *   DIRENTS_PER_BLK   - number of directory entries per block
@@ -7,6 +7,7 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,12 +15,15 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <stdbool.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "blkdev.h"
+#include "stats.h"
 
 // should be defined in "string.h" but is not on macos
 extern char* strdup(const char *);
@@ -65,6 +69,8 @@ static int image_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
 
 	assert(first_blk >= 0 && first_blk+nblks <= im->nblks);
 
+	stats_add(ST_DEV_READS, 1);
+	stats_add(ST_DEV_READ_BLKS, nblks);
 	int result = pread(im->fd, buf, nblks*BLOCK_SIZE, first_blk*BLOCK_SIZE);
 
 	/* Since we already checked the address, this shouldn't
@@ -109,6 +115,8 @@ static int image_write(struct blkdev * dev, int first_blk, int nblks, void *buf)
 
 	assert(first_blk >= 0 && first_blk+nblks <= im->nblks);
 
+	stats_add(ST_DEV_WRITES, 1);
+	stats_add(ST_DEV_WRITE_BLKS, nblks);
 	int result = pwrite(im->fd, buf, nblks*BLOCK_SIZE, first_blk*BLOCK_SIZE);
 
 	/* Since we already checked the address, this shouldn't
@@ -171,13 +179,36 @@ static void image_close(struct blkdev *dev)
 	}
 }
 
+/**
+ * Map a block to the image file descriptor and its byte offset,
+ * so readers can splice from the image without copying.
+ * @param dev: the block device
+ * @param blk: the block index
+ * @param pos: set to the byte offset of the block in the image
+ * @return the file descriptor, or E_UNAVAIL if device unavailable
+*/
+static int image_map(struct blkdev *dev, int blk, off_t *pos)
+{
+	struct image_dev *im = dev->private;
+
+	/* Check whether the disk is unavailable */
+	if (im->fd == -1) {
+		return E_UNAVAIL;
+	}
+
+	assert(blk >= 0 && blk < im->nblks);
+	*pos = (off_t) blk * BLOCK_SIZE;
+	return im->fd;
+}
+
 /** Operations on this block device */
 static struct blkdev_ops image_ops = {
 	.num_blocks = image_num_blocks,
 	.read = image_read,
 	.write = image_write,
 	.flush = image_flush,
-	.close = image_close
+	.close = image_close,
+	.map = image_map
 };
 
 /**
@@ -238,3 +269,298 @@ void image_fail(struct blkdev *dev)
 	}
 	im->fd = -1;
 }
+
+/** definition of RAM block device */
+struct ram_dev {
+	char *path; // image file loaded from and written back to, or NULL
+	char *mem; // the blocks
+	size_t len; // length of the mapping
+	int   nblks; // number of blocks in device
+	bool  writeback; // write the blocks to the image file on close
+	uint64_t *dirty; // blocks changed since written back, one bit each
+};
+
+/** huge page size the RAM device is rounded up to */
+enum { RAM_HUGE_PAGE = 2 * 1024 * 1024 };
+
+static int ram_num_blocks(struct blkdev *dev)
+{
+	struct ram_dev *rd = dev->private;
+	return rd->nblks;
+}
+
+/**
+ * To read blocks from the RAM device
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS
+*/
+static int ram_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct ram_dev *rd = dev->private;
+	assert(first_blk >= 0 && first_blk+nblks <= rd->nblks);
+	stats_add(ST_DEV_READS, 1);
+	stats_add(ST_DEV_READ_BLKS, nblks);
+	memcpy(buf, rd->mem + (size_t) first_blk * BLOCK_SIZE, (size_t) nblks * BLOCK_SIZE);
+	return SUCCESS;
+}
+
+/**
+ * Mark blocks of the RAM device as changed since written back.
+ * @param rd: the RAM device state
+ * @param first_blk: index of the first block
+ * @param nblks: number of blocks
+*/
+static void ram_mark_dirty(struct ram_dev *rd, int first_blk, int nblks)
+{
+	for (int blk = first_blk; blk < first_blk + nblks; blk++) {
+		__atomic_fetch_or(&rd->dirty[blk / 64], (uint64_t) 1 << (blk % 64), __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Clear the dirty bit of a block of the RAM device, to write it back.
+ * @param rd: the RAM device state
+ * @param blk: index of the block
+ * @return true if the block was dirty
+*/
+static bool ram_claim_dirty(struct ram_dev *rd, int blk)
+{
+	uint64_t bit = (uint64_t) 1 << (blk % 64);
+	return __atomic_fetch_and(&rd->dirty[blk / 64], ~bit, __ATOMIC_ACQUIRE) & bit;
+}
+
+/**
+ * To write blocks to the RAM device
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return: SUCCESS
+*/
+static int ram_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct ram_dev *rd = dev->private;
+	assert(first_blk >= 0 && first_blk+nblks <= rd->nblks);
+	stats_add(ST_DEV_WRITES, 1);
+	stats_add(ST_DEV_WRITE_BLKS, nblks);
+	memcpy(rd->mem + (size_t) first_blk * BLOCK_SIZE, buf, (size_t) nblks * BLOCK_SIZE);
+	//marked after the copy, so a writeback that claims the block sees it
+	if (rd->writeback) {
+		ram_mark_dirty(rd, first_blk, nblks);
+	}
+	return SUCCESS;
+}
+
+/**
+ * Write a run of blocks of the RAM device to its image file.
+ * @param rd: the RAM device state
+ * @param fd: the image file
+ * @param first_blk: index of the first block
+ * @param nblks: number of blocks
+ * @return SUCCESS, or E_UNAVAIL if the image file cannot be written
+*/
+static int ram_pwrite(struct ram_dev *rd, int fd, int first_blk, int nblks)
+{
+	size_t len = (size_t) nblks * BLOCK_SIZE, done = 0;
+	off_t offset = (off_t) first_blk * BLOCK_SIZE;
+	while (done < len) {
+		ssize_t n = pwrite(fd, rd->mem + offset + done, len - done, offset + done);
+		if (n <= 0) {
+			fprintf(stderr, "write error on %s: %s\n", rd->path, strerror(errno));
+			return E_UNAVAIL;
+		}
+		done += n;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Write the changed blocks in a range of the RAM device back to its
+ * image file, in runs of adjacent blocks, and sync the file if any
+ * were written.
+ * @param rd: the RAM device state
+ * @param first_blk: index of the first block
+ * @param nblks: number of blocks
+ * @return SUCCESS, or E_UNAVAIL if the image file cannot be written
+*/
+static int ram_writeback(struct ram_dev *rd, int first_blk, int nblks)
+{
+	int fd = -1, result = SUCCESS, end = first_blk + nblks, blk = first_blk;
+	while (blk < end && result == SUCCESS) {
+		//skip words of clean blocks
+		if (blk % 64 == 0 && __atomic_load_n(&rd->dirty[blk / 64], __ATOMIC_RELAXED) == 0) {
+			blk += 64;
+			continue;
+		}
+		//writes after a block is claimed mark it again
+		int run = 0;
+		while (blk + run < end && ram_claim_dirty(rd, blk + run)) run++;
+		if (run > 0 && fd < 0 && (fd = open(rd->path, O_WRONLY | O_CREAT, 0666)) < 0) {
+			fprintf(stderr, "can't open image %s: %s\n", rd->path, strerror(errno));
+			result = E_UNAVAIL;
+		} else if (run > 0) {
+			result = ram_pwrite(rd, fd, blk, run);
+		}
+		if (result != SUCCESS) ram_mark_dirty(rd, blk, run);
+		blk += run + 1;
+	}
+	if (fd < 0) {
+		return result;
+	}
+	//blocks never written are zero, so a new file only needs its length
+	struct stat sb;
+	if (result == SUCCESS && fstat(fd, &sb) == 0 && sb.st_size < (off_t) rd->nblks * BLOCK_SIZE &&
+	    ftruncate(fd, (off_t) rd->nblks * BLOCK_SIZE) < 0) {
+		result = E_UNAVAIL;
+	}
+	if (result == SUCCESS && fsync(fd) < 0) {
+		result = E_UNAVAIL;
+	}
+	close(fd);
+	return result;
+}
+
+/**
+ * Flush the RAM device, writing the changed blocks to the image file
+ * if it writes back.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return SUCCESS, or E_UNAVAIL if the image file cannot be written
+*/
+static int ram_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct ram_dev *rd = dev->private;
+	if (!rd->writeback) {
+		return SUCCESS;
+	}
+	return ram_writeback(rd, first_blk, nblks);
+}
+
+/**
+ * Close the RAM device, writing the changed blocks back to its file
+ * if it writes back, and free its memory.
+ * @param dev: the block device
+*/
+static void ram_close(struct blkdev *dev)
+{
+	struct ram_dev *rd = dev->private;
+	if (rd->writeback) {
+		ram_writeback(rd, 0, rd->nblks);
+	}
+	munmap(rd->mem, rd->len);
+	free(rd->dirty);
+	free(rd->path);
+	free(rd);
+	free(dev);
+}
+
+/** Operations on this block device. There is no map operation, as
+ *  there is no file to splice from. */
+static struct blkdev_ops ram_ops = {
+	.num_blocks = ram_num_blocks,
+	.read = ram_read,
+	.write = ram_write,
+	.flush = ram_flush,
+	.close = ram_close,
+};
+
+/**
+ * Create a block device held in memory, loaded from an image file
+ * if it exists.
+ *
+ * @param path: the image file, or NULL for a device of empty blocks
+ * @param nblks: number of empty blocks if there is no image file
+ * @param writeback: write the blocks back to the image file on close
+ * @return the block device or NULL if the image cannot be read or
+ *   there is not enough memory
+ */
+struct blkdev *image_create_ram(char *path, int nblks, bool writeback)
+{
+	int fd = (path != NULL) ? open(path, O_RDONLY) : -1;
+	if (fd < 0 && path != NULL && errno != ENOENT) {
+		fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	struct stat sb;
+	if (fd >= 0) {
+		if (fstat(fd, &sb) < 0) {
+			fprintf(stderr, "can't access image %s: %s\n", path, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+		nblks = sb.st_size / BLOCK_SIZE;
+	}
+	if (nblks <= 0 || (writeback && path == NULL)) {
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	struct blkdev *dev = malloc(sizeof(*dev));
+	struct ram_dev *rd = calloc(1, sizeof(*rd));
+	if (dev == NULL || rd == NULL) {
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	rd->nblks = nblks;
+	rd->writeback = writeback;
+	rd->path = (path != NULL) ? strdup(path) : NULL;
+	rd->dirty = calloc(nblks / 64 + 1, sizeof(uint64_t));
+	if (rd->dirty == NULL) {
+		if (fd >= 0) close(fd);
+		free(rd->path);
+		free(rd);
+		free(dev);
+		return NULL;
+	}
+
+	/* anonymous memory is zero, so absent blocks need no clearing;
+	 * use huge pages if the system has them reserved */
+	rd->len = ((size_t) nblks * BLOCK_SIZE + RAM_HUGE_PAGE - 1) / RAM_HUGE_PAGE * RAM_HUGE_PAGE;
+	rd->mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	rd->mem = mmap(NULL, rd->len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (rd->mem == MAP_FAILED) {
+		rd->mem = mmap(NULL, rd->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+		if (rd->mem != MAP_FAILED) madvise(rd->mem, rd->len, MADV_HUGEPAGE);
+#endif
+	}
+	if (rd->mem == MAP_FAILED) {
+		fprintf(stderr, "can't allocate %zu bytes for image: %s\n", rd->len, strerror(errno));
+		if (fd >= 0) close(fd);
+		free(rd->dirty);
+		free(rd->path);
+		free(rd);
+		free(dev);
+		return NULL;
+	}
+
+	/* load the image */
+	size_t len = (size_t) nblks * BLOCK_SIZE, done = 0;
+	while (fd >= 0 && done < len) {
+		ssize_t n = pread(fd, rd->mem + done, len - done, done);
+		if (n <= 0) {
+			fprintf(stderr, "read error on %s: %s\n", path, strerror(errno));
+			close(fd);
+			munmap(rd->mem, rd->len);
+			free(rd->dirty);
+			free(rd->path);
+			free(rd);
+			free(dev);
+			return NULL;
+		}
+		done += n;
+	}
+	if (fd >= 0) close(fd);
+
+	dev->private = rd;
+	dev->ops = &ram_ops;
+
+	return dev;
+}
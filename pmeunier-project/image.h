@@ -10,6 +10,8 @@
 #ifndef IMAGE_H_
 #define IMAGE_H_
 
+#include <stdbool.h>
+
 #include "blkdev.h"
 
 /*
@@ -20,4 +22,19 @@
 */
 extern struct blkdev *image_create(char *path);
 
+/*
+ * Create a block device held in memory, in huge pages where the
+ * system has them. Its blocks are loaded from an image file if the
+ * file exists, and are empty otherwise. Reads and writes are copies
+ * to and from memory.
+ *
+ * @param path: the image file, or NULL for a device of empty blocks
+ * @param nblks: number of empty blocks if there is no image file
+ * @param writeback: write the blocks back to the image file on close
+ *   and on flush; needs a path
+ * @return: the block device or NULL if the image file cannot be read
+ *   or there is not enough memory
+*/
+extern struct blkdev *image_create_ram(char *path, int nblks, bool writeback);
+
 #endif /* IMAGE_H_ */
@@ -0,0 +1,162 @@
+/*
+ * file:        lz.c
+ * description: fast LZ77 codec in the style of LZ4, used to compress
+ *              file clusters
+ *
+ * The compressed data is a series of sequences. Each starts with a
+ * token byte whose high nibble is the literal count and low nibble
+ * the match length minus LZ_MIN_MATCH; a nibble of 15 is continued
+ * by bytes added to it until one is less than 255. The literals
+ * follow, then a two byte little-endian match offset. The last
+ * sequence has literals only and ends the data.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/** shortest match worth encoding */
+enum { LZ_MIN_MATCH = 4 };
+/** log2 of the number of match candidates kept */
+enum { LZ_HASH_BITS = 12 };
+
+/**
+ * Read four bytes for hashing and comparison.
+ */
+static uint32_t lz_read32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * Hash four bytes to a candidate table index.
+ */
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write the continuation bytes of a length over 15.
+ *
+ * @return the advanced dst, or NULL if it would pass end
+ */
+static char *lz_put_len(char *dst, char *end, int len)
+{
+	for (len -= 15; len >= 255; len -= 255) {
+		if (dst >= end) return NULL;
+		*dst++ = (char) 255;
+	}
+	if (dst >= end) return NULL;
+	*dst++ = (char) len;
+	return dst;
+}
+
+/**
+ * Write one sequence of literals and an optional match.
+ *
+ * @param mlen: match length, or 0 for the final literals-only sequence
+ * @return the advanced dst, or NULL if it would pass end
+ */
+static char *lz_put_seq(char *dst, char *end, const char *lit, int nlit, int mlen, int offset)
+{
+	if (dst >= end) return NULL;
+	char *token = dst++;
+	int mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+	*token = (char) (((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15));
+	if (nlit >= 15 && (dst = lz_put_len(dst, end, nlit)) == NULL) return NULL;
+	if (dst + nlit > end) return NULL;
+	memcpy(dst, lit, nlit);
+	dst += nlit;
+	if (mlen == 0) return dst;
+
+	if (dst + 2 > end) return NULL;
+	*dst++ = (char) (offset & 0xff);
+	*dst++ = (char) (offset >> 8);
+	if (mcode >= 15 && (dst = lz_put_len(dst, end, mcode)) == NULL) return NULL;
+	return dst;
+}
+
+int lz_compress(const char *src, int len, char *dst, int cap)
+{
+	uint16_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	char *out = dst, *end = dst + cap;
+	int anchor = 0, i = 1;
+
+	//positions are stored plus one, so 0 means no candidate
+	while (i + LZ_MIN_MATCH <= len) {
+		uint32_t v = lz_read32(src + i);
+		uint32_t h = lz_hash(v);
+		int cand = table[h] - 1;
+		table[h] = (uint16_t) (i + 1);
+		if (cand < 0 || lz_read32(src + cand) != v) {
+			i++;
+			continue;
+		}
+
+		int mlen = LZ_MIN_MATCH;
+		while (i + mlen < len && src[cand + mlen] == src[i + mlen]) {
+			mlen++;
+		}
+		out = lz_put_seq(out, end, src + anchor, i - anchor, mlen, i - cand);
+		if (out == NULL) return 0;
+		i += mlen;
+		anchor = i;
+	}
+
+	out = lz_put_seq(out, end, src + anchor, len - anchor, 0, 0);
+	return out ? (int) (out - dst) : 0;
+}
+
+/**
+ * Read the continuation bytes of a length of 15.
+ *
+ * @return the full length, or -1 if src runs out
+ */
+static int lz_get_len(const unsigned char **src, const unsigned char *end, int len)
+{
+	unsigned char b;
+	do {
+		if (*src >= end) return -1;
+		b = *(*src)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+int lz_decompress(const char *src, int len, char *dst, int cap)
+{
+	const unsigned char *in = (const unsigned char *) src, *in_end = in + len;
+	char *out = dst, *out_end = dst + cap;
+
+	while (in < in_end) {
+		int token = *in++;
+		int nlit = token >> 4;
+		if (nlit == 15 && (nlit = lz_get_len(&in, in_end, nlit)) < 0) return -1;
+		if (in + nlit > in_end || out + nlit > out_end) return -1;
+		memcpy(out, in, nlit);
+		in += nlit;
+		out += nlit;
+		if (in == in_end) break;	//final sequence
+
+		if (in + 2 > in_end) return -1;
+		int offset = in[0] | (in[1] << 8);
+		in += 2;
+		int mlen = token & 15;
+		if (mlen == 15 && (mlen = lz_get_len(&in, in_end, mlen)) < 0) return -1;
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out - dst || out + mlen > out_end) return -1;
+
+		//byte copy, as the match may overlap its own output
+		const char *match = out - offset;
+		for (int i = 0; i < mlen; i++) {
+			out[i] = match[i];
+		}
+		out += mlen;
+	}
+	return (int) (out - dst);
+}
@@ -0,0 +1,36 @@
+/*
+ * file:        lz.h
+ * description: fast LZ77 codec in the style of LZ4, used to compress
+ *              file clusters
+ */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+/** largest input the codec accepts, limited by its 16-bit offsets */
+enum { LZ_MAX_INPUT = 65535 };
+
+/**
+ * Compress a buffer.
+ *
+ * @param src: the data
+ * @param len: the number of bytes, at most LZ_MAX_INPUT
+ * @param dst: buffer for the compressed data
+ * @param cap: size of dst
+ * @return the compressed length, or 0 if it would exceed cap
+ */
+extern int lz_compress(const char *src, int len, char *dst, int cap);
+
+/**
+ * Decompress a buffer.
+ *
+ * @param src: the compressed data
+ * @param len: the compressed length
+ * @param dst: buffer for the data
+ * @param cap: size of dst
+ * @return the decompressed length, or -1 if src is malformed or
+ *   would not fit in cap
+ */
+extern int lz_decompress(const char *src, int len, char *dst, int cap);
+
+#endif /* LZ_H_ */
@@ -9,7 +9,7 @@ struct stat sb;
  * 	Philip Gust, March 2019
  */
 
-#define FUSE_USE_VERSION 27
+#define FUSE_USE_VERSION 29
 #define _XOPEN_SOURCE 500
 #define _ATFILE_SOURCE
 #define _DEFAULT_SOURCE
@@ -20,11 +20,27 @@ struct stat sb;
 #include <string.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <fuse.h>
 #include "image.h"
+#include "csum.h"
+#include "slow.h"
+#include "stripe.h"
+#include "mirror.h"
+#include "bcache.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "dedup.h"
+#include "fscore.h"
+#include "bulk.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "fsx492.h"		/* only for certain constants */
 
@@ -35,25 +51,104 @@ extern char *strdup(const char* str);
 /**
  * All functions accessed through operations structure. */
 extern struct fuse_operations fs_ops;
+/** lifetime of entries cached by readdir, see fs.c */
+extern double entry_timeout;
+/** clone a file sharing its data blocks, see fs.c */
+extern int fs_clone(const char *src_path, const char *dst_path);
+/** inode of a path, see fs.c */
+extern int fs_inum(const char *path);
 
 /**  disk block device */
 struct blkdev *disk;
 
+/** most images a file system can be striped or mirrored across */
+enum { MAX_IMAGES = 16 };
+
+/** the slow devices of the images, none if not slowed */
+static struct blkdev *slow_disks[MAX_IMAGES];
+static int n_slow;
+
+/** the checksum device under disk, or NULL if not checksummed */
+static struct blkdev *csum_disk;
+
+/** the block cache, disk itself, or NULL if not cached */
+static struct blkdev *cache_disk;
+
+/** the mirror under disk, or NULL if not mirrored */
+static struct blkdev *mirror_disk;
+static int n_mirrored;
+
 struct data {
 	char *image_name;
 	int   part;
 	int   cmd_mode;
-} _data;
+	int   ram;
+	char *stripe;
+	int   chunk;
+	char *mirror;
+	int   resync;
+	int   mkfs;
+	int   cache;
+	int   dirty_ratio;
+	int   checksum;
+	int   compress;
+	int   dedup;
+	int   prewarm;
+	char *snapshot;
+	char *batch;
+	char *timing;
+	char *trace;
+	int   latency;
+	int   jitter;
+	double bandwidth;
+	double fail_rate;
+	double attr_timeout;
+	double entry_timeout;
+} _data = { .chunk = STRIPE_CHUNK, .resync = -1, .dirty_ratio = 20, .attr_timeout = 1.0, .entry_timeout = 1.0 };
 
 /**
  * Constant: maximum path length
  */
 enum { MAX_PATH = 4096 };
 
+/**
+ * Constants: how -ram and -ram-scratch keep the image
+ */
+enum { RAM_NONE, RAM_WRITEBACK, RAM_SCRATCH };
+
+/**
+ * Constants: how -checksum and -checksum-rebuild open the checksum file
+ */
+enum { CSUM_NONE, CSUM_VERIFY, CSUM_REBUILD };
+
 static void help(){
 	printf("Arguments:\n");
 	printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
 	printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
+	printf(" -ram : Keep the image in memory and write it back at exit\n");
+	printf(" -ram-scratch : Keep the image in memory and discard the changes at exit\n");
+	printf(" -stripe <a.img,b.img...> : Stripe the file system across these images too\n");
+	printf(" -chunk <blocks> : Blocks in each stripe chunk (default 64)\n");
+	printf(" -mirror <a.img,b.img...> : Mirror the file system on these images too\n");
+	printf(" -resync <n> : Rebuild mirror image n (0 for -image) from the others\n");
+	printf(" -mkfs <inodes> : Create an empty file system with this many inodes first\n");
+	printf(" -cache <MiB> : Cache blocks in memory and write them back in the background\n");
+	printf(" -dirty-ratio <pct> : Percent of the cache that may be dirty before writes wait (default 20)\n");
+	printf(" -checksum : Verify block checksums kept in <name.img>.crc\n");
+	printf(" -checksum-rebuild : Like -checksum, building <name.img>.crc from the image first\n");
+	printf(" -compress : Store new files in compressed clusters\n");
+	printf(" -dedup : Share data blocks with identical content between files\n");
+	printf(" -prewarm : Load the inode table in the background after mount, instead of as it is used\n");
+	printf(" -snapshot <name> : Mount the named snapshot read-only\n");
+	printf(" -batch <script> : Run the commands of a script, or of stdin if '-', without their output\n");
+	printf(" -time <file.csv> : With -batch, write the time of each command to a CSV file\n");
+	printf(" -trace <file> : Record every file system operation to a trace for fsx492_replay\n");
+	printf(" -latency <usecs> : Delay every image read, write and flush\n");
+	printf(" -jitter <usecs> : Add a random delay of up to usecs to each one\n");
+	printf(" -bandwidth <MB/s> : Limit image transfers to this rate\n");
+	printf(" -fail-rate <p> : Fail image reads and writes with probability p\n");
+	printf(" -o attr_timeout=<secs> : Time the kernel caches file attributes (default 1.0)\n");
+	printf(" -o entry_timeout=<secs> : Time names are cached by the kernel and by readdir (default 1.0)\n");
 }
 
 /*
@@ -62,11 +157,36 @@ static void help(){
  *
  *  usage: ./fsx492 [-cmdline] -image test/fsx492.img <directory>
  *  		[-cmdline cmd]: optional; run the file system in cmdline mode
+ *  		[-batch script]: optional; run the commands of a script quietly
  *              <directory> - directory to mount it on
  */
 static struct fuse_opt opts[] = {
 	{"-image %s", offsetof(struct data, image_name), 0},
 	{"-cmdline", offsetof(struct data, cmd_mode), 1},
+	{"-ram", offsetof(struct data, ram), RAM_WRITEBACK},
+	{"-ram-scratch", offsetof(struct data, ram), RAM_SCRATCH},
+	{"-stripe %s", offsetof(struct data, stripe), 0},
+	{"-chunk %d", offsetof(struct data, chunk), 0},
+	{"-mirror %s", offsetof(struct data, mirror), 0},
+	{"-resync %d", offsetof(struct data, resync), 0},
+	{"-mkfs %d", offsetof(struct data, mkfs), 0},
+	{"-cache %d", offsetof(struct data, cache), 0},
+	{"-dirty-ratio %d", offsetof(struct data, dirty_ratio), 0},
+	{"-checksum", offsetof(struct data, checksum), CSUM_VERIFY},
+	{"-checksum-rebuild", offsetof(struct data, checksum), CSUM_REBUILD},
+	{"-compress", offsetof(struct data, compress), 1},
+	{"-dedup", offsetof(struct data, dedup), 1},
+	{"-prewarm", offsetof(struct data, prewarm), 1},
+	{"-snapshot %s", offsetof(struct data, snapshot), 0},
+	{"-batch %s", offsetof(struct data, batch), 0},
+	{"-time %s", offsetof(struct data, timing), 0},
+	{"-trace %s", offsetof(struct data, trace), 0},
+	{"-latency %d", offsetof(struct data, latency), 0},
+	{"-jitter %d", offsetof(struct data, jitter), 0},
+	{"-bandwidth %lf", offsetof(struct data, bandwidth), 0},
+	{"-fail-rate %lf", offsetof(struct data, fail_rate), 0},
+	{"attr_timeout=%lf", offsetof(struct data, attr_timeout), 0},
+	{"entry_timeout=%lf", offsetof(struct data, entry_timeout), 0},
 	FUSE_OPT_END
 };
 
@@ -413,6 +533,41 @@ static int do_chmod(char *argv[])
 	return fs_ops.chmod(path, mode);
 }
 
+/**
+ * Print the totals of a bulk attribute change.
+ *
+ * @param st the totals
+ */
+static void print_attr_stats(struct bulk_stats *st)
+{
+	printf("%ju files, %ju directories in %.3f s\n",
+		   (uintmax_t) st->files, (uintmax_t) st->dirs, st->secs);
+}
+
+/**
+ * Modify the mode of a directory and everything below it,
+ * with a single metadata flush.
+ *
+ * @param argv argv[0] is "-R", argv[1] is mode, argv[2] is a
+ * file or directory name
+ */
+static int do_chmod_r(char *argv[])
+{
+	if (strcmp(argv[0], "-R") != 0) {
+		return -EINVAL;
+	}
+	char path[MAX_PATH];
+	int mode = strtol(argv[1], NULL, 8);
+	int inum = fs_inum(full_path(argv[2], path));
+	if (inum < 0) {
+		return inum;
+	}
+	struct bulk_stats st;
+	int val = bulk_setattr(inum, mode, -1, &st);
+	print_attr_stats(&st);
+	return val;
+}
+
 /**
  * Rename directory.
  *
@@ -427,6 +582,20 @@ static int do_rename(char *argv[])
 	return fs_ops.rename(p1, p2);
 }
 
+/**
+ * Clone a file, sharing its data blocks.
+ *
+ * @param argv argv[0] is the file, arg[1] is the new file
+ *   relative to working directory
+ */
+static int do_clone(char *argv[])
+{
+	char p1[MAX_PATH], p2[MAX_PATH];
+	full_path(argv[0], p1);
+	full_path(argv[1], p2);
+	return fs_clone(p1, p2);
+}
+
 /**
  * Make directory.
  *
@@ -503,6 +672,67 @@ static int do_put(char *argv[])
 	return (val >= 0) ? 0 : val;
 }
 
+/** most threads used by bulk copies */
+enum { MAX_BULK_THREADS = 8 };
+
+/**
+ * Number of threads for a bulk copy: one per processor, up
+ * to MAX_BULK_THREADS.
+ */
+static int bulk_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1) ? 1 : (n > MAX_BULK_THREADS) ? MAX_BULK_THREADS : (int) n;
+}
+
+/**
+ * Print the totals of a bulk copy.
+ *
+ * @param st the totals
+ */
+static void print_bulk_stats(struct bulk_stats *st)
+{
+	printf("%ju files, %ju directories, %.1f MB in %.2f s (%.1f MB/s)",
+		   (uintmax_t) st->files, (uintmax_t) st->dirs, st->bytes / 1e6,
+		   st->secs, (st->secs > 0) ? st->bytes / 1e6 / st->secs : 0.0);
+	if (st->errors > 0) {
+		printf(", %ju failed", (uintmax_t) st->errors);
+	}
+	printf("\n");
+}
+
+/**
+ * Copy a directory tree from localdir into the file system,
+ * creating the directory if needed
+ *
+ * @param argv argv[0] is "-r", arg[1] is local directory,
+ *   argv[2] is filesystem directory name
+ */
+static int do_put_r(char *argv[])
+{
+	if (strcmp(argv[0], "-r") != 0) {
+		return -EINVAL;
+	}
+	char path[MAX_PATH];
+	full_path(argv[2], path);
+	int val = fs_ops.mkdir(path, 0777);
+	if (val != 0 && val != -EEXIST) {
+		return val;
+	}
+	int dir = fs_inum(path);
+	if (dir < 0) {
+		return dir;
+	}
+	if (!inode_is_dir(dir)) {
+		return -ENOTDIR;
+	}
+
+	struct bulk_stats st;
+	val = bulk_put(argv[1], dir, bulk_threads(), &st);
+	print_bulk_stats(&st);
+	return val;
+}
+
 /**
  * Copy a file from localdir into file system with
  * same name.
@@ -538,21 +768,47 @@ static int do_get(char *argv[])
 	if ((val = fs_ops.open(path, &info)) != 0) {
 		return val;
 	}
-	while (1) {
-		len = fs_ops.read(path, blkbuf, blksiz, offset, &info);
-		if (len >= 0) {
-			len = write(fd, blkbuf, len);
-			if (len <= 0) {
-				break;
-			}
-			offset += len;
+	//stop at EOF, or on a read or write error
+	while ((len = fs_ops.read(path, blkbuf, blksiz, offset, &info)) > 0) {
+		if (write(fd, blkbuf, len) != len) {
+			len = -EIO;
+			break;
 		}
+		offset += len;
 	}
 	close(fd);
 	fs_ops.release(path, &info);
 	return (len >= 0) ? 0 : len;
 }
 
+/**
+ * Copy a directory tree from the file system to localdir,
+ * creating the directory if needed
+ *
+ * @param argv argv[0] is "-r", arg[1] is filesystem directory
+ *   name, argv[2] is local directory
+ */
+static int do_get_r(char *argv[])
+{
+	if (strcmp(argv[0], "-r") != 0) {
+		return -EINVAL;
+	}
+	char path[MAX_PATH];
+	full_path(argv[1], path);
+	int dir = fs_inum(path);
+	if (dir < 0) {
+		return dir;
+	}
+	if (!inode_is_dir(dir)) {
+		return -ENOTDIR;
+	}
+
+	struct bulk_stats st;
+	int val = bulk_get(dir, argv[2], bulk_threads(), &st);
+	print_bulk_stats(&st);
+	return val;
+}
+
 /**
  * Copy a file from filesystem to localdir with
  * same name.
@@ -591,6 +847,157 @@ static int do_show(char *argv[])
 	return (len >= 0) ? 0 : len;
 }
 
+/**
+ * Wall clock and CPU (user + system) time in seconds.
+ */
+static void bench_clock(double *wall, double *cpu)
+{
+	struct timespec ts;
+	struct rusage ru;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	getrusage(RUSAGE_SELF, &ru);
+	*wall = ts.tv_sec + ts.tv_nsec / 1e9;
+	*cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Read a file repeatedly through the read op and the read_buf op,
+ * and print throughput and CPU time per GiB for each. read_buf
+ * buffers are copied out the way FUSE does when it cannot splice.
+ *
+ * @param argv argv[0] is file name, argv[1] is MiB to read per op,
+ *   argv[2] is the request size in KiB
+ */
+static int do_readbench(char *argv[])
+{
+	char path[MAX_PATH];
+	full_path(argv[0], path);
+	long total = atol(argv[1]) << 20;
+	int reqsiz = atoi(argv[2]) << 10;
+	if (total <= 0 || reqsiz <= 0) {
+		return -EINVAL;
+	}
+	char *reqbuf = malloc(reqsiz);
+	struct fuse_file_info info;
+	memset(&info, 0, sizeof(struct fuse_file_info));
+	int val;
+	if ((val = fs_ops.open(path, &info)) != 0) {
+		free(reqbuf);
+		return val;
+	}
+
+	for (int use_buf = 0; use_buf <= 1; use_buf++) {
+		double wall0, cpu0, wall1, cpu1;
+		long done = 0;
+		int len = 0, offset = 0;
+		bench_clock(&wall0, &cpu0);
+		while (done < total) {
+			if (use_buf) {
+				struct fuse_bufvec *src;
+				struct fuse_bufvec dst = FUSE_BUFVEC_INIT(reqsiz);
+				dst.buf[0].mem = reqbuf;
+				if ((len = fs_ops.read_buf(path, &src, reqsiz, offset, &info)) == 0) {
+					len = fuse_buf_copy(&dst, src, 0);
+					for (int i = 0; i < src->count; i++) {
+						free(src->buf[i].mem);
+					}
+					free(src);
+				}
+			} else {
+				len = fs_ops.read(path, reqbuf, reqsiz, offset, &info);
+			}
+			if (len < 0) break;
+			offset = (len == 0) ? 0 : offset + len;	// wrap at EOF
+			done += len;
+		}
+		bench_clock(&wall1, &cpu1);
+		if (len < 0) {
+			val = len;
+			break;
+		}
+		double gib = done / (double) (1 << 30);
+		printf("%-8s %8.1f MB/s %8.3f cpu s/GiB\n", use_buf ? "read_buf" : "read",
+			   done / 1e6 / (wall1 - wall0), (cpu1 - cpu0) / gib);
+	}
+	fs_ops.release(path, &info);
+	free(reqbuf);
+	return val;
+}
+
+/**
+ * Compress and decompress a buffer one cluster at a time, and print
+ * the throughput of each and the compression ratio of the blocks the
+ * file system would store.
+ *
+ * @param label name of the data
+ * @param data the data
+ * @param len its length, a multiple of the cluster size
+ */
+static void compbench_run(const char *label, const char *data, long len)
+{
+	enum { CLUSTER = FS_CLUSTER_BLKS * FS_BLOCK_SIZE };
+	long nclusters = len / CLUSTER, stored = 0, unpacked = 0;
+	char *z = malloc(len), out[CLUSTER];
+	int *zlen = malloc(nclusters * sizeof(int));
+	double wall0, cpu0, wall1, cpu1, wall2, cpu2;
+
+	bench_clock(&wall0, &cpu0);
+	for (long i = 0; i < nclusters; i++) {
+		zlen[i] = lz_compress(data + i * CLUSTER, CLUSTER, z + i * CLUSTER, CLUSTER - FS_BLOCK_SIZE - 4);
+		//the file system stores whole blocks, or the cluster raw
+		stored += zlen[i] ? (zlen[i] + 4 + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE * FS_BLOCK_SIZE : CLUSTER;
+	}
+	bench_clock(&wall1, &cpu1);
+	for (long i = 0; i < nclusters; i++) {
+		if (zlen[i] && lz_decompress(z + i * CLUSTER, zlen[i], out, CLUSTER) != CLUSTER) {
+			printf("%s: cluster %ld does not round trip\n", label, i);
+		}
+		unpacked += zlen[i] ? CLUSTER : 0;
+	}
+	bench_clock(&wall2, &cpu2);
+	//clusters stored raw are not decompressed
+	printf("%-6s compress %8.1f MB/s  decompress %8.1f MB/s  ratio %.2f  (%ld%% of clusters compressed)\n",
+		   label, len / 1e6 / (wall1 - wall0), unpacked ? unpacked / 1e6 / (wall2 - wall1) : 0.0,
+		   len / (double) stored, 100 * unpacked / len);
+	free(zlen);
+	free(z);
+}
+
+/**
+ * Measure the cluster codec on compressible text and on random data.
+ *
+ * @param argv argv[0] is MiB of each kind of data
+ */
+static int do_compbench(char *argv[])
+{
+	enum { CLUSTER = FS_CLUSTER_BLKS * FS_BLOCK_SIZE };
+	long len = atol(argv[0]) << 20;
+	if (len <= 0) {
+		return -EINVAL;
+	}
+	len -= len % CLUSTER;
+	char *data = malloc(len + 128);
+
+	//log lines with varying numbers
+	static const char *levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+	long off = 0;
+	for (unsigned i = 0; off < len; i++) {
+		off += sprintf(data + off, "2024-03-%02u 12:%02u:%02u %s worker-%u: request %u done in %u ms\n",
+					   i % 28 + 1, (i / 60) % 60, i % 60, levels[(i * 7) % 4],
+					   i % 16, i * 2654435761U % 100000, (i * 31) % 500);
+	}
+	compbench_run("text", data, len);
+
+	srandom(1);
+	for (off = 0; off < len; off++) {
+		data[off] = random();
+	}
+	compbench_run("random", data, len);
+	free(data);
+	return 0;
+}
+
 /**
  * Print filesystem statistics
  *
@@ -604,11 +1011,146 @@ static int do_statfs(char *argv[])
 		printf("block size: %lu\n", st.f_bsize);
 		printf("no. blocks: %ju\n", st.f_blocks);
 		printf("avail blocks: %ju\n", st.f_bavail);
+		printf("pending free blocks: %ju\n", st.f_bfree - st.f_bavail);
 		printf("max name length: %lu\n", st.f_namemax);
+		uint64_t zsize, zblocks;
+		compressed_usage(&zsize, &zblocks);
+		if (zblocks > 0) {
+			printf("compressed files: %ju bytes in %ju blocks, ratio %.2f\n",
+				   (uintmax_t) zsize, (uintmax_t) zblocks,
+				   zsize / (double) (zblocks * FS_BLOCK_SIZE));
+		}
+	}
+	for (int i = 0; retval == 0 && i < n_mirrored; i++) {
+		struct mirror_stats ms;
+		mirror_get_stats(mirror_disk, i, &ms);
+		printf("mirror image %d: read %.1f MB/s (%ju blocks), write %.1f MB/s (%ju blocks), "
+			   "%ju failed, %d dirty regions\n", i,
+			   ms.read_ns ? ms.read_blks * BLOCK_SIZE * 1e3 / ms.read_ns : 0.0,
+			   (uintmax_t) ms.read_blks,
+			   ms.write_ns ? ms.write_blks * BLOCK_SIZE * 1e3 / ms.write_ns : 0.0,
+			   (uintmax_t) ms.write_blks, (uintmax_t) ms.failures, ms.dirty);
+	}
+	for (int i = 0; retval == 0 && i < n_slow; i++) {
+		struct slow_stats ss;
+		slow_get_stats(slow_disks[i], &ss);
+		printf("slow device %d: %ju requests, %ju failed, %.1f ms delay\n", i,
+			   (uintmax_t) ss.ios, (uintmax_t) ss.failures, ss.delay_ns / 1e6);
+	}
+	if (retval == 0 && cache_disk != NULL) {
+		struct bcache_stats bs;
+		bcache_get_stats(cache_disk, &bs);
+		printf("block cache: %ju hits, %ju misses, %ju blocks written, %d dirty\n",
+			   (uintmax_t) bs.read_hits, (uintmax_t) bs.read_misses,
+			   (uintmax_t) bs.write_blks, bs.dirty);
+		printf("writeback: %ju blocks in %ju writes, %ju writers throttled for %.1f ms\n",
+			   (uintmax_t) bs.wb_blks, (uintmax_t) bs.wb_ios,
+			   (uintmax_t) bs.throttled, bs.throttle_ns / 1e6);
+	}
+	if (retval == 0 && csum_disk != NULL) {
+		struct csum_stats cs;
+		csum_get_stats(csum_disk, &cs);
+		printf("checksums (%s): %ju verified, %ju written, %ju mismatches\n",
+			   crc32c_impl_name(), (uintmax_t) cs.blks_verified,
+			   (uintmax_t) cs.blks_summed, (uintmax_t) cs.mismatches);
+		printf("checksum cost: %.1f%% of read time, %.1f%% of write time\n",
+			   cs.read_ns ? 100.0 * cs.verify_ns / cs.read_ns : 0.0,
+			   cs.write_ns ? 100.0 * cs.sum_ns / cs.write_ns : 0.0);
+	}
+	return retval;
+}
+
+/**
+ * Print the performance counters and operation latencies, the
+ * report also read from /.fsx492-stats when mounted
+ *
+ * @argv unused
+ */
+static int do_stats(char *argv[])
+{
+	int len = stats_format(NULL, 0);
+	char *report = malloc(len + 1);
+	stats_format(report, len + 1);
+	fputs(report, stdout);
+	free(report);
+	return 0;
+}
+
+/**
+ * Print logical and physical block usage with shared blocks, and
+ * the size of the deduplication index
+ *
+ * @argv unused
+ */
+static int do_dedup_stats(char *argv[])
+{
+	struct statvfs st;
+	int retval = fs_ops.statfs("/", &st);
+	if (retval == 0) {
+		struct dedup_stats ds;
+		dedup_get_stats(&ds);
+		uint64_t physical = st.f_blocks - st.f_bavail;
+		uint64_t logical = physical + ds.extra_refs;
+		printf("logical blocks: %ju\n", (uintmax_t) logical);
+		printf("physical blocks: %ju\n", (uintmax_t) physical);
+		printf("shared blocks: %ju, saving %ju blocks (%.1f%%)\n",
+			   (uintmax_t) ds.shared_blks, (uintmax_t) ds.extra_refs,
+			   logical ? 100.0 * ds.extra_refs / logical : 0.0);
+		printf("index: %ju entries, %.1f KiB\n", (uintmax_t) ds.entries,
+			   ds.index_bytes / 1024.0);
+		printf("lookups: %ju, hits: %ju\n", (uintmax_t) ds.lookups, (uintmax_t) ds.hits);
 	}
 	return retval;
 }
 
+/**
+ * Create a snapshot of the file system
+ *
+ * @param argv argv[0] is the snapshot name
+ */
+static int do_snapshot(char *argv[])
+{
+	return snap_create(argv[0]);
+}
+
+/**
+ * List snapshots, and the blocks only they hold
+ *
+ * @argv unused
+ */
+static int do_snapshots(char *argv[])
+{
+	struct fs_snap snaps[FS_MAX_SNAPS];
+	int n = snap_list(snaps, FS_MAX_SNAPS);
+	for (int i = 0; i < n; i++) {
+		char time[26], *lasts;
+		time_t ctime = snaps[i].ctime;
+		printf("%-27s %s\n", snaps[i].name, strtok_r(ctime_r(&ctime, time), "\n", &lasts));
+	}
+	printf("blocks held only by snapshots: %d\n", num_snap_blk());
+	return 0;
+}
+
+/**
+ * Delete a snapshot
+ *
+ * @param argv argv[0] is the snapshot name
+ */
+static int do_snap_delete(char *argv[])
+{
+	return snap_delete(argv[0]);
+}
+
+/**
+ * Write a snapshot out as an image file
+ *
+ * @param argv argv[0] is the snapshot name, argv[1] the image file
+ */
+static int do_snap_export(char *argv[])
+{
+	return snap_export(argv[0], argv[1]);
+}
+
 /**
  * Print files statistics
  *
@@ -644,6 +1186,21 @@ static void _blksiz(int size)
 	printf("read/write block size: %d\n", blksiz);
 }
 
+/**
+ * Set read/write block size used by put, get and show.
+ *
+ * @param argv argv[0] is the size in bytes
+ */
+static int do_blksiz(char *argv[])
+{
+	int size = atoi(argv[0]);
+	if (size <= 0) {
+		return -EINVAL;
+	}
+	_blksiz(size);
+	return 0;
+}
+
 /**
  * Truncate file.
  *
@@ -693,6 +1250,28 @@ static int do_touch(char *argv[])
 	return status;
 }
 
+/**
+ * Set the modification time of a directory and everything below
+ * it to the current time, with a single metadata flush.
+ *
+ * @param argv argv[0] is "-R", argv[1] is a file or directory name
+ */
+static int do_touch_r(char *argv[])
+{
+	if (strcmp(argv[0], "-R") != 0) {
+		return -EINVAL;
+	}
+	char path[MAX_PATH];
+	int inum = fs_inum(full_path(argv[1], path));
+	if (inum < 0) {
+		return inum;
+	}
+	struct bulk_stats st;
+	int val = bulk_setattr(inum, -1, time(NULL), &st);
+	print_attr_stats(&st);
+	return val;
+}
+
 /** struct serves a dispatch table for commands */
 static struct {
 	char *name;
@@ -708,23 +1287,92 @@ static struct {
 	{"ls-l", 0, do_lsdashl0, "ls-l - display detailed file listing"},
 	{"ls-l", 1, do_lsdashl1, "ls-l <file> - display detailed file info"},
 	{"chmod", 2, do_chmod, "chmod <mode> <file> - change permissions"},
+	{"chmod", 3, do_chmod_r, "chmod -R <mode> <dir> - change permissions of a directory tree"},
 	{"rename", 2, do_rename, "rename <oldname> <newname> - rename file"},
+	{"clone", 2, do_clone, "clone <file> <newfile> - copy a file, sharing its blocks"},
 	{"mkdir", 1, do_mkdir, "mkdir <dir> - create directory"},
 	{"rmdir", 1, do_rmdir, "rmdir <dir> - remove directory"},
 	{"rm", 1, do_rm, "rm <file> - remove file"},
 	{"put", 2, do_put, "put <outside> <inside> - copy a file from localdir into file system"},
+	{"put", 3, do_put_r, "put -r <outside> <inside> - copy a directory tree from localdir into file system"},
 	{"put", 1, do_put1, "put <name> - ditto, but keep the same name"},
 	{"get", 2, do_get, "get <inside> <outside> - retrieve a file from file system to local directory"},
+	{"get", 3, do_get_r, "get -r <inside> <outside> - copy a directory tree from file system to localdir"},
 	{"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
 	{"show", 1, do_show, "show <file> - retrieve and print a file"},
 	{"statfs", 0, do_statfs, "statfs - print file system info"},
+	{"snapshot", 1, do_snapshot, "snapshot <name> - create a snapshot of the file system"},
+	{"snapshots", 0, do_snapshots, "snapshots - list snapshots"},
+	{"snap-delete", 1, do_snap_delete, "snap-delete <name> - delete a snapshot"},
+	{"snap-export", 2, do_snap_export, "snap-export <name> <outside.img> - write a snapshot to an image file"},
+	{"stats", 0, do_stats, "stats - print performance counters and operation latencies"},
+	{"dedup-stats", 0, do_dedup_stats, "dedup-stats - print logical and physical usage and dedup index size"},
+	{"compbench", 1, do_compbench, "compbench <MiB> - measure compression throughput and ratio"},
+	{"readbench", 3, do_readbench, "readbench <file> <MiB> <KiB> - compare read and read_buf throughput with KiB requests"},
 	{"truncate", 1, do_truncate, "truncate <file> - truncate to zero length"},
 	{"utime", 1, do_utime, "utime <file> - set modified time to current time"},
 	{"touch", 1, do_touch, "touch <file> - create file or set modified time to current time"},
+	{"touch", 2, do_touch_r, "touch -R <dir> - set modified time of a directory tree to current time"},
 	{"stat", 1, do_stat, "stat <file> - print file info"},
+	{"blksiz", 1, do_blksiz, "blksiz <size> - set read/write block size"},
 	{0, 0, 0}
 };
 
+/** results of execute() other than 0 or -error number */
+enum { CMD_EMPTY = 1, CMD_QUIT = 2, CMD_BAD = 3 };
+
+/**
+ * Execute one command line.
+ *
+ * @param line the command line, split in place
+ * @return 0 if successful, CMD_EMPTY for an empty or comment line,
+ *   CMD_QUIT for quit or exit, CMD_BAD for an unknown command or
+ *   wrong argument count, or -error number of the command
+ */
+static int execute(char *line)
+{
+	if (line[0] == '#')	{/* comment lines */
+		return CMD_EMPTY;
+	}
+
+	// split input into command and args
+	char *args[10];
+	int i, nargs = split(line, args, 10, " \t\r\n");
+
+	// continue if empty line
+	if (nargs == 0) {
+		return CMD_EMPTY;
+	}
+
+	// quit if command is "quit" or "exit"
+	if ((strcmp(args[0], "quit") == 0) || (strcmp(args[0], "exit") == 0)) {
+		return CMD_QUIT;
+	}
+
+	// provide help if command is "help" or "?"
+	if ((strcmp(args[0], "help") == 0) || (strcmp(args[0], "?") == 0)) {
+		for (i = 0; cmds[i].name != NULL; i++) {
+			printf("%s\n", cmds[i].help);
+		}
+		return 0;
+	}
+
+	// validate command and arguments
+	for (i = 0; cmds[i].name != NULL; i++) {
+		if ((strcmp(args[0], cmds[i].name) == 0) && (nargs == cmds[i].nargs+1)) {
+			break;
+		}
+	}
+
+	// if command not recognized or incorrect arg count
+	if (cmds[i].name == NULL) {
+		return CMD_BAD;
+	}
+
+	// process command
+	return cmds[i].f(&args[1]);
+}
+
 /**
  * Command loop for interactive command interpreter.
  */
@@ -743,54 +1391,90 @@ static int cmdloop(void)
 			printf("%s", line);
 		}
 
-		if (line[0] == '#')	{/* comment lines */
-			continue;
+		char name[MAX_PATH];
+		sscanf(line, "%s", name);
+		int err = execute(line);
+		if (err == CMD_QUIT) {
+			break;
+		} else if (err == CMD_BAD) {
+			printf("bad command: %s\n", name);
+		} else if (err < 0) {
+			printf("error: %s\n", strerror(-err));
 		}
+	}
+	return 0;
+}
 
-		// split input into command and args
-		char *args[10];
-		int i, nargs = split(line, args, 10, " \t\r\n");
+/**
+ * Command loop for a script of commands. Command output is discarded;
+ * errors and a summary are printed to stderr, and the time of each
+ * command is written to a CSV file if one is given.
+ *
+ * @param in the script
+ * @param timing file for the times as line,usecs,status,command, or NULL
+ * @return 0 if every command succeeded, or 1
+ */
+static int batchloop(FILE *in, FILE *timing)
+{
+	char line[MAX_PATH], cmd[MAX_PATH];
+	int lineno = 0, ncmds = 0, nerrs = 0;
+	double start, end, cpu;
+
+	//keep stdout for the summary, send command output to /dev/null
+	fflush(stdout);
+	int out = dup(1), null = open("/dev/null", O_WRONLY);
+	if (out < 0 || null < 0 || dup2(null, 1) < 0) {
+		perror("batch");
+		return 1;
+	}
+	close(null);
 
-		// continue if empty line
-		if (nargs == 0) {
-			continue;
-		}
+	_blksiz(FS_BLOCK_SIZE);
+	update_cwd(NULL, 0);
+	if (timing != NULL) {
+		fprintf(timing, "line,usecs,status,command\n");
+	}
 
-		// quit if command is "quit" or "exit"
-		if ((strcmp(args[0], "quit") == 0) || (strcmp(args[0], "exit") == 0)) {
+	bench_clock(&start, &cpu);
+	while (fgets(line, sizeof(line), in) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		strcpy(cmd, line);
+		double t0, t1;
+		bench_clock(&t0, &cpu);
+		int err = execute(line);
+		bench_clock(&t1, &cpu);
+		if (err == CMD_QUIT) {
 			break;
-		}
-
-		// provide help if command is "help" or "?"
-		if ((strcmp(args[0], "help") == 0) || (strcmp(args[0], "?") == 0)) {
-			for (i = 0; cmds[i].name != NULL; i++) {
-				printf("%s\n", cmds[i].help);
-			}
+		} else if (err == CMD_EMPTY) {
 			continue;
 		}
-
-		// validate command and arguments
-		for (i = 0; cmds[i].name != NULL; i++) {
-			if ((strcmp(args[0], cmds[i].name) == 0) && (nargs == cmds[i].nargs+1)) {
-				break;
-			}
+		ncmds++;
+		if (err == CMD_BAD) {
+			fprintf(stderr, "line %d: bad command: %s\n", lineno, cmd);
+			nerrs++;
+		} else if (err < 0) {
+			fprintf(stderr, "line %d: %s: %s\n", lineno, cmd, strerror(-err));
+			nerrs++;
 		}
-
-		// if command not recognized or incorrect arg count
-		if (cmds[i].name == NULL) {
-			if (nargs > 0) {
-				printf("bad command: %s\n", args[0]);
+		if (timing != NULL) {
+			//quote the command, doubling any quotes in it
+			fprintf(timing, "%d,%.1f,%d,\"", lineno, (t1 - t0) * 1e6, err);
+			for (char *c = cmd; *c; c++) {
+				if (*c == '"') fputc('"', timing);
+				fputc(*c, timing);
 			}
-			continue;
-		}
-
-		// process command
-		int err = cmds[i].f(&args[1]);
-		if (err != 0) {
-			printf("error: %s\n", strerror(-err));
+			fprintf(timing, "\"\n");
 		}
 	}
-	return 0;
+	bench_clock(&end, &cpu);
+
+	fflush(stdout);
+	dup2(out, 1);
+	close(out);
+	fprintf(stderr, "%d commands, %d errors in %.3f s (%.0f commands/s)\n", ncmds, nerrs,
+		end - start, (end > start) ? ncmds / (end - start) : 0.0);
+	return (nerrs > 0) ? 1 : 0;
 }
 
 /**************/
@@ -813,6 +1497,42 @@ static void fixup(int argc, char *argv[]) {
 	}
 }
 
+/**
+ * Open an image as a block device, in memory with -ram, and slowed
+ * down if asked to. Exits if the image cannot be opened.
+ *
+ * @param file the image file
+ * @return the block device
+ */
+static struct blkdev *open_image(char *file)
+{
+	struct blkdev *dev;
+	if (_data.ram != RAM_NONE) {
+		dev = image_create_ram(file, 0, _data.ram == RAM_WRITEBACK);
+	} else {
+		dev = image_create(file);
+	}
+	if (dev == NULL) {
+		fprintf(stderr, "cannot open image file '%s': %s\n", file, strerror(errno));
+		help();
+		exit(1);
+	}
+
+	if (_data.latency > 0 || _data.jitter > 0 || _data.bandwidth > 0 || _data.fail_rate > 0) {
+		struct slow_params sp = {
+			.latency_us = _data.latency,
+			.jitter_us = _data.jitter,
+			.bandwidth = _data.bandwidth,
+			.fail_rate = _data.fail_rate,
+			.seed = 492 + n_slow,
+		};
+		if ((dev = slow_disks[n_slow++] = slow_create(dev, &sp)) == NULL) {
+			exit(1);
+		}
+	}
+	return dev;
+}
+
 int main(int argc, char **argv)
 {
 	fixup(argc, argv);
@@ -838,19 +1558,123 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	if ((disk = image_create(file)) == NULL) {
-		fprintf(stderr, "cannot open image file '%s': %s\n", file, strerror(errno));
-		help();
+	disk = open_image(file);
+
+	/** each image of a stripe or mirror is a device of its own, slowed separately */
+	if (_data.stripe != NULL && _data.mirror != NULL) {
+		fprintf(stderr, "-stripe and -mirror cannot be used together\n");
 		exit(1);
 	}
+	char *images = (_data.stripe != NULL) ? _data.stripe : _data.mirror;
+	if (images != NULL) {
+		struct blkdev *devs[MAX_IMAGES] = { disk };
+		int ndevs = 1;
+		for (char *f = strtok(images, ","); f != NULL; f = strtok(NULL, ",")) {
+			if (ndevs == MAX_IMAGES) {
+				fprintf(stderr, "too many images (at most %d)\n", MAX_IMAGES);
+				exit(1);
+			}
+			devs[ndevs++] = open_image(f);
+		}
+		if (_data.stripe != NULL && (disk = stripe_create(devs, ndevs, _data.chunk)) == NULL) {
+			fprintf(stderr, "cannot stripe the images in chunks of %d blocks\n", _data.chunk);
+			exit(1);
+		}
+		if (_data.mirror != NULL) {
+			if (_data.resync >= ndevs) {
+				fprintf(stderr, "no mirror image %d to resync\n", _data.resync);
+				exit(1);
+			}
+			if ((disk = mirror_disk = mirror_create(devs, ndevs, _data.resync)) == NULL) {
+				exit(1);
+			}
+			n_mirrored = ndevs;
+		}
+	}
+
+	if (_data.checksum) {
+		char crc_path[strlen(file) + 5];
+		sprintf(crc_path, "%s.crc", file);
+		if ((disk = csum_disk = csum_create(disk, crc_path, _data.checksum == CSUM_REBUILD)) == NULL) {
+			exit(1);
+		}
+	}
+
+	if (_data.cache > 0) {
+		struct bcache_params bp = {
+			.nblks = _data.cache * (1024 * 1024 / BLOCK_SIZE),
+			.dirty_ratio = _data.dirty_ratio,
+			.expire_ms = 1000,
+		};
+		if ((disk = cache_disk = bcache_create(disk, &bp)) == NULL) {
+			fprintf(stderr, "cannot create a cache of %d MiB with dirty ratio %d%%\n",
+				_data.cache, _data.dirty_ratio);
+			exit(1);
+		}
+	}
+
+	if (_data.mkfs > 0) {
+		int err = fs_mkfs_dev(disk, _data.mkfs);
+		if (err < 0) {
+			fprintf(stderr, "cannot create a file system on '%s': %s\n", file, strerror(-err));
+			exit(1);
+		}
+	}
+
+	entry_timeout = _data.entry_timeout;
+	fs_compress = _data.compress;
+	fs_dedup = _data.dedup;
+	fs_prewarm = _data.prewarm;
+	fs_snapshot = _data.snapshot;
+
+	if (_data.trace != NULL) {
+		int err = trace_start(_data.trace);
+		if (err < 0) {
+			fprintf(stderr, "cannot create trace '%s': %s\n", _data.trace, strerror(-err));
+			exit(1);
+		}
+	}
+
+	if (_data.batch != NULL) {  /* process a command script */
+		FILE *in = (strcmp(_data.batch, "-") == 0) ? stdin : fopen(_data.batch, "r");
+		FILE *timing = (_data.timing != NULL) ? fopen(_data.timing, "w") : NULL;
+		if (in == NULL || (_data.timing != NULL && timing == NULL)) {
+			perror((in == NULL) ? _data.batch : _data.timing);
+			exit(1);
+		}
+		fs_ops.init(NULL);
+		int res = batchloop(in, timing);
+		fs_ops.destroy(NULL);
+		disk->ops->close(disk);
+		trace_stop();
+		if (timing != NULL) {
+			fclose(timing);
+		}
+		return res;
+	}
 
 	if (_data.cmd_mode) {  /* process interactive commands */
 		fs_ops.init(NULL);
 		_blksiz(FS_BLOCK_SIZE);
 		cmdloop();
+		fs_ops.destroy(NULL);
+		disk->ops->close(disk);
+		trace_stop();
 		return 0;
 	}
 
+	/** pass the cache timeouts on to fuse */
+	char timeouts[80];
+	snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%g,entry_timeout=%g",
+		 _data.attr_timeout, _data.entry_timeout);
+	fuse_opt_add_arg(&args, timeouts);
+	if (fs_snapshot != NULL) {
+		fuse_opt_add_arg(&args, "-oro");
+	}
+
 	/** pass control to fuse */
-	return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+	int res = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+	disk->ops->close(disk);
+	trace_stop();
+	return res;
 }
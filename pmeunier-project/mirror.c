@@ -0,0 +1,612 @@
+/*
+ * file:        mirror.c
+ * description: block device mirroring its blocks on several other
+ *              block devices, reading from the least busy one and
+ *              resynchronizing stale devices in the background
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "mirror.h"
+
+/** a write of the mirror, done on every device */
+struct mirror_io {
+	int first_blk; // first block
+	int nblks; // number of blocks
+	void *buf; // data of the blocks
+	int pending; // devices still writing
+	int ok; // devices that succeeded
+	int result; // an error of a device
+	pthread_cond_t done; // signaled when pending drops to 0
+};
+
+/** the write queued for one device */
+struct mirror_part {
+	struct mirror_io *io;
+	struct mirror_part *next;
+};
+
+/** a device of the mirror and the thread writing to it */
+struct mirror_member {
+	struct mirror_dev *md; // the mirror
+	struct blkdev *dev; // the device
+	pthread_t thread; // does the queued writes, not started for the first device
+	bool started; // the thread is running
+	pthread_cond_t cond; // signaled when a write is queued or on stop
+	struct mirror_part *head, **tail; // queued writes
+	int inflight; // requests in progress on the device
+	uint8_t *dirty; // regions out of sync
+	struct mirror_stats stats; // counters
+};
+
+/** definition of mirror block device */
+struct mirror_dev {
+	struct mirror_member *members; // the devices
+	int nmembers; // number of devices
+	int nblks; // blocks of the mirror
+	int nregions; // regions in a dirty-region bitmap
+	int *writing; // writes in progress in each region
+	int sync_region; // region being resynced, or -1
+	unsigned next; // device to try first on a read
+	bool stop; // the threads are to exit
+	pthread_t resync; // copies dirty regions
+	bool resync_started; // the resync thread is running
+	pthread_cond_t resync_cond; // signaled when a region is dirtied or on stop
+	pthread_cond_t sync_done; // signaled when a region is resynced
+	pthread_mutex_t lock; // protects all of the above, and the members
+};
+
+/**
+ * Current monotonic time in nanoseconds.
+ */
+static uint64_t mirror_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Mark the regions of a range of blocks dirty on a device. Called
+ * with the lock held.
+ * @param md: the mirror
+ * @param m: the device
+ * @param first_blk: first block of the range
+ * @param nblks: number of blocks
+*/
+static void mirror_dirty(struct mirror_dev *md, struct mirror_member *m, int first_blk, int nblks)
+{
+	for (int r = first_blk / MIRROR_REGION; r <= (first_blk + nblks - 1) / MIRROR_REGION; r++) {
+		if (!m->dirty[r]) {
+			m->dirty[r] = 1;
+			m->stats.dirty++;
+		}
+	}
+	pthread_cond_signal(&md->resync_cond);
+}
+
+/**
+ * Whether a device has all the regions of a range of blocks in sync.
+ * Called with the lock held.
+*/
+static bool mirror_clean(struct mirror_member *m, int first_blk, int nblks)
+{
+	if (m->stats.dirty == 0) {
+		return true;
+	}
+	for (int r = first_blk / MIRROR_REGION; r <= (first_blk + nblks - 1) / MIRROR_REGION; r++) {
+		if (m->dirty[r]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Mark the regions that a successful write to a device covered whole
+ * back in sync there, unless another write in the region is in
+ * progress and might have failed on the device. Called with the lock
+ * held.
+ * @param md: the mirror
+ * @param m: the device
+ * @param first_blk: first block written
+ * @param nblks: number of blocks written
+*/
+static void mirror_rewritten(struct mirror_dev *md, struct mirror_member *m, int first_blk, int nblks)
+{
+	for (int r = (first_blk + MIRROR_REGION - 1) / MIRROR_REGION; m->stats.dirty > 0 && r < md->nregions; r++) {
+		int end = ((r + 1) * MIRROR_REGION < md->nblks) ? (r + 1) * MIRROR_REGION : md->nblks;
+		if (end > first_blk + nblks) {
+			break;
+		}
+		if (m->dirty[r] && md->writing[r] == 1) {
+			m->dirty[r] = 0;
+			m->stats.dirty--;
+		}
+	}
+}
+
+/**
+ * Write a request to one device, counting it and marking the regions
+ * dirty if it fails, or in sync if it rewrote them whole.
+ * @param md: the mirror
+ * @param m: the device
+ * @param io: the write
+*/
+static void mirror_write_one(struct mirror_dev *md, struct mirror_member *m, struct mirror_io *io)
+{
+	uint64_t t0 = mirror_now();
+	int result = m->dev->ops->write(m->dev, io->first_blk, io->nblks, io->buf);
+	uint64_t t1 = mirror_now();
+
+	pthread_mutex_lock(&md->lock);
+	m->inflight--;
+	m->stats.writes++;
+	m->stats.write_blks += io->nblks;
+	m->stats.write_ns += t1 - t0;
+	if (result < 0) {
+		m->stats.failures++;
+		mirror_dirty(md, m, io->first_blk, io->nblks);
+		io->result = result;
+	} else {
+		io->ok++;
+		mirror_rewritten(md, m, io->first_blk, io->nblks);
+	}
+	if (--io->pending == 0) {
+		pthread_cond_signal(&io->done);
+	}
+	pthread_mutex_unlock(&md->lock);
+}
+
+/**
+ * Thread of a device, doing the writes queued for it until the
+ * mirror is closed.
+ * @param arg: the device
+*/
+static void *mirror_thread(void *arg)
+{
+	struct mirror_member *m = arg;
+	struct mirror_dev *md = m->md;
+	pthread_mutex_lock(&md->lock);
+	for (;;) {
+		while (m->head == NULL && !md->stop) {
+			pthread_cond_wait(&m->cond, &md->lock);
+		}
+		if (m->head == NULL) {
+			break;
+		}
+		struct mirror_part *p = m->head;
+		if ((m->head = p->next) == NULL) {
+			m->tail = &m->head;
+		}
+		pthread_mutex_unlock(&md->lock);
+		mirror_write_one(md, m, p->io);
+		pthread_mutex_lock(&md->lock);
+	}
+	pthread_mutex_unlock(&md->lock);
+	return NULL;
+}
+
+/**
+ * Find a dirty region of a device that another device has in sync.
+ * A region dirty on every device, after a write that failed on all
+ * of them, has no newer copy anywhere; the device with the fewest
+ * dirty regions is taken as in sync there, so that the region can be
+ * read again and the others are copied from it. Called with the lock
+ * held.
+ * @param md: the mirror
+ * @param dst: set to the device to copy to
+ * @param src: set to the device to copy from
+ * @return: the region, or -1 if there is none
+*/
+static int mirror_find_dirty(struct mirror_dev *md, struct mirror_member **dst, struct mirror_member **src)
+{
+	for (int i = 0; i < md->nmembers; i++) {
+		struct mirror_member *m = &md->members[i];
+		for (int r = 0; m->stats.dirty > 0 && r < md->nregions; r++) {
+			if (!m->dirty[r]) continue;
+			struct mirror_member *best = m;
+			for (int j = 0; j < md->nmembers; j++) {
+				struct mirror_member *o = &md->members[j];
+				if (j != i && !o->dirty[r]) {
+					*dst = m;
+					*src = o;
+					return r;
+				}
+				if (o->stats.dirty < best->stats.dirty) {
+					best = o;
+				}
+			}
+			best->dirty[r] = 0;
+			best->stats.dirty--;
+			if (best != m) {
+				*dst = m;
+				*src = best;
+				return r;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * Thread copying dirty regions from a device in sync, until the
+ * mirror is closed. Writes to the region being copied wait for the
+ * copy, and the copy waits for the writes already in progress there,
+ * so that it cannot overwrite newer data. After a failure it waits a
+ * second before trying again.
+ * @param arg: the mirror
+*/
+static void *mirror_resync_thread(void *arg)
+{
+	struct mirror_dev *md = arg;
+	char *buf = malloc((size_t) MIRROR_REGION * BLOCK_SIZE);
+	if (buf == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&md->lock);
+	while (!md->stop) {
+		struct mirror_member *dst, *src;
+		int r = mirror_find_dirty(md, &dst, &src);
+		if (r < 0) {
+			pthread_cond_wait(&md->resync_cond, &md->lock);
+			continue;
+		}
+		md->sync_region = r;
+		while (md->writing[r] > 0) {
+			pthread_cond_wait(&md->sync_done, &md->lock);
+		}
+		src->inflight++;
+		dst->inflight++;
+		pthread_mutex_unlock(&md->lock);
+
+		int first = r * MIRROR_REGION;
+		int n = (first + MIRROR_REGION > md->nblks) ? md->nblks - first : MIRROR_REGION;
+		uint64_t t0 = mirror_now();
+		int rresult = src->dev->ops->read(src->dev, first, n, buf);
+		uint64_t t1 = mirror_now();
+		int wresult = (rresult < 0) ? rresult : dst->dev->ops->write(dst->dev, first, n, buf);
+		uint64_t t2 = mirror_now();
+
+		pthread_mutex_lock(&md->lock);
+		src->inflight--;
+		dst->inflight--;
+		src->stats.read_ns += t1 - t0;
+		src->stats.read_blks += n;
+		src->stats.reads++;
+		if (rresult < 0) {
+			src->stats.failures++;
+		} else {
+			dst->stats.write_ns += t2 - t1;
+			dst->stats.write_blks += n;
+			dst->stats.writes++;
+		}
+		if (wresult == SUCCESS) {
+			//a write may have brought it in sync in the meantime
+			if (dst->dirty[r]) {
+				dst->dirty[r] = 0;
+				dst->stats.dirty--;
+			}
+			dst->stats.resynced++;
+		} else if (rresult == SUCCESS) {
+			dst->stats.failures++;
+		}
+		md->sync_region = -1;
+		pthread_cond_broadcast(&md->sync_done);
+		if (wresult < 0 && !md->stop) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&md->resync_cond, &md->lock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&md->lock);
+	free(buf);
+	return NULL;
+}
+
+/**
+ * To count the number of blocks on the device
+ * @param dev: the block device
+ * @return: the number of blocks in the mirror
+*/
+static int mirror_num_blocks(struct blkdev *dev)
+{
+	struct mirror_dev *md = dev->private;
+	return md->nblks;
+}
+
+/**
+ * Read blocks from the device with the fewest requests in progress
+ * that has them in sync, trying the others if it fails.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS if successful, E_BADADDR if outside the mirror,
+ *   or the error of the last device tried
+*/
+static int mirror_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct mirror_dev *md = dev->private;
+	if (first_blk < 0 || nblks < 0 || first_blk + nblks > md->nblks) {
+		return E_BADADDR;
+	}
+	if (nblks == 0) {
+		return SUCCESS;
+	}
+	int result = E_UNAVAIL;
+	pthread_mutex_lock(&md->lock);
+	unsigned start = md->next++;
+	for (;;) {
+		//ties go to the devices in turn
+		struct mirror_member *best = NULL;
+		for (int i = 0; i < md->nmembers; i++) {
+			struct mirror_member *m = &md->members[(start + i) % md->nmembers];
+			if (mirror_clean(m, first_blk, nblks) && (best == NULL || m->inflight < best->inflight)) {
+				best = m;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		best->inflight++;
+		pthread_mutex_unlock(&md->lock);
+		uint64_t t0 = mirror_now();
+		result = best->dev->ops->read(best->dev, first_blk, nblks, buf);
+		uint64_t t1 = mirror_now();
+		pthread_mutex_lock(&md->lock);
+		best->inflight--;
+		best->stats.reads++;
+		best->stats.read_blks += nblks;
+		best->stats.read_ns += t1 - t0;
+		if (result == SUCCESS) {
+			break;
+		}
+		//do not read it there again until it has been rewritten
+		best->stats.failures++;
+		mirror_dirty(md, best, first_blk, nblks);
+	}
+	pthread_mutex_unlock(&md->lock);
+	return result;
+}
+
+/**
+ * Write blocks to all the devices of the mirror. The writes to all
+ * devices but the first are queued to their threads, and the calling
+ * thread writes to the first itself.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return SUCCESS if any device succeeded, E_BADADDR if outside the
+ *   mirror, or the error of a device
+*/
+static int mirror_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct mirror_dev *md = dev->private;
+	if (first_blk < 0 || nblks < 0 || first_blk + nblks > md->nblks) {
+		return E_BADADDR;
+	}
+	if (nblks == 0) {
+		return SUCCESS;
+	}
+	struct mirror_io io = {
+		.first_blk = first_blk, .nblks = nblks, .buf = buf,
+		.pending = md->nmembers, .result = SUCCESS,
+	};
+	struct mirror_part parts[md->nmembers];
+	int r0 = first_blk / MIRROR_REGION, r1 = (first_blk + nblks - 1) / MIRROR_REGION;
+
+	pthread_mutex_lock(&md->lock);
+	//wait for a resync copying one of the regions
+	while (md->sync_region >= r0 && md->sync_region <= r1) {
+		pthread_cond_wait(&md->sync_done, &md->lock);
+	}
+	for (int r = r0; r <= r1; r++) {
+		md->writing[r]++;
+	}
+	pthread_cond_init(&io.done, NULL);
+	for (int i = 0; i < md->nmembers; i++) {
+		md->members[i].inflight++;
+	}
+	for (int i = 1; i < md->nmembers; i++) {
+		struct mirror_member *m = &md->members[i];
+		parts[i].io = &io;
+		parts[i].next = NULL;
+		*m->tail = &parts[i];
+		m->tail = &parts[i].next;
+		pthread_cond_signal(&m->cond);
+	}
+	pthread_mutex_unlock(&md->lock);
+
+	mirror_write_one(md, &md->members[0], &io);
+
+	pthread_mutex_lock(&md->lock);
+	while (io.pending > 0) {
+		pthread_cond_wait(&io.done, &md->lock);
+	}
+	for (int r = r0; r <= r1; r++) {
+		md->writing[r]--;
+	}
+	if (md->sync_region >= r0 && md->sync_region <= r1) {
+		pthread_cond_broadcast(&md->sync_done);
+	}
+	pthread_mutex_unlock(&md->lock);
+	pthread_cond_destroy(&io.done);
+	return (io.ok > 0) ? SUCCESS : io.result;
+}
+
+/**
+ * Flush all the devices of the mirror. The range is marked dirty on
+ * a device that fails to flush, as its data may not be durable.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return: SUCCESS if any device succeeded, or the error of a device
+*/
+static int mirror_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct mirror_dev *md = dev->private;
+	int result = E_UNAVAIL;
+	bool ok = false;
+	int end = (first_blk + nblks < md->nblks) ? first_blk + nblks : md->nblks;
+	for (int i = 0; i < md->nmembers; i++) {
+		struct mirror_member *m = &md->members[i];
+		int r = m->dev->ops->flush(m->dev, first_blk, nblks);
+		if (r == SUCCESS) {
+			ok = true;
+			continue;
+		}
+		result = r;
+		pthread_mutex_lock(&md->lock);
+		m->stats.failures++;
+		if (first_blk >= 0 && end > first_blk) {
+			mirror_dirty(md, m, first_blk, end - first_blk);
+		}
+		pthread_mutex_unlock(&md->lock);
+	}
+	return ok ? SUCCESS : result;
+}
+
+/**
+ * Stop the threads of a mirror that are running and free it.
+ * @param dev: the block device
+ * @param md: the mirror, with the lock and conditions initialized
+ * @param close_devs: close the devices too
+*/
+static void mirror_free(struct blkdev *dev, struct mirror_dev *md, bool close_devs)
+{
+	pthread_mutex_lock(&md->lock);
+	md->stop = true;
+	pthread_cond_signal(&md->resync_cond);
+	for (int i = 0; i < md->nmembers; i++) {
+		pthread_cond_signal(&md->members[i].cond);
+	}
+	pthread_mutex_unlock(&md->lock);
+	if (md->resync_started) {
+		pthread_join(md->resync, NULL);
+	}
+	for (int i = 0; i < md->nmembers; i++) {
+		struct mirror_member *m = &md->members[i];
+		if (m->started) {
+			pthread_join(m->thread, NULL);
+		}
+		if (close_devs) {
+			m->dev->ops->close(m->dev);
+		}
+		pthread_cond_destroy(&m->cond);
+		free(m->dirty);
+	}
+	pthread_cond_destroy(&md->resync_cond);
+	pthread_cond_destroy(&md->sync_done);
+	pthread_mutex_destroy(&md->lock);
+	free(md->writing);
+	free(md->members);
+	free(md);
+	free(dev);
+}
+
+/**
+ * Stop the threads and close the devices of the mirror. Regions
+ * still dirty stay out of sync.
+ * @param dev: the block device
+*/
+static void mirror_close(struct blkdev *dev)
+{
+	mirror_free(dev, dev->private, true);
+}
+
+/** Operations on this block device. There is no map operation, as
+ *  a block is not in one file. */
+static struct blkdev_ops mirror_ops = {
+	.num_blocks = mirror_num_blocks,
+	.read = mirror_read,
+	.write = mirror_write,
+	.flush = mirror_flush,
+	.close = mirror_close,
+};
+
+struct blkdev *mirror_create(struct blkdev **devs, int ndevs, int stale)
+{
+	if (ndevs < 1 || stale >= ndevs)
+		return NULL;
+
+	int nblks = -1;
+	for (int i = 0; i < ndevs; i++) {
+		int n = devs[i]->ops->num_blocks(devs[i]);
+		if (nblks < 0 || n < nblks) nblks = n;
+	}
+	if (nblks <= 0)
+		return NULL;
+
+	struct blkdev *dev = malloc(sizeof(*dev));
+	struct mirror_dev *md = calloc(1, sizeof(*md));
+	struct mirror_member *members = calloc(ndevs, sizeof(*members));
+	int nregions = (nblks + MIRROR_REGION - 1) / MIRROR_REGION;
+	int *writing = calloc(nregions, sizeof(*writing));
+
+	if (dev == NULL || md == NULL || members == NULL || writing == NULL) {
+		free(writing);
+		free(members);
+		free(md);
+		free(dev);
+		return NULL;
+	}
+
+	md->members = members;
+	md->nmembers = ndevs;
+	md->nblks = nblks;
+	md->nregions = nregions;
+	md->writing = writing;
+	md->sync_region = -1;
+	pthread_mutex_init(&md->lock, NULL);
+	pthread_cond_init(&md->resync_cond, NULL);
+	pthread_cond_init(&md->sync_done, NULL);
+	bool ok = true;
+	for (int i = 0; i < ndevs; i++) {
+		struct mirror_member *m = &members[i];
+		m->md = md;
+		m->dev = devs[i];
+		m->tail = &m->head;
+		pthread_cond_init(&m->cond, NULL);
+		ok &= (m->dirty = calloc(nregions, 1)) != NULL;
+	}
+	if (ok && stale >= 0) {
+		mirror_dirty(md, &members[stale], 0, nblks);
+	}
+	//the first device is written by the caller of mirror_write
+	for (int i = 1; ok && i < ndevs; i++) {
+		ok = members[i].started = (pthread_create(&members[i].thread, NULL, mirror_thread, &members[i]) == 0);
+	}
+	if (ok) {
+		ok = md->resync_started = (pthread_create(&md->resync, NULL, mirror_resync_thread, md) == 0);
+	}
+	if (!ok) {
+		mirror_free(dev, md, false);
+		return NULL;
+	}
+
+	dev->private = md;
+	dev->ops = &mirror_ops;
+
+	return dev;
+}
+
+int mirror_get_stats(struct blkdev *dev, int member, struct mirror_stats *st)
+{
+	struct mirror_dev *md = dev->private;
+	if (member < 0 || member >= md->nmembers)
+		return -1;
+	pthread_mutex_lock(&md->lock);
+	*st = md->members[member].stats;
+	pthread_mutex_unlock(&md->lock);
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * file:        mirror.h
+ * description: block device mirroring its blocks on several other
+ *              block devices, reading from the least busy one
+ */
+
+#ifndef MIRROR_H_
+#define MIRROR_H_
+
+#include <stdint.h>
+
+#include "blkdev.h"
+
+/** blocks in a region of the dirty-region bitmaps */
+enum { MIRROR_REGION = 1024 };
+
+/** counters of one device of a mirror */
+struct mirror_stats {
+	uint64_t reads; /* reads served by the device */
+	uint64_t read_blks; /* blocks read */
+	uint64_t read_ns; /* time in reads */
+	uint64_t writes; /* writes, including resync writes */
+	uint64_t write_blks; /* blocks written */
+	uint64_t write_ns; /* time in writes */
+	uint64_t failures; /* reads and writes that failed */
+	uint64_t resynced; /* regions copied to the device */
+	int dirty; /* regions not yet in sync */
+};
+
+/*
+ * Create a block device mirrored on several devices (RAID-1). Writes
+ * go to all the devices in parallel, each by a thread of its device,
+ * and succeed if any device succeeds. Each read goes to the device
+ * with the fewest requests in progress, and is retried on another
+ * device if it fails.
+ *
+ * A device that fails a write, or is named stale, has the regions it
+ * missed marked in its dirty-region bitmap and is not read there. A
+ * background thread copies the dirty regions from a device in sync.
+ * The bitmaps are kept in memory only. The mirror is as long as the
+ * shortest device; the devices are closed with it.
+ *
+ * @param devs: the devices
+ * @param ndevs: number of devices
+ * @param stale: index of a device to rebuild from the others, or -1
+ * @return: the block device, or NULL if there are no devices or out
+ *   of memory
+ */
+extern struct blkdev *mirror_create(struct blkdev **devs, int ndevs, int stale);
+
+/*
+ * Get the counters of a device of a mirror.
+ *
+ * @param dev: the mirror device
+ * @param member: index of the device in the mirror
+ * @param st: set to the counters
+ * @return: 0, or -1 if there is no such device
+ */
+extern int mirror_get_stats(struct blkdev *dev, int member, struct mirror_stats *st);
+
+#endif /* MIRROR_H_ */
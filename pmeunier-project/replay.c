@@ -0,0 +1,318 @@
+/*
+ * file:        replay.c
+ * description: replay a trace of file system operations, recorded
+ *              with fsx492 -trace, against a fresh image, and report
+ *              the latency of each kind of operation
+ *
+ *  usage: ./fsx492_replay [-max] [-image <base.img>] [-dir <dir>] <trace>
+ */
+
+#define FUSE_USE_VERSION 29
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "fscore.h"
+#include "image.h"
+#include "stats.h"
+#include "trace.h"
+
+/** file system operations, see fs.c */
+extern struct fuse_operations fs_ops;
+
+/** disk block device used by fs_ops */
+struct blkdev *disk;
+
+enum {
+	MAX_PATH = 4096,
+	REPLAY_BLKS = 65536, /* blocks of a fresh image, 64 MiB */
+	REPLAY_INODES = 1024, /* inodes of a fresh image */
+};
+
+/** file opened during the replay for a handle of the trace */
+struct replay_file {
+	uint64_t fh; /* handle in the trace */
+	struct fuse_file_info fi; /* file info of the replay */
+};
+
+/** files open during the replay */
+static struct replay_file *files;
+static int nfiles, files_cap;
+
+/** data written by replayed writes */
+static char *wdata;
+static size_t wdata_len;
+
+/**
+ * Add a file opened during the replay for a handle of the trace.
+ *
+ * @param fh: the handle in the trace
+ * @param fi: the file info of the replay
+ * @return the file info in the table
+ */
+static struct fuse_file_info *replay_add(uint64_t fh, struct fuse_file_info *fi)
+{
+	if (nfiles == files_cap) {
+		files_cap = files_cap ? 2 * files_cap : 64;
+		files = realloc(files, files_cap * sizeof(*files));
+		if (files == NULL) exit(1);
+	}
+	files[nfiles].fh = fh;
+	files[nfiles].fi = *fi;
+	return &files[nfiles++].fi;
+}
+
+/**
+ * Find the replay file of a handle of the trace. Files opened before
+ * tracing started are opened by path when first used.
+ *
+ * @param fh: the handle in the trace
+ * @param path: the file path
+ * @return the file info, or NULL if the file cannot be opened
+ */
+static struct fuse_file_info *replay_fi(uint64_t fh, const char *path)
+{
+	for (int i = 0; i < nfiles; i++) {
+		if (files[i].fh == fh) return &files[i].fi;
+	}
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	if (fs_ops.open(path, &fi) != 0) return NULL;
+	return replay_add(fh, &fi);
+}
+
+/**
+ * Forget the replay file of a handle of the trace.
+ */
+static void replay_forget(uint64_t fh)
+{
+	for (int i = 0; i < nfiles; i++) {
+		if (files[i].fh == fh) {
+			files[i] = files[--nfiles];
+			return;
+		}
+	}
+}
+
+/** data of a write of len bytes */
+static char *write_data(size_t len)
+{
+	if (len > wdata_len) {
+		wdata = realloc(wdata, len);
+		if (wdata == NULL) exit(1);
+		for (size_t i = wdata_len; i < len; i++) wdata[i] = (char) (i * 7);
+		wdata_len = len;
+	}
+	return wdata;
+}
+
+/** count the entries passed to a readdir filler */
+static int count_filler(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+	(*(int *) ptr)++;
+	return 0;
+}
+
+/**
+ * Replay one operation through fs_ops, whose wrappers record its
+ * latency in the performance counters.
+ *
+ * @param rec: the operation
+ * @param path: its path
+ * @param path2: its second path
+ * @return its result
+ */
+static int replay_op(struct trace_rec *rec, const char *path, const char *path2)
+{
+	struct fuse_file_info dfi, *fi;
+	struct stat sb;
+	struct statvfs st;
+	int res, n = 0;
+
+	memset(&dfi, 0, sizeof(dfi));
+	switch (rec->op) {
+	case OP_GETATTR:
+		return fs_ops.getattr(path, &sb);
+	case OP_OPENDIR:
+		return fs_ops.opendir(path, &dfi);
+	case OP_READDIR:
+		return fs_ops.readdir(path, &n, count_filler, rec->offset, &dfi);
+	case OP_RELEASEDIR:
+		return fs_ops.releasedir(path, &dfi);
+	case OP_MKNOD:
+		return fs_ops.mknod(path, rec->mode, 0);
+	case OP_MKDIR:
+		return fs_ops.mkdir(path, rec->mode);
+	case OP_UNLINK:
+		return fs_ops.unlink(path);
+	case OP_RMDIR:
+		return fs_ops.rmdir(path);
+	case OP_RENAME:
+		return fs_ops.rename(path, path2);
+	case OP_CHMOD:
+		return fs_ops.chmod(path, rec->mode);
+	case OP_UTIME: {
+		struct utimbuf ut = { .actime = rec->offset, .modtime = rec->offset };
+		return fs_ops.utime(path, (rec->offset < 0) ? NULL : &ut);
+	}
+	case OP_TRUNCATE:
+		return fs_ops.truncate(path, rec->len);
+	case OP_OPEN:
+		dfi.flags = rec->mode;
+		res = fs_ops.open(path, &dfi);
+		if (res == 0) replay_add(rec->fh, &dfi);
+		return res;
+	case OP_RELEASE:
+		for (int i = 0; i < nfiles; i++) {
+			if (files[i].fh == rec->fh) {
+				res = fs_ops.release(path, &files[i].fi);
+				replay_forget(rec->fh);
+				return res;
+			}
+		}
+		return 0;
+	case OP_STATFS:
+		return fs_ops.statfs(path, &st);
+	}
+
+	//the rest work on an open file
+	if ((fi = replay_fi(rec->fh, path)) == NULL) return -ENOENT;
+	switch (rec->op) {
+	case OP_READ:
+		return fs_ops.read(path, write_data(rec->len), rec->len, rec->offset, fi);
+	case OP_READ_BUF: {
+		struct fuse_bufvec *bufv = NULL;
+		res = fs_ops.read_buf(path, &bufv, rec->len, rec->offset, fi);
+		if (res == 0) {
+			for (int i = 0; i < bufv->count; i++) {
+				free(bufv->buf[i].mem);
+			}
+			free(bufv);
+		}
+		return res;
+	}
+	case OP_WRITE:
+		return fs_ops.write(path, write_data(rec->len), rec->len, rec->offset, fi);
+	case OP_WRITE_BUF: {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(rec->len);
+		bufv.buf[0].mem = write_data(rec->len);
+		return fs_ops.write_buf(path, &bufv, rec->offset, fi);
+	}
+	case OP_FSYNC:
+		return fs_ops.fsync(path, rec->mode, fi);
+	}
+	return -ENOSYS;
+}
+
+/**
+ * Copy an image file.
+ *
+ * @return 0 if successful, or -errno
+ */
+static int copy_image(const char *from, const char *to)
+{
+	char buf[64 * 1024];
+	int in = open(from, O_RDONLY), out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	int res = (in < 0 || out < 0) ? -errno : 0;
+	ssize_t len;
+	while (res == 0 && (len = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, len) != len) res = -errno;
+	}
+	if (in >= 0) close(in);
+	if (out >= 0) close(out);
+	return res;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: fsx492_replay [-max] [-image <base.img>] [-dir <dir>] <trace>\n");
+	fprintf(stderr, " -max : replay as fast as possible instead of at the original times\n");
+	fprintf(stderr, " -image <base.img> : replay against a copy of an image instead of an empty one\n");
+	fprintf(stderr, " -dir <dir> : directory for the replay image (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "/tmp", *base = NULL, *trace = NULL;
+	bool max = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-max") == 0) max = true;
+		else if (strcmp(argv[i], "-image") == 0 && i + 1 < argc) base = argv[++i];
+		else if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc) dir = argv[++i];
+		else if (argv[i][0] != '-' && trace == NULL) trace = argv[i];
+		else {
+			usage();
+			exit(1);
+		}
+	}
+	if (trace == NULL) {
+		usage();
+		exit(1);
+	}
+
+	struct trace_hdr hdr;
+	FILE *f = trace_open(trace, &hdr);
+	if (f == NULL) {
+		fprintf(stderr, "cannot read trace %s: %s\n", trace, strerror(errno));
+		exit(1);
+	}
+	char img[MAX_PATH];
+	snprintf(img, sizeof(img), "%s/replay-%d.img", dir, (int) getpid());
+	int res = base ? copy_image(base, img) : fs_mkfs(img, REPLAY_BLKS, REPLAY_INODES);
+	if (res < 0 || (disk = image_create(img)) == NULL) {
+		fprintf(stderr, "cannot create image %s\n", img);
+		exit(1);
+	}
+	fs_ops.init(NULL);
+
+	struct trace_rec rec;
+	char path[TRACE_PATH_MAX], path2[TRACE_PATH_MAX];
+	long nops = 0, differ = 0;
+	uint64_t first = 0, start = stats_start();
+	while ((res = trace_next(f, &rec, path, path2)) > 0) {
+		if (nops++ == 0) first = rec.time;
+		//wait for the operation's time in the trace
+		if (!max) {
+			uint64_t due = start + (rec.time - first), now = stats_start();
+			if (due > now) {
+				struct timespec ts = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL };
+				nanosleep(&ts, NULL);
+			}
+		}
+		if (replay_op(&rec, path, path2) != rec.result) differ++;
+	}
+	double secs = (stats_start() - start) / 1e9;
+	if (res < 0) fprintf(stderr, "%s: truncated or corrupt after %ld operations\n", trace, nops);
+	fclose(f);
+
+	//close files left open by the trace
+	while (nfiles > 0) {
+		fs_ops.release("", &files[nfiles - 1].fi);
+		nfiles--;
+	}
+	fs_ops.destroy(NULL);
+	disk->ops->close(disk);
+	unlink(img);
+
+	printf("%ld operations in %.3f s (%.0f ops/s), %ld results differ from the trace\n\n",
+		   nops, secs, (secs > 0) ? nops / secs : 0.0, differ);
+	int len = stats_format(NULL, 0);
+	char *report = malloc(len + 1);
+	stats_format(report, len + 1);
+	fputs(report, stdout);
+	free(report);
+	return (res < 0) ? 1 : 0;
+}
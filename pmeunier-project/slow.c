@@ -0,0 +1,193 @@
+/*
+ * file:        slow.c
+ * description: block device adding latency, a bandwidth limit and
+ *              random errors to another block device, to test on
+ *              slow or failing storage
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "slow.h"
+
+/** definition of slow block device */
+struct slow_dev {
+	struct blkdev *dev; // device being slowed
+	struct slow_params params; // behavior
+	uint64_t busy_until; // time the queued transfers end
+	unsigned seed; // state of the random numbers
+	pthread_mutex_t lock; // protects busy_until, seed and stats
+	struct slow_stats stats; // counters
+};
+
+/**
+ * Current monotonic time in nanoseconds.
+ */
+static uint64_t slow_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Hold a request for its latency and its place in the transfer queue,
+ * and decide whether it fails.
+ * @param sd: the slow device state
+ * @param nblks: number of blocks transferred, 0 for a flush
+ * @param can_fail: whether the request may fail
+ * @return: SUCCESS, or E_UNAVAIL if the request is to fail
+*/
+static int slow_delay(struct slow_dev *sd, int nblks, bool can_fail)
+{
+	struct slow_params *p = &sd->params;
+	uint64_t now = slow_now();
+
+	pthread_mutex_lock(&sd->lock);
+	uint64_t done = now;
+	if (p->bandwidth > 0 && nblks > 0) {
+		//transfers share the bandwidth one after another
+		uint64_t start = (sd->busy_until > now) ? sd->busy_until : now;
+		sd->busy_until = start + (uint64_t) (nblks * BLOCK_SIZE * 1e3 / p->bandwidth);
+		done = sd->busy_until;
+	}
+	done += (uint64_t) p->latency_us * 1000;
+	if (p->jitter_us > 0) {
+		done += (uint64_t) (rand_r(&sd->seed) % (p->jitter_us + 1)) * 1000;
+	}
+	bool fail = can_fail && p->fail_rate > 0 &&
+		rand_r(&sd->seed) < p->fail_rate * ((double) RAND_MAX + 1);
+	sd->stats.ios++;
+	sd->stats.failures += fail;
+	sd->stats.delay_ns += done - now;
+	pthread_mutex_unlock(&sd->lock);
+
+	if (done > now) {
+		struct timespec ts = { (done - now) / 1000000000ULL, (done - now) % 1000000000ULL };
+		while (nanosleep(&ts, &ts) != 0);
+	}
+	return fail ? E_UNAVAIL : SUCCESS;
+}
+
+/**
+ * To count the number of blocks on the device
+ * @param dev: the block device
+ * @return: the number of blocks in the block device
+*/
+static int slow_num_blocks(struct blkdev *dev)
+{
+	struct slow_dev *sd = dev->private;
+	return sd->dev->ops->num_blocks(sd->dev);
+}
+
+/**
+ * Read blocks from the underlying device after a delay.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS if successful, E_UNAVAIL if failed on purpose, or
+ *   the error of the underlying device
+*/
+static int slow_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct slow_dev *sd = dev->private;
+	int result = slow_delay(sd, nblks, true);
+	if (result < 0) {
+		return result;
+	}
+	return sd->dev->ops->read(sd->dev, first_blk, nblks, buf);
+}
+
+/**
+ * Write blocks to the underlying device after a delay.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return SUCCESS if successful, E_UNAVAIL if failed on purpose, or
+ *   the error of the underlying device
+*/
+static int slow_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	struct slow_dev *sd = dev->private;
+	int result = slow_delay(sd, nblks, true);
+	if (result < 0) {
+		return result;
+	}
+	return sd->dev->ops->write(sd->dev, first_blk, nblks, buf);
+}
+
+/**
+ * Flush the underlying device after a delay.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return SUCCESS if successful, or the error of the underlying device
+*/
+static int slow_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct slow_dev *sd = dev->private;
+	slow_delay(sd, 0, false);
+	return sd->dev->ops->flush(sd->dev, first_blk, nblks);
+}
+
+/**
+ * Close the underlying device.
+ * @param dev: the block device
+*/
+static void slow_close(struct blkdev *dev)
+{
+	struct slow_dev *sd = dev->private;
+	sd->dev->ops->close(sd->dev);
+	pthread_mutex_destroy(&sd->lock);
+	free(sd);
+	free(dev);
+}
+
+/** Operations on this block device. There is no map operation:
+ *  data spliced straight from the image would not be delayed. */
+static struct blkdev_ops slow_ops = {
+	.num_blocks = slow_num_blocks,
+	.read = slow_read,
+	.write = slow_write,
+	.flush = slow_flush,
+	.close = slow_close,
+};
+
+struct blkdev *slow_create(struct blkdev *base, const struct slow_params *params)
+{
+	struct blkdev *dev = malloc(sizeof(*dev));
+	struct slow_dev *sd = calloc(1, sizeof(*sd));
+
+	if (dev == NULL || sd == NULL) {
+		free(sd);
+		free(dev);
+		return NULL;
+	}
+
+	sd->dev = base;
+	sd->params = *params;
+	sd->seed = params->seed;
+	pthread_mutex_init(&sd->lock, NULL);
+
+	dev->private = sd;
+	dev->ops = &slow_ops;
+
+	return dev;
+}
+
+void slow_get_stats(struct blkdev *dev, struct slow_stats *st)
+{
+	struct slow_dev *sd = dev->private;
+	pthread_mutex_lock(&sd->lock);
+	*st = sd->stats;
+	pthread_mutex_unlock(&sd->lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * file:        slow.h
+ * description: block device adding latency, a bandwidth limit and
+ *              random errors to another block device, to test on
+ *              slow or failing storage
+ */
+
+#ifndef SLOW_H_
+#define SLOW_H_
+
+#include <stdint.h>
+
+#include "blkdev.h"
+
+/** behavior of a slow device */
+struct slow_params {
+	int latency_us; /* added to every read, write and flush */
+	int jitter_us; /* random extra latency, up to this much */
+	double bandwidth; /* MB/s shared by all transfers, 0 for no limit */
+	double fail_rate; /* probability a read or write fails, 0 to 1 */
+	unsigned seed; /* seed of the jitter and failures */
+};
+
+/** slow device counters */
+struct slow_stats {
+	uint64_t ios; /* reads, writes and flushes */
+	uint64_t failures; /* reads and writes failed on purpose */
+	uint64_t delay_ns; /* total time requests were held */
+};
+
+/*
+ * Create a block device that delays the requests to another device.
+ * Every request waits latency_us plus a random jitter; transfers are
+ * also queued behind each other so that together they move at most
+ * bandwidth MB/s. Reads and writes fail with E_UNAVAIL, without
+ * reaching the device, with probability fail_rate.
+ *
+ * @param dev: the device to slow down
+ * @param params: the behavior
+ * @return: the block device, or NULL if out of memory
+ */
+extern struct blkdev *slow_create(struct blkdev *dev, const struct slow_params *params);
+
+/*
+ * Get the counters of a slow device.
+ *
+ * @param dev: the slow device
+ * @param st: set to the counters
+ */
+extern void slow_get_stats(struct blkdev *dev, struct slow_stats *st);
+
+#endif /* SLOW_H_ */
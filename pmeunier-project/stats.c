@@ -0,0 +1,187 @@
+/*
+ * file:        stats.c
+ * description: performance counters and operation latency histograms.
+ *              Each thread counts into its own block without locking;
+ *              the blocks are summed only when the counters are read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+__thread struct stats_block *stats_self;
+
+/** counters of live threads */
+static struct stats_block *stats_list;
+/** counters of threads that have exited */
+static struct stats_block stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/** key whose destructor retires a thread's counters */
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static const char *counter_names[ST_NCOUNTERS] = {
+	"dev_reads", "dev_read_blocks", "dev_writes", "dev_write_blocks",
+	"entry_cache_hits", "entry_cache_misses", "bmap_cache_hits", "bmap_cache_misses",
+	"translates", "dir_blocks_read", "allocs", "alloc_scanned",
+	"inode_blocks_loaded",
+};
+
+static const char *op_names[ST_NOPS] = {
+	"getattr", "opendir", "readdir", "releasedir", "mknod",
+	"mkdir", "unlink", "rmdir", "rename", "chmod", "utime",
+	"truncate", "open", "read", "read_buf", "write", "write_buf",
+	"fsync", "release", "statfs",
+};
+
+/**
+ * Add the counters of one block to another.
+ */
+static void stats_sum(struct stats_block *to, const struct stats_block *from)
+{
+	for (int i = 0; i < ST_NCOUNTERS; i++) to->count[i] += from->count[i];
+	for (int op = 0; op < ST_NOPS; op++) {
+		to->calls[op] += from->calls[op];
+		to->nsecs[op] += from->nsecs[op];
+		for (int b = 0; b < STATS_BUCKETS; b++) to->hist[op][b] += from->hist[op][b];
+	}
+}
+
+/**
+ * Fold the counters of an exiting thread into the retired totals.
+ *
+ * @param arg: the thread's counters
+ */
+static void stats_retire(void *arg)
+{
+	struct stats_block *sb = arg;
+	pthread_mutex_lock(&stats_lock);
+	for (struct stats_block **p = &stats_list; *p != NULL; p = &(*p)->next) {
+		if (*p == sb) {
+			*p = sb->next;
+			break;
+		}
+	}
+	stats_sum(&stats_retired, sb);
+	pthread_mutex_unlock(&stats_lock);
+	free(sb);
+}
+
+static void stats_init(void)
+{
+	pthread_key_create(&stats_key, stats_retire);
+}
+
+struct stats_block *stats_thread(void)
+{
+	pthread_once(&stats_once, stats_init);
+	struct stats_block *sb = calloc(1, sizeof(*sb));
+	if (sb == NULL) exit(1);
+	pthread_mutex_lock(&stats_lock);
+	sb->next = stats_list;
+	stats_list = sb;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, sb);
+	stats_self = sb;
+	return sb;
+}
+
+uint64_t stats_start(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_op(enum stats_op op, uint64_t start)
+{
+	uint64_t ns = stats_start() - start;
+	struct stats_block *sb = stats_self ? stats_self : stats_thread();
+	//bucket i holds latencies of 2^(i-1) up to 2^i microseconds
+	uint64_t us = ns / 1000;
+	int b = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+	if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+	sb->calls[op]++;
+	sb->nsecs[op] += ns;
+	sb->hist[op][b]++;
+}
+
+void stats_read(struct stats_block *total)
+{
+	pthread_mutex_lock(&stats_lock);
+	*total = stats_retired;
+	//other threads keep counting; each counter is read whole
+	for (struct stats_block *sb = stats_list; sb != NULL; sb = sb->next) {
+		stats_sum(total, sb);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	total->next = NULL;
+}
+
+/**
+ * Estimate a latency percentile from a histogram, as the upper bound
+ * of the bucket holding it.
+ *
+ * @param hist: the histogram
+ * @param calls: number of operations in it
+ * @param pct: the percentile, 0 to 100
+ * @return the latency in microseconds
+ */
+static uint64_t hist_pct(const uint64_t *hist, uint64_t calls, int pct)
+{
+	uint64_t want = (calls * pct + 99) / 100, seen = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= want) return 1ULL << b;
+	}
+	return 1ULL << (STATS_BUCKETS - 1);
+}
+
+//append to a report, keeping its whole length as snprintf does
+#define REPORT(...) \
+	do { \
+		int n_ = snprintf(buf + (len < size ? len : size), len < size ? size - len : 0, __VA_ARGS__); \
+		if (n_ > 0) len += n_; \
+	} while (0)
+
+int stats_format(char *buf, size_t size)
+{
+	static struct stats_block total;
+	static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t len = 0;
+
+	//the totals are too large for a thread stack
+	pthread_mutex_lock(&format_lock);
+	stats_read(&total);
+	if (size > 0) buf[0] = '\0';
+	for (int i = 0; i < ST_NCOUNTERS; i++) {
+		REPORT("%-20s %llu\n", counter_names[i], (unsigned long long) total.count[i]);
+	}
+	REPORT("\n%-12s %10s %10s %10s %10s\n", "op", "calls", "avg_us", "p50_us", "p99_us");
+	for (int op = 0; op < ST_NOPS; op++) {
+		uint64_t calls = total.calls[op];
+		if (calls == 0) continue;
+		REPORT("%-12s %10llu %10.1f %10llu %10llu\n", op_names[op], (unsigned long long) calls,
+			total.nsecs[op] / 1000.0 / calls,
+			(unsigned long long) hist_pct(total.hist[op], calls, 50),
+			(unsigned long long) hist_pct(total.hist[op], calls, 99));
+	}
+	//histograms list the non-empty buckets as <upper bound in us>:<count>
+	REPORT("\nlatency histograms (us)\n");
+	for (int op = 0; op < ST_NOPS; op++) {
+		if (total.calls[op] == 0) continue;
+		REPORT("%-12s", op_names[op]);
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			if (total.hist[op][b] > 0) {
+				REPORT(" <%llu:%llu", 1ULL << b, (unsigned long long) total.hist[op][b]);
+			}
+		}
+		REPORT("\n");
+	}
+	pthread_mutex_unlock(&format_lock);
+	return (int) len;
+}
@@ -0,0 +1,107 @@
+/*
+ * file:        stats.h
+ * description: performance counters and operation latency histograms.
+ *              Each thread counts into its own block; the blocks are
+ *              summed only when the counters are read.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** event counters */
+enum stats_counter {
+	ST_DEV_READS, /* device read calls */
+	ST_DEV_READ_BLKS, /* blocks read from the device */
+	ST_DEV_WRITES, /* device write calls */
+	ST_DEV_WRITE_BLKS, /* blocks written to the device */
+	ST_ENTRY_HITS, /* paths found in the entry cache */
+	ST_ENTRY_MISSES, /* paths not in the entry cache */
+	ST_BMAP_HITS, /* block pointers found in the cached indirect block */
+	ST_BMAP_MISSES, /* indirect blocks read to map a block */
+	ST_TRANSLATES, /* paths translated to an inode */
+	ST_DIR_BLKS, /* directory blocks read */
+	ST_ALLOCS, /* block allocator calls */
+	ST_ALLOC_SCAN, /* block map entries examined by the allocator */
+	ST_INODE_BLKS, /* inode table blocks loaded on first use */
+	ST_NCOUNTERS
+};
+
+/** timed file system operations, one per fs_ops entry point */
+enum stats_op {
+	OP_GETATTR, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_MKNOD,
+	OP_MKDIR, OP_UNLINK, OP_RMDIR, OP_RENAME, OP_CHMOD, OP_UTIME,
+	OP_TRUNCATE, OP_OPEN, OP_READ, OP_READ_BUF, OP_WRITE, OP_WRITE_BUF,
+	OP_FSYNC, OP_RELEASE, OP_STATFS,
+	ST_NOPS
+};
+
+/** latency buckets; bucket i counts latencies below 2^i microseconds */
+#define STATS_BUCKETS 32
+
+/** counters of one thread */
+struct stats_block {
+	uint64_t count[ST_NCOUNTERS];
+	uint64_t calls[ST_NOPS]; /* operations completed */
+	uint64_t nsecs[ST_NOPS]; /* total latency in nanoseconds */
+	uint64_t hist[ST_NOPS][STATS_BUCKETS];
+	struct stats_block *next; /* next block on the list of threads */
+};
+
+/** the calling thread's counters, or NULL until it first counts */
+extern __thread struct stats_block *stats_self;
+
+/**
+ * Create and register the counters of the calling thread.
+ *
+ * @return the counters
+ */
+extern struct stats_block *stats_thread(void);
+
+/**
+ * Add to a counter of the calling thread.
+ *
+ * @param c: the counter
+ * @param n: the amount to add
+ */
+static inline void stats_add(enum stats_counter c, uint64_t n)
+{
+	struct stats_block *sb = stats_self ? stats_self : stats_thread();
+	sb->count[c] += n;
+}
+
+/**
+ * Get the start time of an operation.
+ *
+ * @return monotonic time in nanoseconds
+ */
+extern uint64_t stats_start(void);
+
+/**
+ * Record the latency of an operation.
+ *
+ * @param op: the operation
+ * @param start: its start time from stats_start()
+ */
+extern void stats_op(enum stats_op op, uint64_t start);
+
+/**
+ * Sum the counters of all threads, including threads that have exited.
+ *
+ * @param total: set to the totals; its next field is unused
+ */
+extern void stats_read(struct stats_block *total);
+
+/**
+ * Format the totals as a readable report.
+ *
+ * @param buf: buffer for the report
+ * @param size: size of buf
+ * @return length of the whole report, which is truncated if size is
+ *	not larger, as for snprintf
+ */
+extern int stats_format(char *buf, size_t size);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,361 @@
+/*
+ * file:        stripe.c
+ * description: block device striping its blocks across several other
+ *              block devices, so transfers use them all in parallel
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "stripe.h"
+
+/** a request of the stripe, split across its devices */
+struct stripe_io {
+	bool write; // write instead of read
+	int first_blk; // first block of the stripe
+	int nblks; // number of blocks
+	char *buf; // data of the blocks
+	int pending; // devices still working on it
+	int result; // first error of a device, or SUCCESS
+	pthread_mutex_t lock; // protects pending and result
+	pthread_cond_t done; // signaled when pending drops to 0
+};
+
+/** the part of a request queued for one device */
+struct stripe_part {
+	struct stripe_io *io;
+	struct stripe_part *next;
+};
+
+/** a device of the stripe and the thread transferring its parts */
+struct stripe_member {
+	struct stripe_dev *sd; // the stripe
+	struct blkdev *dev; // the device
+	int index; // position in the stripe
+	pthread_t thread; // transfers queued parts
+	pthread_mutex_t lock; // protects the queue and stop
+	pthread_cond_t cond; // signaled when a part is queued or on stop
+	struct stripe_part *head, **tail; // queued parts
+	bool stop; // the thread is to exit
+	bool started; // the thread is running
+};
+
+/** definition of stripe block device */
+struct stripe_dev {
+	struct stripe_member *members; // the devices
+	int nmembers; // number of devices
+	int chunk; // blocks in a chunk
+	int nblks; // blocks of the stripe
+};
+
+/**
+ * Transfer the chunks of a request that are on one device.
+ * @param sd: the stripe
+ * @param m: the device
+ * @param io: the request
+ * @return: SUCCESS, or the first error of the device
+*/
+static int stripe_part_io(struct stripe_dev *sd, struct stripe_member *m, struct stripe_io *io)
+{
+	int end = io->first_blk + io->nblks;
+	int c = io->first_blk / sd->chunk, last = (end - 1) / sd->chunk;
+	//the first chunk of the request that is on this device
+	c += (m->index - c % sd->nmembers + sd->nmembers) % sd->nmembers;
+	for (; c <= last; c += sd->nmembers) {
+		int lo = c * sd->chunk, hi = lo + sd->chunk;
+		if (lo < io->first_blk) lo = io->first_blk;
+		if (hi > end) hi = end;
+		int blk = (c / sd->nmembers) * sd->chunk + lo - c * sd->chunk;
+		char *buf = io->buf + (size_t) (lo - io->first_blk) * BLOCK_SIZE;
+		int result = io->write ? m->dev->ops->write(m->dev, blk, hi - lo, buf)
+			: m->dev->ops->read(m->dev, blk, hi - lo, buf);
+		if (result < 0) {
+			return result;
+		}
+	}
+	return SUCCESS;
+}
+
+/**
+ * Record that a device is done with its part of a request.
+ * @param io: the request
+ * @param result: the result of the device
+*/
+static void stripe_part_done(struct stripe_io *io, int result)
+{
+	pthread_mutex_lock(&io->lock);
+	if (result < 0 && io->result == SUCCESS) {
+		io->result = result;
+	}
+	if (--io->pending == 0) {
+		pthread_cond_signal(&io->done);
+	}
+	pthread_mutex_unlock(&io->lock);
+}
+
+/**
+ * Thread of a device, transferring the parts queued for it until
+ * the stripe is closed.
+ * @param arg: the device
+*/
+static void *stripe_thread(void *arg)
+{
+	struct stripe_member *m = arg;
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		while (m->head == NULL && !m->stop) {
+			pthread_cond_wait(&m->cond, &m->lock);
+		}
+		if (m->head == NULL) {
+			break;
+		}
+		struct stripe_part *p = m->head;
+		if ((m->head = p->next) == NULL) {
+			m->tail = &m->head;
+		}
+		pthread_mutex_unlock(&m->lock);
+		stripe_part_done(p->io, stripe_part_io(m->sd, m, p->io));
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+/**
+ * Read or write blocks of the stripe. The parts on all devices but
+ * the first are queued to their threads, and the calling thread
+ * transfers the first part itself.
+ * @param dev: the block device
+ * @param first_blk: index of the first block
+ * @param nblks: number of blocks
+ * @param buf: data of the blocks
+ * @param write: write instead of read
+ * @return: SUCCESS, E_BADADDR if the blocks are outside the stripe,
+ *   or the first error of a device
+*/
+static int stripe_rw(struct blkdev *dev, int first_blk, int nblks, void *buf, bool write)
+{
+	struct stripe_dev *sd = dev->private;
+	if (first_blk < 0 || nblks < 0 || first_blk + nblks > sd->nblks) {
+		return E_BADADDR;
+	}
+	if (nblks == 0) {
+		return SUCCESS;
+	}
+	struct stripe_io io = {
+		.write = write, .first_blk = first_blk, .nblks = nblks, .buf = buf,
+	};
+	int c = first_blk / sd->chunk, nchunks = (first_blk + nblks - 1) / sd->chunk - c + 1;
+	int ndevs = (nchunks < sd->nmembers) ? nchunks : sd->nmembers;
+	struct stripe_member *own = &sd->members[c % sd->nmembers];
+	if (ndevs == 1) {
+		return stripe_part_io(sd, own, &io);
+	}
+
+	pthread_mutex_init(&io.lock, NULL);
+	pthread_cond_init(&io.done, NULL);
+	io.pending = ndevs;
+	struct stripe_part parts[ndevs];
+	for (int i = 1; i < ndevs; i++) {
+		struct stripe_member *m = &sd->members[(c + i) % sd->nmembers];
+		parts[i].io = &io;
+		parts[i].next = NULL;
+		pthread_mutex_lock(&m->lock);
+		*m->tail = &parts[i];
+		m->tail = &parts[i].next;
+		pthread_cond_signal(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+	}
+	stripe_part_done(&io, stripe_part_io(sd, own, &io));
+
+	pthread_mutex_lock(&io.lock);
+	while (io.pending > 0) {
+		pthread_cond_wait(&io.done, &io.lock);
+	}
+	pthread_mutex_unlock(&io.lock);
+	pthread_cond_destroy(&io.done);
+	pthread_mutex_destroy(&io.lock);
+	return io.result;
+}
+
+/**
+ * To count the number of blocks on the device
+ * @param dev: the block device
+ * @return: the number of blocks in the stripe
+*/
+static int stripe_num_blocks(struct blkdev *dev)
+{
+	struct stripe_dev *sd = dev->private;
+	return sd->nblks;
+}
+
+/**
+ * Read blocks from the devices of the stripe.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS if successful, E_BADADDR if outside the stripe,
+ *   or the error of a device
+*/
+static int stripe_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	return stripe_rw(dev, first_blk, nblks, buf, false);
+}
+
+/**
+ * Write blocks to the devices of the stripe.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return: SUCCESS if successful, E_BADADDR if outside the stripe,
+ *   or the error of a device
+*/
+static int stripe_write(struct blkdev *dev, int first_blk, int nblks, void *buf)
+{
+	return stripe_rw(dev, first_blk, nblks, buf, true);
+}
+
+/**
+ * Flush the blocks of a range that are on each device of the stripe.
+ * The chunks of a device in the range are consecutive on it, so each
+ * device flushes one range.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return: SUCCESS if successful, or the first error of a device
+*/
+static int stripe_flush(struct blkdev *dev, int first_blk, int nblks)
+{
+	struct stripe_dev *sd = dev->private;
+	int end = first_blk + nblks;
+	if (first_blk < 0) first_blk = 0;
+	if (end > sd->nblks) end = sd->nblks;
+	if (end <= first_blk) {
+		return SUCCESS;
+	}
+	int c0 = first_blk / sd->chunk, c1 = (end - 1) / sd->chunk;
+	int result = SUCCESS;
+	for (int i = 0; i < sd->nmembers; i++) {
+		//the first and last chunks of the range that are on this device
+		int first = c0 + (i - c0 % sd->nmembers + sd->nmembers) % sd->nmembers;
+		int last = c1 - (c1 % sd->nmembers - i + sd->nmembers) % sd->nmembers;
+		if (first > last) {
+			continue;
+		}
+		int lo = first * sd->chunk, hi = last * sd->chunk + sd->chunk;
+		if (lo < first_blk) lo = first_blk;
+		if (hi > end) hi = end;
+		lo = (first / sd->nmembers) * sd->chunk + lo - first * sd->chunk;
+		hi = (last / sd->nmembers) * sd->chunk + hi - last * sd->chunk;
+		struct blkdev *d = sd->members[i].dev;
+		int r = d->ops->flush(d, lo, hi - lo);
+		if (r < 0 && result == SUCCESS) {
+			result = r;
+		}
+	}
+	return result;
+}
+
+/**
+ * Stop the threads of a striped device that are running and free it.
+ * @param dev: the block device
+ * @param sd: the striped device, with the locks and conditions initialized
+ * @param close_devs: close the devices too
+*/
+static void stripe_free(struct blkdev *dev, struct stripe_dev *sd, bool close_devs)
+{
+	for (int i = 0; i < sd->nmembers; i++) {
+		struct stripe_member *m = &sd->members[i];
+		pthread_mutex_lock(&m->lock);
+		m->stop = true;
+		pthread_cond_signal(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+		if (m->started) {
+			pthread_join(m->thread, NULL);
+		}
+		if (close_devs) {
+			m->dev->ops->close(m->dev);
+		}
+		pthread_cond_destroy(&m->cond);
+		pthread_mutex_destroy(&m->lock);
+	}
+	free(sd->members);
+	free(sd);
+	free(dev);
+}
+
+/**
+ * Stop the threads and close the devices of the stripe.
+ * @param dev: the block device
+*/
+static void stripe_close(struct blkdev *dev)
+{
+	stripe_free(dev, dev->private, true);
+}
+
+/** Operations on this block device. There is no map operation, as
+ *  consecutive blocks are not in one file. */
+static struct blkdev_ops stripe_ops = {
+	.num_blocks = stripe_num_blocks,
+	.read = stripe_read,
+	.write = stripe_write,
+	.flush = stripe_flush,
+	.close = stripe_close,
+};
+
+struct blkdev *stripe_create(struct blkdev **devs, int ndevs, int chunk_blks)
+{
+	if (ndevs < 1 || chunk_blks < 1)
+		return NULL;
+
+	//every device holds the same number of whole chunks
+	int nchunks = -1;
+	for (int i = 0; i < ndevs; i++) {
+		int n = devs[i]->ops->num_blocks(devs[i]) / chunk_blks;
+		if (nchunks < 0 || n < nchunks) nchunks = n;
+	}
+	if (nchunks == 0)
+		return NULL;
+
+	struct blkdev *dev = malloc(sizeof(*dev));
+	struct stripe_dev *sd = calloc(1, sizeof(*sd));
+	struct stripe_member *members = calloc(ndevs, sizeof(*members));
+
+	if (dev == NULL || sd == NULL || members == NULL) {
+		free(members);
+		free(sd);
+		free(dev);
+		return NULL;
+	}
+
+	sd->members = members;
+	sd->nmembers = ndevs;
+	sd->chunk = chunk_blks;
+	sd->nblks = nchunks * chunk_blks * ndevs;
+	for (int i = 0; i < ndevs; i++) {
+		struct stripe_member *m = &members[i];
+		m->sd = sd;
+		m->dev = devs[i];
+		m->index = i;
+		m->tail = &m->head;
+		pthread_mutex_init(&m->lock, NULL);
+		pthread_cond_init(&m->cond, NULL);
+	}
+	for (int i = 0; i < ndevs; i++) {
+		struct stripe_member *m = &members[i];
+		m->started = pthread_create(&m->thread, NULL, stripe_thread, m) == 0;
+		if (!m->started) {
+			stripe_free(dev, sd, false);
+			return NULL;
+		}
+	}
+
+	dev->private = sd;
+	dev->ops = &stripe_ops;
+
+	return dev;
+}
@@ -0,0 +1,31 @@
+/*
+ * file:        stripe.h
+ * description: block device striping its blocks across several other
+ *              block devices, so transfers use them all in parallel
+ */
+
+#ifndef STRIPE_H_
+#define STRIPE_H_
+
+#include "blkdev.h"
+
+/** default number of blocks in a stripe chunk */
+enum { STRIPE_CHUNK = 64 };
+
+/*
+ * Create a block device striped across several devices (RAID-0).
+ * The blocks are split into chunks of chunk_blks blocks that go to
+ * the devices in turn. The parts of a request on different devices
+ * are transferred in parallel, each by a thread of its device. The
+ * stripe is as long as the shortest device allows; the devices are
+ * closed with it.
+ *
+ * @param devs: the devices
+ * @param ndevs: number of devices
+ * @param chunk_blks: blocks in a chunk
+ * @return: the block device, or NULL if there are no devices, they
+ *   are smaller than a chunk, or out of memory
+ */
+extern struct blkdev *stripe_create(struct blkdev **devs, int ndevs, int chunk_blks);
+
+#endif /* STRIPE_H_ */
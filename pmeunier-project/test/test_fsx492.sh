@@ -0,0 +1,344 @@
+#!/bin/bash
+#
+# Scripted -batch runs against copies of test/fsx492.img, checking the
+# file contents and statfs after each feature is used.
+#
+# usage: test/test_fsx492.sh [path to fsx492]
+
+command=$(realpath "${1:-./fsx492}")
+fixture=$(realpath "$(dirname "$0")/fsx492.img")
+
+if [ ! -x "$command" ]; then
+    echo "Error: $command not found, run make first"
+    exit 1
+fi
+
+num_tests=0
+num_right=0
+failed=0
+
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+cd "$workdir" || exit 1
+
+# files to copy in: 100 and 50 blocks of random data
+head -c 102400 /dev/urandom > a.bin
+head -c 51200 /dev/urandom > c.bin
+
+# run the commands on stdin as a batch, failing the test if any fails
+run() {
+    local image="$1"
+    shift
+    if ! "$command" -image "$image" "$@" -batch - > /dev/null 2> batch.err; then
+        echo "batch failed: $(cat batch.err)"
+        failed=1
+    fi
+}
+
+# run the commands on stdin as a batch, failing the test unless one fails
+run_fails() {
+    local image="$1"
+    shift
+    if "$command" -image "$image" "$@" -batch - > /dev/null 2>&1; then
+        echo "batch succeeded on $image $*"
+        failed=1
+    fi
+}
+
+# print the block of an image holding the first block of a file
+find_block() {
+    local image="$1" file="$2" blk
+    for ((blk = 0; blk < $(stat -c %s "$image") / 1024; blk++)); do
+        if cmp -s -n 1024 -i $((blk * 1024)):0 "$image" "$file"; then
+            echo $blk
+            return
+        fi
+    done
+}
+
+# print the available blocks of an image
+avail() {
+    local image="$1"
+    shift
+    echo statfs | "$command" -cmdline -image "$image" "$@" | sed -n 's/^avail blocks: //p'
+}
+
+# check that an image has a number of available blocks and no pending frees
+expect_avail() {
+    local image="$1" expected="$2"
+    shift 2
+    local out
+    out=$(echo statfs | "$command" -cmdline -image "$image" "$@")
+    local got=$(echo "$out" | sed -n 's/^avail blocks: //p')
+    local pending=$(echo "$out" | sed -n 's/^pending free blocks: //p')
+    if [ "$got" != "$expected" ] || [ "$pending" != 0 ]; then
+        echo "$image: expected $expected available blocks, got $got ($pending pending)"
+        failed=1
+    fi
+}
+
+# check that two files have the same contents
+expect_same() {
+    if ! cmp -s "$1" "$2"; then
+        echo "$1 and $2 differ"
+        failed=1
+    fi
+}
+
+start_test() {
+    ((num_tests++))
+    echo -n "Test $num_tests ($1)..."
+    failed=0
+    cp "$fixture" fs.img
+    base=$(avail fs.img)
+}
+
+end_test() {
+    if [ $failed -eq 0 ]; then
+        ((num_right++))
+        echo "ok"
+    else
+        echo "Test $num_tests failed"
+    fi
+}
+
+############################################################
+start_test "block checksums"
+rm -f fs.img.crc
+run fs.img -checksum <<EOF
+put a.bin /a
+put c.bin /c
+EOF
+# a corrupt data block fails the read of its file only
+blk=$(find_block fs.img c.bin)
+if [ -z "$blk" ]; then
+    echo "data of /c not found in fs.img"
+    failed=1
+fi
+printf x | dd of=fs.img bs=1 seek=$((blk * 1024)) conv=notrunc 2> /dev/null
+run_fails fs.img -checksum <<EOF
+get /c c.out
+get /a a.out
+EOF
+expect_same a.bin a.out
+# a checksum file of the wrong size is only replaced on request
+truncate -s 100 fs.img.crc
+run_fails fs.img -checksum <<EOF
+get /a a2.out
+EOF
+run fs.img -checksum-rebuild <<EOF
+get /a a2.out
+EOF
+run fs.img -checksum <<EOF
+get /a a3.out
+EOF
+expect_same a.bin a2.out
+expect_same a.bin a3.out
+expect_avail fs.img $((base - 152)) -checksum
+end_test
+
+############################################################
+start_test "dedup"
+# the second copy only needs its indirect block
+run fs.img -dedup <<EOF
+put a.bin /a
+put a.bin /dir1/a
+put c.bin /c
+EOF
+expect_avail fs.img $((base - 153))
+run fs.img -dedup <<EOF
+rm /a
+get /dir1/a a.out
+EOF
+expect_same a.bin a.out
+expect_avail fs.img $((base - 152))
+run fs.img -dedup <<EOF
+put a.bin /d
+rm /dir1/a
+get /d d.out
+get /c c.out
+EOF
+expect_same a.bin d.out
+expect_same c.bin c.out
+expect_avail fs.img $((base - 152))
+run fs.img -dedup <<EOF
+rm /c
+rm /d
+EOF
+expect_avail fs.img $base
+end_test
+
+############################################################
+start_test "snapshot and restore"
+run fs.img <<EOF
+put a.bin /a
+snapshot s1
+EOF
+held=$(avail fs.img)
+# the snapshot keeps the blocks of the removed file
+run fs.img <<EOF
+rm /a
+put c.bin /a
+EOF
+after=$(avail fs.img)
+if [ "$after" -gt $((held - 51)) ]; then
+    echo "blocks held by the snapshot were freed: $held then $after available"
+    failed=1
+fi
+run fs.img -snapshot s1 <<EOF
+get /a snap.out
+get /test.1 snap1.out
+EOF
+run fs.img <<EOF
+get /a live.out
+get /test.1 live1.out
+snap-export s1 $workdir/restored.img
+EOF
+expect_same a.bin snap.out
+expect_same c.bin live.out
+expect_same live1.out snap1.out
+# the exported image is the file system as it was when snapshotted
+run restored.img <<EOF
+get /a restored.out
+EOF
+expect_same a.bin restored.out
+expect_avail restored.img $((base - 101))
+run fs.img <<EOF
+snap-delete s1
+EOF
+expect_avail fs.img $((base - 51))
+run fs.img <<EOF
+rm /a
+EOF
+expect_avail fs.img $base
+end_test
+
+############################################################
+start_test "clone"
+# 100 data blocks and an indirect block
+run fs.img <<EOF
+put a.bin /a
+EOF
+expect_avail fs.img $((base - 101))
+# the clone shares the data blocks, only its indirect block is new
+run fs.img <<EOF
+clone /a /b
+EOF
+expect_avail fs.img $((base - 102))
+run fs.img <<EOF
+get /b b.out
+rm /a
+get /b b2.out
+EOF
+expect_same a.bin b.out
+expect_same a.bin b2.out
+expect_avail fs.img $((base - 101))
+run fs.img <<EOF
+rm /b
+EOF
+expect_avail fs.img $base
+end_test
+
+############################################################
+start_test "stripe"
+rm -f s0.img s1.img
+truncate -s 1M s0.img s1.img
+run s0.img -stripe s1.img -chunk 16 -mkfs 64 <<EOF
+EOF
+sbase=$(avail s0.img -stripe s1.img -chunk 16)
+run s0.img -stripe s1.img -chunk 16 <<EOF
+put a.bin /a
+mkdir /dir
+put c.bin /dir/c
+EOF
+# both images hold chunks of the files
+if cmp -s s1.img <(head -c 1048576 /dev/zero); then
+    echo "nothing written to s1.img"
+    failed=1
+fi
+run s0.img -stripe s1.img -chunk 16 <<EOF
+get /a a.out
+get /dir/c c.out
+rm /a
+EOF
+expect_same a.bin a.out
+expect_same c.bin c.out
+expect_avail s0.img $((sbase - 52)) -stripe s1.img -chunk 16
+end_test
+
+############################################################
+start_test "mirror resync"
+cp fs.img m1.img
+run fs.img -mirror m1.img <<EOF
+put a.bin /a
+clone /a /b
+EOF
+expect_same fs.img m1.img
+# image 1 misses writes while it is out of the mirror
+cp fs.img stale.img
+run fs.img <<EOF
+put c.bin /c
+rm /a
+EOF
+cp stale.img m1.img
+# reads come from image 0 while image 1 is rebuilt
+(echo "get /b b.out"; echo "get /c c.out"
+ for i in $(seq 20); do echo statfs; sleep 0.1; done) |
+    "$command" -cmdline -image fs.img -mirror m1.img -resync 1 > resync.out
+expect_same a.bin b.out
+expect_same c.bin c.out
+if ! grep 'mirror image 1' resync.out | tail -1 | grep -q ' 0 dirty regions'; then
+    echo "image 1 not resynced: $(grep 'mirror image 1' resync.out | tail -1)"
+    failed=1
+fi
+expect_same fs.img m1.img
+run m1.img <<EOF
+get /b m1b.out
+get /c m1c.out
+EOF
+expect_same a.bin m1b.out
+expect_same c.bin m1c.out
+expect_avail m1.img $((base - 152))
+end_test
+
+############################################################
+start_test "block cache writeback"
+run fs.img -cache 1 <<EOF
+put a.bin /a
+clone /a /b
+put c.bin /dir1/c
+rm /a
+EOF
+run fs.img <<EOF
+get /b b.out
+get /dir1/c c.out
+EOF
+expect_same a.bin b.out
+expect_same c.bin c.out
+expect_avail fs.img $((base - 152))
+end_test
+
+############################################################
+start_test "lazy inode loading"
+run fs.img <<EOF
+get /test.1 t1.out
+get /dir1/testcpy.1 t2.out
+put c.bin /dir3/c
+EOF
+run fs.img -prewarm <<EOF
+get /test.1 p1.out
+get /dir1/testcpy.1 p2.out
+get /dir3/c c.out
+rm /dir3/c
+EOF
+expect_same t1.out p1.out
+expect_same t2.out p2.out
+expect_same c.bin c.out
+expect_avail fs.img $base -prewarm
+end_test
+
+############################################################
+echo
+echo "Total tests run: $num_tests"
+echo "Number correct : $num_right"
+[ $num_right -eq $num_tests ]
@@ -0,0 +1,99 @@
+/*
+ * file:        trace.c
+ * description: binary trace of file system operations, written by
+ *              the fs_ops wrappers in fs.c and read by the replay tool
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "trace.h"
+
+bool trace_enabled;
+
+/** the trace being written */
+static FILE *trace_file;
+/** stats_start() time the trace started */
+static uint64_t trace_base;
+
+int trace_start(const char *path)
+{
+	if ((trace_file = fopen(path, "w")) == NULL) return -errno;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct trace_hdr hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.start = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec,
+	};
+	//written out now, so a fork to run in the background does not copy it
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_file) != 1 || fflush(trace_file) != 0) {
+		int err = errno;
+		fclose(trace_file);
+		trace_file = NULL;
+		return -err;
+	}
+	trace_base = stats_start();
+	trace_enabled = true;
+	return 0;
+}
+
+void trace_stop(void)
+{
+	if (trace_file == NULL) return;
+	trace_enabled = false;
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+void trace_op(struct trace_rec *rec, enum stats_op op, uint64_t start, int result,
+	      const char *path, const char *path2)
+{
+	uint64_t lat = stats_start() - start;
+	size_t plen = strnlen(path, TRACE_PATH_MAX - 1);
+	size_t p2len = (path2 != NULL) ? strnlen(path2, TRACE_PATH_MAX - 1) : 0;
+	rec->op = op;
+	rec->path_len = plen;
+	rec->path2_len = p2len;
+	rec->result = result;
+	rec->time = (start > trace_base) ? start - trace_base : 0;
+	rec->latency = (lat > UINT32_MAX) ? UINT32_MAX : lat;
+
+	//one write per record, so records of threads do not interleave
+	char buf[sizeof(*rec) + 2 * TRACE_PATH_MAX];
+	memcpy(buf, rec, sizeof(*rec));
+	memcpy(buf + sizeof(*rec), path, plen);
+	if (p2len > 0) memcpy(buf + sizeof(*rec) + plen, path2, p2len);
+	FILE *f = trace_file;
+	if (f != NULL) fwrite(buf, sizeof(*rec) + plen + p2len, 1, f);
+}
+
+FILE *trace_open(const char *path, struct trace_hdr *hdr)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return NULL;
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != TRACE_MAGIC ||
+	    hdr->version != TRACE_VERSION) {
+		fclose(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	return f;
+}
+
+int trace_next(FILE *f, struct trace_rec *rec, char *path, char *path2)
+{
+	size_t n = fread(rec, 1, sizeof(*rec), f);
+	if (n == 0) return 0;
+	if (n != sizeof(*rec) || rec->op >= ST_NOPS ||
+	    rec->path_len >= TRACE_PATH_MAX || rec->path2_len >= TRACE_PATH_MAX ||
+	    fread(path, 1, rec->path_len, f) != rec->path_len ||
+	    fread(path2, 1, rec->path2_len, f) != rec->path2_len) {
+		return -EIO;
+	}
+	path[rec->path_len] = '\0';
+	path2[rec->path2_len] = '\0';
+	return 1;
+}
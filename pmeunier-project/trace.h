@@ -0,0 +1,99 @@
+/*
+ * file:        trace.h
+ * description: binary trace of file system operations, written by
+ *              the fs_ops wrappers in fs.c and read by the replay tool
+ *
+ * A trace is a trace_hdr followed by one trace_rec per operation,
+ * each followed by its path and second path without terminators.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stats.h"
+
+enum {
+	TRACE_MAGIC = 0x52545846, /* "FXTR" */
+	TRACE_VERSION = 1,
+	TRACE_PATH_MAX = 4096 /* buffer size for a path of a record */
+};
+
+/** start of a trace */
+struct trace_hdr {
+	uint32_t magic; /* TRACE_MAGIC */
+	uint32_t version; /* TRACE_VERSION */
+	uint64_t start; /* wall clock time the trace started, in ns */
+}; /* total 16 bytes */
+
+/** one operation */
+struct trace_rec {
+	uint8_t op; /* enum stats_op */
+	uint8_t unused;
+	uint16_t path_len; /* bytes of the path following the record */
+	uint16_t path2_len; /* bytes of the second path, of a rename */
+	uint16_t pad;
+	int32_t result; /* result of the operation */
+	uint32_t mode; /* mode of mknod, mkdir and chmod, flags of open, datasync of fsync */
+	uint64_t fh; /* file handle of an open file */
+	uint64_t time; /* start of the operation, in ns since the trace started */
+	uint32_t latency; /* latency in ns, at most UINT32_MAX */
+	uint32_t len; /* length of read, write and truncate */
+	int64_t offset; /* offset of read, write and readdir, time of utime or -1 for now */
+}; /* total 48 bytes */
+
+/** true while operations are traced */
+extern bool trace_enabled;
+
+/**
+ * Start tracing operations to a file.
+ *
+ * @param path: the trace file, created or truncated
+ * @return 0 if successful, or -errno
+ */
+extern int trace_start(const char *path);
+
+/**
+ * Stop tracing and close the trace file.
+ */
+extern void trace_stop(void);
+
+/**
+ * Append an operation to the trace. The record's op, time, latency,
+ * result and path lengths are filled in.
+ *
+ * @param rec: the fields specific to the operation
+ * @param op: the operation
+ * @param start: its start time from stats_start()
+ * @param result: its result
+ * @param path: its path
+ * @param path2: its second path, or NULL
+ */
+extern void trace_op(struct trace_rec *rec, enum stats_op op, uint64_t start, int result,
+		     const char *path, const char *path2);
+
+/**
+ * Open a trace for reading.
+ *
+ * @param path: the trace file
+ * @param hdr: set to its header
+ * @return the open trace, or NULL with errno set
+ */
+extern FILE *trace_open(const char *path, struct trace_hdr *hdr);
+
+/**
+ * Read the next operation of a trace.
+ *
+ * @param f: the open trace
+ * @param rec: set to the record
+ * @param path: buffer of TRACE_PATH_MAX bytes for the path
+ * @param path2: buffer of TRACE_PATH_MAX bytes for the second path
+ * @return 1 if read, 0 at the end of the trace, or -EIO if truncated
+ *	or corrupt
+ */
+extern int trace_next(FILE *f, struct trace_rec *rec, char *path, char *path2);
+
+#endif /* TRACE_H_ */